@@ -0,0 +1,72 @@
+/*============================================================================
+  
+  compformat.h
+
+  The layout of a compressed sample segment, as written by CompStore and
+  read by CompReader. A segment is a HCSR04CompHeader followed by a 
+  stream of variable-length records, one per sample. Each segment can 
+  be decoded on its own: all the "previous" values below start at zero
+  at the beginning of each segment.
+
+  Each record is:
+
+    byte   flags: bits 0-1 status, bit 2 filtered distance present, 
+           bit 3 sequence number not previous + 1
+    varint delta-of-delta of time_usec
+    varint sequence number - (previous + 1), if flag bit 3 is set
+    varint rise_usec - previous rise_usec, unless status is NO_RISE
+    varint (fall_usec - rise_usec) - previous width, if there was a fall
+    varint filtered distance in units of 0.1mm - previous, if bit 2 set
+
+  All the varints are signed, zigzag-encoded (0, -1, 1, -2... become 
+  0, 1, 2, 3...), then written seven bits per byte, least significant
+  first, with the top bit set on all but the last byte. With a steady
+  sensor, most of these values are zero or close to it, and a sample
+  takes about six bytes, rather than the 32 of a HCSR04Sample.
+
+  The raw distance is not stored, because it is calculated from the 
+  edge times, using the metres_per_usec value in the header. Only the
+  filtered distance is rounded, to the nearest 0.1mm.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include "hcsr04.h"
+
+#define HCSR04_COMP_MAGIC "HCSR04CZ"
+#define HCSR04_COMP_VERSION 1
+
+// File name extension for segments
+#define HCSR04_COMP_EXTENSION ".hcz"
+
+// Flag bits in the first byte of each record
+#define HCSR04_COMP_STATUS_MASK  0x03
+#define HCSR04_COMP_HAS_FILTERED 0x04
+#define HCSR04_COMP_SEQ_JUMP     0x08
+
+// Filtered distances are stored in this many units per metre
+#define HCSR04_COMP_FILTERED_SCALE 10000.0
+
+// The longest a record can be: a flag byte, and five varints of up to
+//  ten bytes each
+#define HCSR04_COMP_MAX_RECORD 51
+
+// HCSR04CompHeader -- the start of every segment. It is exactly 64 bytes.
+typedef struct _HCSR04CompHeader
+  {
+  char magic[8];            // HCSR04_COMP_MAGIC, without the terminating 0
+  uint32_t version;
+  uint32_t header_size;     // sizeof (HCSR04CompHeader)
+  int64_t start_time_usec;  // When the segment was started
+  int32_t sound_pin;
+  int32_t echo_pin;
+  int32_t cycle_usec;
+  float smoothing;
+  double metres_per_usec;   // For calculating raw distances from echoes
+  uint32_t reserved[4];
+  } HCSR04CompHeader;
+
@@ -0,0 +1,238 @@
+/*==========================================================================
+  
+    compreader.c
+
+    This "class" decodes a compressed sample segment. The file is read
+    through a fixed-size buffer, which is topped up whenever it holds
+    less than one maximum-size record.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <fcntl.h>
+#include "defs.h" 
+#include "hcsr04.h" 
+#include "compformat.h" 
+#include "compreader.h" 
+
+_Static_assert (sizeof (HCSR04CompHeader) == 64, 
+  "Segment header must be 64 bytes");
+
+#define IN_BUFFER 16384
+
+struct _CompReader
+  {
+  char *filename;
+  int fd;
+  BOOL eof;          // Nothing more to read from the file
+  HCSR04CompHeader header;
+  // Decoder state -- see compformat.h
+  int64_t prev_time;
+  int64_t prev_dt;
+  uint32_t prev_seq;
+  int32_t prev_rise;
+  int32_t prev_width;
+  int64_t prev_filtered;
+  int in_pos;        // Next byte to decode
+  int in_len;        // Number of bytes in the buffer
+  uint8_t in[IN_BUFFER];
+  };
+
+/*============================================================================
+  compreader_create
+============================================================================*/
+CompReader *compreader_create (const char *filename)
+  {
+  assert (filename != NULL);
+  CompReader *self = malloc (sizeof (CompReader));
+  memset (self, 0, sizeof (CompReader));
+  self->filename = strdup (filename);
+  self->fd = -1;
+  return self;
+  }
+
+/*============================================================================
+  compreader_destroy
+============================================================================*/
+void compreader_destroy (CompReader *self)
+  {
+  if (self)
+    {
+    compreader_uninit (self);
+    free (self->filename);
+    free (self);
+    }
+  }
+
+/*============================================================================
+  compreader_init
+============================================================================*/
+BOOL compreader_init (CompReader *self, char **error)
+  {
+  assert (self != NULL);
+  assert (self->fd < 0);
+  self->fd = open (self->filename, O_RDONLY | O_CLOEXEC);
+  if (self->fd < 0)
+    {
+    if (error)
+      asprintf (error, "Can't open %s: %s", self->filename, strerror (errno));
+    return FALSE;
+    }
+  HCSR04CompHeader *h = &self->header;
+  if (read (self->fd, h, sizeof (*h)) != sizeof (*h)
+       || memcmp (h->magic, HCSR04_COMP_MAGIC, sizeof (h->magic)) != 0
+       || h->version != HCSR04_COMP_VERSION
+       || h->header_size < sizeof (*h)
+       || lseek (self->fd, h->header_size, SEEK_SET) < 0)
+    {
+    if (error)
+      asprintf (error, "%s is not a compatible sample segment", 
+        self->filename);
+    compreader_uninit (self);
+    return FALSE;
+    }
+  self->eof = FALSE;
+  self->in_pos = 0;
+  self->in_len = 0;
+  self->prev_time = h->start_time_usec;
+  self->prev_dt = 0;
+  self->prev_seq = (uint32_t)-1;
+  self->prev_rise = 0;
+  self->prev_width = 0;
+  self->prev_filtered = 0;
+  return TRUE;
+  }
+
+/*============================================================================
+  compreader_uninit
+============================================================================*/
+void compreader_uninit (CompReader *self)
+  {
+  assert (self != NULL);
+  if (self->fd >= 0) close (self->fd);
+  self->fd = -1;
+  }
+
+/*============================================================================
+  compreader_get_header
+============================================================================*/
+const HCSR04CompHeader *compreader_get_header (const CompReader *self)
+  {
+  return &self->header;
+  }
+
+/*============================================================================
+
+  compreader_fill
+
+  Make sure the buffer holds at least one maximum-size record, unless 
+  the end of the file has been reached
+
+============================================================================*/
+static void compreader_fill (CompReader *self)
+  {
+  if (self->in_len - self->in_pos >= HCSR04_COMP_MAX_RECORD || self->eof)
+    return;
+  memmove (self->in, self->in + self->in_pos, self->in_len - self->in_pos);
+  self->in_len -= self->in_pos;
+  self->in_pos = 0;
+  while (self->in_len < IN_BUFFER && !self->eof)
+    {
+    ssize_t n = read (self->fd, self->in + self->in_len, 
+      IN_BUFFER - self->in_len);
+    if (n > 0)
+      self->in_len += n;
+    else if (n == 0 || errno != EINTR)
+      self->eof = TRUE;
+    }
+  }
+
+/*============================================================================
+
+  compreader_get_varint
+
+  Decode a zigzag varint. Returns FALSE if the data runs out first.
+
+============================================================================*/
+static BOOL compreader_get_varint (CompReader *self, int64_t *value)
+  {
+  uint64_t v = 0;
+  int shift = 0;
+  while (self->in_pos < self->in_len && shift < 64)
+    {
+    uint8_t b = self->in[self->in_pos++];
+    v |= (uint64_t)(b & 0x7F) << shift;
+    if (!(b & 0x80))
+      {
+      *value = (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+      return TRUE;
+      }
+    shift += 7;
+    }
+  return FALSE;
+  }
+
+/*============================================================================
+  compreader_next
+============================================================================*/
+BOOL compreader_next (CompReader *self, HCSR04Sample *s)
+  {
+  assert (self != NULL);
+  assert (self->fd >= 0);
+  compreader_fill (self);
+  if (self->in_pos >= self->in_len) return FALSE;
+
+  uint8_t flags = self->in[self->in_pos++];
+  memset (s, 0, sizeof (HCSR04Sample));
+  s->status = flags & HCSR04_COMP_STATUS_MASK;
+  s->rise_usec = -1;
+  s->fall_usec = -1;
+  s->raw = -1.0;
+  s->filtered = -1.0;
+
+  int64_t v;
+  if (!compreader_get_varint (self, &v)) return FALSE;
+  self->prev_dt += v;
+  self->prev_time += self->prev_dt;
+  s->time_usec = self->prev_time;
+
+  uint32_t seq = self->prev_seq + 1;
+  if (flags & HCSR04_COMP_SEQ_JUMP)
+    {
+    if (!compreader_get_varint (self, &v)) return FALSE;
+    seq += (int32_t)v;
+    }
+  s->seq = self->prev_seq = seq;
+
+  if (s->status != HCSR04_SAMPLE_NO_RISE)
+    {
+    if (!compreader_get_varint (self, &v)) return FALSE;
+    self->prev_rise += (int32_t)v;
+    s->rise_usec = self->prev_rise;
+    }
+
+  if (s->status == HCSR04_SAMPLE_OK || s->status == HCSR04_SAMPLE_OUT_OF_RANGE)
+    {
+    if (!compreader_get_varint (self, &v)) return FALSE;
+    self->prev_width += (int32_t)v;
+    s->fall_usec = s->rise_usec + self->prev_width;
+    if (s->status == HCSR04_SAMPLE_OK)
+      s->raw = self->header.metres_per_usec * self->prev_width;
+    }
+
+  if (flags & HCSR04_COMP_HAS_FILTERED)
+    {
+    if (!compreader_get_varint (self, &v)) return FALSE;
+    self->prev_filtered += v;
+    s->filtered = self->prev_filtered / HCSR04_COMP_FILTERED_SCALE;
+    }
+  return TRUE;
+  }
+
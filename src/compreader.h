@@ -0,0 +1,49 @@
+/*============================================================================
+  
+  compreader.h
+
+  Functions to decode a compressed sample segment written by CompStore,
+  one sample at a time, using a fixed amount of memory however large
+  the segment is.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include "defs.h"
+#include "hcsr04.h"
+#include "compformat.h"
+
+struct CompReader;
+typedef struct _CompReader CompReader;
+
+BEGIN_DECLS
+
+/** Create a CompReader for a segment file. This method only stores 
+    values, and will always succeed. */
+CompReader *compreader_create (const char *filename);
+
+/** Clean up. This method implicitly calls _uninit(). */
+void        compreader_destroy (CompReader *self);
+
+/** Open the segment, and read its header. If this method fails, and
+    error is not NULL, it is written with an error message that the 
+    caller should free. */
+BOOL        compreader_init (CompReader *self, char **error);
+
+/** Close the segment. */
+void        compreader_uninit (CompReader *self);
+
+/** Get the segment header. */
+const HCSR04CompHeader *compreader_get_header (const CompReader *self);
+
+/** Decode the next sample. Returns FALSE at the end of the segment. A
+    record cut short, by a crash while it was being written, is treated
+    as the end. */
+BOOL        compreader_next (CompReader *self, HCSR04Sample *sample);
+
+END_DECLS
+
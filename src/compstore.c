@@ -0,0 +1,461 @@
+/*==========================================================================
+  
+    compstore.c
+
+    This "class" compresses samples into segment files. Like SampleLog,
+    it takes samples from the HCSR04 thread through a SampleRing, and
+    does all the real work -- compression, writing, rotation, and 
+    deleting old segments -- in its own thread. 
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <math.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include "defs.h" 
+#include "hcsr04.h" 
+#include "compformat.h" 
+#include "samplering.h" 
+#include "compstore.h" 
+
+// Size of the queue between the HCSR04 thread and the compressor
+#define RING_SIZE 1024
+
+// Size of the buffer of compressed data waiting to be written 
+#define OUT_BUFFER 4096
+
+struct _CompStore
+  {
+  char *dir;
+  char *prefix;
+  long segment_size;
+  long budget;
+  HCSR04 *hcsr04;
+  SampleRing *ring;
+  pthread_t pthread;
+  BOOL running;
+  int stop_fd;             // eventfd to stop the compression thread
+  HCSR04CompHeader header; // Header of the current segment
+  int fd;                  // The current segment
+  char *segment_name;      // Name of the current segment, without the path
+  long segment_bytes;      // Bytes in the segment, written or buffered
+  // Encoder state -- the previous values that each field is stored 
+  //  relative to. These are reset at the start of each segment.
+  int64_t prev_time;
+  int64_t prev_dt;
+  uint32_t prev_seq;
+  int32_t prev_rise;
+  int32_t prev_width;
+  int64_t prev_filtered;
+  int out_len;
+  struct timespec first;   // When the oldest buffered record was added
+  uint8_t out[OUT_BUFFER];
+  };
+
+/*============================================================================
+  compstore_create
+============================================================================*/
+CompStore *compstore_create (const char *dir, const char *prefix,
+      long segment_size, long budget)
+  {
+  assert (dir != NULL);
+  assert (prefix != NULL);
+  CompStore *self = malloc (sizeof (CompStore));
+  memset (self, 0, sizeof (CompStore));
+  self->dir = strdup (dir);
+  self->prefix = strdup (prefix);
+  self->segment_size = segment_size > 0 ? segment_size 
+    : COMPSTORE_SEGMENT_SIZE;
+  self->budget = budget > 0 ? budget : COMPSTORE_BUDGET;
+  // A segment must at least hold its header and one record
+  if (self->segment_size < (long)(sizeof (HCSR04CompHeader) 
+        + HCSR04_COMP_MAX_RECORD))
+    self->segment_size = sizeof (HCSR04CompHeader) + HCSR04_COMP_MAX_RECORD;
+  self->fd = -1;
+  self->stop_fd = -1;
+  return self;
+  }
+
+/*============================================================================
+  compstore_destroy
+============================================================================*/
+void compstore_destroy (CompStore *self)
+  {
+  if (self)
+    {
+    compstore_uninit (self);
+    free (self->dir);
+    free (self->prefix);
+    free (self);
+    }
+  }
+
+/*============================================================================
+  compstore_put_varint
+
+  Append a signed value, zigzag-encoded as a varint
+
+============================================================================*/
+static void compstore_put_varint (CompStore *self, int64_t value)
+  {
+  uint64_t v = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+  while (v >= 0x80)
+    {
+    self->out[self->out_len++] = (uint8_t)(v | 0x80);
+    v >>= 7;
+    }
+  self->out[self->out_len++] = (uint8_t)v;
+  }
+
+/*============================================================================
+  compstore_flush
+============================================================================*/
+static void compstore_flush (CompStore *self)
+  {
+  const uint8_t *p = self->out;
+  size_t len = self->out_len;
+  while (len > 0)
+    {
+    ssize_t n = write (self->fd, p, len);
+    if (n <= 0 && errno != EINTR) break;
+    if (n > 0)
+      {
+      p += n;
+      len -= n;
+      }
+    }
+  self->out_len = 0;
+  }
+
+/*============================================================================
+  compstore_is_segment
+============================================================================*/
+static BOOL compstore_is_segment (const CompStore *self, const char *name)
+  {
+  size_t plen = strlen (self->prefix);
+  size_t nlen = strlen (name);
+  size_t elen = strlen (HCSR04_COMP_EXTENSION);
+  return nlen > plen + elen && strncmp (name, self->prefix, plen) == 0
+    && name[plen] == '-'
+    && strcmp (name + nlen - elen, HCSR04_COMP_EXTENSION) == 0;
+  }
+
+/*============================================================================
+  compstore_compare_names
+============================================================================*/
+static int compstore_compare_names (const void *a, const void *b)
+  {
+  return strcmp (*(char * const *)a, *(char * const *)b);
+  }
+
+/*============================================================================
+
+  compstore_enforce_budget
+
+  Delete the oldest segments until the total size is within the budget.
+  The segment names contain the start time in fixed-width digits, so 
+  sorting them by name sorts them by age. The current segment is never
+  deleted.
+
+============================================================================*/
+static void compstore_enforce_budget (CompStore *self)
+  {
+  DIR *d = opendir (self->dir);
+  if (!d) return;
+  int n = 0, size = 16;
+  char **names = malloc (size * sizeof (char *));
+  long *sizes = malloc (size * sizeof (long));
+  long total = 0;
+  char path[PATH_MAX];
+  struct dirent *de;
+  while ((de = readdir (d)) != NULL)
+    {
+    if (!compstore_is_segment (self, de->d_name)) continue;
+    if (n == size)
+      {
+      size *= 2;
+      names = realloc (names, size * sizeof (char *));
+      }
+    names[n++] = strdup (de->d_name);
+    }
+  closedir (d);
+  qsort (names, n, sizeof (char *), compstore_compare_names);
+
+  sizes = realloc (sizes, (n + 1) * sizeof (long));
+  for (int i = 0; i < n; i++)
+    {
+    struct stat sb;
+    snprintf (path, sizeof (path), "%s/%s", self->dir, names[i]);
+    sizes[i] = stat (path, &sb) == 0 ? sb.st_size : 0;
+    total += sizes[i];
+    }
+  for (int i = 0; i < n && total > self->budget; i++)
+    {
+    if (strcmp (names[i], self->segment_name) == 0) continue;
+    snprintf (path, sizeof (path), "%s/%s", self->dir, names[i]);
+    if (unlink (path) == 0) total -= sizes[i];
+    }
+  for (int i = 0; i < n; i++)
+    free (names[i]);
+  free (names);
+  free (sizes);
+  }
+
+/*============================================================================
+
+  compstore_start_segment
+
+  Close the current segment, if there is one, and start another. 
+
+============================================================================*/
+static BOOL compstore_start_segment (CompStore *self, char **error)
+  {
+  if (self->fd >= 0)
+    {
+    compstore_flush (self);
+    close (self->fd);
+    self->fd = -1;
+    }
+  free (self->segment_name);
+
+  struct timeval tv;
+  gettimeofday (&tv, NULL);
+  self->header.start_time_usec = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+  asprintf (&self->segment_name, "%s-%016lld%s", self->prefix, 
+    (long long)self->header.start_time_usec, HCSR04_COMP_EXTENSION);
+  char path[PATH_MAX];
+  snprintf (path, sizeof (path), "%s/%s", self->dir, self->segment_name);
+  self->fd = open (path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC,
+    0644);
+  if (self->fd < 0 || write (self->fd, &self->header, 
+        sizeof (self->header)) != sizeof (self->header))
+    {
+    if (error)
+      asprintf (error, "Can't write %s: %s", path, strerror (errno));
+    if (self->fd >= 0) close (self->fd);
+    self->fd = -1;
+    return FALSE;
+    }
+
+  self->segment_bytes = sizeof (self->header);
+  self->prev_time = self->header.start_time_usec;
+  self->prev_dt = 0;
+  self->prev_seq = (uint32_t)-1;
+  self->prev_rise = 0;
+  self->prev_width = 0;
+  self->prev_filtered = 0;
+  self->out_len = 0;
+  compstore_enforce_budget (self);
+  return TRUE;
+  }
+
+/*============================================================================
+  compstore_encode
+============================================================================*/
+static void compstore_encode (CompStore *self, const HCSR04Sample *s)
+  {
+  if (self->segment_bytes + HCSR04_COMP_MAX_RECORD > self->segment_size)
+    {
+    // If a new segment can't be started, e.g., because the disk is full,
+    //  samples are discarded until one can be
+    if (!compstore_start_segment (self, NULL)) return;
+    }
+  if (self->fd < 0) return;
+
+  int start = self->out_len;
+  if (start == 0)
+    clock_gettime (CLOCK_MONOTONIC, &self->first);
+  BOOL has_filtered = s->filtered >= 0;
+  BOOL seq_jump = s->seq != self->prev_seq + 1;
+  uint8_t flags = s->status & HCSR04_COMP_STATUS_MASK;
+  if (has_filtered) flags |= HCSR04_COMP_HAS_FILTERED;
+  if (seq_jump) flags |= HCSR04_COMP_SEQ_JUMP;
+  self->out[self->out_len++] = flags;
+
+  int64_t dt = s->time_usec - self->prev_time;
+  compstore_put_varint (self, dt - self->prev_dt);
+  self->prev_time = s->time_usec;
+  self->prev_dt = dt;
+
+  if (seq_jump)
+    compstore_put_varint (self, (int32_t)(s->seq - (self->prev_seq + 1)));
+  self->prev_seq = s->seq;
+
+  if (s->status != HCSR04_SAMPLE_NO_RISE)
+    {
+    compstore_put_varint (self, s->rise_usec - self->prev_rise);
+    self->prev_rise = s->rise_usec;
+    }
+
+  if (s->status == HCSR04_SAMPLE_OK || s->status == HCSR04_SAMPLE_OUT_OF_RANGE)
+    {
+    int32_t width = s->fall_usec - s->rise_usec;
+    compstore_put_varint (self, width - self->prev_width);
+    self->prev_width = width;
+    }
+
+  if (has_filtered)
+    {
+    int64_t f = llround (s->filtered * HCSR04_COMP_FILTERED_SCALE);
+    compstore_put_varint (self, f - self->prev_filtered);
+    self->prev_filtered = f;
+    }
+
+  self->segment_bytes += self->out_len - start;
+  if (self->out_len > OUT_BUFFER - HCSR04_COMP_MAX_RECORD)
+    compstore_flush (self);
+  }
+
+/*============================================================================
+
+  compstore_get_timeout
+
+  The time, in msec, until the oldest buffered record has been waiting
+  COMPSTORE_FLUSH_MSEC, for poll(). This is -1 if nothing is buffered,
+  and 0 if the buffer is already overdue.
+
+============================================================================*/
+static int compstore_get_timeout (const CompStore *self)
+  {
+  if (self->out_len == 0) return -1;
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  long waited = (now.tv_sec - self->first.tv_sec) * 1000
+    + (now.tv_nsec - self->first.tv_nsec) / 1000000;
+  return waited >= COMPSTORE_FLUSH_MSEC 
+    ? 0 : (int)(COMPSTORE_FLUSH_MSEC - waited);
+  }
+
+/*============================================================================
+
+  compstore_loop
+
+  The compression thread
+
+============================================================================*/
+static void *compstore_loop (void *arg)
+  {
+  CompStore *self = (CompStore *)arg;
+  struct pollfd fdset[2];
+  fdset[0].fd = samplering_get_fd (self->ring);
+  fdset[0].events = POLLIN;
+  fdset[1].fd = self->stop_fd;
+  fdset[1].events = POLLIN;
+  HCSR04Sample s;
+  while (TRUE)
+    {
+    fdset[0].revents = 0;
+    fdset[1].revents = 0;
+    // The timeout runs from when the oldest record was buffered, so a
+    //  steady stream of samples can't keep putting the write off
+    poll (fdset, 2, compstore_get_timeout (self));
+    if (fdset[0].revents & POLLIN)
+      {
+      samplering_clear_fd (self->ring);
+      while (samplering_pop (self->ring, &s))
+        compstore_encode (self, &s);
+      }
+    if (compstore_get_timeout (self) == 0)
+      compstore_flush (self);
+    if (fdset[1].revents & POLLIN)
+      break;
+    }
+  while (samplering_pop (self->ring, &s))
+    compstore_encode (self, &s);
+  compstore_flush (self);
+  return NULL;
+  }
+
+/*============================================================================
+  compstore_init
+============================================================================*/
+BOOL compstore_init (CompStore *self, HCSR04 *hcsr04, char **error)
+  {
+  assert (self != NULL);
+  assert (self->fd < 0);
+  HCSR04CompHeader *h = &self->header;
+  memset (h, 0, sizeof (HCSR04CompHeader));
+  memcpy (h->magic, HCSR04_COMP_MAGIC, sizeof (h->magic));
+  h->version = HCSR04_COMP_VERSION;
+  h->header_size = sizeof (HCSR04CompHeader);
+  h->sound_pin = hcsr04_get_sound_pin (hcsr04);
+  h->echo_pin = hcsr04_get_echo_pin (hcsr04);
+  h->cycle_usec = hcsr04_get_cycle_usec (hcsr04);
+  h->smoothing = hcsr04_get_smoothing (hcsr04);
+  h->metres_per_usec = HCSR04_USEC_TO_METRES;
+  if (!compstore_start_segment (self, error)) return FALSE;
+
+  self->ring = samplering_create (RING_SIZE);
+  self->stop_fd = eventfd (0, EFD_CLOEXEC);
+  if (self->ring && self->stop_fd >= 0 
+        && pthread_create (&self->pthread, NULL, compstore_loop, self) == 0)
+    {
+    self->running = TRUE;
+    if (hcsr04_add_sample_callback (hcsr04, samplering_sample_callback, 
+          self->ring))
+      {
+      self->hcsr04 = hcsr04;
+      return TRUE;
+      }
+    if (error)
+      asprintf (error, "Too many sample callbacks on this HCSR04");
+    }
+  else
+    {
+    if (error)
+      asprintf (error, "Can't start compression thread: %s", 
+        strerror (errno));
+    }
+  compstore_uninit (self);
+  return FALSE;
+  }
+
+/*============================================================================
+  compstore_uninit
+============================================================================*/
+void compstore_uninit (CompStore *self)
+  {
+  assert (self != NULL);
+  if (self->hcsr04)
+    hcsr04_remove_sample_callback (self->hcsr04, samplering_sample_callback,
+      self->ring);
+  self->hcsr04 = NULL;
+  if (self->running)
+    {
+    uint64_t one = 1;
+    write (self->stop_fd, &one, sizeof (one));
+    pthread_join (self->pthread, NULL);
+    self->running = FALSE;
+    }
+  if (self->stop_fd >= 0) close (self->stop_fd);
+  self->stop_fd = -1;
+  samplering_destroy (self->ring);
+  self->ring = NULL;
+  if (self->fd >= 0) close (self->fd);
+  self->fd = -1;
+  free (self->segment_name);
+  self->segment_name = NULL;
+  }
+
+/*============================================================================
+  compstore_get_dropped
+============================================================================*/
+uint64_t compstore_get_dropped (const CompStore *self)
+  {
+  return self->ring ? samplering_get_dropped (self->ring) : 0;
+  }
+
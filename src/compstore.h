@@ -0,0 +1,59 @@
+/*============================================================================
+  
+  compstore.h
+
+  Functions to keep a long-term, compressed record of the samples from a
+  HCSR04, in a directory of segment files (see compformat.h). When a 
+  segment reaches a set size a new one is started, and when the 
+  segments together exceed a set budget, the oldest are deleted. So the
+  disk space used is bounded, and so is the memory -- compression runs 
+  in its own thread, using fixed-size buffers.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include "defs.h"
+#include "hcsr04.h"
+
+// Defaults for the segment size and total budget, in bytes
+#define COMPSTORE_SEGMENT_SIZE (1024 * 1024)
+#define COMPSTORE_BUDGET (64 * 1024 * 1024)
+
+// Longest time a sample waits in memory before it is written. This is
+//  a trade-off between SD card wear, and what is lost in a crash.
+#define COMPSTORE_FLUSH_MSEC 5000
+
+struct CompStore;
+typedef struct _CompStore CompStore;
+
+BEGIN_DECLS
+
+/** Create a CompStore that writes segments into the given directory. 
+    Segment names start with prefix, followed by the start time, so 
+    several sensors can share a directory if they use different 
+    prefixes. segment_size and budget are in bytes; zero means the
+    default. This method only stores values, and will always succeed. */
+CompStore *compstore_create (const char *dir, const char *prefix,
+             long segment_size, long budget);
+
+/** Clean up. This method implicitly calls _uninit(). */
+void       compstore_destroy (CompStore *self);
+
+/** Start a new segment, and start recording samples from the HCSR04. 
+    If this method fails, and error is not NULL, it is written with an
+    error message that the caller should free. */
+BOOL       compstore_init (CompStore *self, HCSR04 *hcsr04, char **error);
+
+/** Stop recording, and write and close the current segment. */
+void       compstore_uninit (CompStore *self);
+
+/** Get the number of samples dropped, because the compression thread 
+    could not keep up. */
+uint64_t   compstore_get_dropped (const CompStore *self);
+
+END_DECLS
+
@@ -0,0 +1,191 @@
+/*==========================================================================
+
+    filterbank.c
+
+    The filter state of a set of sensors, as arrays. See filterbank.h.
+    This file is built with optimization, so that filterbank_update()
+    is vectorized.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "defs.h"
+#include "hcsr04.h"
+#include "filterbank.h"
+
+// Alignment of the arrays, and the unit their sizes are rounded up to,
+//  so that each starts on a cache line
+#define ALIGN 64
+#define ALIGN_UP(size) (((size) + ALIGN - 1) / ALIGN * ALIGN)
+
+/*============================================================================
+
+  filterbank_create
+
+  The FilterBank and its three arrays are one zeroed, aligned block, in 
+  that order
+
+============================================================================*/
+FilterBank *filterbank_create (int count)
+  {
+  assert (count >= 1);
+  size_t head = ALIGN_UP (sizeof (FilterBank));
+  size_t doubles = ALIGN_UP (count * sizeof (double));
+  size_t ints = ALIGN_UP (count * sizeof (int));
+  char *block = aligned_alloc (ALIGN, head + 2 * doubles + ints);
+  memset (block, 0, head + 2 * doubles + ints);
+  FilterBank *self = (FilterBank *)block;
+  self->count = count;
+  self->avg = (double *)(block + head);
+  self->smoothing = (double *)(block + head + doubles);
+  self->good_count = (int *)(block + head + 2 * doubles);
+  return self;
+  }
+
+/*============================================================================
+  filterbank_destroy
+============================================================================*/
+void filterbank_destroy (FilterBank *self)
+  {
+  free (self);
+  }
+
+/*============================================================================
+  filterbank_init_entry
+============================================================================*/
+void filterbank_init_entry (FilterBank *self, FilterEntry *entry)
+  {
+  assert (self != NULL);
+  assert (entry != NULL);
+  memset (entry, 0, sizeof (FilterEntry));
+  self->count = 1;
+  self->avg = &entry->avg;
+  self->smoothing = &entry->smoothing;
+  self->good_count = &entry->good_count;
+  }
+
+/*============================================================================
+  filterbank_get_count
+============================================================================*/
+int filterbank_get_count (const FilterBank *self)
+  {
+  assert (self != NULL);
+  return self->count;
+  }
+
+/*============================================================================
+  filterbank_set_smoothing
+============================================================================*/
+void filterbank_set_smoothing (FilterBank *self, int i, double smoothing)
+  {
+  assert (self != NULL);
+  assert (i >= 0 && i < self->count);
+  self->smoothing[i] = smoothing;
+  }
+
+/*============================================================================
+  filterbank_reset
+============================================================================*/
+void filterbank_reset (FilterBank *self, int i)
+  {
+  assert (self != NULL);
+  assert (i >= 0 && i < self->count);
+  self->avg[i] = 0.0;
+  self->good_count[i] = 0;
+  }
+
+/*============================================================================
+
+  filterbank_update
+
+  Written as two loops without branches, one over the doubles and one 
+  over the ints, because that is what gcc will vectorize. An invalid
+  distance multiplies the change in the average by zero.
+
+============================================================================*/
+void filterbank_update (FilterBank *self, const double *raw)
+  {
+  assert (self != NULL);
+  assert (raw != NULL);
+  int n = self->count;
+  double *restrict avg = self->avg;
+  const double *restrict smoothing = self->smoothing;
+  int *restrict good_count = self->good_count;
+  for (int i = 0; i < n; i++)
+    {
+    double d = raw[i];
+    double a = avg[i];
+    double s = smoothing[i];
+    double next = d * (1 - s) + a * s;
+    avg[i] = a + (d > 0) * (next - a);
+    }
+  for (int i = 0; i < n; i++)
+    {
+    int g = good_count[i] + (raw[i] > 0 ? 1 : -1);
+    g = g > HCSR04_VALID_SAMPLES ? HCSR04_VALID_SAMPLES : g;
+    good_count[i] = g < 0 ? 0 : g;
+    }
+  }
+
+/*============================================================================
+  filterbank_update_one
+============================================================================*/
+void filterbank_update_one (FilterBank *self, int i, double raw)
+  {
+  assert (self != NULL);
+  assert (i >= 0 && i < self->count);
+  if (raw > 0)
+    {
+    double s = self->smoothing[i];
+    self->avg[i] = raw * (1 - s) + self->avg[i] * s;
+    if (self->good_count[i] < HCSR04_VALID_SAMPLES) self->good_count[i]++;
+    }
+  else if (self->good_count[i] > 0)
+    self->good_count[i]--;
+  }
+
+/*============================================================================
+  filterbank_set_value
+============================================================================*/
+void filterbank_set_value (FilterBank *self, int i, double value)
+  {
+  assert (self != NULL);
+  assert (i >= 0 && i < self->count);
+  self->avg[i] = value;
+  }
+
+/*============================================================================
+  filterbank_get_value
+============================================================================*/
+double filterbank_get_value (const FilterBank *self, int i)
+  {
+  assert (self != NULL);
+  assert (i >= 0 && i < self->count);
+  return self->avg[i];
+  }
+
+/*============================================================================
+  filterbank_get_good_count
+============================================================================*/
+int filterbank_get_good_count (const FilterBank *self, int i)
+  {
+  assert (self != NULL);
+  assert (i >= 0 && i < self->count);
+  return self->good_count[i];
+  }
+
+/*============================================================================
+  filterbank_get_distance
+============================================================================*/
+double filterbank_get_distance (const FilterBank *self, int i)
+  {
+  assert (self != NULL);
+  assert (i >= 0 && i < self->count);
+  return self->good_count[i] >= HCSR04_VALID_SAMPLES ? self->avg[i] : -1.0;
+  }
+
@@ -0,0 +1,98 @@
+/*============================================================================
+
+  filterbank.h
+
+  The filter state of a set of sensors -- the smoothed distance, the
+  smoothing factor, and the count of recent good samples -- kept as one
+  array of each, rather than as a structure per sensor. A HCSR04Group
+  updates the filters of all its sensors with one call to
+  filterbank_update(), which is a single loop over the arrays that the
+  compiler can vectorize. Each HCSR04 reads its own entry. A HCSR04 that
+  is not in a group has a bank of one, made by filterbank_init_entry() 
+  over a FilterEntry inside the HCSR04, so it allocates nothing; or it
+  can be given an entry in a bank shared with other sensors, as a 
+  HCSR04Executor does, so that their filters are kept together.
+
+  The filter is the exponential moving average. A sensor whose smoothing
+  factor is 0 gets each valid distance as it is, so this is also the
+  "none" filter; the HCSR04 median filter overwrites the value in the
+  bank with filterbank_set_value().
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include "defs.h"
+
+// FilterBank -- the arrays, of count entries each. A bank made by 
+//  filterbank_create() is one allocation, with each array starting on
+//  a cache line.
+typedef struct _FilterBank
+  {
+  int count;
+  double *avg;
+  double *smoothing;
+  int *good_count;
+  } FilterBank;
+
+// FilterEntry -- the storage of a bank of one, to be kept inside the 
+//  structure that uses it
+typedef struct _FilterEntry
+  {
+  double avg;
+  double smoothing;
+  int good_count;
+  } FilterEntry;
+
+BEGIN_DECLS
+
+/** Create a bank of count filters, all reset, with no smoothing. This
+    method only allocates memory, and will always succeed. */
+FilterBank *filterbank_create (int count);
+
+/** Free the bank. */
+void        filterbank_destroy (FilterBank *self);
+
+/** Make self a bank of one, reset, with no smoothing, whose filter is 
+    kept in entry. Nothing is allocated, and the bank must not be 
+    passed to filterbank_destroy(). */
+void        filterbank_init_entry (FilterBank *self, FilterEntry *entry);
+
+/** Get the number of filters in the bank. */
+int         filterbank_get_count (const FilterBank *self);
+
+/** Set the smoothing factor of filter i, 0-0.9999. */
+void        filterbank_set_smoothing (FilterBank *self, int i,
+              double smoothing);
+
+/** Forget the history of filter i. */
+void        filterbank_reset (FilterBank *self, int i);
+
+/** Add a raw distance to every filter. raw has an entry for each filter;
+    a distance that is not positive means that there was no valid
+    reading. Valid distances update the smoothed value, and increase
+    the good count, up to HCSR04_VALID_SAMPLES; invalid ones decrease
+    it, down to zero. */
+void        filterbank_update (FilterBank *self, const double *raw);
+
+/** Add a raw distance to filter i only, in the same way. */
+void        filterbank_update_one (FilterBank *self, int i, double raw);
+
+/** Replace the smoothed value of filter i, for a filter worked out
+    elsewhere. */
+void        filterbank_set_value (FilterBank *self, int i, double value);
+
+/** Get the smoothed value of filter i, whether or not it is valid. */
+double      filterbank_get_value (const FilterBank *self, int i);
+
+/** Get the good count of filter i. */
+int         filterbank_get_good_count (const FilterBank *self, int i);
+
+/** Get the smoothed value of filter i, or -1.0 if its good count is
+    less than HCSR04_VALID_SAMPLES. */
+double      filterbank_get_distance (const FilterBank *self, int i);
+
+END_DECLS
+
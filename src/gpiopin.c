@@ -17,15 +17,84 @@
 #include <pthread.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <libgen.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
 #include "defs.h" 
 #include "gpiopin.h" 
+#include "probes.h" 
+
+// Longest gpiopin_wait_ready() sleeps before checking a file again, in
+//  msec, whether or not inotify is watching for it
+#define GPIOPIN_READY_POLL_MSEC 10
 
 struct _GPIOPin
   {
   int pin; 
+  // Descriptors for the pin's sysfs files, kept open from _init() to 
+  //  _uninit(), so that changing a setting is a single system call.
+  //  edge_fd is only opened for inputs.
   int value_fd;
+  int edge_fd;
+  int direction_fd;
+  GPIOPinTrigger trigger; // The last edge setting written, or -1
+  int wake_fd; // Interrupts gpiopin_wait_for_trigger, if not -1
+  BOOL simulated; // If set, the value is stored here and not in sysfs
+  BOOL sim_value;
+  BOOL exported; // Set if this object exported the pin
+  BOOL unexport; // Unexport the pin in _uninit(), if this object exported it
+  // If the value file is a FIFO, as in a test harness, an edge arrives as
+  //  a byte to read -- the new value -- rather than as POLLPRI
+  BOOL fifo;
+  BOOL fifo_value;
+  // Time taken to read the clock, in nsec, measured at init. A spun 
+  //  pulse stops this much early, because the clock read that ends the
+  //  spin is part of the pulse.
+  int64_t clock_nsec;
   };
 
+// Directory containing the GPIO sysfs files, if set by gpiopin_set_root()
+static const char *gpio_root = NULL;
+
+/*============================================================================
+  gpiopin_set_root
+============================================================================*/
+void gpiopin_set_root (const char *root)
+  {
+  gpio_root = root;
+  }
+
+/*============================================================================
+  gpiopin_get_root
+============================================================================*/
+const char *gpiopin_get_root (void)
+  {
+  if (gpio_root) return gpio_root;
+  const char *env = getenv ("HCSR04_GPIO_ROOT");
+  if (env && env[0]) return env;
+  return GPIOPIN_DEFAULT_ROOT;
+  }
+
+/*============================================================================
+
+  gpiopin_path
+
+  Work out the path of one of the pin's files, like "value", or of the
+  pin's directory if attr is NULL
+
+============================================================================*/
+static void gpiopin_path (const GPIOPin *self, const char *attr, char *buff,
+    size_t size)
+  {
+  if (attr)
+    snprintf (buff, size, "%s/gpio%d/%s", gpiopin_get_root(), self->pin, 
+      attr);
+  else
+    snprintf (buff, size, "%s/gpio%d", gpiopin_get_root(), self->pin);
+  }
+
 /*============================================================================
   gpiopin_create
 ============================================================================*/
@@ -35,6 +104,20 @@ GPIOPin *gpiopin_create (int pin)
   memset (self, 0, sizeof (GPIOPin));
   self->pin = pin;
   self->value_fd = -1;
+  self->edge_fd = -1;
+  self->direction_fd = -1;
+  self->wake_fd = -1;
+  self->unexport = TRUE;
+  return self;
+  }
+
+/*============================================================================
+  gpiopin_create_simulated
+============================================================================*/
+GPIOPin *gpiopin_create_simulated (int pin)
+  {
+  GPIOPin *self = gpiopin_create (pin);
+  self->simulated = TRUE;
   return self;
   }
 
@@ -50,7 +133,7 @@ static BOOL gpiopin_write_to_file (const char *filename,
   FILE *f = fopen (filename, "w");
   if (f)
     {
-    fprintf (f, text);
+    fputs (text, f);
     fclose (f);
     ret = TRUE;
     }
@@ -65,6 +148,139 @@ static BOOL gpiopin_write_to_file (const char *filename,
   }
 
 
+/*============================================================================
+
+  gpiopin_wait_ready
+
+  Wait until the file path exists and can be accessed with mode (as for
+  access()), or until deadline, a CLOCK_MONOTONIC time in msec. After a
+  pin is exported, udev creates its files and then changes their
+  permissions, and there is no telling how long that takes. So we watch
+  the directory that contains the file with inotify, and check again
+  whenever anything in it is created or has its attributes changed. If
+  that directory doesn't exist yet, we watch its parent until it does.
+  sysfs doesn't always report such changes, though, so inotify only
+  cuts a wait short: we check again every GPIOPIN_READY_POLL_MSEC
+  regardless, and a missed event costs no more than that.
+  Returns FALSE, and fills in error, if the deadline passes.
+
+============================================================================*/
+static BOOL gpiopin_wait_ready (const char *path, int mode, long deadline,
+    char **error)
+  {
+  if (access (path, mode) == 0) return TRUE;
+  char *dir = strdup (path);
+  dirname (dir);
+  char *parent = strdup (dir);
+  dirname (parent);
+  int fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  BOOL watching = FALSE; // The directory containing the file is watched
+  BOOL ret = FALSE;
+  int err = 0;
+  // Each watch is set after a check, so check again before waiting, in 
+  //  case the change happened in between
+  while (!(ret = (access (path, mode) == 0)))
+    {
+    err = errno;
+    if (fd >= 0 && !watching)
+      {
+      watching = inotify_add_watch (fd, dir, 
+        IN_CREATE | IN_ATTRIB | IN_MOVED_TO) >= 0;
+      if (watching) continue;
+      inotify_add_watch (fd, parent, IN_CREATE | IN_MOVED_TO);
+      }
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    long left = deadline - (now.tv_sec * 1000 + now.tv_nsec / 1000000);
+    if (left <= 0) break;
+    struct pollfd fdset[1];
+    fdset[0].fd = fd;
+    fdset[0].events = POLLIN; 
+    fdset[0].revents = 0; 
+    poll (fdset, 1, left < GPIOPIN_READY_POLL_MSEC 
+      ? left : GPIOPIN_READY_POLL_MSEC);
+    if (fd >= 0)
+      {
+      char buff[4096];
+      while (read (fd, buff, sizeof (buff)) > 0);
+      }
+    }
+  if (!ret && error)
+    asprintf (error, "Timed out waiting for %s: %s", path, strerror (err));
+  if (fd >= 0) close (fd);
+  free (parent);
+  free (dir);
+  return ret;
+  }
+
+/*============================================================================
+
+  gpiopin_monotonic_nsec
+
+============================================================================*/
+static int64_t gpiopin_monotonic_nsec (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  }
+
+/*============================================================================
+
+  gpiopin_calibrate
+
+  Find how long it takes to read the clock, as the shortest of several
+  back-to-back reads. Any read that is interrupted is just longer, and
+  is not the shortest.
+
+============================================================================*/
+static int64_t gpiopin_calibrate (void)
+  {
+  int64_t best = -1;
+  for (int i = 0; i < 16; i++)
+    {
+    int64_t start = gpiopin_monotonic_nsec();
+    int64_t t = gpiopin_monotonic_nsec() - start;
+    if (best < 0 || t < best) best = t;
+    }
+  return best;
+  }
+
+/*============================================================================
+
+  gpiopin_open_attr
+
+  Wait for one of the pin's files to be ready, and open it. Returns -1,
+  and fills in error, if this can't be done.
+
+============================================================================*/
+static int gpiopin_open_attr (const GPIOPin *self, const char *attr, 
+    int flags, long deadline, char **error)
+  {
+  char s[PATH_MAX];
+  gpiopin_path (self, attr, s, sizeof (s));
+  int mode = (flags & O_ACCMODE) == O_RDONLY ? R_OK : W_OK;
+  if (!gpiopin_wait_ready (s, mode, deadline, error)) return -1;
+  int fd = open (s, flags | O_CLOEXEC);
+  if (fd < 0 && error)
+    asprintf (error, "Can't open %s: %s", s, strerror (errno));
+  return fd;
+  }
+
+/*============================================================================
+
+  gpiopin_write_attr
+
+  Write a setting to one of the pin's files. sysfs takes the whole
+  setting from a single write at the start of the file.
+
+============================================================================*/
+static BOOL gpiopin_write_attr (int fd, const char *text)
+  {
+  size_t len = strlen (text);
+  return pwrite (fd, text, len, 0) == (ssize_t)len;
+  }
+
 /*============================================================================
   gpiopin_destroy
 ============================================================================*/
@@ -83,34 +299,66 @@ void gpiopin_destroy (GPIOPin *self)
 BOOL gpiopin_init (GPIOPin *self, GPIOPinDirection dir, char **error)
   {
   assert (self != NULL);
-  char s[50];
-  snprintf (s, sizeof(s), "%d", self->pin);
-  BOOL ret = gpiopin_write_to_file ("/sys/class/gpio/export", s, error);
+  if (self->simulated)
+    {
+    self->sim_value = LOW;
+    return TRUE;
+    }
+  self->clock_nsec = gpiopin_calibrate ();
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  long deadline = now.tv_sec * 1000 + now.tv_nsec / 1000000 
+    + GPIOPIN_READY_MSEC;
+
+  // A pin that is already exported -- by an earlier run, or at boot --
+  //  can be used as it is. Exporting it again would fail anyway.
+  char s[PATH_MAX];
+  gpiopin_path (self, NULL, s, sizeof (s));
+  BOOL ret = TRUE;
+  self->exported = FALSE;
+  if (access (s, F_OK) != 0)
+    {
+    char export[PATH_MAX];
+    snprintf (export, sizeof(export), "%s/export", gpiopin_get_root());
+    snprintf (s, sizeof(s), "%d", self->pin);
+    ret = gpiopin_write_to_file (export, s, error);
+    self->exported = ret;
+    }
   if (ret)
     {
-    char s[50];
-    snprintf (s, sizeof(s), "/sys/class/gpio/gpio%d/direction", self->pin);
-    if (dir == GPIOPIN_OUT)
-      gpiopin_write_to_file (s, "out", NULL); 
-    else
-      gpiopin_write_to_file (s, "in", NULL); 
-    snprintf (s, sizeof(s), "/sys/class/gpio/gpio%d/value", self->pin);
-    if (dir == GPIOPIN_OUT)
-      self->value_fd = open (s, O_RDWR);
-    else
-      self->value_fd = open (s, O_RDONLY | O_NONBLOCK);
-      
-    if (self->value_fd >= 0) 
-      {
-      ret = TRUE;
-      }
-    else
-      {
-      if (error)
-        asprintf (error, "Can't open %s for writing: %s", s, strerror (errno));
-      ret = FALSE;
-      }
+    self->direction_fd = gpiopin_open_attr (self, "direction", O_WRONLY, 
+      deadline, error);
+    ret = self->direction_fd >= 0;
+    }
+  if (ret && !gpiopin_write_attr (self->direction_fd, 
+        dir == GPIOPIN_OUT ? "out" : "in"))
+    {
+    if (error)
+      asprintf (error, "Can't set direction of GPIO %d: %s", self->pin,
+        strerror (errno));
+    ret = FALSE;
+    }
+  if (ret)
+    {
+    self->value_fd = gpiopin_open_attr (self, "value", 
+      dir == GPIOPIN_OUT ? O_RDWR : O_RDONLY | O_NONBLOCK, deadline, error);
+    ret = self->value_fd >= 0;
+    }
+  if (ret && dir == GPIOPIN_IN)
+    {
+    self->edge_fd = gpiopin_open_attr (self, "edge", O_WRONLY, deadline, 
+      error);
+    ret = self->edge_fd >= 0;
     }
+  if (ret)
+    {
+    struct stat sb;
+    self->fifo = (fstat (self->value_fd, &sb) == 0 && S_ISFIFO (sb.st_mode));
+    self->fifo_value = LOW;
+    self->trigger = -1;
+    }
+  else
+    gpiopin_uninit (self);
   return ret;
   }
 
@@ -120,12 +368,37 @@ BOOL gpiopin_init (GPIOPin *self, GPIOPinDirection dir, char **error)
 void gpiopin_uninit (GPIOPin *self)
   {
   assert (self != NULL);
+  if (self->simulated) return;
   if (self->value_fd >= 0)
     close (self->value_fd);
   self->value_fd = -1;
-  char s[50];
-  snprintf (s, sizeof(s), "%d", self->pin);
-  gpiopin_write_to_file ("/sys/class/gpio/unexport", s, NULL);
+  if (self->edge_fd >= 0)
+    close (self->edge_fd);
+  self->edge_fd = -1;
+  if (self->direction_fd >= 0)
+    close (self->direction_fd);
+  self->direction_fd = -1;
+  // Leave a pin exported if it was exported before we started, or if
+  //  we've been asked to, so that the next user doesn't have to wait
+  //  for it to be set up again
+  if (self->exported && self->unexport)
+    {
+    char unexport[PATH_MAX];
+    snprintf (unexport, sizeof(unexport), "%s/unexport", gpiopin_get_root());
+    char s[50];
+    snprintf (s, sizeof(s), "%d", self->pin);
+    gpiopin_write_to_file (unexport, s, NULL);
+    self->exported = FALSE;
+    }
+  }
+
+/*============================================================================
+  gpiopin_set_unexport
+============================================================================*/
+void gpiopin_set_unexport (GPIOPin *self, BOOL unexport)
+  {
+  assert (self != NULL);
+  self->unexport = unexport;
   }
 
 /*============================================================================
@@ -134,9 +407,19 @@ void gpiopin_uninit (GPIOPin *self)
 void gpiopin_set (GPIOPin *self, BOOL val)
   {
   assert (self != NULL);
+  if (self->simulated)
+    {
+    self->sim_value = val ? HIGH : LOW;
+    return;
+    }
   assert (self->value_fd >= 0);
   char c = val ? '1' : '0';
-  write (self->value_fd, &c, 1);
+  // A sysfs value file has to be written from offset 0 each time; a FIFO
+  //  (the fake GPIO) can't seek, and just takes the next byte
+  if (self->fifo)
+    write (self->value_fd, &c, 1);
+  else
+    pwrite (self->value_fd, &c, 1, 0);
   }
 
 /*============================================================================
@@ -144,11 +427,12 @@ void gpiopin_set (GPIOPin *self, BOOL val)
 ============================================================================*/
 BOOL gpiopin_get (const GPIOPin *self)
   {
-  char c;
-  lseek (self->value_fd, 0, SEEK_SET);
-  /* int n = */ read (self->value_fd, &c, 1);
+  if (self->simulated) return self->sim_value;
+  if (self->fifo) return self->fifo_value;
+  char c = 0;
+  int n = pread (self->value_fd, &c, 1, 0);
   BOOL ret = (c == '1');
-  // printf ("n=%d c=%d s=%d\n", n, c, self->value_fd);
+  HCSR04_PROBE3 (gpio_get, self->pin, n, ret);
   return ret; 
   }
 
@@ -157,26 +441,118 @@ BOOL gpiopin_get (const GPIOPin *self)
 ============================================================================*/
 void gpiopin_set_trigger (GPIOPin *self, GPIOPinTrigger trigger)
   {
-  char s[50];
-  snprintf (s, sizeof(s), "/sys/class/gpio/gpio%d/edge", self->pin);
-  int f = open (s, O_WRONLY);
-  assert (f >= 0);
+  if (self->simulated) return;
+  assert (self->edge_fd >= 0);
+  if (trigger == self->trigger) return;
   switch (trigger)
     {
     case GPIOPIN_BOTH:
-      gpiopin_write_to_file (s, "both", NULL); 
+      gpiopin_write_attr (self->edge_fd, "both"); 
       break;
     case GPIOPIN_RISING:
-      gpiopin_write_to_file (s, "rising", NULL); 
+      gpiopin_write_attr (self->edge_fd, "rising"); 
       break;
     case GPIOPIN_FALLING:
-      gpiopin_write_to_file (s, "falling", NULL); 
+      gpiopin_write_attr (self->edge_fd, "falling"); 
       break;
     default:
-      gpiopin_write_to_file (s, "none", NULL); 
+      gpiopin_write_attr (self->edge_fd, "none"); 
       break;
     }
-  close (f);
+  self->trigger = trigger;
+  }
+
+/*============================================================================
+
+  gpiopin_clear_trigger
+
+  sysfs reports an edge with POLLPRI until the value file is next read,
+  so reading it clears the edge. A FIFO in the fake GPIO tree holds a
+  byte for each edge, which must all be read.
+
+============================================================================*/
+void gpiopin_clear_trigger (GPIOPin *self)
+  {
+  assert (self != NULL);
+  if (self->simulated) return;
+  assert (self->value_fd >= 0);
+  char c;
+  if (self->fifo)
+    {
+    while (read (self->value_fd, &c, 1) == 1)
+      self->fifo_value = (c == '1');
+    }
+  else
+    pread (self->value_fd, &c, 1, 0);
+  }
+
+/*============================================================================
+  gpiopin_pulse
+============================================================================*/
+int gpiopin_pulse (GPIOPin *self, int usec, BOOL spin, int64_t *end_usec)
+  {
+  assert (self != NULL);
+  gpiopin_set (self, HIGH);
+  int64_t start = gpiopin_monotonic_nsec();
+  if (spin)
+    {
+    int64_t until = start + (int64_t)usec * 1000 - self->clock_nsec;
+    while (gpiopin_monotonic_nsec() < until)
+      ;
+    }
+  else
+    usleep (usec);
+  gpiopin_set (self, LOW);
+  int64_t end = gpiopin_monotonic_nsec();
+  if (end_usec) *end_usec = end / 1000;
+  return (int)((end - start + 500) / 1000);
+  }
+
+/*============================================================================
+  gpiopin_get_fd
+============================================================================*/
+int gpiopin_get_fd (const GPIOPin *self)
+  {
+  assert (self != NULL);
+  return self->simulated ? -1 : self->value_fd;
+  }
+
+/*============================================================================
+  gpiopin_get_poll_events
+============================================================================*/
+short gpiopin_get_poll_events (const GPIOPin *self)
+  {
+  assert (self != NULL);
+  return self->fifo ? POLLIN : POLLPRI;
+  }
+
+/*============================================================================
+  gpiopin_take_trigger
+============================================================================*/
+BOOL gpiopin_take_trigger (GPIOPin *self)
+  {
+  assert (self != NULL);
+  if (self->simulated) return FALSE;
+  assert (self->value_fd >= 0);
+  char c;
+  if (self->fifo)
+    {
+    if (read (self->value_fd, &c, 1) != 1) return FALSE;
+    self->fifo_value = (c == '1');
+    return TRUE;
+    }
+  // sysfs keeps reporting the edge until the value is read
+  pread (self->value_fd, &c, 1, 0);
+  return TRUE;
+  }
+
+/*============================================================================
+  gpiopin_set_wake_fd
+============================================================================*/
+void gpiopin_set_wake_fd (GPIOPin *self, int fd)
+  {
+  assert (self != NULL);
+  self->wake_fd = fd;
   }
 
 /*============================================================================
@@ -188,19 +564,49 @@ void gpiopin_set_trigger (GPIOPin *self, GPIOPinTrigger trigger)
   and reads are what I've arrived at by trial-and-error 
 
 ============================================================================*/
-void gpiopin_wait_for_trigger (GPIOPin *self, int usec)
+BOOL gpiopin_wait_for_trigger (GPIOPin *self, int usec)
   {
   assert (self != NULL);
+  if (self->simulated)
+    {
+    // Nothing will ever change a simulated input, so just wait out the
+    //  timeout, unless woken.
+    struct pollfd fdset[1];
+    fdset[0].fd = self->wake_fd;
+    fdset[0].events = POLLIN; 
+    fdset[0].revents = 0; 
+    poll (fdset, 1, usec / 1000);
+    return FALSE;
+    }
   assert (self->value_fd >= 0);
-  struct pollfd fdset[1];
+  struct pollfd fdset[2];
   fdset[0].fd = self->value_fd;
-  fdset[0].events = POLLPRI; 
+  fdset[0].events = self->fifo ? POLLIN : POLLPRI; 
   fdset[0].revents = 0; 
+  // If there is no wake fd, poll() ignores the negative descriptor
+  fdset[1].fd = self->wake_fd;
+  fdset[1].events = POLLIN; 
+  fdset[1].revents = 0; 
+  if (self->fifo)
+    {
+    // Each edge is one byte, so take just one, leaving any later edge
+    //  for the next wait
+    poll (fdset, 2, usec / 1000);
+    char c;
+    BOOL fired = (fdset[0].revents & POLLIN) 
+      && read (self->value_fd, &c, 1) == 1;
+    if (fired) self->fifo_value = (c == '1');
+    HCSR04_PROBE2 (gpio_wake, self->pin, fired);
+    return fired;
+    }
   char  buff[50];
   lseek (self->value_fd, 0, 0); 
-  poll (fdset, 1, usec / 1000);
+  poll (fdset, 2, usec / 1000);
   // We should not read more the one byte here, but better to be safe.
   read (self->value_fd, buff, sizeof (buff));
+  BOOL fired = (fdset[0].revents & POLLPRI) != 0;
+  HCSR04_PROBE2 (gpio_wake, self->pin, fired);
+  return fired;
   }
 
 
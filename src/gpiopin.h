@@ -10,8 +10,17 @@
   ==========================================================================*/
 #pragma once
 
+#include <stdint.h>
 #include "defs.h"
 
+// Longest time gpiopin_init() waits for udev to make a newly-exported
+//  pin's files usable, in msec
+#define GPIOPIN_READY_MSEC 2000
+
+// Where the GPIO sysfs files are, unless changed by gpiopin_set_root()
+//  or the HCSR04_GPIO_ROOT environment variable
+#define GPIOPIN_DEFAULT_ROOT "/sys/class/gpio"
+
 struct GPIOPin;
 typedef struct _GPIOPin GPIOPin;
 
@@ -33,41 +42,103 @@ typedef enum
 
 BEGIN_DECLS
 
+/** Set the directory that contains the GPIO "export" and "unexport" 
+    files, and the pin directories, for all pins initialized after this
+    call. This is for testing against a fake GPIO tree (see 
+    tools/fakegpio.h). If root is NULL, the HCSR04_GPIO_ROOT environment
+    variable is used if it is set, or else GPIOPIN_DEFAULT_ROOT. The 
+    string is not copied. */
+void      gpiopin_set_root (const char *root);
+
+/** Get the directory set by gpiopin_set_root(), or its default. */
+const char *gpiopin_get_root (void);
+
 /** Initialize the GPIOPin object with pin number. 
     Note that this method only stores values, 
     and will always succeed. */
 GPIOPin  *gpiopin_create (int pin);
 
+/** Create a simulated pin. This behaves like a real pin, except that
+    its value is kept in memory, and no sysfs files are touched. It is
+    intended for testing code that drives output pins. Waiting for
+    a trigger on a simulated pin always times out. */
+GPIOPin  *gpiopin_create_simulated (int pin);
+
 /** Clean up the object. This method implicitly calls _uninit(). */
 void      gpiopin_destroy (GPIOPin *self);
 
-/** Initialize the object. This opens a file handles for the
-    sysfs file for the GPIO pin. Consequently, the method
-    can fail. If it does, and *error is not NULL, then it is written with
-    and error message that the caller should free. If this method 
-    succeeds, _uninit() should be called in due course to clean up. */ 
+/** Initialize the object. This exports the pin, unless it is already
+    exported, waits up to GPIOPIN_READY_MSEC for its files to be usable,
+    and opens a file handles for the sysfs file for the GPIO pin. 
+    Consequently, the method can fail. If it does, and *error is not
+    NULL, then it is written with and error message that the caller 
+    should free. If this method succeeds, _uninit() should be called in
+    due course to clean up. */ 
 BOOL      gpiopin_init (GPIOPin *self, GPIOPinDirection dir, char **error);
 
-/** Clean up. In principle, this operation can fail, as it involves sysfs
-    operations. But what can we do if this happens? Probably nothing, so no
-    errors are reported. */
+/** Clean up, unexporting the pin if _init() exported it. In principle, 
+    this operation can fail, as it involves sysfs operations. But what can
+    we do if this happens? Probably nothing, so no errors are reported. */
 void      gpiopin_uninit (GPIOPin *self);
 
+/** Set whether _uninit() unexports a pin that _init() exported. The 
+    default is TRUE. Leaving the pin exported makes the next _init()
+    much quicker, as it doesn't have to wait for udev. */
+void      gpiopin_set_unexport (GPIOPin *self, BOOL unexport);
+
 /** Set the edge which will trigger a priority poll. The trigger value
     is one of the GPIOPinTrigger constants. Default is "none". In order
     to use gpio_wait_for_trigger, this method needs to have been called
-    to set the trigger conditions. */
+    to set the trigger conditions. Only input pins have a trigger. 
+    Setting the trigger it already has costs nothing. */
 void      gpiopin_set_trigger (GPIOPin *self, GPIOPinTrigger trigger);
 
+/** Discard any edge that has already been signalled, so that the next
+    gpiopin_wait_for_trigger() waits for a new one. An edge that comes
+    after this call, even before the wait starts, is not lost -- so a
+    caller that expects an edge soon after doing something should set
+    the trigger and call this method first, and wait afterwards. */
+void      gpiopin_clear_trigger (GPIOPin *self);
+
 /** Set this pin HIGH or LOW. */
 void      gpiopin_set (GPIOPin *self, BOOL val);
 
 /** Get the current state of the pin, HIGH or LOW */
 BOOL      gpiopin_get (const GPIOPin *self);
 
+/** Set this output pin HIGH for usec microseconds, then LOW. If spin is
+    TRUE, the time is measured by spinning on the clock, which is right 
+    for the few usec of a sensor's trigger pulse; otherwise the thread
+    sleeps. Returns the width as measured -- from the write that sets 
+    the pin high returning, to the write that sets it low returning --
+    in usec. If end_usec is not NULL, it is written with the time the 
+    pulse ended, from CLOCK_MONOTONIC. */
+int       gpiopin_pulse (GPIOPin *self, int usec, BOOL spin, 
+            int64_t *end_usec);
+
+/** Set a file descriptor that will interrupt gpiopin_wait_for_trigger()
+    as soon as it becomes readable. This is typically an eventfd that 
+    the owner of the pin signals when it wants a waiting thread to 
+    stop. The pin does not take ownership of the descriptor. Set -1 
+    (the default) to remove it. */
+void      gpiopin_set_wake_fd (GPIOPin *self, int fd);
+
 /** Wait for a trigger. After the trigger, the state of the pin can 
     be read. In principle, the state will already be known, unless 
-    the trigger edge is set to "none". */
-void      gpiopin_wait_for_trigger (GPIOPin *self, int usec);
+    the trigger edge is set to "none". Returns TRUE if the trigger
+    fired, and FALSE if the wait timed out, or was interrupted by the
+    wake file descriptor. */
+BOOL      gpiopin_wait_for_trigger (GPIOPin *self, int usec);
+
+/** Get the descriptor to watch for a trigger, and the poll() or epoll
+    events to watch it for, so that one thread can wait for edges on 
+    many pins. The descriptor is -1 for a simulated pin. */
+int       gpiopin_get_fd (const GPIOPin *self);
+short     gpiopin_get_poll_events (const GPIOPin *self);
+
+/** Take an edge that was reported on the descriptor from 
+    gpiopin_get_fd(), so that it is not reported again. Returns FALSE
+    if there was none after all. */
+BOOL      gpiopin_take_trigger (GPIOPin *self);
 
 END_DECLS
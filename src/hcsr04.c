@@ -18,18 +18,57 @@
 #include <unistd.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/time.h>
+#include <sys/eventfd.h>
 #include "defs.h" 
 #include "gpiopin.h" 
 #include "hcsr04.h" 
+#include "zoneset.h" 
+#include "filterbank.h" 
+#include "samplering.h" 
+#include "probes.h" 
 
-// How far sound travels in a microsecond, at standard temperature and
-//  pressure. 343 / 1E6 / 2. The division by two is to account for the 
-//  fact that the sound pulse has to travel from the transucer and back.
-// In principle we should correct for temperature and pressure but,
-//  to be frank, the whole measurement process on a Pi is not stable enough
-//  to worry about such small error sources.
-#define USEC_TO_METRES 0.0001715
+// Reflex -- a reflex rule and its state
+typedef struct _Reflex
+  {
+  HCSR04Reflex config;
+  BOOL asserted;     // TRUE if the output is at its active level
+  HCSR04ReflexStats stats;
+  } Reflex;
+
+// Listener -- a function to be called with every sample
+typedef struct _Listener
+  {
+  HCSR04SampleCallback callback;
+  void *user_data;
+  } Listener;
+
+// Request -- an on-demand measurement, waiting for its answer. ping is 0
+//  until a measurement starts that will answer it, and then that
+//  measurement's number.
+typedef struct _Request
+  {
+  HCSR04SampleCallback callback;
+  void *user_data;
+  int event_fd;
+  uint32_t ping;
+  } Request;
+
+// EdgeRecord -- the raw result of one measurement cycle, passed from the
+//  measurement thread to the processing thread, when pipelined
+typedef struct _EdgeRecord
+  {
+  HCSR04Sample sample;   // With time_usec, rise_usec and fall_usec set
+  int64_t cycle_start;   // Monotonic usec
+  int64_t done_usec;     // When the measurement finished, usec since epoch
+  int32_t pulse_width;   // Measured trigger pulse, usec, or -1
+  int32_t timed;         // Set if phases have been filled in
+  uint32_t ping;         // Number of the measurement, for its requests
+  int64_t phases[HCSR04_PHASE_COUNT];
+  } EdgeRecord;
 
 // HCSR04 structure -- stores all internal data related to this
 //  HCSR04 instance
@@ -43,28 +82,122 @@ struct _HCSR04
   //  valid range. 
   int max_time;
   pthread_t pthread; // Reference to the running thread
-  BOOL stop; // Set when hcsr04_stop() is called, to stop the HCSR04 thead
+  BOOL running; // Set while the thread exists, and must be joined
+  volatile BOOL stop; // Set by hcsr04_uninit(), to stop the HCSR04 thead
+  // eventfd that is signalled by hcsr04_uninit() to wake the thread
+  //  from any wait it is doing -- sleeping between cycles, or waiting
+  //  for an edge on the echo pin.
+  int wake_fd;
   GPIOPin *gpiopin_sound; // Object referring to the sound pin
   GPIOPin *gpiopin_echo;  // Object referring to the echo pin
   int cycle_usec;    // Number of microseconds between measurement cycles.
-  double avg;        // The current smoothed distance value
   double smoothing;  // Smoothing factor (0-1);
-  // good_count is the number of valid measurements made, constrained
-  //  between 0 and HCS04_VALID_SAMPLES. Every valid measurement
-  //  increases this count, and every invalid measurement decreases it.
-  int good_count;    
+  // The smoothed distance, and the good count -- the number of valid
+  //  measurements made, constrained between 0 and HCS04_VALID_SAMPLES. 
+  //  Every valid measurement increases this count, and every invalid 
+  //  measurement decreases it. They are entry bank_index of the bank,
+  //  which is shared with other sensors -- in a group, say -- or else
+  //  is single, a bank of one whose entry is kept here.
+  FilterBank *bank;
+  int bank_index;
+  FilterBank single;
+  FilterEntry entry;
+  // Zones watched by subscribers, and reflex rules. These are protected
+  //  by lock because they can be changed while the thread is running
+  ZoneSet *zones;
+  Reflex reflexes[HCSR04_MAX_REFLEXES];
+  int reflexes_count;
+  Listener listeners[HCSR04_MAX_LISTENERS];
+  int listeners_count;
+  pthread_mutex_t lock;
+  uint32_t seq;      // Sequence number of the next sample
+  HCSR04Sample last_sample; // The most recent sample, protected by lock
+  BOOL have_sample;  // Set when last_sample has been filled in
+  // If set, measurements come from this function, rather than the GPIO
+  HCSR04Simulator simulator;
+  void *simulator_data;
+  // Phase timing. The histograms are protected by lock.
+  volatile BOOL instrumented;
+  HCSR04Histogram phases[HCSR04_PHASE_COUNT];
+  // Running totals, protected by lock. The CPU time in the counters is
+  //  that of threads that have finished; the running thread's CPU time
+  //  is read from its clock when the counters are requested.
+  HCSR04Counters counters;
+  BOOL thread_done;  // Set by the thread, with lock held, as it finishes
+  // Filter settings, and the recent valid samples for the median filter
+  HCSR04FilterType filter;
+  int median_window;
+  double median_values[HCSR04_MAX_MEDIAN];
+  int median_count;  // Number of values stored, up to median_window
+  int median_next;   // Where the next value goes
+  volatile BOOL adaptive;
+  int priority;      // SCHED_FIFO priority, or 0
+  int cpu;           // CPU to bind the thread to, or -1
+  HCSR04TriggerMode trigger_mode;
+  int pulse_usec;    // Trigger pulse width asked for
+  int echo_timeout;  // Longest wait for each edge of the echo, usec
+  // Measured width of the last trigger pulse, or -1 if none was sent.
+  //  Only used by the thread that is processing samples.
+  int pulse_width;
+  // Pipelining, set by hcsr04_set_pipelined(). The measurement thread
+  //  passes raw edges to the processing thread through the edge queue;
+  //  as it finishes, it sets measure_done, and wakes that thread, which
+  //  then processes what is left in the queue, and finishes too.
+  BOOL pipelined;
+  SampleRing *edges; // Of EdgeRecords
+  pthread_t process_pthread;
+  BOOL process_running; // Set while the processing thread must be joined
+  int measure_done;
+  BOOL process_done;    // Like thread_done, for the processing thread
+  // On-demand measurements, protected by lock. requests_waiting counts
+  //  those with no ping yet, and requests_taken those with a ping, but
+  //  no answer; both are changed with the lock held, but are read 
+  //  without it, so that a cycle with no requests costs no locking. 
+  //  request_fd is signalled by hcsr04_request_measurement(), to wake 
+  //  the thread from its sleep between cycles.
+  Request requests[HCSR04_MAX_REQUESTS];
+  int requests_count;
+  int requests_waiting;
+  int requests_taken;
+  uint32_t pings;    // Measurements started; used only by the thread
+  int request_fd;
+  };
+
+static BOOL hcsr04_measure (HCSR04 *self, HCSR04Sample *sample, 
+    int64_t *done_usec, int *pulse_width, int64_t *phases);
+
+static const char *phase_names[HCSR04_PHASE_COUNT] = 
+  {
+  "pulse", "rise_wait", "echo_width", "fall_lag", "filter", "sleep_overshoot"
   };
 
 /*============================================================================
 
-  get_system_time_usec
+  hcsr04_get_time_usec
+
+  The arithmetic is done in 64 bits, as long is only 32 on a 32-bit Pi
 
 ============================================================================*/
-static long get_system_time_usec (void)
+int64_t hcsr04_get_time_usec (void)
   {
   struct timeval tv;
   gettimeofday (&tv, NULL);
-  return tv.tv_usec  + tv.tv_sec * 1000000;
+  return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+  }
+
+/*============================================================================
+
+  get_monotonic_usec
+
+  Used for timing the phases of a cycle, which must not be upset by
+  changes to the system clock
+
+============================================================================*/
+static int64_t get_monotonic_usec (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
   }
 
 /*============================================================================
@@ -82,8 +215,20 @@ HCSR04 *hcsr04_create (int sound_pin, int echo_pin, int cycle_msec,
   self->gpiopin_sound = gpiopin_create (self->sound_pin);
   self->gpiopin_echo = gpiopin_create (self->echo_pin);
   self->cycle_usec = cycle_msec * 1000;
-  self->max_time = (int) (HCSR04_MAX_RANGE / USEC_TO_METRES); 
+  self->max_time = (int) (HCSR04_MAX_RANGE / HCSR04_USEC_TO_METRES); 
   self->smoothing = smoothing; 
+  filterbank_init_entry (&self->single, &self->entry);
+  self->bank = &self->single;
+  filterbank_set_smoothing (self->bank, 0, smoothing);
+  self->wake_fd = -1;
+  self->request_fd = -1;
+  self->filter = HCSR04_FILTER_EMA;
+  self->median_window = 5;
+  self->cpu = -1;
+  self->pulse_usec = HCSR04_PULSE_USEC;
+  self->echo_timeout = HCSR04_ECHO_TIMEOUT;
+  self->zones = zoneset_create ();
+  pthread_mutex_init (&self->lock, NULL);
   return self;
   }
 
@@ -97,10 +242,358 @@ void hcsr04_destroy (HCSR04 *self)
     hcsr04_uninit (self);
     gpiopin_destroy (self->gpiopin_sound);
     gpiopin_destroy (self->gpiopin_echo);
+    zoneset_destroy (self->zones);
+    pthread_mutex_destroy (&self->lock);
     free (self);
     }
   }
 
+/*============================================================================
+
+  hcsr04_sleep
+
+  Wait for the specified number of microseconds, or until the thread is
+  woken by hcsr04_uninit() or hcsr04_request_measurement(), whichever 
+  comes first. Returns TRUE if it was woken by a request.
+
+============================================================================*/
+static BOOL hcsr04_sleep (const HCSR04 *self, int usec)
+  {
+  struct pollfd fdset[2];
+  fdset[0].fd = self->wake_fd;
+  fdset[1].fd = self->request_fd;
+  for (int i = 0; i < 2; i++)
+    {
+    fdset[i].events = POLLIN; 
+    fdset[i].revents = 0; 
+    }
+  struct timespec ts;
+  ts.tv_sec = usec / 1000000;
+  ts.tv_nsec = (usec % 1000000) * 1000;
+  ppoll (fdset, 2, &ts, NULL);
+  if (!(fdset[1].revents & POLLIN)) return FALSE;
+  uint64_t count;
+  read (self->request_fd, &count, sizeof (count));
+  return TRUE;
+  }
+
+/*============================================================================
+
+  hcsr04_wait_cycle
+
+  Sleep until due, a monotonic time in usec, between cycles. If a 
+  measurement is requested, the sleep ends early, as soon as 
+  HCSR04_MIN_CYCLE msec have passed since the cycle started, so that 
+  the new ping can't be confused with the echoes of the last one. 
+  Returns TRUE if the sleep was shortened by a request.
+
+============================================================================*/
+static BOOL hcsr04_wait_cycle (HCSR04 *self, int64_t cycle_start, 
+    int64_t due)
+  {
+  BOOL requested = FALSE;
+  while (!self->stop)
+    {
+    if (!requested 
+         && __atomic_load_n (&self->requests_waiting, __ATOMIC_ACQUIRE) > 0)
+      {
+      requested = TRUE;
+      int64_t soonest = cycle_start + HCSR04_MIN_CYCLE * 1000;
+      if (soonest < due) due = soonest;
+      }
+    int64_t wait = due - get_monotonic_usec();
+    if (wait <= 0) break;
+    if (!hcsr04_sleep (self, (int)wait)) break;
+    }
+  return requested;
+  }
+
+/*============================================================================
+
+  hcsr04_take_requests
+
+  Called by the measurement thread as a measurement starts, to make it 
+  the answer to all the requests that are waiting
+
+============================================================================*/
+static void hcsr04_take_requests (HCSR04 *self, uint32_t ping)
+  {
+  pthread_mutex_lock (&self->lock);
+  int taken = 0;
+  for (int i = 0; i < self->requests_count; i++)
+    {
+    Request *r = &self->requests[i];
+    if (r->ping == 0)
+      {
+      r->ping = ping;
+      taken++;
+      }
+    }
+  if (taken > 0) self->counters.request_pings++;
+  __atomic_store_n (&self->requests_waiting, 0, __ATOMIC_RELEASE);
+  __atomic_add_fetch (&self->requests_taken, taken, __ATOMIC_RELEASE);
+  pthread_mutex_unlock (&self->lock);
+  }
+
+/*============================================================================
+
+  hcsr04_answer_requests
+
+  Pass a processed sample to the requests it answers. The requests of a
+  measurement that was never processed, because the pipeline dropped it,
+  are answered by the next one. The requests are taken off the list with
+  the lock held, but answered after it is released, so that callers can
+  use the HCSR04 from their callbacks.
+
+============================================================================*/
+static void hcsr04_answer_requests (HCSR04 *self, 
+    const HCSR04Sample *sample, uint32_t ping)
+  {
+  if (__atomic_load_n (&self->requests_taken, __ATOMIC_ACQUIRE) == 0) 
+    return;
+  Request answered[HCSR04_MAX_REQUESTS];
+  int answered_count = 0;
+  pthread_mutex_lock (&self->lock);
+  int kept = 0;
+  for (int i = 0; i < self->requests_count; i++)
+    {
+    Request *r = &self->requests[i];
+    if (r->ping != 0 && (int32_t)(ping - r->ping) >= 0)
+      answered[answered_count++] = *r;
+    else
+      self->requests[kept++] = *r;
+    }
+  self->requests_count = kept;
+  self->counters.requests += answered_count;
+  __atomic_sub_fetch (&self->requests_taken, answered_count, 
+    __ATOMIC_RELEASE);
+  pthread_mutex_unlock (&self->lock);
+
+  for (int i = 0; i < answered_count; i++)
+    {
+    Request *r = &answered[i];
+    if (r->callback) r->callback (sample, r->user_data);
+    if (r->event_fd >= 0)
+      {
+      uint64_t one = 1;
+      write (r->event_fd, &one, sizeof (one));
+      }
+    }
+  }
+
+/*============================================================================
+
+  hcsr04_reflex_wanted
+
+  Work out whether a reflex output should be asserted, given the current
+  filtered distance.
+
+============================================================================*/
+static BOOL hcsr04_reflex_wanted (const HCSR04 *self, const Reflex *r)
+  {
+  const HCSR04Reflex *c = &r->config;
+  double avg = filterbank_get_value (self->bank, self->bank_index);
+  if (!hcsr04_is_distance_valid (self))
+    return c->assert_on_invalid ? TRUE : r->asserted;
+  if (c->direction == HCSR04_REFLEX_BELOW)
+    {
+    if (r->asserted)
+      return avg < c->threshold + c->hysteresis;
+    return avg < c->threshold;
+    }
+  else
+    {
+    if (r->asserted)
+      return avg > c->threshold - c->hysteresis;
+    return avg > c->threshold;
+    }
+  }
+
+/*============================================================================
+
+  hcsr04_run_reflexes
+
+  Drive any reflex outputs whose state should change as a result of the 
+  latest sample, and record how long after the sample that happened. 
+  Called from the measurement thread, with the lock held.
+
+============================================================================*/
+static void hcsr04_run_reflexes (HCSR04 *self, int64_t done_usec)
+  {
+  for (int i = 0; i < self->reflexes_count; i++)
+    {
+    Reflex *r = &self->reflexes[i];
+    BOOL want = hcsr04_reflex_wanted (self, r);
+    if (want == r->asserted) continue;
+    BOOL level = r->config.active_level;
+    gpiopin_set (r->config.pin, want ? level : !level);
+    long latency = (long)(hcsr04_get_time_usec() - done_usec);
+    r->asserted = want;
+    r->stats.actuations++;
+    r->stats.last_latency_usec = latency;
+    r->stats.total_latency_usec += latency;
+    if (latency > r->stats.max_latency_usec) 
+      r->stats.max_latency_usec = latency;
+    }
+  }
+
+/*============================================================================
+
+  hcsr04_median
+
+  Add a valid distance to the median filter's window, and return the
+  median of the window
+
+============================================================================*/
+static double hcsr04_median (HCSR04 *self, double d)
+  {
+  self->median_values[self->median_next] = d;
+  self->median_next = (self->median_next + 1) % self->median_window;
+  if (self->median_count < self->median_window) self->median_count++;
+  // The window is small, so an insertion sort of a copy is as quick
+  //  as anything cleverer
+  double sorted[HCSR04_MAX_MEDIAN];
+  int n = self->median_count;
+  for (int i = 0; i < n; i++)
+    {
+    double v = self->median_values[i];
+    int j = i;
+    for (; j > 0 && sorted[j - 1] > v; j--)
+      sorted[j] = sorted[j - 1];
+    sorted[j] = v;
+    }
+  return (n % 2) ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+  }
+
+/*============================================================================
+
+  hcsr04_record_phases
+
+  Add the phase times from one cycle to the histograms. Phases that were
+  not timed are -1. Called with the lock held.
+
+============================================================================*/
+static void hcsr04_record_phases (HCSR04 *self, const int64_t *phases)
+  {
+  for (int i = 0; i < HCSR04_PHASE_COUNT; i++)
+    if (phases[i] >= 0) histo_record (&self->phases[i], phases[i]);
+  }
+
+/*============================================================================
+
+  hcsr04_count_pulse
+
+  Add the width of the last trigger pulse, if one was sent, to the 
+  counters. Called with the lock held.
+
+============================================================================*/
+static void hcsr04_count_pulse (HCSR04 *self)
+  {
+  if (self->pulse_width < 0) return;
+  HCSR04Counters *c = &self->counters;
+  uint64_t width = (uint64_t)self->pulse_width;
+  c->pulses++;
+  c->pulse_usec_total += width;
+  if (width > c->pulse_usec_max) c->pulse_usec_max = width;
+  if (self->pulse_width > self->pulse_usec + HCSR04_PULSE_SLACK) 
+    c->long_pulses++;
+  }
+
+/*============================================================================
+
+  hcsr04_process
+
+  Everything that happens to a sample after it has been measured: it 
+  gets a sequence number, and is filtered, and passed to the reflexes,
+  zones, and sample callbacks. If filtered is set, the sample has already
+  been added to the filter bank, along with those of the other sensors
+  in the bank, and only the median filter is left to do. done_usec is 
+  the time the measurement finished. If cycle_start is not zero, a cycle
+  that has taken longer than the cycle time, by the time processing is 
+  done, is counted as an overrun. If phases is not NULL, the filter 
+  phase is timed, and all the phases are recorded.
+
+============================================================================*/
+static void hcsr04_process (HCSR04 *self, HCSR04Sample *sample, 
+    BOOL filtered, int64_t done_usec, int64_t cycle_start, int64_t *phases)
+  {
+  if (sample->status != HCSR04_SAMPLE_OK)
+    HCSR04_PROBE2 (timeout, self->echo_pin, sample->status);
+  int64_t filter_start = phases ? get_monotonic_usec() : 0;
+  sample->seq = self->seq++;
+  double d = sample->raw;
+  FilterBank *bank = self->bank;
+  int b = self->bank_index;
+  if (!filtered)
+    filterbank_update_one (bank, b, d);
+  if (d > 0 && self->filter == HCSR04_FILTER_MEDIAN)
+    filterbank_set_value (bank, b, hcsr04_median (self, d));
+
+  // Reflexes first, because they drive outputs that something is
+  //  waiting for in real time; then zones.
+  pthread_mutex_lock (&self->lock);
+  hcsr04_run_reflexes (self, done_usec);
+  if (d > 0 && hcsr04_is_distance_valid (self))
+    zoneset_evaluate (self->zones, filterbank_get_value (bank, b), 
+      sample->time_usec);
+  else if (!hcsr04_is_distance_valid (self))
+    zoneset_invalidate (self->zones, sample->time_usec);
+  sample->filtered = hcsr04_get_distance (self);
+  HCSR04_PROBE4 (filter, self->echo_pin, (long)(sample->raw * 1e6), 
+    (long)(sample->filtered * 1e6), filterbank_get_good_count (bank, b));
+  HCSR04_PROBE4 (publish, self->echo_pin, sample->seq, sample->time_usec, 
+    sample->status);
+  for (int i = 0; i < self->listeners_count; i++)
+    self->listeners[i].callback (sample, self->listeners[i].user_data);
+  self->last_sample = *sample;
+  self->have_sample = TRUE;
+  HCSR04Counters *c = &self->counters;
+  c->cycles++;
+  switch (sample->status)
+    {
+    case HCSR04_SAMPLE_OK: c->good++; break;
+    case HCSR04_SAMPLE_NO_RISE: c->no_rise++; break;
+    case HCSR04_SAMPLE_NO_FALL: c->no_fall++; break;
+    default: c->out_of_range++; break;
+    }
+  if (cycle_start && self->cycle_usec > 0 
+       && get_monotonic_usec() - cycle_start > self->cycle_usec)
+    c->overruns++;
+  hcsr04_count_pulse (self);
+  if (phases)
+    {
+    phases[HCSR04_PHASE_FILTER] = get_monotonic_usec() - filter_start;
+    hcsr04_record_phases (self, phases);
+    }
+  pthread_mutex_unlock (&self->lock);
+  }
+
+/*============================================================================
+
+  hcsr04_pass_edges
+
+  Hand a measurement to the processing thread, when pipelined. Overruns
+  are counted here, because only this thread knows when the cycle 
+  started.
+
+============================================================================*/
+static void hcsr04_pass_edges (HCSR04 *self, EdgeRecord *record, 
+    int64_t cycle_start, BOOL timed)
+  {
+  record->cycle_start = cycle_start;
+  record->timed = timed;
+  BOOL overrun = self->cycle_usec > 0 
+    && get_monotonic_usec() - cycle_start > self->cycle_usec;
+  BOOL pushed = samplering_push_record (self->edges, record);
+  if (overrun || !pushed)
+    {
+    pthread_mutex_lock (&self->lock);
+    if (overrun) self->counters.overruns++;
+    if (!pushed) self->counters.pipeline_dropped++;
+    pthread_mutex_unlock (&self->lock);
+    }
+  }
+
 /*============================================================================
 
   hcsr04_loop
@@ -111,38 +604,239 @@ void hcsr04_destroy (HCSR04 *self)
 void *hcsr04_loop (void *arg)
   {
   HCSR04 *self = (HCSR04 *)arg;
+  int64_t overshoot = -1; // Sleep overshoot at the end of the last cycle
   while (!self->stop)
     {
-    double d = hcsr04_read_one (self);
-    if (d > 0)
+    int64_t cycle_start = get_monotonic_usec();
+    EdgeRecord record;
+    // Measurement numbers start from 1, because 0 marks a request that
+    //  is still waiting
+    if (++self->pings == 0) self->pings = 1;
+    record.ping = self->pings;
+    if (__atomic_load_n (&self->requests_waiting, __ATOMIC_ACQUIRE) > 0)
+      hcsr04_take_requests (self, record.ping);
+    int64_t *timing = NULL;
+    if (self->instrumented)
       {
-      self->avg = d * (1 - self->smoothing) + self->avg * (self->smoothing); 
-      self->good_count++;
-      if (self->good_count > HCSR04_VALID_SAMPLES) 
-         self->good_count = HCSR04_VALID_SAMPLES;
+      for (int i = 0; i < HCSR04_PHASE_COUNT; i++)
+        record.phases[i] = -1;
+      timing = record.phases;
       }
+    if (!hcsr04_measure (self, &record.sample, &record.done_usec, 
+          &record.pulse_width, timing)) 
+      break; // A simulator has run out of data
+    if (timing)
+      record.phases[HCSR04_PHASE_SLEEP_OVERSHOOT] = overshoot;
+    if (self->edges)
+      hcsr04_pass_edges (self, &record, cycle_start, timing != NULL);
     else
       {
-      self->good_count--;
-      if (self->good_count < 0) self->good_count = 0;
+      self->pulse_width = record.pulse_width;
+      hcsr04_process (self, &record.sample, FALSE, record.done_usec, 
+        cycle_start, timing);
+      hcsr04_answer_requests (self, &record.sample, record.ping);
+      }
+
+    overshoot = -1;
+    int sleep_usec = self->cycle_usec;
+    if (self->adaptive)
+      sleep_usec -= (int)(get_monotonic_usec() - cycle_start);
+    if (!self->stop && sleep_usec > 0)
+      {
+      int64_t due = get_monotonic_usec() + sleep_usec;
+      BOOL requested = hcsr04_wait_cycle (self, cycle_start, due);
+      // A sleep cut short by hcsr04_uninit(), or by a request, doesn't 
+      //  count
+      if (timing && !self->stop && !requested)
+        overshoot = get_monotonic_usec() - due;
       }
-    usleep (self->cycle_usec);
+    }
+
+  struct timespec cpu;
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &cpu);
+  pthread_mutex_lock (&self->lock);
+  self->counters.cpu_usec += (int64_t)cpu.tv_sec * 1000000 
+    + cpu.tv_nsec / 1000;
+  self->thread_done = TRUE;
+  pthread_mutex_unlock (&self->lock);
+  if (self->edges)
+    {
+    __atomic_store_n (&self->measure_done, 1, __ATOMIC_RELEASE);
+    samplering_signal (self->edges);
     }
   return NULL;
   }
 
 /*============================================================================
 
-  hcsr04_init
+  hcsr04_process_loop
+
+  The processing thread, when the HCSR04 is pipelined. It processes the
+  raw edges from the queue, in order, until the measurement thread has
+  finished, and the queue is empty.
 
 ============================================================================*/
-BOOL hcsr04_init (HCSR04 *self, char **error)
+static void *hcsr04_process_loop (void *arg)
   {
-  assert (self != NULL);
-  self->avg = 0.0;
-  self->good_count = 0;
+  HCSR04 *self = (HCSR04 *)arg;
+  BOOL done = FALSE;
+  while (!done)
+    {
+    // Read before the queue is emptied, so that every record pushed
+    //  before the measurement thread finished is processed
+    done = __atomic_load_n (&self->measure_done, __ATOMIC_ACQUIRE);
+    samplering_clear_fd (self->edges);
+    EdgeRecord record;
+    while (samplering_pop_record (self->edges, &record))
+      {
+      self->pulse_width = record.pulse_width;
+      // Overruns were counted by the measurement thread
+      hcsr04_process (self, &record.sample, FALSE, record.done_usec, 0,
+        record.timed ? record.phases : NULL);
+      hcsr04_answer_requests (self, &record.sample, record.ping);
+      }
+    if (!done)
+      {
+      struct pollfd fdset[1];
+      fdset[0].fd = samplering_get_fd (self->edges);
+      fdset[0].events = POLLIN;
+      fdset[0].revents = 0;
+      poll (fdset, 1, -1);
+      }
+    }
+
+  struct timespec cpu;
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &cpu);
+  pthread_mutex_lock (&self->lock);
+  self->counters.cpu_usec += (int64_t)cpu.tv_sec * 1000000 
+    + cpu.tv_nsec / 1000;
+  self->process_done = TRUE;
+  pthread_mutex_unlock (&self->lock);
+  return NULL;
+  }
+
+/*============================================================================
+
+  hcsr04_start_process_thread
+
+  Create the edge queue, and start the processing thread of a pipelined
+  HCSR04. It is kept off the measurement thread's CPU, if that has one.
+
+============================================================================*/
+static BOOL hcsr04_start_process_thread (HCSR04 *self, char **error)
+  {
+  self->edges = samplering_create_sized (HCSR04_PIPELINE_QUEUE, 
+    sizeof (EdgeRecord));
+  if (!self->edges)
+    {
+    if (error)
+      asprintf (error, "Can't create eventfd: %s", strerror (errno));
+    return FALSE;
+    }
+  self->measure_done = 0;
+  self->process_done = FALSE;
+  pthread_attr_t attr;
+  pthread_attr_init (&attr);
+  int cpus = (int)sysconf (_SC_NPROCESSORS_ONLN);
+  if (self->cpu >= 0 && cpus > 1)
+    {
+    cpu_set_t set;
+    CPU_ZERO (&set);
+    for (int i = 0; i < cpus; i++)
+      if (i != self->cpu) CPU_SET (i, &set);
+    pthread_attr_setaffinity_np (&attr, sizeof (set), &set);
+    }
+  int err = pthread_create (&self->process_pthread, &attr, 
+    hcsr04_process_loop, self);
+  pthread_attr_destroy (&attr);
+  if (err != 0)
+    {
+    if (error)
+      asprintf (error, "Can't start HCSR04 processing thread: %s", 
+        strerror (err));
+    return FALSE;
+    }
+  self->process_running = TRUE;
+  return TRUE;
+  }
+
+/*============================================================================
+
+  hcsr04_start_thread
+
+  Start the measurement thread, with the scheduling policy and CPU 
+  affinity set by hcsr04_set_scheduling()
+
+============================================================================*/
+static BOOL hcsr04_start_thread (HCSR04 *self, char **error)
+  {
+  pthread_attr_t attr;
+  pthread_attr_init (&attr);
+  if (self->priority > 0)
+    {
+    struct sched_param param;
+    memset (&param, 0, sizeof (param));
+    param.sched_priority = self->priority;
+    pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy (&attr, SCHED_FIFO);
+    pthread_attr_setschedparam (&attr, &param);
+    }
+  if (self->cpu >= 0)
+    {
+    cpu_set_t cpus;
+    CPU_ZERO (&cpus);
+    CPU_SET (self->cpu, &cpus);
+    pthread_attr_setaffinity_np (&attr, sizeof (cpus), &cpus);
+    }
+  if (self->pipelined && !hcsr04_start_process_thread (self, error))
+    {
+    pthread_attr_destroy (&attr);
+    return FALSE;
+    }
+  int err = pthread_create (&self->pthread, &attr, hcsr04_loop, self);
+  pthread_attr_destroy (&attr);
+  if (err != 0)
+    {
+    if (error)
+      asprintf (error, "Can't start HCSR04 thread: %s", strerror (err));
+    return FALSE;
+    }
+  self->running = TRUE;
+  return TRUE;
+  }
+
+/*============================================================================
+
+  hcsr04_init_pins
+
+  Reset the measurement state, and set up the GPIO pins and the eventfd
+  that wakes the thread, but don't start the thread
+
+============================================================================*/
+static BOOL hcsr04_init_pins (HCSR04 *self, char **error)
+  {
+  filterbank_reset (self->bank, self->bank_index);
+  self->seq = 0;
+  self->stop = FALSE;
+  self->thread_done = FALSE;
+  self->median_count = 0;
+  self->median_next = 0;
+  self->pulse_width = -1;
+  self->pings = 0;
   BOOL ret = FALSE;
-  if (gpiopin_init (self->gpiopin_echo, GPIOPIN_IN, error))
+  self->wake_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  self->request_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (self->wake_fd < 0 || self->request_fd < 0)
+    {
+    if (error)
+      asprintf (error, "Can't create eventfd: %s", strerror (errno));
+    }
+  else if (self->simulator)
+    {
+    // A simulated sensor has no GPIO pins to set up
+    ret = TRUE;
+    }
+  else if (gpiopin_init (self->gpiopin_echo, GPIOPIN_IN, error))
     {
     // If we can initialize one GPIO pin, we'll assume that others
     //  initialize OK as well.
@@ -152,82 +846,730 @@ BOOL hcsr04_init (HCSR04 *self, char **error)
     //  each measurement cycle.
     gpiopin_set (self->gpiopin_sound, LOW);
 
-    pthread_t pt;
-    pthread_create (&pt, NULL, hcsr04_loop, self);
-    pthread_detach (pt); // This doesn't seem to prevent the small mem leak,
-                       //  perhaps because the application closes before the
-                       //  loop has time to complete nicely.
-    self->pthread = pt;
-
+    // Any wait on the echo pin must end as soon as we are asked
+    //  to stop
+    gpiopin_set_wake_fd (self->gpiopin_echo, self->wake_fd);
     ret = TRUE;
     }
   return ret;
   }
 
 /*============================================================================
-  hcsr04_uninit
+
+  hcsr04_init
+
 ============================================================================*/
-void hcsr04_uninit (HCSR04 *self)
+BOOL hcsr04_init (HCSR04 *self, char **error)
   {
   assert (self != NULL);
-  self->stop = TRUE;
-  gpiopin_uninit (self->gpiopin_sound);
-  gpiopin_uninit (self->gpiopin_echo);
+  BOOL ret = hcsr04_init_pins (self, error) 
+    && hcsr04_start_thread (self, error);
+  if (!ret)
+    hcsr04_uninit (self);
+  return ret;
   }
 
 /*============================================================================
-  hcsr04_read_one
-============================================================================*/
-double hcsr04_read_one (HCSR04 *self)
-  {
-  // Pulse the sound pin high. This should be for 10usec, but the Pi
-  //  can't time with that precision. Longer doesn't seem to be a 
-  //  problem.
-  gpiopin_set (self->gpiopin_sound, HIGH);
-  usleep (100);
-  gpiopin_set (self->gpiopin_sound, LOW);
-
-  // Set the echo pin to trigger on the rising edge, and wait for
-  //  the edge
-  gpiopin_set_trigger (self->gpiopin_echo, GPIOPIN_RISING);
-  gpiopin_wait_for_trigger (self->gpiopin_echo, 500000);
-
-  // Start the timer, and the start of the rising edge
-  long start = get_system_time_usec();
 
-  // Now wait for the falling edige
-  gpiopin_set_trigger (self->gpiopin_echo, GPIOPIN_FALLING);
-  gpiopin_wait_for_trigger (self->gpiopin_echo, 500000);
+  hcsr04_open
 
-  long end = get_system_time_usec();
-
-  //printf ("trigger %ld %g\n", end - start, (end - start) * 343.0 / 1e6 / 2.0);
- 
-  // If the response time is within limits, return the calculated
-  //  distance. 
-  int diff = (int) (end - start);
-  if (diff > self->max_time)
-    return -1.0;
-  else
-    return USEC_TO_METRES * (end - start);
+============================================================================*/
+BOOL hcsr04_open (HCSR04 *self, char **error)
+  {
+  assert (self != NULL);
+  BOOL ret = hcsr04_init_pins (self, error);
+  if (!ret)
+    hcsr04_uninit (self);
+  return ret;
   }
 
 /*============================================================================
-  hcsr04_is_distance_valid
+  hcsr04_uninit
 ============================================================================*/
-BOOL hcsr04_is_distance_valid (const HCSR04 *self)
+void hcsr04_uninit (HCSR04 *self)
   {
-  return self->good_count >= HCSR04_VALID_SAMPLES; 
+  assert (self != NULL);
+  self->stop = TRUE;
+  if (self->running)
+    {
+    // Wake the thread from whatever it is waiting for, and wait for it
+    //  to finish. Only then is it safe to close the GPIO pins it uses.
+    uint64_t one = 1;
+    write (self->wake_fd, &one, sizeof (one));
+    pthread_join (self->pthread, NULL);
+    self->running = FALSE;
+    }
+  if (self->process_running)
+    {
+    // The measurement thread has finished, so the processing thread 
+    //  will too, once it has emptied the queue. If the measurement 
+    //  thread never started, it must be told.
+    __atomic_store_n (&self->measure_done, 1, __ATOMIC_RELEASE);
+    samplering_signal (self->edges);
+    pthread_join (self->process_pthread, NULL);
+    self->process_running = FALSE;
+    }
+  samplering_destroy (self->edges);
+  self->edges = NULL;
+  gpiopin_set_wake_fd (self->gpiopin_echo, -1);
+  if (!self->simulator)
+    {
+    gpiopin_uninit (self->gpiopin_sound);
+    gpiopin_uninit (self->gpiopin_echo);
+    }
+  if (self->wake_fd >= 0)
+    close (self->wake_fd);
+  self->wake_fd = -1;
+  // Requests that were never answered are dropped
+  pthread_mutex_lock (&self->lock);
+  if (self->request_fd >= 0)
+    close (self->request_fd);
+  self->request_fd = -1;
+  self->requests_count = 0;
+  __atomic_store_n (&self->requests_waiting, 0, __ATOMIC_RELEASE);
+  __atomic_store_n (&self->requests_taken, 0, __ATOMIC_RELEASE);
+  pthread_mutex_unlock (&self->lock);
   }
 
 /*============================================================================
-  hcsr04_get_distance
+
+  hcsr04_classify_sample
+
 ============================================================================*/
-double hcsr04_get_distance (const HCSR04 *self)
+void hcsr04_classify_sample (const HCSR04 *self, HCSR04Sample *sample)
   {
-  if (hcsr04_is_distance_valid (self))
-    return self->avg; 
+  sample->raw = -1.0;
+  if (sample->rise_usec < 0)
+    sample->status = HCSR04_SAMPLE_NO_RISE;
+  else if (sample->fall_usec < 0)
+    sample->status = HCSR04_SAMPLE_NO_FALL;
+  else if (sample->fall_usec - sample->rise_usec > self->max_time)
+    sample->status = HCSR04_SAMPLE_OUT_OF_RANGE;
   else
-    return -1.0;
+    {
+    sample->status = HCSR04_SAMPLE_OK;
+    sample->raw = HCSR04_USEC_TO_METRES 
+      * (sample->fall_usec - sample->rise_usec);
+    }
   }
 
+/*============================================================================
+
+  hcsr04_measure
+
+  Carry out one measurement, and fill in the raw parts of the sample --
+  everything except the sequence number and filtered value. If done_usec
+  is not NULL, it is written with the time at which the measurement 
+  finished. The width of the trigger pulse is written to *pulse_width,
+  or -1 if there wasn't one; nothing else in the HCSR04 is changed, so
+  that a sensor can be measured in one thread while another processes
+  its last sample. If phases is not NULL, the times of the measurement
+  phases that can be timed are written to it. Returns FALSE if the
+  measurement could not be made, because a simulator has run out of data.
+
+============================================================================*/
+static BOOL hcsr04_measure (HCSR04 *self, HCSR04Sample *sample, 
+    int64_t *done_usec, int *pulse_width, int64_t *phases)
+  {
+  sample->time_usec = hcsr04_get_time_usec();
+  sample->rise_usec = -1;
+  sample->fall_usec = -1;
+  *pulse_width = -1;
+
+  if (self->simulator)
+    {
+    BOOL ret = self->simulator (self->simulator_data, sample);
+    hcsr04_classify_sample (self, sample);
+    // There is no real trigger pulse, but the edge times can still
+    //  be reported
+    if (phases && sample->rise_usec >= 0)
+      {
+      phases[HCSR04_PHASE_RISE_WAIT] = sample->rise_usec;
+      if (sample->fall_usec >= 0)
+        phases[HCSR04_PHASE_ECHO_WIDTH] = 
+          sample->fall_usec - sample->rise_usec;
+      }
+    if (done_usec) *done_usec = hcsr04_get_time_usec();
+    return ret;
+    }
+
+  // Set the echo pin to trigger on the rising edge before sending the
+  //  pulse. The echo can start soon after the pulse ends -- sooner than
+  //  a busy system might get round to setting up the trigger, if that
+  //  were done afterwards -- and an edge that comes before the wait 
+  //  starts is still reported.
+  gpiopin_set_trigger (self->gpiopin_echo, GPIOPIN_RISING);
+  gpiopin_clear_trigger (self->gpiopin_echo);
+
+  int64_t pulse_end;
+  *pulse_width = gpiopin_pulse (self->gpiopin_sound, self->pulse_usec,
+    self->trigger_mode == HCSR04_TRIGGER_SPIN, &pulse_end);
+  HCSR04_PROBE2 (trigger, self->echo_pin, sample->time_usec);
+  if (phases)
+    phases[HCSR04_PHASE_PULSE] = *pulse_width;
+
+  // Wait for the rising edge
+  if (gpiopin_wait_for_trigger (self->gpiopin_echo, self->echo_timeout) 
+       && !self->stop)
+    {
+    // Start the timer, and the start of the rising edge
+    int64_t start = hcsr04_get_time_usec();
+    sample->rise_usec = (int32_t)(start - sample->time_usec);
+    HCSR04_PROBE2 (rise, self->echo_pin, sample->rise_usec);
+    int64_t rise_seen = 0;
+    if (phases)
+      {
+      rise_seen = get_monotonic_usec();
+      phases[HCSR04_PHASE_RISE_WAIT] = rise_seen - pulse_end;
+      }
+
+    // Now wait for the falling edige
+    gpiopin_set_trigger (self->gpiopin_echo, GPIOPIN_FALLING);
+    if (phases)
+      phases[HCSR04_PHASE_FALL_LAG] = get_monotonic_usec() - rise_seen;
+    if (gpiopin_wait_for_trigger (self->gpiopin_echo, self->echo_timeout))
+      {
+      int64_t end = hcsr04_get_time_usec();
+      sample->fall_usec = (int32_t)(end - sample->time_usec);
+      if (phases)
+        phases[HCSR04_PHASE_ECHO_WIDTH] = end - start;
+      HCSR04_PROBE3 (fall, self->echo_pin, sample->fall_usec, end - start);
+      }
+    }
+
+  // If the response time is within limits, work out the distance
+  hcsr04_classify_sample (self, sample);
+  if (done_usec) *done_usec = hcsr04_get_time_usec();
+  return TRUE;
+  }
+
+/*============================================================================
+  hcsr04_read_one
+============================================================================*/
+double hcsr04_read_one (HCSR04 *self)
+  {
+  assert (self != NULL);
+  assert (!self->running);
+  HCSR04Sample sample;
+  int64_t phases[HCSR04_PHASE_COUNT];
+  int64_t *timing = NULL;
+  if (self->instrumented)
+    {
+    for (int i = 0; i < HCSR04_PHASE_COUNT; i++)
+      phases[i] = -1;
+    timing = phases;
+    }
+  if (!hcsr04_measure (self, &sample, NULL, &self->pulse_width, timing)) 
+    return -1.0;
+  pthread_mutex_lock (&self->lock);
+  hcsr04_count_pulse (self);
+  if (timing)
+    hcsr04_record_phases (self, phases);
+  pthread_mutex_unlock (&self->lock);
+  return sample.raw;
+  }
+
+/*============================================================================
+  hcsr04_measure_sample
+============================================================================*/
+BOOL hcsr04_measure_sample (HCSR04 *self, HCSR04Sample *sample, 
+        int *pulse_usec)
+  {
+  assert (self != NULL);
+  assert (sample != NULL);
+  assert (!self->running);
+  memset (sample, 0, sizeof (HCSR04Sample));
+  int width;
+  BOOL ret = hcsr04_measure (self, sample, NULL, &width, NULL);
+  if (pulse_usec) *pulse_usec = width;
+  return ret && !self->stop;
+  }
+
+/*============================================================================
+  hcsr04_request_measurement
+============================================================================*/
+BOOL hcsr04_request_measurement (HCSR04 *self, 
+        HCSR04SampleCallback callback, void *user_data, int event_fd)
+  {
+  assert (self != NULL);
+  BOOL ret = FALSE;
+  pthread_mutex_lock (&self->lock);
+  if (self->running && !self->thread_done 
+       && self->requests_count < HCSR04_MAX_REQUESTS)
+    {
+    Request *r = &self->requests[self->requests_count++];
+    r->callback = callback;
+    r->user_data = user_data;
+    r->event_fd = event_fd;
+    r->ping = 0;
+    __atomic_add_fetch (&self->requests_waiting, 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    write (self->request_fd, &one, sizeof (one));
+    ret = TRUE;
+    }
+  pthread_mutex_unlock (&self->lock);
+  return ret;
+  }
+
+/*============================================================================
+  hcsr04_interrupt
+============================================================================*/
+void hcsr04_interrupt (HCSR04 *self)
+  {
+  assert (self != NULL);
+  self->stop = TRUE;
+  if (self->wake_fd >= 0)
+    {
+    uint64_t one = 1;
+    write (self->wake_fd, &one, sizeof (one));
+    }
+  }
+
+/*============================================================================
+  hcsr04_process_sample
+============================================================================*/
+void hcsr04_process_sample (HCSR04 *self, HCSR04Sample *sample, 
+        int pulse_usec)
+  {
+  assert (self != NULL);
+  assert (sample != NULL);
+  assert (!self->running);
+  self->pulse_width = pulse_usec;
+  hcsr04_classify_sample (self, sample);
+  hcsr04_process (self, sample, FALSE, hcsr04_get_time_usec(), 0, NULL);
+  }
+
+/*============================================================================
+  hcsr04_publish_sample
+============================================================================*/
+void hcsr04_publish_sample (HCSR04 *self, HCSR04Sample *sample, 
+        int pulse_usec)
+  {
+  assert (self != NULL);
+  assert (sample != NULL);
+  assert (!self->running);
+  self->pulse_width = pulse_usec;
+  hcsr04_process (self, sample, TRUE, hcsr04_get_time_usec(), 0, NULL);
+  }
+
+/*============================================================================
+  hcsr04_publish_measured
+============================================================================*/
+void hcsr04_publish_measured (HCSR04 *self, HCSR04Sample *sample, 
+        int pulse_usec, int64_t done_usec, int64_t cycle_start,
+        int64_t cpu_usec, int64_t *phases)
+  {
+  assert (self != NULL);
+  assert (sample != NULL);
+  assert (!self->running);
+  self->pulse_width = pulse_usec;
+  hcsr04_process (self, sample, TRUE, done_usec, cycle_start, 
+    self->instrumented ? phases : NULL);
+  if (cpu_usec > 0)
+    {
+    pthread_mutex_lock (&self->lock);
+    self->counters.cpu_usec += cpu_usec;
+    pthread_mutex_unlock (&self->lock);
+    }
+  }
+
+/*============================================================================
+  hcsr04_is_distance_valid
+============================================================================*/
+BOOL hcsr04_is_distance_valid (const HCSR04 *self)
+  {
+  return filterbank_get_good_count (self->bank, self->bank_index) 
+    >= HCSR04_VALID_SAMPLES; 
+  }
+
+/*============================================================================
+  hcsr04_get_distance
+============================================================================*/
+double hcsr04_get_distance (const HCSR04 *self)
+  {
+  return filterbank_get_distance (self->bank, self->bank_index);
+  }
+
+/*============================================================================
+  hcsr04_zone_init
+============================================================================*/
+void hcsr04_zone_init (HCSR04Zone *zone, double near, double far)
+  {
+  assert (zone != NULL);
+  memset (zone, 0, sizeof (HCSR04Zone));
+  zone->near = near;
+  zone->far = far;
+  zone->event_fd = -1;
+  }
+
+/*============================================================================
+  hcsr04_add_zone
+============================================================================*/
+int hcsr04_add_zone (HCSR04 *self, const HCSR04Zone *zone)
+  {
+  assert (self != NULL);
+  pthread_mutex_lock (&self->lock);
+  int ret = zoneset_add (self->zones, zone);
+  pthread_mutex_unlock (&self->lock);
+  return ret;
+  }
+
+/*============================================================================
+  hcsr04_remove_zone
+============================================================================*/
+BOOL hcsr04_remove_zone (HCSR04 *self, int zone_id)
+  {
+  assert (self != NULL);
+  pthread_mutex_lock (&self->lock);
+  BOOL ret = zoneset_remove (self->zones, zone_id);
+  pthread_mutex_unlock (&self->lock);
+  return ret;
+  }
+
+/*============================================================================
+  hcsr04_is_zone_occupied
+============================================================================*/
+BOOL hcsr04_is_zone_occupied (HCSR04 *self, int zone_id)
+  {
+  assert (self != NULL);
+  pthread_mutex_lock (&self->lock);
+  BOOL ret = zoneset_is_occupied (self->zones, zone_id);
+  pthread_mutex_unlock (&self->lock);
+  return ret;
+  }
+
+/*============================================================================
+  hcsr04_set_simulator
+============================================================================*/
+void hcsr04_set_simulator (HCSR04 *self, HCSR04Simulator simulator,
+        void *user_data)
+  {
+  assert (self != NULL);
+  assert (!self->running);
+  self->simulator = simulator;
+  self->simulator_data = user_data;
+  }
+
+/*============================================================================
+  hcsr04_add_reflex
+============================================================================*/
+int hcsr04_add_reflex (HCSR04 *self, const HCSR04Reflex *reflex)
+  {
+  assert (self != NULL);
+  assert (reflex != NULL);
+  assert (reflex->pin != NULL);
+  int ret = -1;
+  pthread_mutex_lock (&self->lock);
+  if (self->reflexes_count < HCSR04_MAX_REFLEXES && reflex->hysteresis >= 0)
+    {
+    ret = self->reflexes_count++;
+    Reflex *r = &self->reflexes[ret];
+    memset (r, 0, sizeof (Reflex));
+    r->config = *reflex;
+    // Put the output into a known state straight away, rather than
+    //  waiting for the first sample
+    r->asserted = hcsr04_reflex_wanted (self, r);
+    BOOL level = r->config.active_level;
+    gpiopin_set (r->config.pin, r->asserted ? level : !level);
+    }
+  pthread_mutex_unlock (&self->lock);
+  return ret;
+  }
+
+/*============================================================================
+  hcsr04_get_reflex_stats
+============================================================================*/
+BOOL hcsr04_get_reflex_stats (HCSR04 *self, int reflex_id,
+        HCSR04ReflexStats *stats)
+  {
+  assert (self != NULL);
+  assert (stats != NULL);
+  BOOL ret = FALSE;
+  pthread_mutex_lock (&self->lock);
+  if (reflex_id >= 0 && reflex_id < self->reflexes_count)
+    {
+    *stats = self->reflexes[reflex_id].stats;
+    ret = TRUE;
+    }
+  pthread_mutex_unlock (&self->lock);
+  return ret;
+  }
+
+/*============================================================================
+  hcsr04_add_sample_callback
+============================================================================*/
+BOOL hcsr04_add_sample_callback (HCSR04 *self, HCSR04SampleCallback callback,
+        void *user_data)
+  {
+  assert (self != NULL);
+  assert (callback != NULL);
+  BOOL ret = FALSE;
+  pthread_mutex_lock (&self->lock);
+  if (self->listeners_count < HCSR04_MAX_LISTENERS)
+    {
+    Listener *l = &self->listeners[self->listeners_count++];
+    l->callback = callback;
+    l->user_data = user_data;
+    ret = TRUE;
+    }
+  pthread_mutex_unlock (&self->lock);
+  return ret;
+  }
+
+/*============================================================================
+  hcsr04_remove_sample_callback
+============================================================================*/
+void hcsr04_remove_sample_callback (HCSR04 *self, 
+        HCSR04SampleCallback callback, void *user_data)
+  {
+  assert (self != NULL);
+  pthread_mutex_lock (&self->lock);
+  for (int i = 0; i < self->listeners_count; i++)
+    {
+    Listener *l = &self->listeners[i];
+    if (l->callback == callback && l->user_data == user_data)
+      {
+      memmove (l, l + 1, 
+        (self->listeners_count - i - 1) * sizeof (Listener));
+      self->listeners_count--;
+      break;
+      }
+    }
+  pthread_mutex_unlock (&self->lock);
+  }
+
+/*============================================================================
+  hcsr04_get_sound_pin
+============================================================================*/
+int hcsr04_get_sound_pin (const HCSR04 *self)
+  {
+  return self->sound_pin;
+  }
+
+/*============================================================================
+  hcsr04_get_echo_pin
+============================================================================*/
+int hcsr04_get_echo_pin (const HCSR04 *self)
+  {
+  return self->echo_pin;
+  }
+
+/*============================================================================
+  hcsr04_get_cycle_usec
+============================================================================*/
+int hcsr04_get_cycle_usec (const HCSR04 *self)
+  {
+  return self->cycle_usec;
+  }
+
+/*============================================================================
+  hcsr04_get_smoothing
+============================================================================*/
+double hcsr04_get_smoothing (const HCSR04 *self)
+  {
+  return self->smoothing;
+  }
+
+/*============================================================================
+
+  hcsr04_set_bank_smoothing
+
+  Set the smoothing factor in the filter bank to suit the filter. With
+  no smoothing, the bank's moving average is just the last valid 
+  distance, which is what the "none" filter wants. The median filter
+  replaces the average, so its smoothing doesn't matter.
+
+============================================================================*/
+static void hcsr04_set_bank_smoothing (HCSR04 *self)
+  {
+  filterbank_set_smoothing (self->bank, self->bank_index, 
+    self->filter == HCSR04_FILTER_EMA ? self->smoothing : 0.0);
+  }
+
+/*============================================================================
+  hcsr04_set_filter
+============================================================================*/
+void hcsr04_set_filter (HCSR04 *self, HCSR04FilterType filter, int window)
+  {
+  assert (self != NULL);
+  assert (!self->running);
+  self->filter = filter;
+  if (filter == HCSR04_FILTER_MEDIAN)
+    {
+    assert (window >= 1 && window <= HCSR04_MAX_MEDIAN);
+    self->median_window = window;
+    }
+  hcsr04_set_bank_smoothing (self);
+  }
+
+/*============================================================================
+  hcsr04_set_filter_bank
+============================================================================*/
+void hcsr04_set_filter_bank (HCSR04 *self, FilterBank *bank, int i)
+  {
+  assert (self != NULL);
+  assert (!self->running);
+  if (!bank)
+    {
+    bank = &self->single;
+    i = 0;
+    }
+  assert (i >= 0 && i < filterbank_get_count (bank));
+  self->bank = bank;
+  self->bank_index = i;
+  filterbank_reset (bank, i);
+  hcsr04_set_bank_smoothing (self);
+  }
+
+/*============================================================================
+  hcsr04_set_adaptive
+============================================================================*/
+void hcsr04_set_adaptive (HCSR04 *self, BOOL adaptive)
+  {
+  assert (self != NULL);
+  self->adaptive = adaptive;
+  }
+
+/*============================================================================
+  hcsr04_set_scheduling
+============================================================================*/
+void hcsr04_set_scheduling (HCSR04 *self, int priority, int cpu)
+  {
+  assert (self != NULL);
+  assert (!self->running);
+  self->priority = priority;
+  self->cpu = cpu;
+  }
+
+/*============================================================================
+  hcsr04_set_pipelined
+============================================================================*/
+void hcsr04_set_pipelined (HCSR04 *self, BOOL pipelined)
+  {
+  assert (self != NULL);
+  assert (!self->running);
+  self->pipelined = pipelined;
+  }
+
+/*============================================================================
+  hcsr04_set_keep_exported
+============================================================================*/
+void hcsr04_set_keep_exported (HCSR04 *self, BOOL keep)
+  {
+  assert (self != NULL);
+  gpiopin_set_unexport (self->gpiopin_sound, !keep);
+  gpiopin_set_unexport (self->gpiopin_echo, !keep);
+  }
+
+/*============================================================================
+  hcsr04_set_trigger_mode
+============================================================================*/
+void hcsr04_set_trigger_mode (HCSR04 *self, HCSR04TriggerMode mode, 
+        int pulse_usec)
+  {
+  assert (self != NULL);
+  assert (!self->running);
+  self->trigger_mode = mode;
+  self->pulse_usec = pulse_usec > 0 ? pulse_usec : HCSR04_PULSE_USEC;
+  }
+
+/*============================================================================
+  hcsr04_set_echo_timeout
+============================================================================*/
+void hcsr04_set_echo_timeout (HCSR04 *self, int usec)
+  {
+  assert (self != NULL);
+  assert (!self->running);
+  self->echo_timeout = usec > 0 ? usec : HCSR04_ECHO_TIMEOUT;
+  }
+
+/*============================================================================
+  hcsr04_set_instrumented
+============================================================================*/
+void hcsr04_set_instrumented (HCSR04 *self, BOOL instrumented)
+  {
+  assert (self != NULL);
+  self->instrumented = instrumented;
+  }
+
+/*============================================================================
+  hcsr04_is_instrumented
+============================================================================*/
+BOOL hcsr04_is_instrumented (const HCSR04 *self)
+  {
+  assert (self != NULL);
+  return self->instrumented;
+  }
+
+/*============================================================================
+  hcsr04_get_phase_histogram
+============================================================================*/
+void hcsr04_get_phase_histogram (HCSR04 *self, HCSR04Phase phase,
+        HCSR04Histogram *histogram)
+  {
+  assert (self != NULL);
+  assert (histogram != NULL);
+  assert (phase >= 0 && phase < HCSR04_PHASE_COUNT);
+  pthread_mutex_lock (&self->lock);
+  *histogram = self->phases[phase];
+  pthread_mutex_unlock (&self->lock);
+  }
+
+/*============================================================================
+  hcsr04_get_counters
+============================================================================*/
+void hcsr04_get_counters (HCSR04 *self, HCSR04Counters *counters)
+  {
+  assert (self != NULL);
+  assert (counters != NULL);
+  pthread_mutex_lock (&self->lock);
+  *counters = self->counters;
+  counters->good_count = filterbank_get_good_count (self->bank, 
+    self->bank_index);
+  clockid_t clock;
+  struct timespec cpu;
+  if (self->running && !self->thread_done 
+       && pthread_getcpuclockid (self->pthread, &clock) == 0
+       && clock_gettime (clock, &cpu) == 0)
+    counters->cpu_usec += (int64_t)cpu.tv_sec * 1000000 + cpu.tv_nsec / 1000;
+  if (self->process_running && !self->process_done 
+       && pthread_getcpuclockid (self->process_pthread, &clock) == 0
+       && clock_gettime (clock, &cpu) == 0)
+    counters->cpu_usec += (int64_t)cpu.tv_sec * 1000000 + cpu.tv_nsec / 1000;
+  pthread_mutex_unlock (&self->lock);
+  }
+
+/*============================================================================
+  hcsr04_get_last_sample
+============================================================================*/
+BOOL hcsr04_get_last_sample (HCSR04 *self, HCSR04Sample *sample)
+  {
+  assert (self != NULL);
+  assert (sample != NULL);
+  pthread_mutex_lock (&self->lock);
+  BOOL ret = self->have_sample;
+  if (ret) *sample = self->last_sample;
+  pthread_mutex_unlock (&self->lock);
+  return ret;
+  }
+
+/*============================================================================
+  hcsr04_reset_phase_histograms
+============================================================================*/
+void hcsr04_reset_phase_histograms (HCSR04 *self)
+  {
+  assert (self != NULL);
+  pthread_mutex_lock (&self->lock);
+  for (int i = 0; i < HCSR04_PHASE_COUNT; i++)
+    histo_reset (&self->phases[i]);
+  pthread_mutex_unlock (&self->lock);
+  }
+
+/*============================================================================
+  hcsr04_get_phase_name
+============================================================================*/
+const char *hcsr04_get_phase_name (HCSR04Phase phase)
+  {
+  assert (phase >= 0 && phase < HCSR04_PHASE_COUNT);
+  return phase_names[phase];
+  }
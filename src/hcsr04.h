@@ -10,9 +10,22 @@
   ==========================================================================*/
 #pragma once
 
+#include <stdint.h>
+#include "gpiopin.h"
+#include "histo.h"
+#include "filterbank.h"
+
 // Shortest measurement time in msec -- the manufacturer recommends 60 msec
 #define HCSR04_MIN_CYCLE 60
 
+// How far sound travels in a microsecond, at standard temperature and
+//  pressure. 343 / 1E6 / 2. The division by two is to account for the 
+//  fact that the sound pulse has to travel from the transucer and back.
+// In principle we should correct for temperature and pressure but,
+//  to be frank, the whole measurement process on a Pi is not stable enough
+//  to worry about such small error sources.
+#define HCSR04_USEC_TO_METRES 0.0001715
+
 // The maximum range of the device, in metres. The usual claim is 4m. Any
 //  measurement outside this range is assumed to result from a timeout,
 //  and should be discarded.
@@ -26,9 +39,253 @@
 //  to be invalid.
 #define HCSR04_VALID_SAMPLES 4
 
+// Longest time to wait for each edge of the echo, in usec, unless it is
+//  set by hcsr04_set_echo_timeout(). This is much longer than any real
+//  echo, so that a busy system is given every chance to see the edges.
+#define HCSR04_ECHO_TIMEOUT 500000
+
+// The longest echo the sensor gives, in usec: with nothing in range, it
+//  holds the echo pin high for about 38 msec. An echo timeout of this,
+//  with some slack, bounds a measurement that gets no echo, at the risk
+//  of missing an edge that a busy system is slow to see.
+#define HCSR04_MAX_ECHO 38000
+#define HCSR04_MAX_ECHO_SLACK 10000
+
+// Width of the trigger pulse, in usec. The sensor needs at least 10.
+#define HCSR04_PULSE_USEC 10
+
+// A trigger pulse that is measured to be this much longer than asked
+//  for, in usec, is counted as a long pulse. The sensor doesn't mind
+//  a long pulse, but it delays the measurement, and it means that the
+//  thread was preempted while sending it.
+#define HCSR04_PULSE_SLACK 50
+
+// The maximum number of reflex rules that can be attached to one sensor
+#define HCSR04_MAX_REFLEXES 4
+
+// The maximum number of sample callbacks that can be attached to one sensor
+#define HCSR04_MAX_LISTENERS 8
+
+// Raw measurements that can wait for the processing thread, when the
+//  measurement and processing are pipelined. Any more are dropped.
+#define HCSR04_PIPELINE_QUEUE 64
+
+// The maximum number of on-demand measurement requests that can wait
+//  for their answer
+#define HCSR04_MAX_REQUESTS 16
+
 struct HCSR04;
 typedef struct _HCSR04 HCSR04;
 
+// Zone events, passed to a HCSR04ZoneCallback
+typedef enum
+  {
+  HCSR04_ZONE_ENTERED = 1,
+  HCSR04_ZONE_LEFT = 2
+  } HCSR04ZoneEvent;
+
+/** Function called, from the HCSR04 thread, when an object enters or
+    leaves a zone. distance is the filtered distance that caused the
+    event, or -1.0 if the zone was left because there is no longer a
+    valid distance. The callback must be quick. It is called with the
+    sensor's lock held, so it must not call any HCSR04 function that
+    reads or changes the sensor's zones, reflexes, callbacks, requests,
+    counters, histograms, or last sample, which would deadlock; those 
+    that only read its settings, such as hcsr04_get_echo_pin(), or its 
+    distance, such as hcsr04_get_distance(), are safe. */
+typedef void (*HCSR04ZoneCallback) (int zone_id, HCSR04ZoneEvent event,
+        double distance, void *user_data);
+
+// HCSR04Zone -- the specification of a zone to watch, passed to 
+//  hcsr04_add_zone(). Use hcsr04_zone_init() to fill in defaults, then
+//  change whatever is needed. A simple threshold -- "nearer than X" -- is
+//  just a zone from 0.0 to X.
+typedef struct _HCSR04Zone
+  {
+  double near;       // Nearest edge of the zone, in metres
+  double far;        // Furthest edge of the zone, in metres
+  // The distance must go this far outside the zone, in metres, before
+  //  the object is considered to have left it
+  double hysteresis;
+  // A change of state must persist for this long before it is reported
+  int dwell_msec;
+  // A change of state must be seen in this many consecutive samples 
+  //  before it is reported
+  int debounce;
+  HCSR04ZoneCallback callback; // Called on each event, if not NULL
+  void *user_data;             // Passed to the callback
+  int event_fd;                // eventfd signalled on each event, if >= 0
+  } HCSR04Zone;
+
+// The outcome of one measurement cycle
+typedef enum
+  {
+  HCSR04_SAMPLE_OK = 0,
+  HCSR04_SAMPLE_NO_RISE = 1,      // The echo pulse never started
+  HCSR04_SAMPLE_NO_FALL = 2,      // The echo pulse never ended
+  HCSR04_SAMPLE_OUT_OF_RANGE = 3  // The echo was longer than the maximum range
+  } HCSR04SampleStatus;
+
+// HCSR04Sample -- everything known about one measurement cycle. This
+//  structure has a fixed size and layout, so it can be stored and shared
+//  between processes as it is.
+typedef struct _HCSR04Sample
+  {
+  int64_t time_usec;  // Time the trigger pulse was sent, usec since epoch
+  uint32_t seq;       // Cycle number, from zero when the thread starts
+  int32_t status;     // A HCSR04SampleStatus value
+  int32_t rise_usec;  // Start of the echo, usec after time_usec, or -1
+  int32_t fall_usec;  // End of the echo, usec after time_usec, or -1
+  float raw;          // Unfiltered distance in metres, or -1.0
+  float filtered;     // Filtered distance in metres, or -1.0 if not valid
+  } HCSR04Sample;
+
+/** Function called, from the HCSR04 thread, with every sample after it
+    has been filtered. The callback must be quick -- the next measurement
+    can't start until it returns. As for a HCSR04ZoneCallback, the 
+    sensor's lock is held, so the same HCSR04 functions must not be 
+    called from it. */
+typedef void (*HCSR04SampleCallback) (const HCSR04Sample *sample,
+        void *user_data);
+
+/** Function that stands in for the hardware, when set by 
+    hcsr04_set_simulator(). It is called from the HCSR04 thread once per
+    cycle, with a sample whose time_usec is the current time, and whose
+    rise_usec and fall_usec are -1. It should fill in rise_usec and 
+    fall_usec, if there were echo edges, and may also change time_usec.
+    The status and distance are then worked out exactly as they would be
+    for real edges. Return FALSE if there is no more data, and the 
+    HCSR04 thread should finish. */
+typedef BOOL (*HCSR04Simulator) (void *user_data, HCSR04Sample *sample);
+
+// Whether a reflex output is asserted when the distance is below, or
+//  above, its threshold
+typedef enum
+  {
+  HCSR04_REFLEX_BELOW = 0,
+  HCSR04_REFLEX_ABOVE = 1
+  } HCSR04ReflexDirection;
+
+// HCSR04Reflex -- a rule that sets an output pin directly from the
+//  HCSR04 thread when the filtered distance crosses a threshold, for
+//  interlocks that can't wait for a consumer to notice. 
+typedef struct _HCSR04Reflex
+  {
+  // The output pin. This must already be initialized in GPIOPIN_OUT 
+  //  mode, and must stay valid while the HCSR04 exists.
+  GPIOPin *pin;
+  double threshold;  // Distance in metres
+  // The distance must go this far back across the threshold before
+  //  the output is deasserted
+  double hysteresis;
+  HCSR04ReflexDirection direction;
+  BOOL active_level; // HIGH or LOW -- the pin state when asserted
+  // If TRUE, the output is asserted whenever there is no valid distance,
+  //  which is usually what an interlock wants. Otherwise the output
+  //  keeps its last state.
+  BOOL assert_on_invalid;
+  } HCSR04Reflex;
+
+// HCSR04ReflexStats -- how often a reflex output has changed, and
+//  the time from the end of the measurement to the pin being set
+typedef struct _HCSR04ReflexStats
+  {
+  long actuations;
+  long last_latency_usec;
+  long max_latency_usec;
+  long total_latency_usec; // Divide by actuations for the mean
+  } HCSR04ReflexStats;
+
+// Longest window for the median filter
+#define HCSR04_MAX_MEDIAN 15
+
+// Filters that can be applied to the valid raw distances, to give the
+//  filtered distance
+typedef enum
+  {
+  // Exponential moving average, with the smoothing factor given to
+  //  hcsr04_create(). This is the default.
+  HCSR04_FILTER_EMA = 0,
+  // Median of the last few valid samples. This removes isolated bad
+  //  readings completely, rather than spreading them out.
+  HCSR04_FILTER_MEDIAN = 1,
+  // No filtering -- the filtered distance is the last valid raw distance
+  HCSR04_FILTER_NONE = 2
+  } HCSR04FilterType;
+
+// How the trigger pulse is timed
+typedef enum
+  {
+  // Spin on the clock between setting the trigger pin high and low. The
+  //  pulse is as short as the GPIO writes allow, and costs a few usec of
+  //  CPU. This is the default.
+  HCSR04_TRIGGER_SPIN = 0,
+  // Sleep between setting the pin high and low. This uses no CPU, but 
+  //  the sleep is always longer than asked for, and on a busy system 
+  //  it can be much longer.
+  HCSR04_TRIGGER_SLEEP = 1
+  } HCSR04TriggerMode;
+
+// Parts of the measurement cycle that are timed when instrumentation is
+//  enabled by hcsr04_set_instrumented(). All are in microseconds.
+typedef enum
+  {
+  // How long the trigger pin is actually held high -- from the write
+  //  that sets it high returning, to the write that sets it low 
+  //  returning
+  HCSR04_PHASE_PULSE = 0,
+  // From the end of the trigger pulse to the rising edge of the echo
+  //  being seen
+  HCSR04_PHASE_RISE_WAIT = 1,
+  // The echo width, as measured -- the distance, before filtering
+  HCSR04_PHASE_ECHO_WIDTH = 2,
+  // From the rising edge being seen to the wait for the falling edge 
+  //  being armed. Any echo that ends within this time is measured late,
+  //  so this is the part of the error that comes from the kernel and
+  //  the load on the system, rather than the sensor.
+  HCSR04_PHASE_FALL_LAG = 3,
+  // From the end of the measurement to the sample being delivered --
+  //  filtering, reflexes, zones, and sample callbacks
+  HCSR04_PHASE_FILTER = 4,
+  // How much longer the sleep between cycles took than was asked for
+  HCSR04_PHASE_SLEEP_OVERSHOOT = 5,
+  HCSR04_PHASE_COUNT = 6
+  } HCSR04Phase;
+
+// HCSR04Counters -- running totals since the HCSR04 was created, for
+//  monitoring
+typedef struct _HCSR04Counters
+  {
+  uint64_t cycles;
+  uint64_t good;          // Samples with status HCSR04_SAMPLE_OK
+  uint64_t no_rise;       // ...HCSR04_SAMPLE_NO_RISE, and so on
+  uint64_t no_fall;
+  uint64_t out_of_range;
+  // Cycles in which measuring and processing the sample took longer 
+  //  than the cycle time itself
+  uint64_t overruns;
+  // Trigger pulses sent, the total and longest of their measured widths
+  //  in usec, and how many were longer than asked for by more than
+  //  HCSR04_PULSE_SLACK. Pulses sent by hcsr04_read_one() are counted 
+  //  too.
+  uint64_t pulses;
+  uint64_t pulse_usec_total;
+  uint64_t pulse_usec_max;
+  uint64_t long_pulses;
+  // Measurements dropped because the processing thread, when pipelined,
+  //  had fallen HCSR04_PIPELINE_QUEUE behind
+  uint64_t pipeline_dropped;
+  // Requests made by hcsr04_request_measurement() that have been 
+  //  answered, and the measurements that answered them. Requests that
+  //  were coalesced share a measurement.
+  uint64_t requests;
+  uint64_t request_pings;
+  int good_count;         // The current count of recent good samples 
+  int64_t cpu_usec;       // CPU time used by the HCSR04 thread, or both
+                          //  threads, if pipelined, or its share of a
+                          //  group's thread
+  } HCSR04Counters;
+
 BEGIN_DECLS
 
 /** Create a HCSR04 instance. This method only initializes and allocates 
@@ -43,7 +300,9 @@ BEGIN_DECLS
     fast as the cycle time allows. However, there will be considerable
     noise. At the other extreme, a value of 0.9 means that it could
     take hundreds of cycles for the value to converge to the latest
-    measurement. A value of 0.5 is probably a good starting point. */
+    measurement. A value of 0.5 is probably a good starting point. 
+    A cycle time of zero means that each measurement starts as soon as
+    the last one finishes, which is only useful with a simulator. */
 HCSR04     *hcsr04_create (int sound_pin, int echo_pin, int cycle_msec,
         double smoothing);
 
@@ -56,16 +315,95 @@ void     hcsr04_destroy (HCSR04 *hcsr04);
     length, in microseconds. */
 BOOL     hcsr04_init (HCSR04 *self, char **error);
 
-/** Stop the HCSR04 thread, and uninitialze the GPIO. */
+/** Set whether hcsr04_uninit() leaves the GPIO pins exported. Exporting
+    a pin means waiting for udev to set it up, which can take a long
+    time, so a program that is restarted often should keep them. 
+    The default is to unexport them. Pins that were already exported when
+    hcsr04_init() was called are always left exported. */
+void     hcsr04_set_keep_exported (HCSR04 *self, BOOL keep);
+
+/** Initialize the GPIO, but don't start the HCSR04 thread. This is for
+    callers that want only a few readings, and will take them with
+    hcsr04_read_one() -- there is no filtering, and the distance is never
+    valid. Like hcsr04_init(), this method can fail, and fills in *error
+    if it does. Call hcsr04_uninit() afterwards. */
+BOOL     hcsr04_open (HCSR04 *self, char **error);
+
+/** Stop the HCSR04 thread, and uninitialze the GPIO. The thread is woken
+    immediately, even if it is waiting for an echo, and this method does
+    not return until it has finished. It is therefore safe to call 
+    hcsr04_init() again straight away. */
 void     hcsr04_uninit (HCSR04 *self);
 
 /** Carry out a single cycle of the distance measurement, no filtering, not
     error checking, just the raw value from the hardware. The return
     value will be a number between 0.0 and the maximum set distance. 
     A negative return indicates that no data was read, usually meaning that
-    the measurement timed out. */
+    the measurement timed out. This must not be called while the HCSR04
+    thread is running, because it would use the pins at the same time; 
+    use hcsr04_request_measurement() instead. */
 double hcsr04_read_one (HCSR04 *self);
 
+/** Carry out one measurement on a sensor opened with hcsr04_open(), and
+    fill in the sample's time_usec, rise_usec and fall_usec, ready to be
+    passed to hcsr04_process_sample(), perhaps in another thread. The
+    width of the trigger pulse is written to *pulse_usec, if it is not
+    NULL. Nothing in the HCSR04 is changed, so the next measurement can
+    be made while the last sample is still being processed -- but
+    measurements must not overlap each other. Returns FALSE if there
+    was no measurement, because a simulator ran out of data, or 
+    hcsr04_interrupt() was called. */
+BOOL hcsr04_measure_sample (HCSR04 *self, HCSR04Sample *sample, 
+        int *pulse_usec);
+
+/** Make a hcsr04_measure_sample() in progress in another thread return
+    at once, even if it is waiting for an echo, and every later one fail,
+    until the sensor is opened again. */
+void hcsr04_interrupt (HCSR04 *self);
+
+/** Process a sample whose echo was timed by something other than the 
+    HCSR04's own thread -- a HCSR04Group, for example -- exactly as the
+    thread would have: work out its status and raw distance from 
+    time_usec, rise_usec and fall_usec, give it a sequence number, 
+    filter it, and pass it to the reflexes, zones, and sample callbacks.
+    pulse_usec is the measured width of the trigger pulse, or -1 if
+    there wasn't one. The HCSR04's own thread must not be running. */
+void hcsr04_process_sample (HCSR04 *self, HCSR04Sample *sample, 
+        int pulse_usec);
+
+/** Work out the status and raw distance of a sample, from time_usec,
+    rise_usec and fall_usec. */
+void hcsr04_classify_sample (const HCSR04 *self, HCSR04Sample *sample);
+
+/** Like hcsr04_process_sample(), for a sample that has already been
+    classified, and whose raw distance has already been added to the
+    sensor's entry in its filter bank -- by a HCSR04Group, which updates
+    the filters of all its sensors at once. */
+void hcsr04_publish_sample (HCSR04 *self, HCSR04Sample *sample, 
+        int pulse_usec);
+
+/** Like hcsr04_publish_sample(), for a thread that measures the sensor 
+    in cycles of its own, as a HCSR04Group's does, and so can account 
+    for them as the HCSR04 thread would. done_usec is the time the 
+    measurement finished, in usec since the epoch, from which reflex 
+    latencies are timed. If cycle_start, in usec on CLOCK_MONOTONIC, is
+    not zero, a cycle that has run over the HCSR04's cycle time is 
+    counted as an overrun. cpu_usec is CPU time spent on the sensor, to
+    add to its counters. If the HCSR04 is instrumented, and phases is 
+    not NULL, the filter phase is timed into phases, which then go into
+    the histograms; phases that were not timed are -1. */
+void hcsr04_publish_measured (HCSR04 *self, HCSR04Sample *sample, 
+        int pulse_usec, int64_t done_usec, int64_t cycle_start,
+        int64_t cpu_usec, int64_t *phases);
+
+/** Keep the sensor's filter state -- the smoothed distance and the count
+    of recent good samples -- in entry i of a bank shared with other 
+    sensors, rather than in the HCSR04 itself. The entry is reset, and 
+    the bank must outlast the HCSR04, or be replaced first. A NULL bank
+    puts the state back in the HCSR04. This method must not be called
+    while the HCSR04 thread is running. */
+void hcsr04_set_filter_bank (HCSR04 *self, FilterBank *bank, int i);
+
 /** The distance is considered value if there have been more than
     HCSRO4_VALID_SAMPLES good measurements in a row. */
 BOOL hcsr04_is_distance_valid (const HCSR04 *self);
@@ -75,5 +413,172 @@ BOOL hcsr04_is_distance_valid (const HCSR04 *self);
     cause any measurement to take place. */
 double hcsr04_get_distance (const HCSR04 *self);
 
+/** Get the GPIO pin numbers, cycle time, and smoothing factor set when
+    the object was created. */
+int hcsr04_get_sound_pin (const HCSR04 *self);
+int hcsr04_get_echo_pin (const HCSR04 *self);
+int hcsr04_get_cycle_usec (const HCSR04 *self);
+double hcsr04_get_smoothing (const HCSR04 *self);
+
+/** Arrange for a function to be called with every sample. Returns FALSE
+    if HCSR04_MAX_LISTENERS callbacks are already attached. */
+BOOL hcsr04_add_sample_callback (HCSR04 *self, HCSR04SampleCallback callback,
+        void *user_data);
+
+/** Stop calling a function added by hcsr04_add_sample_callback(). When this
+    method returns, the function is not running, and will not be called
+    again. */
+void hcsr04_remove_sample_callback (HCSR04 *self, 
+        HCSR04SampleCallback callback, void *user_data);
+
+/** Use a simulator function instead of the hardware. When this is set,
+    hcsr04_init() does not touch the GPIO pins. This method must be 
+    called before hcsr04_init(). */
+void hcsr04_set_simulator (HCSR04 *self, HCSR04Simulator simulator,
+        void *user_data);
+
+/** Add a reflex rule. The output pin is set to its correct state at
+    once, and thereafter updated from the HCSR04 thread, immediately
+    after the sample that causes it to change. Returns a reflex ID, 
+    or -1 if HCSR04_MAX_REFLEXES have already been added. */
+int hcsr04_add_reflex (HCSR04 *self, const HCSR04Reflex *reflex);
+
+/** Get the actuation count and latencies of a reflex. Returns FALSE if
+    the reflex ID is not known. */
+BOOL hcsr04_get_reflex_stats (HCSR04 *self, int reflex_id,
+        HCSR04ReflexStats *stats);
+
+/** Fill in a HCSR04Zone with the given edges, and default values for
+    everything else: no hysteresis, dwell, or debounce, and no callback
+    or eventfd. */
+void hcsr04_zone_init (HCSR04Zone *zone, double near, double far);
+
+/** Start watching a zone. Events are delivered by callback and/or eventfd
+    from the HCSR04 thread, as soon as a filtered sample causes the object
+    to enter or leave the zone. When the distance stops being valid -- 
+    the target has moved out of range, or the echoes have stopped -- 
+    the object is taken to have left every zone, subject to each zone's
+    dwell time and debounce count, so a zone with neither is left at 
+    the first missed echo. Zones can be added and removed whether or
+    not the thread is running. Returns a zone ID, or -1 if the zone 
+    specification is not sensible. */
+int hcsr04_add_zone (HCSR04 *self, const HCSR04Zone *zone);
+
+/** Stop watching a zone. Returns FALSE if the zone ID is not known. */
+BOOL hcsr04_remove_zone (HCSR04 *self, int zone_id);
+
+/** Returns TRUE if the object is in the zone, according to the last
+    event reported. This is useful for finding out what happened after
+    an eventfd is signalled. */
+BOOL hcsr04_is_zone_occupied (HCSR04 *self, int zone_id);
+
+/** Choose the filter. window is the number of samples for the median
+    filter, from 1 to HCSR04_MAX_MEDIAN; it is ignored by the others. 
+    This method must be called before hcsr04_init(). */
+void hcsr04_set_filter (HCSR04 *self, HCSR04FilterType filter, int window);
+
+/** In adaptive mode, the cycle time is the interval from the start of one
+    measurement to the start of the next, rather than the sleep between
+    them. The sleep is shortened by however long the measurement and 
+    processing took, so that samples come at a steady rate, whatever the
+    distance. If there is no time left, the next cycle starts at once, 
+    and the cycle is counted as an overrun. This method can be called 
+    at any time. */
+void hcsr04_set_adaptive (HCSR04 *self, BOOL adaptive);
+
+/** Run the HCSR04 thread with the SCHED_FIFO real-time policy at the
+    given priority (1-99), or 0 for the normal policy, which is the 
+    default. If cpu is not negative, the thread is bound to that CPU.
+    Real-time scheduling usually needs root, or CAP_SYS_NICE; if it
+    can't be set, hcsr04_init() fails. This method must be called before 
+    hcsr04_init(). */
+void hcsr04_set_scheduling (HCSR04 *self, int priority, int cpu);
+
+/** Split the HCSR04 thread in two. The measurement thread then only
+    sends the trigger pulse, times the echo edges, and sleeps; it passes
+    the raw edge times to a second thread, through a lock-free queue,
+    and that thread does the filtering, zones, reflexes, and sample
+    callbacks. So a slow callback, or a heavy filter, no longer delays
+    the next measurement. The processing thread runs with the normal
+    scheduling policy, and if the measurement thread is bound to a CPU 
+    by hcsr04_set_scheduling(), on any CPU but that one. Samples are
+    published a little later, and cycles that were not processed before
+    hcsr04_uninit() are processed as it stops the threads. This method 
+    must be called before hcsr04_init(). */
+void hcsr04_set_pipelined (HCSR04 *self, BOOL pipelined);
+
+/** Ask the running HCSR04 thread for a measurement now, rather than 
+    at the end of the cycle. This lets a sensor run with a long cycle
+    time in the background, and take readings quickly when they are 
+    wanted. The measurement is made as soon as the last one's echoes 
+    have died away -- HCSR04_MIN_CYCLE msec after it started -- and is
+    then filtered and published in the usual way. The cycle starts again
+    from that measurement. All the requests that are waiting when it 
+    starts are answered by it, so requests that are made together, or 
+    within one cycle, cost only one trigger pulse. 
+
+    When the filtered sample is ready, the callback, if not NULL, is 
+    called with it, from the thread that processes samples, and the 
+    eventfd, if event_fd >= 0, is signalled. The callback must be quick,
+    but, unlike a sample callback, it is called without the sensor's 
+    lock, so it may call any HCSR04 function, and make another request.
+    The sample is then also
+    available from hcsr04_get_last_sample(), until the next cycle 
+    replaces it. Each request is answered once. Returns FALSE if the 
+    thread is not running, or HCSR04_MAX_REQUESTS requests are already 
+    waiting. Requests that have not been answered when hcsr04_uninit() 
+    is called are dropped. */
+BOOL hcsr04_request_measurement (HCSR04 *self, 
+        HCSR04SampleCallback callback, void *user_data, int event_fd);
+
+/** Choose how the trigger pulse is timed, and its width in usec. A 
+    width of 0 means HCSR04_PULSE_USEC. Whatever the mode, the wait for
+    the echo is set up before the pulse is sent, so an echo that starts
+    while the pulse is still being finished is not missed. This method 
+    must be called before hcsr04_init(). */
+void hcsr04_set_trigger_mode (HCSR04 *self, HCSR04TriggerMode mode, 
+        int pulse_usec);
+
+/** Set the longest time to wait for each edge of the echo, in usec, or
+    0 for HCSR04_ECHO_TIMEOUT. A caller that wants an answer quickly --
+    one using hcsr04_read_one(), say -- can set HCSR04_MAX_ECHO + 
+    HCSR04_MAX_ECHO_SLACK, so that a sensor that doesn't answer costs
+    less than a tenth of a second. This method must be called before 
+    hcsr04_init(). */
+void hcsr04_set_echo_timeout (HCSR04 *self, int usec);
+
+/** Turn timing of the phases of each measurement cycle on or off. This
+    can be done at any time. When it is off, which is the default, the
+    only cost is a test of a flag. */
+void hcsr04_set_instrumented (HCSR04 *self, BOOL instrumented);
+
+/** Find out whether phase timing is on, for a thread that measures the
+    sensor on its behalf. */
+BOOL hcsr04_is_instrumented (const HCSR04 *self);
+
+/** Get a copy of the histogram of the durations of one phase, in usec,
+    since the HCSR04 was created or the histograms were reset. */
+void hcsr04_get_phase_histogram (HCSR04 *self, HCSR04Phase phase,
+        HCSR04Histogram *histogram);
+
+/** Get the running totals of cycles and their outcomes. This is cheap
+    enough to call often; it does not interrupt the HCSR04 thread. */
+void hcsr04_get_counters (HCSR04 *self, HCSR04Counters *counters);
+
+/** Get a copy of the most recent sample, for a caller that reads the
+    distance at its own rate but wants the whole record. Returns FALSE
+    if the thread has not finished a cycle yet. */
+BOOL hcsr04_get_last_sample (HCSR04 *self, HCSR04Sample *sample);
+
+/** Empty all the phase histograms. */
+void hcsr04_reset_phase_histograms (HCSR04 *self);
+
+/** Get a short name for a phase, like "rise_wait", for reports. */
+const char *hcsr04_get_phase_name (HCSR04Phase phase);
+
+/** Get the time of day, in usec since the epoch, as a sample's 
+    time_usec is given. */
+int64_t hcsr04_get_time_usec (void);
+
 END_DECLS
 
@@ -0,0 +1,653 @@
+/*==========================================================================
+
+    hcsr04executor.c
+
+    This "class" runs many sensors, and groups of sensors, with one
+    scheduler thread that makes all the measurements, in turn, and a
+    pool of worker threads that process the samples. See
+    hcsr04executor.h.
+
+    Each worker has a queue of the slots that have samples waiting. A
+    slot is in its owner's queue at most once, however many samples it
+    has waiting, and is marked ready while it is queued or being worked
+    on; whichever worker takes it processes all its samples, in order,
+    before clearing the mark. A slot's samples, its mark, and the queue
+    of its owner are all protected by the owner's lock. A semaphore
+    counts the slots in all the queues, so a worker that gets past it
+    is sure to find one, if not in its own queue then in another's.
+
+    The filters of the single sensors that a worker owns are kept 
+    together, in a FilterBank of the worker's, so that it works through
+    a few compact arrays, rather than a sensor's worth of memory each.
+    A worker's bank is written by other workers only when they steal.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include "defs.h"
+#include "filterbank.h"
+#include "hcsr04.h"
+#include "hcsr04group.h"
+#include "hcsr04executor.h"
+
+// HCSR04ExecutorSlot -- a sensor or a group, and its samples that are
+//  waiting to be processed
+typedef struct _HCSR04ExecutorSlot
+  {
+  HCSR04 *sensor;        // One of sensor and group is set
+  HCSR04Group *group;
+  int count;             // Samples in each measurement
+  int owner;             // Index of the worker that owns the slot
+  HCSR04Sample *backlog; // HCSR04EXECUTOR_BACKLOG measurements
+  int pulses[HCSR04EXECUTOR_BACKLOG];
+  int head;
+  int waiting;
+  BOOL ready;            // In a worker's queue, or being processed
+  } HCSR04ExecutorSlot;
+
+typedef struct _HCSR04ExecutorWorker
+  {
+  HCSR04Executor *executor;
+  pthread_t pthread;
+  pthread_mutex_t lock;
+  int *queue;            // Indexes of ready slots, one place for each slot
+  int head;
+  int queued;
+  FilterBank *bank;      // Filters of the single sensors the worker owns
+  } HCSR04ExecutorWorker;
+
+struct _HCSR04Executor
+  {
+  int cycle_usec;
+  HCSR04ExecutorSlot *slots;
+  int slots_count;
+  HCSR04ExecutorWorker *workers;
+  int workers_count;
+  int workers_running;   // Workers started, which must be joined
+  sem_t ready;           // Counts the slots in the workers' queues
+  BOOL sem_ready;        // Set while the semaphore exists
+  int priority;          // SCHED_FIFO priority, or 0
+  int cpu;               // CPU to bind the scheduler to, or -1
+  pthread_t pthread;
+  BOOL running;          // Set while the scheduler exists, and must be joined
+  volatile BOOL stop;
+  int wake_fd;           // Signalled by hcsr04executor_uninit()
+  BOOL banked;           // Set once the sensors are in the workers' banks
+  HCSR04ExecutorStats stats;
+  };
+
+/*============================================================================
+  get_monotonic_usec
+============================================================================*/
+static int64_t get_monotonic_usec (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+/*============================================================================
+
+  hcsr04executor_count
+
+  Add to one of the counts, which may be read by another thread
+
+============================================================================*/
+static void hcsr04executor_count (uint64_t *count, uint64_t n)
+  {
+  __atomic_add_fetch (count, n, __ATOMIC_RELAXED);
+  }
+
+/*============================================================================
+  hcsr04executor_create
+============================================================================*/
+HCSR04Executor *hcsr04executor_create (int cycle_msec, int workers)
+  {
+  HCSR04Executor *self = malloc (sizeof (HCSR04Executor));
+  memset (self, 0, sizeof (HCSR04Executor));
+  self->cycle_usec = cycle_msec * 1000;
+  if (workers <= 0)
+    workers = (int)sysconf (_SC_NPROCESSORS_ONLN);
+  if (workers <= 0)
+    workers = 1;
+  self->workers_count = workers;
+  self->workers = malloc (workers * sizeof (HCSR04ExecutorWorker));
+  memset (self->workers, 0, workers * sizeof (HCSR04ExecutorWorker));
+  self->cpu = -1;
+  self->wake_fd = -1;
+  return self;
+  }
+
+/*============================================================================
+  hcsr04executor_destroy
+============================================================================*/
+void hcsr04executor_destroy (HCSR04Executor *self)
+  {
+  if (self)
+    {
+    hcsr04executor_uninit (self);
+    // The sensors outlast the executor, so they get their filters back
+    for (int i = 0; i < self->slots_count; i++)
+      {
+      if (self->banked && self->slots[i].sensor)
+        hcsr04_set_filter_bank (self->slots[i].sensor, NULL, 0);
+      free (self->slots[i].backlog);
+      }
+    for (int w = 0; w < self->workers_count; w++)
+      filterbank_destroy (self->workers[w].bank);
+    free (self->slots);
+    free (self->workers);
+    free (self);
+    }
+  }
+
+/*============================================================================
+
+  hcsr04executor_add_slot
+
+  Add a slot for a sensor or a group, that makes count samples at a time
+
+============================================================================*/
+static void hcsr04executor_add_slot (HCSR04Executor *self, HCSR04 *sensor,
+    HCSR04Group *group, int count)
+  {
+  assert (!self->running);
+  self->slots = realloc (self->slots,
+    (self->slots_count + 1) * sizeof (HCSR04ExecutorSlot));
+  HCSR04ExecutorSlot *slot = &self->slots[self->slots_count];
+  memset (slot, 0, sizeof (HCSR04ExecutorSlot));
+  slot->sensor = sensor;
+  slot->group = group;
+  slot->count = count;
+  slot->owner = self->slots_count % self->workers_count;
+  slot->backlog = malloc (HCSR04EXECUTOR_BACKLOG * count
+    * sizeof (HCSR04Sample));
+  self->slots_count++;
+  }
+
+/*============================================================================
+  hcsr04executor_add_sensor
+============================================================================*/
+void hcsr04executor_add_sensor (HCSR04Executor *self, HCSR04 *sensor)
+  {
+  assert (self != NULL);
+  assert (sensor != NULL);
+  hcsr04executor_add_slot (self, sensor, NULL, 1);
+  }
+
+/*============================================================================
+  hcsr04executor_add_group
+============================================================================*/
+void hcsr04executor_add_group (HCSR04Executor *self, HCSR04Group *group)
+  {
+  assert (self != NULL);
+  assert (group != NULL);
+  hcsr04executor_add_slot (self, NULL, group, hcsr04group_get_count (group));
+  }
+
+/*============================================================================
+
+  hcsr04executor_bank
+
+  Put the filters of each worker's single sensors in a bank of the 
+  worker's, the first time the executor is initialized
+
+============================================================================*/
+static void hcsr04executor_bank (HCSR04Executor *self)
+  {
+  if (self->banked) return;
+  for (int w = 0; w < self->workers_count; w++)
+    {
+    int count = 0;
+    for (int i = 0; i < self->slots_count; i++)
+      if (self->slots[i].sensor && self->slots[i].owner == w) count++;
+    if (count == 0) continue;
+    HCSR04ExecutorWorker *worker = &self->workers[w];
+    worker->bank = filterbank_create (count);
+    count = 0;
+    for (int i = 0; i < self->slots_count; i++)
+      if (self->slots[i].sensor && self->slots[i].owner == w)
+        hcsr04_set_filter_bank (self->slots[i].sensor, worker->bank, 
+          count++);
+    }
+  self->banked = TRUE;
+  }
+
+/*============================================================================
+
+  hcsr04executor_submit
+
+  Add a measurement to a slot's backlog, and queue the slot with its
+  owner, if it isn't already queued or being worked on
+
+============================================================================*/
+static void hcsr04executor_submit (HCSR04Executor *self, int i,
+    const HCSR04Sample *samples, int pulse_usec)
+  {
+  HCSR04ExecutorSlot *slot = &self->slots[i];
+  HCSR04ExecutorWorker *owner = &self->workers[slot->owner];
+  BOOL post = FALSE;
+  pthread_mutex_lock (&owner->lock);
+  if (slot->waiting == HCSR04EXECUTOR_BACKLOG)
+    hcsr04executor_count (&self->stats.dropped, 1);
+  else
+    {
+    int place = (slot->head + slot->waiting) % HCSR04EXECUTOR_BACKLOG;
+    memcpy (&slot->backlog[place * slot->count], samples,
+      slot->count * sizeof (HCSR04Sample));
+    slot->pulses[place] = pulse_usec;
+    slot->waiting++;
+    if (!slot->ready)
+      {
+      slot->ready = TRUE;
+      owner->queue[(owner->head + owner->queued) % self->slots_count] = i;
+      owner->queued++;
+      post = TRUE;
+      }
+    }
+  pthread_mutex_unlock (&owner->lock);
+  if (post)
+    sem_post (&self->ready);
+  }
+
+/*============================================================================
+
+  hcsr04executor_take
+
+  Take a ready slot from a worker's queue: the oldest, for the worker
+  itself, or the newest, for another worker stealing it. Returns the
+  slot's index, or -1 if the queue is empty.
+
+============================================================================*/
+static int hcsr04executor_take (HCSR04Executor *self,
+    HCSR04ExecutorWorker *worker, BOOL own)
+  {
+  int i = -1;
+  pthread_mutex_lock (&worker->lock);
+  if (worker->queued > 0)
+    {
+    if (own)
+      {
+      i = worker->queue[worker->head];
+      worker->head = (worker->head + 1) % self->slots_count;
+      }
+    else
+      i = worker->queue[(worker->head + worker->queued - 1)
+        % self->slots_count];
+    worker->queued--;
+    }
+  pthread_mutex_unlock (&worker->lock);
+  return i;
+  }
+
+/*============================================================================
+
+  hcsr04executor_run_slot
+
+  Process all the samples waiting in a slot, oldest first, and then
+  clear its ready mark. Samples that arrive while this is going on are
+  processed too, before it returns.
+
+============================================================================*/
+static void hcsr04executor_run_slot (HCSR04Executor *self, int i)
+  {
+  HCSR04ExecutorSlot *slot = &self->slots[i];
+  HCSR04ExecutorWorker *owner = &self->workers[slot->owner];
+  HCSR04Sample samples[HCSR04GROUP_MAX_SENSORS];
+  while (!self->stop)
+    {
+    pthread_mutex_lock (&owner->lock);
+    if (slot->waiting == 0)
+      {
+      slot->ready = FALSE;
+      pthread_mutex_unlock (&owner->lock);
+      return;
+      }
+    memcpy (samples, &slot->backlog[slot->head * slot->count],
+      slot->count * sizeof (HCSR04Sample));
+    int pulse_usec = slot->pulses[slot->head];
+    slot->head = (slot->head + 1) % HCSR04EXECUTOR_BACKLOG;
+    slot->waiting--;
+    pthread_mutex_unlock (&owner->lock);
+
+    if (slot->group)
+      hcsr04group_process_samples (slot->group, samples, pulse_usec);
+    else
+      hcsr04_process_sample (slot->sensor, samples, pulse_usec);
+    }
+  }
+
+/*============================================================================
+
+  hcsr04executor_work
+
+  A worker thread. It runs the slots in its own queue, and when that is
+  empty, steals from the other workers' queues in turn.
+
+============================================================================*/
+static void *hcsr04executor_work (void *arg)
+  {
+  HCSR04ExecutorWorker *worker = (HCSR04ExecutorWorker *)arg;
+  HCSR04Executor *self = worker->executor;
+  int me = (int)(worker - self->workers);
+  while (TRUE)
+    {
+    sem_wait (&self->ready);
+    if (self->stop) break;
+    int i = hcsr04executor_take (self, worker, TRUE);
+    for (int k = 1; i < 0; k++)
+      {
+      HCSR04ExecutorWorker *victim =
+        &self->workers[(me + k) % self->workers_count];
+      i = hcsr04executor_take (self, victim, FALSE);
+      if (i >= 0)
+        hcsr04executor_count (&self->stats.steals, 1);
+      }
+    hcsr04executor_run_slot (self, i);
+    }
+  return NULL;
+  }
+
+/*============================================================================
+
+  hcsr04executor_wait_until
+
+  Wait until the monotonic time reaches usec, or the wake eventfd is
+  signalled
+
+============================================================================*/
+static void hcsr04executor_wait_until (HCSR04Executor *self, int64_t usec)
+  {
+  int64_t wait = usec - get_monotonic_usec();
+  if (wait <= 0 || self->stop) return;
+  struct pollfd fdset[1];
+  fdset[0].fd = self->wake_fd;
+  fdset[0].events = POLLIN;
+  fdset[0].revents = 0;
+  struct timespec ts;
+  ts.tv_sec = wait / 1000000;
+  ts.tv_nsec = (wait % 1000000) * 1000;
+  ppoll (fdset, 1, &ts, NULL);
+  }
+
+/*============================================================================
+
+  hcsr04executor_schedule
+
+  The scheduler thread. Slot i of a cycle starts i/n of the way through
+  it. A measurement that overruns makes the next slots late, but they
+  are never skipped; if the whole schedule falls more than a cycle
+  behind, the missed cycles are skipped instead, so that it doesn't
+  race to catch up.
+
+============================================================================*/
+static void *hcsr04executor_schedule (void *arg)
+  {
+  HCSR04Executor *self = (HCSR04Executor *)arg;
+  int n = self->slots_count;
+  int64_t slot_usec = self->cycle_usec / n;
+  int64_t cycle_start = get_monotonic_usec();
+  HCSR04Sample samples[HCSR04GROUP_MAX_SENSORS];
+  while (!self->stop)
+    {
+    for (int i = 0; i < n && !self->stop; i++)
+      {
+      int64_t due = cycle_start + (int64_t)self->cycle_usec * i / n;
+      hcsr04executor_wait_until (self, due);
+      if (self->stop) break;
+      if (slot_usec > 0 && get_monotonic_usec() - due > slot_usec)
+        hcsr04executor_count (&self->stats.late_slots, 1);
+
+      HCSR04ExecutorSlot *slot = &self->slots[i];
+      int pulse_usec;
+      BOOL measured = slot->group
+        ? hcsr04group_measure_samples (slot->group, samples, &pulse_usec)
+        : hcsr04_measure_sample (slot->sensor, samples, &pulse_usec);
+      if (measured)
+        hcsr04executor_submit (self, i, samples, pulse_usec);
+      }
+    hcsr04executor_count (&self->stats.cycles, 1);
+
+    int64_t now = get_monotonic_usec();
+    if (self->cycle_usec <= 0)
+      cycle_start = now;
+    else
+      {
+      cycle_start += self->cycle_usec;
+      if (now - cycle_start > self->cycle_usec)
+        {
+        int64_t missed = (now - cycle_start) / self->cycle_usec;
+        cycle_start += missed * self->cycle_usec;
+        hcsr04executor_count (&self->stats.skipped_cycles,
+          (uint64_t)missed);
+        }
+      }
+    }
+  return NULL;
+  }
+
+/*============================================================================
+
+  hcsr04executor_start_threads
+
+  Start the workers, each bound to a CPU in turn, and then the scheduler,
+  with the scheduling policy and CPU affinity set by
+  hcsr04executor_set_scheduling()
+
+============================================================================*/
+static BOOL hcsr04executor_start_threads (HCSR04Executor *self,
+    char **error)
+  {
+  int cpus = (int)sysconf (_SC_NPROCESSORS_ONLN);
+  for (int w = 0; w < self->workers_count; w++)
+    {
+    HCSR04ExecutorWorker *worker = &self->workers[w];
+    pthread_attr_t attr;
+    pthread_attr_init (&attr);
+    if (cpus > 1)
+      {
+      cpu_set_t set;
+      CPU_ZERO (&set);
+      CPU_SET (w % cpus, &set);
+      pthread_attr_setaffinity_np (&attr, sizeof (set), &set);
+      }
+    int err = pthread_create (&worker->pthread, &attr,
+      hcsr04executor_work, worker);
+    pthread_attr_destroy (&attr);
+    if (err != 0)
+      {
+      if (error)
+        asprintf (error, "Can't start executor worker: %s", strerror (err));
+      return FALSE;
+      }
+    self->workers_running++;
+    }
+
+  pthread_attr_t attr;
+  pthread_attr_init (&attr);
+  if (self->priority > 0)
+    {
+    struct sched_param param;
+    memset (&param, 0, sizeof (param));
+    param.sched_priority = self->priority;
+    pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy (&attr, SCHED_FIFO);
+    pthread_attr_setschedparam (&attr, &param);
+    }
+  if (self->cpu >= 0)
+    {
+    cpu_set_t set;
+    CPU_ZERO (&set);
+    CPU_SET (self->cpu, &set);
+    pthread_attr_setaffinity_np (&attr, sizeof (set), &set);
+    }
+  int err = pthread_create (&self->pthread, &attr, hcsr04executor_schedule,
+    self);
+  pthread_attr_destroy (&attr);
+  if (err != 0)
+    {
+    if (error)
+      asprintf (error, "Can't start executor thread: %s", strerror (err));
+    return FALSE;
+    }
+  self->running = TRUE;
+  return TRUE;
+  }
+
+/*============================================================================
+  hcsr04executor_init
+============================================================================*/
+BOOL hcsr04executor_init (HCSR04Executor *self, char **error)
+  {
+  assert (self != NULL);
+  assert (self->slots_count > 0);
+  self->stop = FALSE;
+  memset (&self->stats, 0, sizeof (self->stats));
+  hcsr04executor_bank (self);
+  for (int i = 0; i < self->slots_count; i++)
+    {
+    HCSR04ExecutorSlot *slot = &self->slots[i];
+    slot->head = 0;
+    slot->waiting = 0;
+    slot->ready = FALSE;
+    BOOL ok = slot->group
+      ? hcsr04group_open (slot->group, error)
+      : hcsr04_open (slot->sensor, error);
+    if (!ok)
+      {
+      // Only the slots opened so far are closed
+      for (int k = 0; k < i; k++)
+        {
+        if (self->slots[k].group)
+          hcsr04group_uninit (self->slots[k].group);
+        else
+          hcsr04_uninit (self->slots[k].sensor);
+        }
+      return FALSE;
+      }
+    }
+
+  for (int w = 0; w < self->workers_count; w++)
+    {
+    HCSR04ExecutorWorker *worker = &self->workers[w];
+    worker->executor = self;
+    worker->queue = malloc (self->slots_count * sizeof (int));
+    worker->head = 0;
+    worker->queued = 0;
+    pthread_mutex_init (&worker->lock, NULL);
+    }
+  sem_init (&self->ready, 0, 0);
+  self->sem_ready = TRUE;
+  self->wake_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  BOOL ret = FALSE;
+  if (self->wake_fd < 0)
+    {
+    if (error)
+      asprintf (error, "Can't create eventfd: %s", strerror (errno));
+    }
+  else
+    ret = hcsr04executor_start_threads (self, error);
+  if (!ret)
+    hcsr04executor_uninit (self);
+  return ret;
+  }
+
+/*============================================================================
+  hcsr04executor_uninit
+============================================================================*/
+void hcsr04executor_uninit (HCSR04Executor *self)
+  {
+  assert (self != NULL);
+  if (!self->sem_ready) return; // Not initialized
+  self->stop = TRUE;
+  if (self->running)
+    {
+    // Wake the scheduler from its sleep, or from the measurement it is
+    //  making. Only when it has finished can the GPIO be closed.
+    uint64_t one = 1;
+    write (self->wake_fd, &one, sizeof (one));
+    for (int i = 0; i < self->slots_count; i++)
+      {
+      if (self->slots[i].group)
+        hcsr04group_interrupt (self->slots[i].group);
+      else
+        hcsr04_interrupt (self->slots[i].sensor);
+      }
+    pthread_join (self->pthread, NULL);
+    self->running = FALSE;
+    }
+  for (int w = 0; w < self->workers_running; w++)
+    sem_post (&self->ready);
+  for (int w = 0; w < self->workers_running; w++)
+    pthread_join (self->workers[w].pthread, NULL);
+  self->workers_running = 0;
+  for (int w = 0; w < self->workers_count; w++)
+    {
+    pthread_mutex_destroy (&self->workers[w].lock);
+    free (self->workers[w].queue);
+    self->workers[w].queue = NULL;
+    }
+  sem_destroy (&self->ready);
+  self->sem_ready = FALSE;
+  for (int i = 0; i < self->slots_count; i++)
+    {
+    if (self->slots[i].group)
+      hcsr04group_uninit (self->slots[i].group);
+    else
+      hcsr04_uninit (self->slots[i].sensor);
+    }
+  if (self->wake_fd >= 0)
+    close (self->wake_fd);
+  self->wake_fd = -1;
+  }
+
+/*============================================================================
+  hcsr04executor_set_scheduling
+============================================================================*/
+void hcsr04executor_set_scheduling (HCSR04Executor *self, int priority,
+      int cpu)
+  {
+  assert (self != NULL);
+  self->priority = priority;
+  self->cpu = cpu;
+  }
+
+/*============================================================================
+  hcsr04executor_get_workers
+============================================================================*/
+int hcsr04executor_get_workers (const HCSR04Executor *self)
+  {
+  assert (self != NULL);
+  return self->workers_count;
+  }
+
+/*============================================================================
+  hcsr04executor_get_stats
+============================================================================*/
+void hcsr04executor_get_stats (const HCSR04Executor *self,
+      HCSR04ExecutorStats *stats)
+  {
+  assert (self != NULL);
+  assert (stats != NULL);
+  stats->cycles = __atomic_load_n (&self->stats.cycles, __ATOMIC_RELAXED);
+  stats->late_slots = __atomic_load_n (&self->stats.late_slots,
+    __ATOMIC_RELAXED);
+  stats->skipped_cycles = __atomic_load_n (&self->stats.skipped_cycles,
+    __ATOMIC_RELAXED);
+  stats->dropped = __atomic_load_n (&self->stats.dropped, __ATOMIC_RELAXED);
+  stats->steals = __atomic_load_n (&self->stats.steals, __ATOMIC_RELAXED);
+  }
+
@@ -0,0 +1,109 @@
+/*============================================================================
+
+  hcsr04executor.h
+
+  Functions to run many HC-SR04 sensors, and groups of sensors that share
+  a trigger pin, with a fixed number of threads, however many sensors
+  there are.
+
+  One scheduler thread sends all the trigger pulses. Each sensor or
+  group is given a slot in the cycle, in the order they were added, and
+  the slots are spread evenly over the cycle. Only one sensor or group
+  is measured at a time, and each is measured once a cycle, so a sensor
+  never hears another's ping -- if a measurement runs into the next
+  slot, that slot starts late, rather than overlapping it.
+
+  The rest of the work on each sample -- filtering, zones, reflexes and
+  sample callbacks -- is done by a pool of worker threads, by default
+  one on each CPU. Each sensor or group is owned by one worker, which
+  gets its samples; a worker with nothing to do steals work from the
+  others. The samples of any one sensor are always processed in order,
+  and by one thread at a time, so the sample callbacks of a sensor are
+  never called concurrently -- but they are called from the worker
+  threads, not from the scheduler thread.
+
+  The sensors and groups are created, and set up, in the usual way, but
+  are neither initialized nor opened by the caller: the executor opens
+  them in hcsr04executor_init(). They still belong to the caller, and
+  must outlast the executor. From hcsr04executor_init() until the 
+  executor is destroyed, the filters of the single sensors are kept in
+  filter banks of the executor's, one for each worker's sensors, and 
+  don't carry over after that, as hcsr04_set_filter_bank() describes.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include "defs.h"
+#include "hcsr04.h"
+#include "hcsr04group.h"
+
+// Number of samples of a sensor or group that can wait to be processed.
+//  Any more are dropped, and counted.
+#define HCSR04EXECUTOR_BACKLOG 4
+
+struct HCSR04Executor;
+typedef struct _HCSR04Executor HCSR04Executor;
+
+// HCSR04ExecutorStats -- counts kept by the executor since it was
+//  initialized
+typedef struct _HCSR04ExecutorStats
+  {
+  uint64_t cycles;          // Rounds of all the slots
+  uint64_t late_slots;      // Slots that started after the next was due
+  uint64_t skipped_cycles;  // Cycles missed, when more than a cycle late
+  uint64_t dropped;         // Samples dropped because the backlog was full
+  uint64_t steals;          // Samples processed by a worker that didn't
+                            //  own their sensor
+  } HCSR04ExecutorStats;
+
+BEGIN_DECLS
+
+/** Create an executor. cycle_msec is the time from the start of one
+    round of the slots to the start of the next; workers is the number
+    of worker threads, or 0 for one per CPU. This method only stores
+    values, and will always succeed. */
+HCSR04Executor *hcsr04executor_create (int cycle_msec, int workers);
+
+/** Stop the executor, if it is running, and free it. The sensors and
+    groups are not freed. */
+void      hcsr04executor_destroy (HCSR04Executor *self);
+
+/** Give a sensor the next slot. Must be called before
+    hcsr04executor_init(). */
+void      hcsr04executor_add_sensor (HCSR04Executor *self, HCSR04 *sensor);
+
+/** Give a group of sensors the next slot. All the sensors in the group
+    are measured together, in the one slot. Must be called before
+    hcsr04executor_init(). */
+void      hcsr04executor_add_group (HCSR04Executor *self,
+            HCSR04Group *group);
+
+/** Open the GPIO of all the sensors and groups, and start the threads.
+    This method can fail, because it accesses hardware; if it does, it
+    fills in *error, which the caller must free. */
+BOOL      hcsr04executor_init (HCSR04Executor *self, char **error);
+
+/** Stop the threads, and close the sensors and groups. The scheduler is
+    woken at once, even if it is waiting for an echo. Samples that are
+    waiting to be processed are discarded. */
+void      hcsr04executor_uninit (HCSR04Executor *self);
+
+/** Set the scheduling of the scheduler thread, as for
+    hcsr04_set_scheduling(). The workers are always bound one to each
+    CPU, in turn. Must be called before hcsr04executor_init(). */
+void      hcsr04executor_set_scheduling (HCSR04Executor *self,
+            int priority, int cpu);
+
+/** Get the number of worker threads. */
+int       hcsr04executor_get_workers (const HCSR04Executor *self);
+
+/** Get the executor's counts. This can be called while it is running. */
+void      hcsr04executor_get_stats (const HCSR04Executor *self,
+            HCSR04ExecutorStats *stats);
+
+END_DECLS
+
@@ -0,0 +1,555 @@
+/*==========================================================================
+
+    hcsr04group.c
+
+    This "class" runs a thread that measures a group of HC-SR04 sensors
+    that share a trigger pin. Each cycle sends one trigger pulse, and
+    times the echoes of all the sensors at once, with a single epoll
+    set. The samples are then filtered together, in the group's filter
+    bank, and handed to the sensors' HCSR04 objects, which publish them
+    as if they had measured them.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "defs.h"
+#include "gpiopin.h"
+#include "hcsr04.h"
+#include "filterbank.h"
+#include "hcsr04group.h"
+
+// The epoll data of the wake eventfd. The echo pins' data are their
+//  indexes.
+#define WAKE_INDEX HCSR04GROUP_MAX_SENSORS
+
+struct _HCSR04Group
+  {
+  int trigger_pin;
+  int count;
+  int cycle_usec;    // Start of one cycle to the start of the next
+  HCSR04 *sensors[HCSR04GROUP_MAX_SENSORS];
+  GPIOPin *gpiopin_trigger;
+  GPIOPin *gpiopin_echoes[HCSR04GROUP_MAX_SENSORS];
+  FilterBank *bank;  // The sensors' filters
+  // One cycle's raw distances, to add to the bank
+  double raw[HCSR04GROUP_MAX_SENSORS];
+  HCSR04TriggerMode trigger_mode;
+  int pulse_usec;
+  volatile BOOL adaptive;
+  int priority;      // SCHED_FIFO priority, or 0
+  int cpu;           // CPU to bind the thread to, or -1
+  pthread_t pthread;
+  BOOL running;      // Set while the thread exists, and must be joined
+  volatile BOOL stop;
+  int wake_fd;       // Signalled by hcsr04group_uninit() to stop the thread
+  int epoll_fd;      // The echo pins, and wake_fd
+  };
+
+/*============================================================================
+  get_monotonic_usec
+============================================================================*/
+static int64_t get_monotonic_usec (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+/*============================================================================
+  hcsr04group_create
+============================================================================*/
+HCSR04Group *hcsr04group_create (int trigger_pin, const int *echo_pins,
+      int count, int cycle_msec, double smoothing)
+  {
+  assert (echo_pins != NULL);
+  assert (count >= 1 && count <= HCSR04GROUP_MAX_SENSORS);
+  HCSR04Group *self = malloc (sizeof (HCSR04Group));
+  memset (self, 0, sizeof (HCSR04Group));
+  self->trigger_pin = trigger_pin;
+  self->count = count;
+  self->cycle_usec = cycle_msec * 1000;
+  self->gpiopin_trigger = gpiopin_create (trigger_pin);
+  self->bank = filterbank_create (count);
+  for (int i = 0; i < count; i++)
+    {
+    self->sensors[i] = hcsr04_create (trigger_pin, echo_pins[i], cycle_msec,
+      smoothing);
+    hcsr04_set_filter_bank (self->sensors[i], self->bank, i);
+    self->gpiopin_echoes[i] = gpiopin_create (echo_pins[i]);
+    }
+  self->pulse_usec = HCSR04_PULSE_USEC;
+  self->cpu = -1;
+  self->wake_fd = -1;
+  self->epoll_fd = -1;
+  return self;
+  }
+
+/*============================================================================
+  hcsr04group_destroy
+============================================================================*/
+void hcsr04group_destroy (HCSR04Group *self)
+  {
+  if (self)
+    {
+    hcsr04group_uninit (self);
+    for (int i = 0; i < self->count; i++)
+      {
+      hcsr04_destroy (self->sensors[i]);
+      gpiopin_destroy (self->gpiopin_echoes[i]);
+      }
+    gpiopin_destroy (self->gpiopin_trigger);
+    filterbank_destroy (self->bank);
+    free (self);
+    }
+  }
+
+/*============================================================================
+
+  hcsr04group_process
+
+  Classify and filter one cycle's samples, and publish them, with what
+  is known of how they were measured, as hcsr04_publish_measured() 
+  describes. The CPU time is shared equally between the sensors, and
+  phases, if not NULL, holds each sensor's phase times, in order.
+
+============================================================================*/
+static void hcsr04group_process (HCSR04Group *self, HCSR04Sample *samples,
+      int pulse_usec, int64_t done_usec, int64_t cycle_start, 
+      int64_t cpu_usec, int64_t (*phases)[HCSR04_PHASE_COUNT])
+  {
+  for (int i = 0; i < self->count; i++)
+    {
+    hcsr04_classify_sample (self->sensors[i], &samples[i]);
+    self->raw[i] = samples[i].raw;
+    }
+  filterbank_update (self->bank, self->raw);
+  for (int i = 0; i < self->count; i++)
+    {
+    int64_t share = cpu_usec / self->count
+      + (i == 0 ? cpu_usec % self->count : 0);
+    hcsr04_publish_measured (self->sensors[i], &samples[i], pulse_usec,
+      done_usec, cycle_start, share, phases ? phases[i] : NULL);
+    }
+  }
+
+/*============================================================================
+  hcsr04group_process_samples
+============================================================================*/
+void hcsr04group_process_samples (HCSR04Group *self, HCSR04Sample *samples,
+      int pulse_usec)
+  {
+  assert (self != NULL);
+  assert (samples != NULL);
+  hcsr04group_process (self, samples, pulse_usec, hcsr04_get_time_usec(),
+    0, 0, NULL);
+  }
+
+/*============================================================================
+
+  hcsr04group_measure
+
+  Each echo pin is set to trigger on the rising edge before the pulse is
+  sent, and then on the falling edge as soon as its echo starts. The
+  epoll wait ends when every echo has finished, at the timeout, or when
+  the wake eventfd is signalled. If phases is not NULL, each sensor's
+  pulse, rise wait, fall lag and echo width are timed into it, as the 
+  HCSR04 thread times them. The time the measurement finished is 
+  written to *done_usec.
+
+============================================================================*/
+static BOOL hcsr04group_measure (HCSR04Group *self, HCSR04Sample *samples,
+      int *pulse_usec, int64_t *done_usec, 
+      int64_t (*phases)[HCSR04_PHASE_COUNT])
+  {
+  for (int i = 0; i < self->count; i++)
+    {
+    memset (&samples[i], 0, sizeof (HCSR04Sample));
+    samples[i].rise_usec = -1;
+    samples[i].fall_usec = -1;
+    gpiopin_set_trigger (self->gpiopin_echoes[i], GPIOPIN_RISING);
+    gpiopin_clear_trigger (self->gpiopin_echoes[i]);
+    }
+
+  int64_t time_usec = hcsr04_get_time_usec();
+  int pulse = gpiopin_pulse (self->gpiopin_trigger, self->pulse_usec,
+    self->trigger_mode == HCSR04_TRIGGER_SPIN, NULL);
+  int64_t pulse_end = 0;
+  if (phases)
+    {
+    pulse_end = get_monotonic_usec();
+    for (int i = 0; i < self->count; i++)
+      {
+      for (int p = 0; p < HCSR04_PHASE_COUNT; p++)
+        phases[i][p] = -1;
+      phases[i][HCSR04_PHASE_PULSE] = pulse;
+      }
+    }
+
+  int pending = self->count;
+  int64_t deadline = get_monotonic_usec() + HCSR04GROUP_ECHO_TIMEOUT;
+  struct epoll_event events[HCSR04GROUP_MAX_SENSORS + 1];
+  while (pending > 0 && !self->stop)
+    {
+    int64_t wait = deadline - get_monotonic_usec();
+    if (wait <= 0) break;
+    int n = epoll_wait (self->epoll_fd, events, self->count + 1,
+      (int)((wait + 999) / 1000));
+    // Edges reported together are timed together
+    int64_t now = hcsr04_get_time_usec();
+    for (int k = 0; k < n; k++)
+      {
+      int i = (int)events[k].data.u32;
+      if (i == WAKE_INDEX) continue; // stop is set
+      GPIOPin *echo = self->gpiopin_echoes[i];
+      if (!gpiopin_take_trigger (echo)) continue;
+      HCSR04Sample *sample = &samples[i];
+      if (sample->rise_usec < 0)
+        {
+        sample->rise_usec = (int32_t)(now - time_usec);
+        int64_t rise_seen = phases ? get_monotonic_usec() : 0;
+        gpiopin_set_trigger (echo, GPIOPIN_FALLING);
+        if (phases)
+          {
+          phases[i][HCSR04_PHASE_RISE_WAIT] = rise_seen - pulse_end;
+          phases[i][HCSR04_PHASE_FALL_LAG] = get_monotonic_usec() 
+            - rise_seen;
+          }
+        }
+      else if (sample->fall_usec < 0)
+        {
+        sample->fall_usec = (int32_t)(now - time_usec);
+        gpiopin_set_trigger (echo, GPIOPIN_NONE);
+        if (phases)
+          phases[i][HCSR04_PHASE_ECHO_WIDTH] = sample->fall_usec 
+            - sample->rise_usec;
+        pending--;
+        }
+      }
+    }
+  if (self->stop) return FALSE;
+
+  for (int i = 0; i < self->count; i++)
+    samples[i].time_usec = time_usec;
+  if (pulse_usec) *pulse_usec = pulse;
+  if (done_usec) *done_usec = hcsr04_get_time_usec();
+  return TRUE;
+  }
+
+/*============================================================================
+  hcsr04group_measure_samples
+============================================================================*/
+BOOL hcsr04group_measure_samples (HCSR04Group *self, HCSR04Sample *samples,
+      int *pulse_usec)
+  {
+  assert (self != NULL);
+  assert (samples != NULL);
+  return hcsr04group_measure (self, samples, pulse_usec, NULL, NULL);
+  }
+
+/*============================================================================
+
+  hcsr04group_is_instrumented
+
+  Phases are timed if any of the sensors wants them; each sensor only 
+  records them if it does
+
+============================================================================*/
+static BOOL hcsr04group_is_instrumented (const HCSR04Group *self)
+  {
+  for (int i = 0; i < self->count; i++)
+    if (hcsr04_is_instrumented (self->sensors[i])) return TRUE;
+  return FALSE;
+  }
+
+/*============================================================================
+  hcsr04group_thread_cpu_usec
+============================================================================*/
+static int64_t hcsr04group_thread_cpu_usec (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+/*============================================================================
+
+  hcsr04group_loop
+
+  The measurement loop, that runs in its own thread. It accounts for 
+  each cycle in the sensors' counters and histograms as their own 
+  threads would: overruns, phase times, and the thread's CPU time, 
+  which is shared between them.
+
+============================================================================*/
+static void *hcsr04group_loop (void *arg)
+  {
+  HCSR04Group *self = (HCSR04Group *)arg;
+  int64_t overshoot = -1; // Sleep overshoot at the end of the last cycle
+  int64_t cpu_counted = 0;
+  while (!self->stop)
+    {
+    int64_t cycle_start = get_monotonic_usec();
+    HCSR04Sample samples[HCSR04GROUP_MAX_SENSORS];
+    int64_t phases[HCSR04GROUP_MAX_SENSORS][HCSR04_PHASE_COUNT];
+    int64_t (*timing)[HCSR04_PHASE_COUNT] = 
+      hcsr04group_is_instrumented (self) ? phases : NULL;
+    int pulse;
+    int64_t done_usec;
+    if (hcsr04group_measure (self, samples, &pulse, &done_usec, timing))
+      {
+      if (timing)
+        for (int i = 0; i < self->count; i++)
+          timing[i][HCSR04_PHASE_SLEEP_OVERSHOOT] = overshoot;
+      int64_t cpu = hcsr04group_thread_cpu_usec();
+      hcsr04group_process (self, samples, pulse, done_usec, cycle_start,
+        cpu - cpu_counted, timing);
+      cpu_counted = cpu;
+      }
+    overshoot = -1;
+    int64_t sleep_usec = self->cycle_usec;
+    if (self->adaptive)
+      sleep_usec -= get_monotonic_usec() - cycle_start;
+    if (!self->stop && sleep_usec > 0)
+      {
+      int64_t due = get_monotonic_usec() + sleep_usec;
+      struct pollfd fdset[1];
+      fdset[0].fd = self->wake_fd;
+      fdset[0].events = POLLIN;
+      fdset[0].revents = 0;
+      struct timespec ts;
+      ts.tv_sec = sleep_usec / 1000000;
+      ts.tv_nsec = (sleep_usec % 1000000) * 1000;
+      ppoll (fdset, 1, &ts, NULL);
+      // A sleep cut short by hcsr04group_uninit() doesn't count
+      if (timing && !self->stop)
+        overshoot = get_monotonic_usec() - due;
+      }
+    }
+  return NULL;
+  }
+
+/*============================================================================
+
+  hcsr04group_start_thread
+
+  Start the measurement thread, with the scheduling policy and CPU
+  affinity set by hcsr04group_set_scheduling()
+
+============================================================================*/
+static BOOL hcsr04group_start_thread (HCSR04Group *self, char **error)
+  {
+  pthread_attr_t attr;
+  pthread_attr_init (&attr);
+  if (self->priority > 0)
+    {
+    struct sched_param param;
+    memset (&param, 0, sizeof (param));
+    param.sched_priority = self->priority;
+    pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy (&attr, SCHED_FIFO);
+    pthread_attr_setschedparam (&attr, &param);
+    }
+  if (self->cpu >= 0)
+    {
+    cpu_set_t cpus;
+    CPU_ZERO (&cpus);
+    CPU_SET (self->cpu, &cpus);
+    pthread_attr_setaffinity_np (&attr, sizeof (cpus), &cpus);
+    }
+  int err = pthread_create (&self->pthread, &attr, hcsr04group_loop, self);
+  pthread_attr_destroy (&attr);
+  if (err != 0)
+    {
+    if (error)
+      asprintf (error, "Can't start HCSR04 group thread: %s", strerror (err));
+    return FALSE;
+    }
+  self->running = TRUE;
+  return TRUE;
+  }
+
+/*============================================================================
+
+  hcsr04group_init_pins
+
+  Set up the GPIO pins, and the epoll set that watches the echo pins
+  and the wake eventfd
+
+============================================================================*/
+static BOOL hcsr04group_init_pins (HCSR04Group *self, char **error)
+  {
+  self->stop = FALSE;
+  self->wake_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  self->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+  if (self->wake_fd < 0 || self->epoll_fd < 0)
+    {
+    if (error)
+      asprintf (error, "Can't create eventfd or epoll: %s", strerror (errno));
+    return FALSE;
+    }
+  struct epoll_event ev;
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN;
+  ev.data.u32 = WAKE_INDEX;
+  epoll_ctl (self->epoll_fd, EPOLL_CTL_ADD, self->wake_fd, &ev);
+
+  for (int i = 0; i < self->count; i++)
+    {
+    GPIOPin *echo = self->gpiopin_echoes[i];
+    if (!gpiopin_init (echo, GPIOPIN_IN, error)) return FALSE;
+    ev.events = gpiopin_get_poll_events (echo);
+    ev.data.u32 = (uint32_t)i;
+    if (epoll_ctl (self->epoll_fd, EPOLL_CTL_ADD, gpiopin_get_fd (echo),
+          &ev) != 0)
+      {
+      if (error)
+        asprintf (error, "Can't watch GPIO %d: %s",
+          hcsr04_get_echo_pin (self->sensors[i]), strerror (errno));
+      return FALSE;
+      }
+    }
+  if (!gpiopin_init (self->gpiopin_trigger, GPIOPIN_OUT, error))
+    return FALSE;
+  gpiopin_set (self->gpiopin_trigger, LOW);
+  return TRUE;
+  }
+
+/*============================================================================
+  hcsr04group_init
+============================================================================*/
+BOOL hcsr04group_init (HCSR04Group *self, char **error)
+  {
+  assert (self != NULL);
+  BOOL ret = hcsr04group_init_pins (self, error)
+    && hcsr04group_start_thread (self, error);
+  if (!ret)
+    hcsr04group_uninit (self);
+  return ret;
+  }
+
+/*============================================================================
+  hcsr04group_open
+============================================================================*/
+BOOL hcsr04group_open (HCSR04Group *self, char **error)
+  {
+  assert (self != NULL);
+  BOOL ret = hcsr04group_init_pins (self, error);
+  if (!ret)
+    hcsr04group_uninit (self);
+  return ret;
+  }
+
+/*============================================================================
+  hcsr04group_interrupt
+============================================================================*/
+void hcsr04group_interrupt (HCSR04Group *self)
+  {
+  assert (self != NULL);
+  self->stop = TRUE;
+  if (self->wake_fd >= 0)
+    {
+    uint64_t one = 1;
+    write (self->wake_fd, &one, sizeof (one));
+    }
+  }
+
+/*============================================================================
+  hcsr04group_uninit
+============================================================================*/
+void hcsr04group_uninit (HCSR04Group *self)
+  {
+  assert (self != NULL);
+  self->stop = TRUE;
+  if (self->running)
+    {
+    uint64_t one = 1;
+    write (self->wake_fd, &one, sizeof (one));
+    pthread_join (self->pthread, NULL);
+    self->running = FALSE;
+    }
+  gpiopin_uninit (self->gpiopin_trigger);
+  for (int i = 0; i < self->count; i++)
+    gpiopin_uninit (self->gpiopin_echoes[i]);
+  if (self->epoll_fd >= 0)
+    close (self->epoll_fd);
+  self->epoll_fd = -1;
+  if (self->wake_fd >= 0)
+    close (self->wake_fd);
+  self->wake_fd = -1;
+  }
+
+/*============================================================================
+  hcsr04group_get_count
+============================================================================*/
+int hcsr04group_get_count (const HCSR04Group *self)
+  {
+  assert (self != NULL);
+  return self->count;
+  }
+
+/*============================================================================
+  hcsr04group_get_sensor
+============================================================================*/
+HCSR04 *hcsr04group_get_sensor (HCSR04Group *self, int i)
+  {
+  assert (self != NULL);
+  assert (i >= 0 && i < self->count);
+  return self->sensors[i];
+  }
+
+/*============================================================================
+  hcsr04group_set_trigger_mode
+============================================================================*/
+void hcsr04group_set_trigger_mode (HCSR04Group *self,
+      HCSR04TriggerMode mode, int pulse_usec)
+  {
+  assert (self != NULL);
+  assert (!self->running);
+  self->trigger_mode = mode;
+  self->pulse_usec = pulse_usec > 0 ? pulse_usec : HCSR04_PULSE_USEC;
+  }
+
+/*============================================================================
+  hcsr04group_set_adaptive
+============================================================================*/
+void hcsr04group_set_adaptive (HCSR04Group *self, BOOL adaptive)
+  {
+  assert (self != NULL);
+  self->adaptive = adaptive;
+  }
+
+/*============================================================================
+  hcsr04group_set_scheduling
+============================================================================*/
+void hcsr04group_set_scheduling (HCSR04Group *self, int priority, int cpu)
+  {
+  assert (self != NULL);
+  assert (!self->running);
+  self->priority = priority;
+  self->cpu = cpu;
+  }
+
+/*============================================================================
+  hcsr04group_set_keep_exported
+============================================================================*/
+void hcsr04group_set_keep_exported (HCSR04Group *self, BOOL keep)
+  {
+  assert (self != NULL);
+  gpiopin_set_unexport (self->gpiopin_trigger, !keep);
+  for (int i = 0; i < self->count; i++)
+    gpiopin_set_unexport (self->gpiopin_echoes[i], !keep);
+  }
+
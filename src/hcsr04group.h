@@ -0,0 +1,127 @@
+/*============================================================================
+
+  hcsr04group.h
+
+  Functions to manage a group of HC-SR04 sensors that share one trigger
+  pin, each with its own echo pin. One thread sends a single trigger
+  pulse, and times all the echoes together, waiting for their edges in
+  one epoll set. So a cycle gives a reading from every sensor in the
+  group, in the time a single sensor would take to give one reading.
+  The sensors' filters are kept together in one FilterBank, and are
+  all updated by one loop over it, so the cost of filtering a sample
+  doesn't grow with the size of the group.
+
+  Each sensor in the group is a HCSR04, got from hcsr04group_get_sensor(),
+  and everything about it except the measurement -- the filter, zones,
+  reflexes, sample callbacks, and counters -- is set up and read through
+  the usual HCSR04 functions. Its own thread is never started: don't
+  call hcsr04_init(), hcsr04_open(), or hcsr04_read_one() on it. The 
+  group's thread counts overruns, times phases, if the sensor is 
+  instrumented, and shares its CPU time between the sensors, in their
+  counters; but it can't be pipelined, so hcsr04_set_pipelined() and
+  hcsr04_set_adaptive() have no effect on a sensor in a group -- use
+  hcsr04group_set_adaptive() instead.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include "defs.h"
+#include "hcsr04.h"
+
+// The most sensors that can share a trigger pin
+#define HCSR04GROUP_MAX_SENSORS 64
+
+// Longest time to wait for the echoes in one cycle, in usec. Like a
+//  single sensor's wait for each edge, this is much longer than any
+//  real echo, so that a sensor that is not connected doesn't hold up
+//  the cycle for long.
+#define HCSR04GROUP_ECHO_TIMEOUT 500000
+
+struct HCSR04Group;
+typedef struct _HCSR04Group HCSR04Group;
+
+BEGIN_DECLS
+
+/** Create a group of count sensors, on the given trigger pin and echo
+    pins. cycle_msec and smoothing are as for hcsr04_create(). This
+    method only stores values, and will always succeed. */
+HCSR04Group *hcsr04group_create (int trigger_pin, const int *echo_pins,
+               int count, int cycle_msec, double smoothing);
+
+/** Stop the group's thread, if it is running, and free the group and
+    its sensors. */
+void         hcsr04group_destroy (HCSR04Group *self);
+
+/** Initialize the GPIO and start the group's thread. This method can
+    fail, because it accesses hardware; if it does, it fills in *error,
+    which the caller must free. */
+BOOL         hcsr04group_init (HCSR04Group *self, char **error);
+
+/** Initialize the GPIO, but don't start the group's thread, for a caller
+    that will make the measurements itself, with 
+    hcsr04group_measure_samples(). Like hcsr04group_init(), this method 
+    can fail, and fills in *error if it does. */
+BOOL         hcsr04group_open (HCSR04Group *self, char **error);
+
+/** Stop the thread, and uninitialize the GPIO. As with hcsr04_uninit(),
+    the thread is woken at once, even if it is waiting for echoes. */
+void         hcsr04group_uninit (HCSR04Group *self);
+
+/** Get the number of sensors in the group. */
+int          hcsr04group_get_count (const HCSR04Group *self);
+
+/** Get sensor number i, counting from 0 in the order of the echo pins
+    given to hcsr04group_create(). The sensor belongs to the group. */
+HCSR04      *hcsr04group_get_sensor (HCSR04Group *self, int i);
+
+/** Send one trigger pulse, on a group opened with hcsr04group_open(), 
+    and time the echoes. samples must have room for a sample for each
+    sensor, in order; their time_usec, rise_usec and fall_usec are
+    filled in, ready for hcsr04group_process_samples(), which may be
+    called in another thread, while the next measurement is made. The 
+    width of the pulse is written to *pulse_usec, if it is not NULL.
+    Returns FALSE if the measurement was cut short by 
+    hcsr04group_interrupt(). */
+BOOL         hcsr04group_measure_samples (HCSR04Group *self,
+               HCSR04Sample *samples, int *pulse_usec);
+
+/** Make a hcsr04group_measure_samples() in progress in another thread
+    return at once, and every later one fail, until the group is 
+    opened again. */
+void         hcsr04group_interrupt (HCSR04Group *self);
+
+/** Process one cycle's samples, one for each sensor in order, whose
+    time_usec, rise_usec and fall_usec have been filled in. They are 
+    classified, all the filters are updated together, and then each 
+    sample is published by its sensor, as hcsr04_publish_sample() 
+    describes. pulse_usec is the measured width of the trigger pulse,
+    or -1. The group's thread does this after each measurement; it is 
+    public for benchmarks, and for samples that come from elsewhere,
+    which must not be given to it while the thread is running. */
+void         hcsr04group_process_samples (HCSR04Group *self,
+               HCSR04Sample *samples, int pulse_usec);
+
+/** Choose how the trigger pulse is timed, and its width, as for
+    hcsr04_set_trigger_mode(). Must be called before hcsr04group_init(). */
+void         hcsr04group_set_trigger_mode (HCSR04Group *self,
+               HCSR04TriggerMode mode, int pulse_usec);
+
+/** Make the cycle time the time from the start of one measurement to
+    the start of the next, rather than the sleep between them, as for 
+    hcsr04_set_adaptive(). This method can be called at any time. */
+void         hcsr04group_set_adaptive (HCSR04Group *self, BOOL adaptive);
+
+/** Set the scheduling of the group's thread, as for
+    hcsr04_set_scheduling(). Must be called before hcsr04group_init(). */
+void         hcsr04group_set_scheduling (HCSR04Group *self, int priority,
+               int cpu);
+
+/** Set whether hcsr04group_uninit() leaves the GPIO pins exported, as
+    for hcsr04_set_keep_exported(). */
+void         hcsr04group_set_keep_exported (HCSR04Group *self, BOOL keep);
+
+END_DECLS
+
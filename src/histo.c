@@ -0,0 +1,137 @@
+/*==========================================================================
+
+    histo.c
+
+    Fixed-size, log-linear latency histograms. See histo.h.
+
+    The first HISTO_SUB_BUCKETS buckets hold the values 0 to
+    HISTO_SUB_BUCKETS - 1 exactly. After that, a value whose highest set
+    bit is bit b is counted by its top HISTO_SUB_BITS bits, so that each
+    power of two from HISTO_SUB_BUCKETS upwards gets HISTO_SUB_BUCKETS / 2
+    buckets.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include "defs.h"
+#include "histo.h"
+
+#define HISTO_HALF (HISTO_SUB_BUCKETS / 2)
+
+/*============================================================================
+  histo_reset
+============================================================================*/
+void histo_reset (HCSR04Histogram *self)
+  {
+  assert (self != NULL);
+  memset (self, 0, sizeof (HCSR04Histogram));
+  }
+
+/*============================================================================
+  histo_bucket_of
+============================================================================*/
+int histo_bucket_of (int64_t value)
+  {
+  if (value < HISTO_SUB_BUCKETS)
+    return value < 0 ? 0 : (int)value;
+  if (value >= (int64_t)1 << HISTO_MAX_BITS)
+    return HISTO_BUCKETS - 1;
+  int top = 63 - __builtin_clzll ((uint64_t)value);
+  int shift = top - HISTO_SUB_BITS + 1;
+  int sub = (int)(value >> shift);   // HISTO_HALF to HISTO_SUB_BUCKETS - 1
+  return HISTO_SUB_BUCKETS + (shift - 1) * HISTO_HALF + (sub - HISTO_HALF);
+  }
+
+/*============================================================================
+  histo_bucket_limit
+============================================================================*/
+int64_t histo_bucket_limit (int bucket)
+  {
+  if (bucket < HISTO_SUB_BUCKETS)
+    return bucket;
+  int k = bucket - HISTO_SUB_BUCKETS;
+  int shift = k / HISTO_HALF + 1;
+  int64_t sub = k % HISTO_HALF + HISTO_HALF;
+  return ((sub + 1) << shift) - 1;
+  }
+
+/*============================================================================
+  histo_record
+============================================================================*/
+void histo_record (HCSR04Histogram *self, int64_t value)
+  {
+  if (value < 0) value = 0;
+  if (self->count == 0 || value < self->min) self->min = value;
+  if (self->count == 0 || value > self->max) self->max = value;
+  self->count++;
+  self->total += value;
+  self->counts[histo_bucket_of (value)]++;
+  }
+
+/*============================================================================
+  histo_percentile
+============================================================================*/
+int64_t histo_percentile (const HCSR04Histogram *self, double percent)
+  {
+  assert (self != NULL);
+  if (self->count == 0) return 0;
+  uint64_t wanted = (uint64_t)(percent / 100.0 * self->count + 0.5);
+  if (wanted < 1) wanted = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < HISTO_BUCKETS; i++)
+    {
+    seen += self->counts[i];
+    if (seen >= wanted)
+      {
+      // The bucket limit can be beyond the largest value actually seen
+      int64_t limit = histo_bucket_limit (i);
+      return limit < self->max ? limit : self->max;
+      }
+    }
+  return self->max;
+  }
+
+/*============================================================================
+  histo_add
+============================================================================*/
+void histo_add (HCSR04Histogram *self, const HCSR04Histogram *other)
+  {
+  assert (self != NULL);
+  assert (other != NULL);
+  if (other->count == 0) return;
+  if (self->count == 0 || other->min < self->min) self->min = other->min;
+  if (self->count == 0 || other->max > self->max) self->max = other->max;
+  self->count += other->count;
+  self->total += other->total;
+  for (int i = 0; i < HISTO_BUCKETS; i++)
+    self->counts[i] += other->counts[i];
+  }
+
+/*============================================================================
+  histo_print
+============================================================================*/
+void histo_print (const HCSR04Histogram *self, const char *name, FILE *f)
+  {
+  assert (self != NULL);
+  if (self->count == 0)
+    {
+    fprintf (f, "%-16s no data\n", name);
+    return;
+    }
+  fprintf (f, "%-16s n=%llu min=%lld mean=%.1f p50=%lld p90=%lld "
+     "p99=%lld p99.9=%lld max=%lld\n", name,
+     (unsigned long long)self->count, (long long)self->min,
+     (double)self->total / self->count,
+     (long long)histo_percentile (self, 50),
+     (long long)histo_percentile (self, 90),
+     (long long)histo_percentile (self, 99),
+     (long long)histo_percentile (self, 99.9),
+     (long long)self->max);
+  }
+
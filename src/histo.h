@@ -0,0 +1,71 @@
+/*============================================================================
+
+  histo.h
+
+  Fixed-size latency histograms, in the style of HdrHistogram. Values
+  below HISTO_SUB_BUCKETS are counted exactly; above that, each power of
+  two is divided into HISTO_SUB_BUCKETS / 2 equal buckets, so every value
+  is recorded to within about 3% of its true value, whatever its size.
+  Recording a value is a few shifts and an increment, and the histogram
+  never allocates memory, so it is cheap enough to use on every
+  measurement cycle.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include "defs.h"
+
+// Number of bits of precision kept for each value
+#define HISTO_SUB_BITS 6
+#define HISTO_SUB_BUCKETS (1 << HISTO_SUB_BITS)
+
+// Values above 2^HISTO_MAX_BITS - 1 (about 67 seconds, in usec) are
+//  counted in the top bucket
+#define HISTO_MAX_BITS 26
+
+#define HISTO_BUCKETS \
+  (HISTO_SUB_BUCKETS \
+    + (HISTO_MAX_BITS - HISTO_SUB_BITS) * HISTO_SUB_BUCKETS / 2)
+
+// HCSR04Histogram -- a histogram of durations, usually in microseconds
+typedef struct _HCSR04Histogram
+  {
+  uint64_t count;
+  int64_t min;
+  int64_t max;
+  int64_t total;     // Divide by count for the mean
+  uint64_t counts[HISTO_BUCKETS];
+  } HCSR04Histogram;
+
+BEGIN_DECLS
+
+/** Empty the histogram. */
+void      histo_reset (HCSR04Histogram *self);
+
+/** Count one value. Negative values are counted as zero. */
+void      histo_record (HCSR04Histogram *self, int64_t value);
+
+/** Get the index of the bucket that a value is counted in. */
+int       histo_bucket_of (int64_t value);
+
+/** Get the largest value that is counted in a bucket. */
+int64_t   histo_bucket_limit (int bucket);
+
+/** Get the value below which the given percentage of values lie, to the
+    precision of the histogram. Returns 0 if the histogram is empty. */
+int64_t   histo_percentile (const HCSR04Histogram *self, double percent);
+
+/** Merge the counts of another histogram into this one. */
+void      histo_add (HCSR04Histogram *self, const HCSR04Histogram *other);
+
+/** Print a one-line summary -- count, min, mean, percentiles, and max. */
+void      histo_print (const HCSR04Histogram *self, const char *name,
+            FILE *f);
+
+END_DECLS
+
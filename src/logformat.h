@@ -0,0 +1,43 @@
+/*============================================================================
+  
+  logformat.h
+
+  The layout of a binary sample log, as written by SampleLog and read by
+  LogReader. A log is a HCSR04LogHeader, followed by any number of
+  HCSR04Sample records, all the same size. Everything is in the byte 
+  order of the machine that wrote it. Logs are only ever appended to, so
+  a log that was being written when the system crashed is still valid,
+  except possibly for a partial last record, which readers ignore.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include "hcsr04.h"
+
+#define HCSR04_LOG_MAGIC "HCSR04LG"
+#define HCSR04_LOG_VERSION 1
+
+// Timebases for sample times. Only wall-clock time is currently used.
+#define HCSR04_LOG_TIMEBASE_REALTIME 0
+
+// HCSR04LogHeader -- the start of every log. It is exactly 64 bytes.
+typedef struct _HCSR04LogHeader
+  {
+  char magic[8];            // HCSR04_LOG_MAGIC, without the terminating 0
+  uint32_t version;
+  uint32_t header_size;     // sizeof (HCSR04LogHeader) 
+  uint32_t record_size;     // sizeof (HCSR04Sample)
+  uint32_t timebase;        // HCSR04_LOG_TIMEBASE_xxx
+  int64_t start_time_usec;  // When the log was created, in the timebase
+  int32_t sound_pin;
+  int32_t echo_pin;
+  int32_t cycle_usec;
+  float smoothing;
+  float max_range;          // Metres
+  uint32_t reserved[3];
+  } HCSR04LogHeader;
+
@@ -0,0 +1,137 @@
+/*==========================================================================
+  
+    logreader.c
+
+    This "class" maps a binary sample log into memory, so that its
+    samples can be used in place.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "defs.h" 
+#include "hcsr04.h" 
+#include "logformat.h" 
+#include "logreader.h" 
+
+_Static_assert (sizeof (HCSR04LogHeader) == 64, "Log header must be 64 bytes");
+
+struct _LogReader
+  {
+  char *filename;
+  const void *map;     // The mapped file, or NULL
+  size_t size;
+  };
+
+/*============================================================================
+  logreader_create
+============================================================================*/
+LogReader *logreader_create (const char *filename)
+  {
+  assert (filename != NULL);
+  LogReader *self = malloc (sizeof (LogReader));
+  memset (self, 0, sizeof (LogReader));
+  self->filename = strdup (filename);
+  return self;
+  }
+
+/*============================================================================
+  logreader_destroy
+============================================================================*/
+void logreader_destroy (LogReader *self)
+  {
+  if (self)
+    {
+    logreader_uninit (self);
+    free (self->filename);
+    free (self);
+    }
+  }
+
+/*============================================================================
+  logreader_init
+============================================================================*/
+BOOL logreader_init (LogReader *self, char **error)
+  {
+  assert (self != NULL);
+  assert (self->map == NULL);
+  int fd = open (self->filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+    if (error)
+      asprintf (error, "Can't open %s: %s", self->filename, strerror (errno));
+    return FALSE;
+    }
+
+  BOOL ret = FALSE;
+  struct stat sb;
+  if (fstat (fd, &sb) == 0 && (size_t)sb.st_size >= sizeof (HCSR04LogHeader))
+    {
+    void *p = mmap (NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p != MAP_FAILED)
+      {
+      const HCSR04LogHeader *h = p;
+      if (memcmp (h->magic, HCSR04_LOG_MAGIC, sizeof (h->magic)) == 0 
+           && h->version == HCSR04_LOG_VERSION
+           && h->header_size >= sizeof (HCSR04LogHeader)
+           && h->header_size <= (size_t)sb.st_size
+           && h->record_size == sizeof (HCSR04Sample))
+        {
+        // We will be reading the whole thing from start to finish
+        madvise (p, sb.st_size, MADV_SEQUENTIAL);
+        self->map = p;
+        self->size = sb.st_size;
+        ret = TRUE;
+        }
+      else
+        munmap (p, sb.st_size);
+      }
+    }
+  if (!ret && error)
+    asprintf (error, "%s is not a compatible sample log", self->filename);
+  close (fd);
+  return ret;
+  }
+
+/*============================================================================
+  logreader_uninit
+============================================================================*/
+void logreader_uninit (LogReader *self)
+  {
+  assert (self != NULL);
+  if (self->map)
+    munmap ((void *)self->map, self->size);
+  self->map = NULL;
+  }
+
+/*============================================================================
+  logreader_get_header
+============================================================================*/
+const HCSR04LogHeader *logreader_get_header (const LogReader *self)
+  {
+  assert (self != NULL);
+  return self->map;
+  }
+
+/*============================================================================
+  logreader_get_samples
+============================================================================*/
+const HCSR04Sample *logreader_get_samples (const LogReader *self, 
+      size_t *count)
+  {
+  assert (self != NULL);
+  assert (self->map != NULL);
+  const HCSR04LogHeader *h = self->map;
+  *count = (self->size - h->header_size) / h->record_size;
+  return (const HCSR04Sample *)((const char *)self->map + h->header_size);
+  }
+
@@ -0,0 +1,50 @@
+/*============================================================================
+  
+  logreader.h
+
+  Functions to read a binary sample log written by SampleLog. The log is
+  memory-mapped, and its samples are accessed in place, without copying.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include "defs.h"
+#include "hcsr04.h"
+#include "logformat.h"
+
+struct LogReader;
+typedef struct _LogReader LogReader;
+
+BEGIN_DECLS
+
+/** Create a LogReader for a file. This method only stores values, and 
+    will always succeed. */
+LogReader *logreader_create (const char *filename);
+
+/** Clean up. This method implicitly calls _uninit(). */
+void       logreader_destroy (LogReader *self);
+
+/** Map the log. This fails if the file can't be read, or is not a 
+    sample log that this version understands. If it does, and error is
+    not NULL, it is written with an error message that the caller 
+    should free. */
+BOOL       logreader_init (LogReader *self, char **error);
+
+/** Unmap the log. Pointers returned by the other methods become 
+    invalid. */
+void       logreader_uninit (LogReader *self);
+
+/** Get the log header. */
+const HCSR04LogHeader *logreader_get_header (const LogReader *self);
+
+/** Get the samples in the log, and the number of them. The samples are
+    in the order they were recorded, and stay valid until _uninit(). */
+const HCSR04Sample *logreader_get_samples (const LogReader *self, 
+             size_t *count);
+
+END_DECLS
+
@@ -1,27 +1,962 @@
 /*============================================================================
-  
+
     main.c
 
     A test driver for the HCSR04 "class". This program uses the HCSR04
-    class to collect ultrasonic range data from an HC-SR04 sensor. It
-    sets the sensor to collect data at the maximum rate, and displays
-    the smoothed value every two seconds. 
+    class to collect ultrasonic range data from one or more HC-SR04
+    sensors, and displays the smoothed values. Run with "--help" for the
+    options.
+
+    By default, one sensor with its trigger on GPIO 17 and its echo on
+    GPIO 27 is measured every HCSR04_MIN_CYCLE msec, and the distance is
+    printed twice a second. "--rate 0" prints every sample instead.
+
+    With "-s <socket>", the program runs as a daemon instead, serving
+    readings to clients on a Unix-domain socket -- see server.h for the
+    protocol.
+
+    With "-l <file>", every sample is also recorded in a binary log --
+    see logformat.h. With more than one sensor, "-<trigger>-<echo>" is
+    added to the file name for each.
+
+    With "-z <dir>", every sample is also kept in compressed segment
+    files in the directory, using at most COMPSTORE_BUDGET bytes -- see
+    compformat.h.
+
+    With "-m <file>", counters and phase timings are written to the file
+    every METRICS_INTERVAL_MSEC, in Prometheus text format -- see
+    metrics.h.
+
+    With "-i", the phases of each measurement cycle are timed. Send the
+    process SIGUSR1 to print histograms of the timings to stderr.
+
+    Sensors given with "-p" that share a trigger pin are measured 
+    together, by a HCSR04Group -- one trigger pulse times all their 
+    echoes. See hcsr04group.h.
+
+    With "-r <file>", the echoes recorded in a binary log are replayed,
+    instead of using the hardware. Add "-F" to replay them as fast as
+    possible, rather than in real time; the replay rate is reported at
+    the end. "--backend sim" simulates a sensor facing a fixed target
+    instead.
 
     Copyright (c)2020 Kevin Boone, GPL v3.0
 
 ============================================================================*/
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <time.h>
+#include <signal.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/time.h>
-#include "defs.h" 
-#include "hcsr04.h" 
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include "defs.h"
+#include "hcsr04.h"
+#include "hcsr04group.h"
+#include "server.h"
+#include "samplelog.h"
+#include "samplering.h"
+#include "replay.h"
+#include "compstore.h"
+#include "metrics.h"
+#include "output.h"
+
+#define MAIN_MAX_SENSORS 8
+
+// Defaults for the command-line options
+#define DEFAULT_PIN_SOUND 17
+#define DEFAULT_PIN_ECHO 27
+#define DEFAULT_SMOOTHING 0.5
+#define DEFAULT_RATE 2.0
+#define DEFAULT_SIM_DISTANCE 1.0
+// Time between readings in one-shot mode, unless --cycle is given. This
+//  is long enough for the echoes of one ping to die away before the next,
+//  at the distances we measure.
+#define DEFAULT_BURST_GAP 15
+
+// Size of the queue of samples for each sensor, when printing every
+//  sample
+#define PRINT_RING_SIZE 4096
+
+// Where the measurements come from
+typedef enum
+  {
+  MAIN_BACKEND_SYSFS = 0,
+  MAIN_BACKEND_SIM = 1,
+  MAIN_BACKEND_REPLAY = 2
+  } MainBackend;
+
+// Options -- everything that can be set on the command line
+typedef struct _Options
+  {
+  int sensors_count;
+  int sound_pins[MAIN_MAX_SENSORS];
+  int echo_pins[MAIN_MAX_SENSORS];
+  int cycle_msec;
+  BOOL adaptive;
+  BOOL pipelined;
+  HCSR04FilterType filter;
+  int window;
+  double smoothing;
+  MainBackend backend;
+  const char *replay_file;
+  BOOL fast;
+  double sim_distance;
+  double rate;       // Readings printed per second, or 0 for every sample
+  long count;        // Stop after printing this many readings, if not 0
+  double duration;   // Stop after this many seconds, if not 0
+  int priority;      // SCHED_FIFO priority for the HCSR04 threads, or 0
+  int cpu;           // CPU to bind the HCSR04 threads to, or -1
+  BOOL mlock;
+  BOOL instrumented;
+  const char *socket_path;
+  const char *log_file;
+  const char *store_dir;
+  const char *metrics_file;
+  OutputFormat format;
+  int batch;         // Readings written at once, or 0 for the default
+  int flush_msec;    // Longest time a reading waits to be written
+  int once;          // Take this many readings without the thread, or 0
+  BOOL cycle_set;    // The cycle time was given on the command line
+  BOOL keep_exported;
+  HCSR04TriggerMode trigger_mode;
+  int pulse_usec;    // Trigger pulse width, or 0 for the default
+  } Options;
+
+// Sensor -- one HCSR04 and everything attached to it
+typedef struct _Sensor
+  {
+  HCSR04 *hcsr04;
+  Replay *replay;
+  SampleLog *log;
+  CompStore *store;
+  SampleRing *ring;  // Samples to print, when printing every sample
+  // The group that measures this sensor, if it shares its trigger pin
+  //  with others. The group owns hcsr04.
+  HCSR04Group *group;
+  double sim_distance;
+  unsigned int sim_seed;
+  } Sensor;
+
+// Setup -- the options, and the sensors they describe
+typedef struct _Setup
+  {
+  Options options;
+  Sensor sensors[MAIN_MAX_SENSORS];
+  HCSR04Group *groups[MAIN_MAX_SENSORS];
+  int groups_count;
+  } Setup;
+
+static Server *server = NULL;
+
+// eventfd signalled by SIGINT and SIGTERM, to stop printing
+static int stop_fd = -1;
+
+static const struct option long_options[] =
+  {
+  { "sensor",     required_argument, NULL, 'p' },
+  { "cycle",      required_argument, NULL, 'c' },
+  { "adaptive",   no_argument,       NULL, 'a' },
+  { "filter",     required_argument, NULL, 'f' },
+  { "window",     required_argument, NULL, 'w' },
+  { "smoothing",  required_argument, NULL, 'k' },
+  { "backend",    required_argument, NULL, 'b' },
+  { "replay",     required_argument, NULL, 'r' },
+  { "fast",       no_argument,       NULL, 'F' },
+  { "distance",   required_argument, NULL, 'd' },
+  { "rate",       required_argument, NULL, 'R' },
+  { "count",      required_argument, NULL, 'n' },
+  { "duration",   required_argument, NULL, 't' },
+  { "realtime",   required_argument, NULL, 'P' },
+  { "cpu",        required_argument, NULL, 'C' },
+  { "mlock",      no_argument,       NULL, 'M' },
+  { "instrument", no_argument,       NULL, 'i' },
+  { "socket",     required_argument, NULL, 's' },
+  { "log",        required_argument, NULL, 'l' },
+  { "store",      required_argument, NULL, 'z' },
+  { "metrics",    required_argument, NULL, 'm' },
+  { "format",     required_argument, NULL, 'o' },
+  { "batch",      required_argument, NULL, 'B' },
+  { "flush",      required_argument, NULL, 'T' },
+  { "once",       required_argument, NULL, 'O' },
+  { "keep-exported", no_argument,    NULL, 'K' },
+  { "trigger",    required_argument, NULL, 'g' },
+  { "pulse",      required_argument, NULL, 'u' },
+  { "pipeline",   no_argument,       NULL, 'L' },
+  { "help",       no_argument,       NULL, 'h' },
+  { NULL, 0, NULL, 0 }
+  };
+
+/*============================================================================
+  main_usage
+============================================================================*/
+static void main_usage (FILE *f, const char *argv0)
+  {
+  fprintf (f, "Usage: %s [options]\n", argv0);
+  fprintf (f,
+"  -p, --sensor TRIG:ECHO  GPIO pins of a sensor; may be repeated (%d:%d)\n"
+"  -c, --cycle MSEC        time between measurements (%d)\n"
+"  -a, --adaptive          cycle time is start-to-start, not a sleep\n"
+"  -f, --filter NAME       ema, median, or none (ema)\n"
+"  -w, --window N          median filter window, 1-%d (5)\n"
+"  -k, --smoothing F       ema smoothing factor, 0-0.9999 (%g)\n"
+"  -b, --backend NAME      sysfs, sim, or replay (sysfs)\n"
+"  -r, --replay FILE       replay a binary log; implies --backend replay\n"
+"  -F, --fast              replay as fast as possible\n"
+"  -d, --distance METRES   target distance for --backend sim (%g)\n"
+"  -R, --rate HZ           readings printed per second; 0 = every sample (%g)\n"
+"  -n, --count N           stop after printing N readings\n"
+"  -t, --duration SECS     stop after this long\n"
+"  -P, --realtime PRIO     run sensor threads SCHED_FIFO at this priority\n"
+"  -C, --cpu N             bind sensor threads to this CPU\n"
+"  -M, --mlock             lock the process in memory\n"
+"  -i, --instrument        time measurement phases; dump on SIGUSR1\n"
+"  -s, --socket PATH       serve readings on a Unix socket, as a daemon\n"
+"  -l, --log FILE          record every sample in a binary log\n"
+"  -z, --store DIR         keep compressed samples in this directory\n"
+"  -m, --metrics FILE      write Prometheus metrics to this file\n"
+"  -o, --format NAME       text, csv, jsonl, or binary (text)\n"
+"  -B, --batch N           readings written at once (1 for text, else %d)\n"
+"  -T, --flush MSEC        longest a reading waits to be written (%d)\n"
+"  -O, --once N            take N readings at once, print the median, and\n"
+"                          exit; status 2 if none was good\n"
+"  -K, --keep-exported     leave GPIO pins exported, for a quicker restart\n"
+"  -g, --trigger NAME      time the trigger pulse by spin or sleep (spin)\n"
+"  -u, --pulse USEC        trigger pulse width (%d)\n"
+"  -L, --pipeline          filter and publish in a second thread per sensor\n"
+"  -h, --help              show this message\n",
+    DEFAULT_PIN_SOUND, DEFAULT_PIN_ECHO, HCSR04_MIN_CYCLE, HCSR04_MAX_MEDIAN,
+    DEFAULT_SMOOTHING, DEFAULT_SIM_DISTANCE, DEFAULT_RATE, OUTPUT_BATCH,
+    OUTPUT_FLUSH_MSEC, HCSR04_PULSE_USEC);
+  }
+
+/*============================================================================
+
+  main_has_groups
+
+  Find out whether any sensors will share a trigger pin, and so be 
+  measured by a HCSR04Group, as main_setup_groups() decides
+
+============================================================================*/
+static BOOL main_has_groups (const Options *o)
+  {
+  if (o->backend != MAIN_BACKEND_SYSFS || o->once) return FALSE;
+  for (int i = 0; i < o->sensors_count; i++)
+    for (int j = i + 1; j < o->sensors_count; j++)
+      if (o->sound_pins[j] == o->sound_pins[i]) return TRUE;
+  return FALSE;
+  }
+
+/*============================================================================
+
+  main_parse_options
+
+  Fill in the options from the command line. Returns FALSE, having
+  printed a message, if they don't make sense.
+
+============================================================================*/
+static BOOL main_parse_options (int argc, char **argv, Options *o)
+  {
+  memset (o, 0, sizeof (Options));
+  o->cycle_msec = HCSR04_MIN_CYCLE;
+  o->filter = HCSR04_FILTER_EMA;
+  o->window = 5;
+  o->smoothing = DEFAULT_SMOOTHING;
+  o->sim_distance = DEFAULT_SIM_DISTANCE;
+  o->rate = DEFAULT_RATE;
+  o->cpu = -1;
+  o->flush_msec = OUTPUT_FLUSH_MSEC;
+  BOOL backend_set = FALSE;
+
+  int opt;
+  while ((opt = getopt_long (argc, argv,
+      "p:c:af:w:k:b:r:Fd:R:n:t:P:C:Mis:l:z:m:o:B:T:O:Kg:u:Lh", 
+      long_options, NULL)) != -1)
+    {
+    switch (opt)
+      {
+      case 'p':
+        if (o->sensors_count == MAIN_MAX_SENSORS)
+          {
+          fprintf (stderr, "%s: at most %d sensors\n", argv[0],
+            MAIN_MAX_SENSORS);
+          return FALSE;
+          }
+        if (sscanf (optarg, "%d:%d", &o->sound_pins[o->sensors_count],
+              &o->echo_pins[o->sensors_count]) != 2)
+          {
+          fprintf (stderr, "%s: bad sensor '%s'; expected TRIG:ECHO\n",
+            argv[0], optarg);
+          return FALSE;
+          }
+        o->sensors_count++;
+        break;
+      case 'c':
+        o->cycle_msec = atoi (optarg);
+        o->cycle_set = TRUE;
+        break;
+      case 'a':
+        o->adaptive = TRUE;
+        break;
+      case 'f':
+        if (strcmp (optarg, "ema") == 0)
+          o->filter = HCSR04_FILTER_EMA;
+        else if (strcmp (optarg, "median") == 0)
+          o->filter = HCSR04_FILTER_MEDIAN;
+        else if (strcmp (optarg, "none") == 0)
+          o->filter = HCSR04_FILTER_NONE;
+        else
+          {
+          fprintf (stderr, "%s: unknown filter '%s'\n", argv[0], optarg);
+          return FALSE;
+          }
+        break;
+      case 'w':
+        o->window = atoi (optarg);
+        break;
+      case 'k':
+        o->smoothing = atof (optarg);
+        break;
+      case 'b':
+        backend_set = TRUE;
+        if (strcmp (optarg, "sysfs") == 0)
+          o->backend = MAIN_BACKEND_SYSFS;
+        else if (strcmp (optarg, "sim") == 0)
+          o->backend = MAIN_BACKEND_SIM;
+        else if (strcmp (optarg, "replay") == 0)
+          o->backend = MAIN_BACKEND_REPLAY;
+        else
+          {
+          fprintf (stderr, "%s: unknown backend '%s'\n", argv[0], optarg);
+          return FALSE;
+          }
+        break;
+      case 'r':
+        o->replay_file = optarg;
+        if (!backend_set) o->backend = MAIN_BACKEND_REPLAY;
+        break;
+      case 'F':
+        o->fast = TRUE;
+        break;
+      case 'd':
+        o->sim_distance = atof (optarg);
+        break;
+      case 'R':
+        o->rate = atof (optarg);
+        break;
+      case 'n':
+        o->count = atol (optarg);
+        break;
+      case 't':
+        o->duration = atof (optarg);
+        break;
+      case 'P':
+        o->priority = atoi (optarg);
+        break;
+      case 'C':
+        o->cpu = atoi (optarg);
+        break;
+      case 'M':
+        o->mlock = TRUE;
+        break;
+      case 'i':
+        o->instrumented = TRUE;
+        break;
+      case 's':
+        o->socket_path = optarg;
+        break;
+      case 'l':
+        o->log_file = optarg;
+        break;
+      case 'z':
+        o->store_dir = optarg;
+        break;
+      case 'm':
+        o->metrics_file = optarg;
+        break;
+      case 'o':
+        if (!output_parse_format (optarg, &o->format))
+          {
+          fprintf (stderr, "%s: unknown format '%s'\n", argv[0], optarg);
+          return FALSE;
+          }
+        break;
+      case 'B':
+        o->batch = atoi (optarg);
+        break;
+      case 'T':
+        o->flush_msec = atoi (optarg);
+        break;
+      case 'K':
+        o->keep_exported = TRUE;
+        break;
+      case 'g':
+        if (strcmp (optarg, "spin") == 0)
+          o->trigger_mode = HCSR04_TRIGGER_SPIN;
+        else if (strcmp (optarg, "sleep") == 0)
+          o->trigger_mode = HCSR04_TRIGGER_SLEEP;
+        else
+          {
+          fprintf (stderr, "%s: unknown trigger timing '%s'\n", argv[0], 
+            optarg);
+          return FALSE;
+          }
+        break;
+      case 'u':
+        o->pulse_usec = atoi (optarg);
+        break;
+      case 'L':
+        o->pipelined = TRUE;
+        break;
+      case 'O':
+        o->once = atoi (optarg);
+        if (o->once <= 0)
+          {
+          fprintf (stderr, "%s: bad reading count '%s'\n", argv[0], optarg);
+          return FALSE;
+          }
+        break;
+      case 'h':
+        main_usage (stdout, argv[0]);
+        exit (0);
+      default:
+        main_usage (stderr, argv[0]);
+        return FALSE;
+      }
+    }
+
+  if (o->sensors_count == 0)
+    {
+    o->sound_pins[0] = DEFAULT_PIN_SOUND;
+    o->echo_pins[0] = DEFAULT_PIN_ECHO;
+    o->sensors_count = 1;
+    }
+
+  const char *problem = NULL;
+  if (optind < argc)
+    problem = "unexpected arguments";
+  else if (o->cycle_msec < 0)
+    problem = "the cycle time can't be negative";
+  else if (o->window < 1 || o->window > HCSR04_MAX_MEDIAN)
+    problem = "the median window is out of range";
+  else if (o->smoothing < 0 || o->smoothing >= 1)
+    problem = "the smoothing factor must be at least 0, and less than 1";
+  else if (o->rate < 0)
+    problem = "the rate can't be negative";
+  else if (o->batch < 0)
+    problem = "the batch size can't be negative";
+  else if (o->flush_msec <= 0)
+    problem = "the flush time must be positive";
+  else if (o->pulse_usec < 0)
+    problem = "the pulse width can't be negative";
+  else if (o->priority < 0 || o->priority > 99)
+    problem = "the real-time priority must be 1-99";
+  else if (o->backend == MAIN_BACKEND_REPLAY && !o->replay_file)
+    problem = "the replay backend needs a log file (--replay)";
+  else if (o->backend == MAIN_BACKEND_REPLAY && o->sensors_count > 1)
+    problem = "only one sensor can be replayed";
+  else if (o->once && (o->backend == MAIN_BACKEND_REPLAY || o->socket_path
+      || o->log_file || o->store_dir || o->metrics_file))
+    problem = "one-shot mode can't replay, serve, log, or store readings";
+  else if (o->pipelined && main_has_groups (o))
+    problem = "sensors that share a trigger pin can't be pipelined";
+  if (problem)
+    {
+    fprintf (stderr, "%s: %s\n", argv[0], problem);
+    return FALSE;
+    }
+  return TRUE;
+  }
+
+/*============================================================================
+
+  main_simulate
+
+  The simulator for "--backend sim": a sensor facing a fixed target, with
+  a few millimetres of noise, that misses an echo now and then
+
+============================================================================*/
+static BOOL main_simulate (void *user_data, HCSR04Sample *sample)
+  {
+  Sensor *s = user_data;
+  if (rand_r (&s->sim_seed) % 100 == 0)
+    return TRUE; // No echo
+  double noise = ((int)(rand_r (&s->sim_seed) % 1001) - 500) / 500.0 * 0.005;
+  sample->rise_usec = 150;
+  sample->fall_usec = 150
+    + (int32_t)((s->sim_distance + noise) / HCSR04_USEC_TO_METRES);
+  return TRUE;
+  }
+
+/*============================================================================
+
+  main_stop
+
+  Signal handler for SIGINT and SIGTERM
+
+============================================================================*/
+static void main_stop (int sig)
+  {
+  sig = sig;
+  if (server)
+    server_stop (server);
+  uint64_t one = 1;
+  write (stop_fd, &one, sizeof (one));
+  }
+
+/*============================================================================
+
+  main_serve
+
+  Serve readings on the socket until stopped by a signal. Returns the
+  process exit status.
+
+============================================================================*/
+static int main_serve (Sensor *sensors, int count, const char *socket_path)
+  {
+  int ret = 0;
+  char *error = NULL;
+  server = server_create (socket_path);
+  for (int i = 0; i < count; i++)
+    server_add_sensor (server, sensors[i].hcsr04);
+  if (server_init (server, &error))
+    {
+    // A signal that came before the server was ready has only been
+    //  seen on stop_fd
+    struct pollfd fdset[1];
+    fdset[0].fd = stop_fd;
+    fdset[0].events = POLLIN;
+    fdset[0].revents = 0;
+    if (poll (fdset, 1, 0) == 0)
+      server_run (server);
+    }
+  else
+    {
+    fprintf (stderr, "Can't start server: %s\n", error);
+    free (error);
+    ret = 1;
+    }
+  Server *s = server;
+  server = NULL;
+  server_destroy (s);
+  return ret;
+  }
+
+/*============================================================================
+
+  main_dump_phases
+
+  A thread that prints the phase timing histograms to stderr whenever
+  SIGUSR1 arrives. Doing this in a thread, with the signal blocked
+  everywhere else, means the printing isn't done in a signal handler.
+
+============================================================================*/
+static void *main_dump_phases (void *arg)
+  {
+  Setup *setup = arg;
+  sigset_t set;
+  sigemptyset (&set);
+  sigaddset (&set, SIGUSR1);
+  int sig;
+  while (sigwait (&set, &sig) == 0)
+    {
+    for (int s = 0; s < setup->options.sensors_count; s++)
+      {
+      HCSR04 *hcsr04 = setup->sensors[s].hcsr04;
+      HCSR04Histogram histogram;
+      fprintf (stderr, "Phase times (usec), sensor %d/%d\n",
+        hcsr04_get_sound_pin (hcsr04), hcsr04_get_echo_pin (hcsr04));
+      for (int i = 0; i < HCSR04_PHASE_COUNT; i++)
+        {
+        hcsr04_get_phase_histogram (hcsr04, i, &histogram);
+        histo_print (&histogram, hcsr04_get_phase_name (i), stderr);
+        }
+      }
+    }
+  return NULL;
+  }
+
+/*============================================================================
+
+  main_current_sample
+
+  Get the most recent sample from a sensor, with its filtered distance
+  as it is now. Before the first cycle has finished, the sample is a
+  blank one, with no distance.
+
+============================================================================*/
+static void main_current_sample (HCSR04 *hcsr04, HCSR04Sample *sample)
+  {
+  if (!hcsr04_get_last_sample (hcsr04, sample))
+    {
+    struct timespec now;
+    clock_gettime (CLOCK_REALTIME, &now);
+    memset (sample, 0, sizeof (HCSR04Sample));
+    sample->time_usec = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    sample->status = HCSR04_SAMPLE_NO_RISE;
+    sample->rise_usec = -1;
+    sample->fall_usec = -1;
+    sample->raw = -1.0;
+    }
+  sample->filtered = hcsr04_get_distance (hcsr04);
+  }
+
+/*============================================================================
+  main_elapsed
+============================================================================*/
+static double main_elapsed (const struct timespec *start)
+  {
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+  }
+
+/*============================================================================
+
+  main_print
+
+  Write readings to stdout -- the latest sample of each sensor at the set
+  rate, or every sample if the rate is zero -- until stopped by a signal,
+  or the count or duration is reached, or a replay is finished. Readings
+  are written a batch at a time.
+
+============================================================================*/
+static void main_print (const Options *o, Sensor *sensors)
+  {
+  int n = o->sensors_count;
+  Replay *replay = sensors[0].replay;
+  int batch = o->batch;
+  if (batch == 0 && o->format == OUTPUT_TEXT) batch = 1;
+  Output *output = output_create (STDOUT_FILENO, o->format, n, batch,
+    o->flush_msec);
+  struct timespec start;
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  struct pollfd fdset[MAIN_MAX_SENSORS + 2];
+  int nfds = 0;
+  fdset[nfds].fd = stop_fd;
+  fdset[nfds++].events = POLLIN;
+  fdset[nfds].fd = replay ? replay_get_done_fd (replay) : -1;
+  fdset[nfds++].events = POLLIN;
+  if (o->rate == 0)
+    {
+    for (int i = 0; i < n; i++)
+      {
+      fdset[nfds].fd = samplering_get_fd (sensors[i].ring);
+      fdset[nfds++].events = POLLIN;
+      }
+    }
+
+  long printed = 0;
+  double next_print = 0; // Time of the next reading, when there is a rate
+  BOOL stop = FALSE;
+  BOOL finished = FALSE; // The replay has finished
+  while (!stop)
+    {
+    if (o->rate > 0 && main_elapsed (&start) >= next_print)
+      {
+      for (int i = 0; i < n && !stop; i++)
+        {
+        HCSR04Sample sample;
+        main_current_sample (sensors[i].hcsr04, &sample);
+        output_sample (output, i, sensors[i].hcsr04, &sample);
+        stop = (o->count > 0 && ++printed >= o->count);
+        }
+      next_print += 1 / o->rate;
+      }
+    else if (o->rate == 0)
+      {
+      for (int i = 0; i < n && !stop; i++)
+        {
+        HCSR04Sample sample;
+        samplering_clear_fd (sensors[i].ring);
+        while (!stop && samplering_pop (sensors[i].ring, &sample))
+          {
+          output_sample (output, i, sensors[i].hcsr04, &sample);
+          stop = (o->count > 0 && ++printed >= o->count);
+          }
+        }
+      }
+    // When a replay finishes, go round once more to print what's left
+    if (finished || stop) break;
+
+    int timeout = -1;
+    if (o->rate > 0)
+      {
+      timeout = (int)((next_print - main_elapsed (&start)) * 1000);
+      if (timeout < 0) timeout = 0;
+      }
+    int flush = output_get_timeout (output);
+    if (flush == 0)
+      output_flush (output);
+    else if (flush > 0 && (timeout < 0 || flush < timeout))
+      timeout = flush;
+    if (o->duration > 0)
+      {
+      int left = (int)((o->duration - main_elapsed (&start)) * 1000);
+      if (left <= 0) break;
+      if (timeout < 0 || left < timeout) timeout = left;
+      }
+    for (int i = 0; i < nfds; i++)
+      fdset[i].revents = 0;
+    poll (fdset, nfds, timeout);
+    if (fdset[0].revents & POLLIN)
+      stop = TRUE;
+    if (fdset[1].revents & POLLIN)
+      {
+      finished = TRUE;
+      // Stop waiting on the descriptor, which stays readable
+      fdset[1].fd = -1;
+      }
+    }
+  output_destroy (output);
+
+  if (replay && replay_is_finished (replay))
+    {
+    double secs = main_elapsed (&start);
+    fprintf (stderr, "Replayed %zu samples in %.3f s (%.0f samples/sec)\n",
+      replay_get_count (replay), secs, replay_get_count (replay) / secs);
+    }
+  }
+
+/*============================================================================
+
+  main_compare_double
+
+============================================================================*/
+static int main_compare_double (const void *a, const void *b)
+  {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+  }
+
+/*============================================================================
+
+  main_once
+
+  Take a burst of readings from each sensor in turn, directly, without
+  starting the HCSR04 thread, and write the median of the good ones. 
+  The wait for each edge is cut to the longest real echo, so that a 
+  sensor that doesn't answer doesn't hold things up for long.
+  Returns 0 if every sensor gave at least one good reading, 2 if any gave
+  none, or 1 if a sensor could not be set up.
+
+============================================================================*/
+static int main_once (const Options *o, Sensor *sensors)
+  {
+  int n = o->sensors_count;
+  int gap = o->cycle_set ? o->cycle_msec : DEFAULT_BURST_GAP;
+  Output *output = output_create (STDOUT_FILENO, o->format, n, n,
+    o->flush_msec);
+  int ret = 0;
+  double *d = malloc (o->once * sizeof (double));
+  for (int i = 0; i < n && ret != 1; i++)
+    {
+    HCSR04 *hcsr04 = sensors[i].hcsr04;
+    hcsr04_set_echo_timeout (hcsr04, HCSR04_MAX_ECHO + HCSR04_MAX_ECHO_SLACK);
+    char *error = NULL;
+    if (!hcsr04_open (hcsr04, &error))
+      {
+      fprintf (stderr, "Can't set up HC-SR04 %d:%d: %s\n",
+        o->sound_pins[i], o->echo_pins[i], error);
+      free (error);
+      ret = 1;
+      break;
+      }
+    HCSR04Sample sample;
+    memset (&sample, 0, sizeof (sample));
+    struct timespec now;
+    clock_gettime (CLOCK_REALTIME, &now);
+    sample.time_usec = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    sample.rise_usec = -1;
+    sample.fall_usec = -1;
+
+    int good = 0;
+    for (int j = 0; j < o->once; j++)
+      {
+      if (j > 0 && gap > 0) usleep (gap * 1000);
+      double r = hcsr04_read_one (hcsr04);
+      if (r > 0) d[good++] = r;
+      }
+    hcsr04_uninit (hcsr04);
 
-#define PIN_SOUND 17
-#define PIN_ECHO 27 
+    if (good > 0)
+      {
+      qsort (d, good, sizeof (double), main_compare_double);
+      sample.status = HCSR04_SAMPLE_OK;
+      sample.raw = d[good / 2];
+      sample.filtered = sample.raw;
+      }
+    else
+      {
+      sample.status = HCSR04_SAMPLE_NO_RISE;
+      sample.raw = -1.0;
+      sample.filtered = -1.0;
+      ret = 2;
+      }
+    output_sample (output, i, hcsr04, &sample);
+    }
+  free (d);
+  output_destroy (output);
+  return ret;
+  }
+
+/*============================================================================
+
+  main_log_name
+
+  Work out the log file name for a sensor. With more than one sensor,
+  each needs its own file. The caller must free the result.
+
+============================================================================*/
+static char *main_log_name (const Options *o, int i)
+  {
+  char *name;
+  if (o->sensors_count == 1)
+    name = strdup (o->log_file);
+  else
+    asprintf (&name, "%s-%d-%d", o->log_file, o->sound_pins[i],
+      o->echo_pins[i]);
+  return name;
+  }
+
+/*============================================================================
+
+  main_setup_groups
+
+  Make a HCSR04Group for each set of sensors that share a trigger pin,
+  and take their HCSR04 objects from it. Sensors that can't be measured
+  that way -- simulated or replayed ones, or in one-shot mode -- are 
+  left alone.
+
+============================================================================*/
+static void main_setup_groups (Setup *setup)
+  {
+  const Options *o = &setup->options;
+  if (o->backend != MAIN_BACKEND_SYSFS || o->once) return;
+  for (int i = 0; i < o->sensors_count; i++)
+    {
+    if (setup->sensors[i].group) continue;
+    int members[MAIN_MAX_SENSORS];
+    int echoes[MAIN_MAX_SENSORS];
+    int count = 0;
+    for (int j = i; j < o->sensors_count; j++)
+      {
+      if (o->sound_pins[j] != o->sound_pins[i]) continue;
+      members[count] = j;
+      echoes[count++] = o->echo_pins[j];
+      }
+    if (count < 2) continue;
+    HCSR04Group *group = hcsr04group_create (o->sound_pins[i], echoes, 
+      count, o->cycle_msec, o->smoothing);
+    hcsr04group_set_trigger_mode (group, o->trigger_mode, o->pulse_usec);
+    hcsr04group_set_adaptive (group, o->adaptive);
+    hcsr04group_set_scheduling (group, o->priority, o->cpu);
+    hcsr04group_set_keep_exported (group, o->keep_exported);
+    setup->groups[setup->groups_count++] = group;
+    for (int k = 0; k < count; k++)
+      {
+      Sensor *s = &setup->sensors[members[k]];
+      s->group = group;
+      s->hcsr04 = hcsr04group_get_sensor (group, k);
+      }
+    }
+  }
+
+/*============================================================================
+
+  main_setup_sensor
+
+  Create sensor number i, unless its group has, and everything attached
+  to it, but don't start it. Returns FALSE, and fills in error, if 
+  anything can't be set up; whatever was set up is cleaned up by 
+  main_cleanup_sensor().
+
+============================================================================*/
+static BOOL main_setup_sensor (const Options *o, int i, Sensor *s,
+      char **error)
+  {
+  int cycle = o->backend == MAIN_BACKEND_REPLAY ? 0 : o->cycle_msec;
+  if (!s->hcsr04)
+    s->hcsr04 = hcsr04_create (o->sound_pins[i], o->echo_pins[i], cycle,
+      o->smoothing);
+  hcsr04_set_filter (s->hcsr04, o->filter, o->window);
+  hcsr04_set_adaptive (s->hcsr04, o->adaptive);
+  hcsr04_set_pipelined (s->hcsr04, o->pipelined);
+  hcsr04_set_scheduling (s->hcsr04, o->priority, o->cpu);
+  hcsr04_set_instrumented (s->hcsr04, o->instrumented);
+  hcsr04_set_keep_exported (s->hcsr04, o->keep_exported);
+  hcsr04_set_trigger_mode (s->hcsr04, o->trigger_mode, o->pulse_usec);
+
+  if (o->backend == MAIN_BACKEND_REPLAY)
+    {
+    s->replay = replay_create (o->replay_file, !o->fast);
+    if (!replay_init (s->replay, s->hcsr04, error)) return FALSE;
+    }
+  else if (o->backend == MAIN_BACKEND_SIM)
+    {
+    s->sim_distance = o->sim_distance;
+    s->sim_seed = (unsigned)(o->sound_pins[i] * 1000 + o->echo_pins[i]);
+    hcsr04_set_simulator (s->hcsr04, main_simulate, s);
+    }
+
+  if (o->log_file)
+    {
+    // Start logging before the sensor, so as not to miss any samples
+    char *name = main_log_name (o, i);
+    s->log = samplelog_create (name);
+    free (name);
+    if (!samplelog_init (s->log, s->hcsr04, error)) return FALSE;
+    }
+
+  if (o->store_dir)
+    {
+    char prefix[32];
+    snprintf (prefix, sizeof (prefix), "hcsr04-%d-%d", o->sound_pins[i],
+      o->echo_pins[i]);
+    s->store = compstore_create (o->store_dir, prefix, 0, 0);
+    if (!compstore_init (s->store, s->hcsr04, error)) return FALSE;
+    }
+
+  if (!o->socket_path && o->rate == 0)
+    {
+    s->ring = samplering_create (PRINT_RING_SIZE);
+    if (!s->ring)
+      {
+      asprintf (error, "Can't create sample queue: %s", strerror (errno));
+      return FALSE;
+      }
+    hcsr04_add_sample_callback (s->hcsr04, samplering_sample_callback,
+      s->ring);
+    }
+  return TRUE;
+  }
+
+/*============================================================================
+
+  main_cleanup_sensor
+
+  Stop the sensor, if it was started, and clean up everything attached
+  to it, in the right order. A sensor in a group must have been stopped
+  already, by stopping the group.
+
+============================================================================*/
+static void main_cleanup_sensor (Sensor *s)
+  {
+  if (!s->hcsr04) return;
+  if (!s->group) hcsr04_uninit (s->hcsr04);
+  compstore_destroy (s->store);
+  samplelog_destroy (s->log);
+  replay_destroy (s->replay);
+  if (!s->group) hcsr04_destroy (s->hcsr04);
+  samplering_destroy (s->ring);
+  }
 
 /*============================================================================
 
@@ -30,28 +965,102 @@
 ============================================================================*/
 int main (int argc, char **argv)
   {
-  argc = argc; argv = argv; // Suppress warnings
+  Setup setup;
+  memset (&setup, 0, sizeof (setup));
+  Options *o = &setup.options;
+  Sensor *sensors = setup.sensors;
+  if (!main_parse_options (argc, argv, o)) return 1;
 
-  // Create the HCSR04 object with the specified pins, cycle time, and
-  //  smoothing factor
-  HCSR04 *hcsr04 = hcsr04_create (PIN_SOUND, PIN_ECHO, 
-     4 * HCSR04_MIN_CYCLE, 0.5);
+  if (o->mlock && mlockall (MCL_CURRENT | MCL_FUTURE) != 0)
+    {
+    fprintf (stderr, "Can't lock memory: %s\n", strerror (errno));
+    return 1;
+    }
+
+  // SIGUSR1 is handled only by the dump thread. It must be blocked
+  //  before any other thread starts, so that they all inherit the mask.
+  sigset_t usr1;
+  sigemptyset (&usr1);
+  sigaddset (&usr1, SIGUSR1);
+  pthread_sigmask (SIG_BLOCK, &usr1, NULL);
+
+  stop_fd = eventfd (0, EFD_CLOEXEC);
+  signal (SIGINT, main_stop);
+  signal (SIGTERM, main_stop);
+
+  int ret = 0;
   char *error = NULL;
-  if (hcsr04_init (hcsr04, &error))
+  main_setup_groups (&setup);
+  for (int i = 0; i < o->sensors_count && ret == 0; i++)
     {
-    while (TRUE)
+    if (!main_setup_sensor (o, i, &sensors[i], &error))
       {
-      if (hcsr04_is_distance_valid (hcsr04))
-        printf ("%.2f\n", hcsr04_get_distance (hcsr04));
-      else
-        printf ("No data\n"); 
-      usleep (500000);
+      fprintf (stderr, "Can't set up sensor %d:%d: %s\n", o->sound_pins[i],
+        o->echo_pins[i], error);
+      free (error);
+      ret = 1;
       }
     }
-  else
+
+  Metrics *metrics = NULL;
+  if (ret == 0 && o->metrics_file)
+    {
+    metrics = metrics_create (o->metrics_file, 0);
+    for (int i = 0; i < o->sensors_count; i++)
+      metrics_add_sensor (metrics, sensors[i].hcsr04);
+    if (!metrics_init (metrics, &error))
+      {
+      fprintf (stderr, "Can't start metrics: %s\n", error);
+      free (error);
+      ret = 1;
+      }
+    }
+
+  for (int i = 0; i < o->sensors_count && ret == 0 && !o->once; i++)
     {
-    fprintf (stderr, "Can't set up HC-SR04: %s", error);
-    free (error); 
+    if (!sensors[i].group && !hcsr04_init (sensors[i].hcsr04, &error))
+      {
+      fprintf (stderr, "Can't set up HC-SR04 %d:%d: %s\n",
+        o->sound_pins[i], o->echo_pins[i], error);
+      free (error);
+      ret = 1;
+      }
     }
+
+  for (int i = 0; i < setup.groups_count && ret == 0; i++)
+    {
+    if (!hcsr04group_init (setup.groups[i], &error))
+      {
+      fprintf (stderr, "Can't set up HC-SR04 group on GPIO %d: %s\n",
+        hcsr04_get_sound_pin (hcsr04group_get_sensor (setup.groups[i], 0)),
+        error);
+      free (error);
+      ret = 1;
+      }
+    }
+
+  if (ret == 0 && o->once)
+    ret = main_once (o, sensors);
+  else if (ret == 0)
+    {
+    pthread_t dump_thread;
+    pthread_create (&dump_thread, NULL, main_dump_phases, &setup);
+    if (o->socket_path)
+      ret = main_serve (sensors, o->sensors_count, o->socket_path);
+    else
+      main_print (o, sensors);
+    pthread_cancel (dump_thread);
+    pthread_join (dump_thread, NULL);
+    }
+
+  metrics_destroy (metrics);
+  for (int i = 0; i < setup.groups_count; i++)
+    hcsr04group_uninit (setup.groups[i]);
+  for (int i = 0; i < o->sensors_count; i++)
+    main_cleanup_sensor (&sensors[i]);
+  for (int i = 0; i < setup.groups_count; i++)
+    hcsr04group_destroy (setup.groups[i]);
+  close (stop_fd);
+  return ret;
   }
 
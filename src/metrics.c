@@ -0,0 +1,402 @@
+/*==========================================================================
+
+    metrics.c
+
+    This "class" writes a Prometheus text file with the counters and
+    phase histograms of a set of HCSR04 sensors. All the work is done in
+    its own thread. The HCSR04 lock is only held while the counters, or
+    one histogram at a time, are copied, and the text is rendered into a
+    buffer that is allocated once, so the measurement threads are not
+    held up by formatting or file I/O.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "defs.h"
+#include "hcsr04.h"
+#include "histo.h"
+#include "metrics.h"
+
+// Initial buffer size for each sensor. It is enlarged if it ever turns
+//  out to be too small.
+#define BUFFER_PER_SENSOR 16384
+
+// Upper bounds of the exported histogram buckets, in usec. These are
+//  coarser than the HCSR04's own histograms, to keep the file small.
+static const int64_t bucket_bounds[] =
+  {
+  10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+  100000, 250000, 500000, 1000000
+  };
+#define BUCKET_BOUNDS (int)(sizeof (bucket_bounds) / sizeof (bucket_bounds[0]))
+
+struct _Metrics
+  {
+  char *filename;
+  char *tmp_filename;
+  int interval_msec;
+  HCSR04 *sensors[METRICS_MAX_SENSORS];
+  int sensors_count;
+  pthread_t pthread;
+  BOOL running;
+  int stop_fd;       // eventfd to stop the thread
+  // Everything below is only used by the thread, once started
+  HCSR04Counters counters[METRICS_MAX_SENSORS];
+  HCSR04Histogram histogram;
+  char *buffer;
+  size_t buffer_size;
+  size_t len;
+  BOOL overflow;     // The last render did not fit in the buffer
+  };
+
+/*============================================================================
+  metrics_create
+============================================================================*/
+Metrics *metrics_create (const char *filename, int interval_msec)
+  {
+  assert (filename != NULL);
+  Metrics *self = malloc (sizeof (Metrics));
+  memset (self, 0, sizeof (Metrics));
+  self->filename = strdup (filename);
+  asprintf (&self->tmp_filename, "%s.tmp", filename);
+  self->interval_msec = interval_msec > 0 ? interval_msec
+    : METRICS_INTERVAL_MSEC;
+  self->stop_fd = -1;
+  return self;
+  }
+
+/*============================================================================
+  metrics_destroy
+============================================================================*/
+void metrics_destroy (Metrics *self)
+  {
+  if (self)
+    {
+    metrics_uninit (self);
+    free (self->filename);
+    free (self->tmp_filename);
+    free (self);
+    }
+  }
+
+/*============================================================================
+  metrics_add_sensor
+============================================================================*/
+BOOL metrics_add_sensor (Metrics *self, HCSR04 *hcsr04)
+  {
+  assert (self != NULL);
+  assert (hcsr04 != NULL);
+  assert (!self->running);
+  if (self->sensors_count == METRICS_MAX_SENSORS) return FALSE;
+  self->sensors[self->sensors_count++] = hcsr04;
+  return TRUE;
+  }
+
+/*============================================================================
+
+  metrics_append
+
+  Append formatted text to the buffer. If it doesn't fit, the overflow
+  flag is set, and the rest of the rendering is wasted, but harmless.
+
+============================================================================*/
+static void metrics_append (Metrics *self, const char *fmt, ...)
+  {
+  if (self->overflow) return;
+  va_list ap;
+  va_start (ap, fmt);
+  size_t room = self->buffer_size - self->len;
+  int n = vsnprintf (self->buffer + self->len, room, fmt, ap);
+  va_end (ap);
+  if (n < 0 || (size_t)n >= room)
+    self->overflow = TRUE;
+  else
+    self->len += n;
+  }
+
+/*============================================================================
+
+  metrics_family
+
+  Write the HELP and TYPE lines for a metric, then the value for each
+  sensor. The value is taken from the counters at the given offset; it
+  is a uint64_t unless is_int is set.
+
+============================================================================*/
+static void metrics_family (Metrics *self, const char *name,
+      const char *type, const char *help, size_t offset, BOOL is_int)
+  {
+  metrics_append (self, "# HELP %s %s\n# TYPE %s %s\n", name, help,
+    name, type);
+  for (int i = 0; i < self->sensors_count; i++)
+    {
+    const char *c = (const char *)&self->counters[i] + offset;
+    long long value = is_int ? *(const int *)c
+      : (long long)*(const uint64_t *)c;
+    metrics_append (self, "%s{sound_pin=\"%d\",echo_pin=\"%d\"} %lld\n",
+      name, hcsr04_get_sound_pin (self->sensors[i]),
+      hcsr04_get_echo_pin (self->sensors[i]), value);
+    }
+  }
+
+/*============================================================================
+
+  metrics_timeouts
+
+  The invalid samples, with the cause as a label
+
+============================================================================*/
+static void metrics_timeouts (Metrics *self)
+  {
+  const char *name = "hcsr04_timeouts_total";
+  metrics_append (self, "# HELP %s Cycles without a valid echo, "
+    "by cause.\n# TYPE %s counter\n", name, name);
+  for (int i = 0; i < self->sensors_count; i++)
+    {
+    const HCSR04Counters *c = &self->counters[i];
+    int sound = hcsr04_get_sound_pin (self->sensors[i]);
+    int echo = hcsr04_get_echo_pin (self->sensors[i]);
+    const char *fmt =
+      "%s{sound_pin=\"%d\",echo_pin=\"%d\",cause=\"%s\"} %llu\n";
+    metrics_append (self, fmt, name, sound, echo, "no_rise",
+      (unsigned long long)c->no_rise);
+    metrics_append (self, fmt, name, sound, echo, "no_fall",
+      (unsigned long long)c->no_fall);
+    metrics_append (self, fmt, name, sound, echo, "out_of_range",
+      (unsigned long long)c->out_of_range);
+    }
+  }
+
+/*============================================================================
+
+  metrics_histograms
+
+  The phase histograms, in seconds. The HCSR04's histogram buckets are
+  much finer than the exported ones, and each is counted in the first
+  exported bucket that its upper limit fits in.
+
+============================================================================*/
+static void metrics_histograms (Metrics *self)
+  {
+  const char *name = "hcsr04_phase_seconds";
+  metrics_append (self, "# HELP %s Time taken by each phase of the "
+    "measurement cycle.\n# TYPE %s histogram\n", name, name);
+  for (int i = 0; i < self->sensors_count; i++)
+    {
+    HCSR04 *hcsr04 = self->sensors[i];
+    int sound = hcsr04_get_sound_pin (hcsr04);
+    int echo = hcsr04_get_echo_pin (hcsr04);
+    for (int p = 0; p < HCSR04_PHASE_COUNT; p++)
+      {
+      const HCSR04Histogram *h = &self->histogram;
+      hcsr04_get_phase_histogram (hcsr04, p, &self->histogram);
+      const char *phase = hcsr04_get_phase_name (p);
+      uint64_t cumulative = 0;
+      int b = 0;
+      for (int j = 0; j < BUCKET_BOUNDS; j++)
+        {
+        for (; b < HISTO_BUCKETS
+               && histo_bucket_limit (b) <= bucket_bounds[j]; b++)
+          cumulative += h->counts[b];
+        metrics_append (self, "%s_bucket{sound_pin=\"%d\",echo_pin=\"%d\","
+          "phase=\"%s\",le=\"%g\"} %llu\n", name, sound, echo, phase,
+          bucket_bounds[j] / 1e6, (unsigned long long)cumulative);
+        }
+      metrics_append (self, "%s_bucket{sound_pin=\"%d\",echo_pin=\"%d\","
+        "phase=\"%s\",le=\"+Inf\"} %llu\n", name, sound, echo, phase,
+        (unsigned long long)h->count);
+      metrics_append (self, "%s_sum{sound_pin=\"%d\",echo_pin=\"%d\","
+        "phase=\"%s\"} %g\n", name, sound, echo, phase, h->total / 1e6);
+      metrics_append (self, "%s_count{sound_pin=\"%d\",echo_pin=\"%d\","
+        "phase=\"%s\"} %llu\n", name, sound, echo, phase,
+        (unsigned long long)h->count);
+      }
+    }
+  }
+
+/*============================================================================
+  metrics_render
+============================================================================*/
+static void metrics_render (Metrics *self)
+  {
+  self->len = 0;
+  self->overflow = FALSE;
+  for (int i = 0; i < self->sensors_count; i++)
+    hcsr04_get_counters (self->sensors[i], &self->counters[i]);
+
+  metrics_family (self, "hcsr04_cycles_total", "counter",
+    "Measurement cycles.", offsetof (HCSR04Counters, cycles), FALSE);
+  metrics_family (self, "hcsr04_good_samples_total", "counter",
+    "Cycles with a valid echo.", offsetof (HCSR04Counters, good), FALSE);
+  metrics_timeouts (self);
+  metrics_family (self, "hcsr04_cycle_overruns_total", "counter",
+    "Cycles that took longer than the cycle time.",
+    offsetof (HCSR04Counters, overruns), FALSE);
+  metrics_family (self, "hcsr04_trigger_pulses_total", "counter",
+    "Trigger pulses sent.", offsetof (HCSR04Counters, pulses), FALSE);
+  metrics_family (self, "hcsr04_trigger_pulse_microseconds_total", "counter",
+    "Total measured width of the trigger pulses.",
+    offsetof (HCSR04Counters, pulse_usec_total), FALSE);
+  metrics_family (self, "hcsr04_trigger_pulse_max_microseconds", "gauge",
+    "Longest measured trigger pulse.",
+    offsetof (HCSR04Counters, pulse_usec_max), FALSE);
+  metrics_family (self, "hcsr04_long_trigger_pulses_total", "counter",
+    "Trigger pulses longer than asked for by more than "
+    "HCSR04_PULSE_SLACK.", offsetof (HCSR04Counters, long_pulses), FALSE);
+  metrics_family (self, "hcsr04_pipeline_dropped_total", "counter",
+    "Measurements dropped because the processing thread fell behind.",
+    offsetof (HCSR04Counters, pipeline_dropped), FALSE);
+  metrics_family (self, "hcsr04_requests_total", "counter",
+    "On-demand measurement requests answered.",
+    offsetof (HCSR04Counters, requests), FALSE);
+  metrics_family (self, "hcsr04_request_pings_total", "counter",
+    "Measurements that answered on-demand requests.",
+    offsetof (HCSR04Counters, request_pings), FALSE);
+  metrics_family (self, "hcsr04_good_count", "gauge",
+    "Recent valid samples; the distance is valid at "
+    "HCSR04_VALID_SAMPLES.", offsetof (HCSR04Counters, good_count), TRUE);
+
+  const char *name = "hcsr04_sampler_cpu_seconds_total";
+  metrics_append (self, "# HELP %s CPU time used by the measurement "
+    "thread.\n# TYPE %s counter\n", name, name);
+  for (int i = 0; i < self->sensors_count; i++)
+    metrics_append (self, "%s{sound_pin=\"%d\",echo_pin=\"%d\"} %.6f\n",
+      name, hcsr04_get_sound_pin (self->sensors[i]),
+      hcsr04_get_echo_pin (self->sensors[i]),
+      self->counters[i].cpu_usec / 1e6);
+
+  metrics_histograms (self);
+  }
+
+/*============================================================================
+
+  metrics_write
+
+  Render the metrics and replace the file. Returns FALSE, and sets errno,
+  if the file could not be written.
+
+============================================================================*/
+static BOOL metrics_write (Metrics *self)
+  {
+  metrics_render (self);
+  while (self->overflow)
+    {
+    self->buffer_size *= 2;
+    self->buffer = realloc (self->buffer, self->buffer_size);
+    metrics_render (self);
+    }
+
+  int fd = open (self->tmp_filename,
+    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return FALSE;
+  const char *p = self->buffer;
+  size_t len = self->len;
+  while (len > 0)
+    {
+    ssize_t n = write (fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    p += n;
+    len -= n;
+    }
+  close (fd);
+  if (len > 0 || rename (self->tmp_filename, self->filename) != 0)
+    {
+    int e = errno;
+    unlink (self->tmp_filename);
+    errno = e;
+    return FALSE;
+    }
+  return TRUE;
+  }
+
+/*============================================================================
+
+  metrics_loop
+
+  The thread that rewrites the file, every interval and once more when
+  it is stopped. Errors are ignored -- the next attempt might succeed.
+
+============================================================================*/
+static void *metrics_loop (void *arg)
+  {
+  Metrics *self = (Metrics *)arg;
+  struct pollfd fdset[1];
+  fdset[0].fd = self->stop_fd;
+  fdset[0].events = POLLIN;
+  BOOL stop = FALSE;
+  while (!stop)
+    {
+    fdset[0].revents = 0;
+    stop = poll (fdset, 1, self->interval_msec) > 0;
+    metrics_write (self);
+    }
+  return NULL;
+  }
+
+/*============================================================================
+  metrics_init
+============================================================================*/
+BOOL metrics_init (Metrics *self, char **error)
+  {
+  assert (self != NULL);
+  assert (!self->running);
+  self->buffer_size = BUFFER_PER_SENSOR * (self->sensors_count + 1);
+  self->buffer = malloc (self->buffer_size);
+
+  // Write the file once straight away, so that errors can be reported
+  if (!metrics_write (self))
+    {
+    if (error)
+      asprintf (error, "Can't write %s: %s", self->filename,
+        strerror (errno));
+    metrics_uninit (self);
+    return FALSE;
+    }
+
+  self->stop_fd = eventfd (0, EFD_CLOEXEC);
+  if (self->stop_fd >= 0
+        && pthread_create (&self->pthread, NULL, metrics_loop, self) == 0)
+    {
+    self->running = TRUE;
+    return TRUE;
+    }
+  if (error)
+    asprintf (error, "Can't start metrics thread: %s", strerror (errno));
+  metrics_uninit (self);
+  return FALSE;
+  }
+
+/*============================================================================
+  metrics_uninit
+============================================================================*/
+void metrics_uninit (Metrics *self)
+  {
+  assert (self != NULL);
+  if (self->running)
+    {
+    uint64_t one = 1;
+    write (self->stop_fd, &one, sizeof (one));
+    pthread_join (self->pthread, NULL);
+    self->running = FALSE;
+    }
+  if (self->stop_fd >= 0) close (self->stop_fd);
+  self->stop_fd = -1;
+  free (self->buffer);
+  self->buffer = NULL;
+  self->buffer_size = 0;
+  }
+
@@ -0,0 +1,55 @@
+/*============================================================================
+
+  metrics.h
+
+  Functions to export the counters and phase timings of one or more
+  HCSR04 sensors as a Prometheus text file, for the node exporter's
+  textfile collector. The file is rewritten periodically by a thread
+  of its own, and replaced atomically, so the collector never sees a
+  partial file.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include "defs.h"
+#include "hcsr04.h"
+
+// Default interval between rewrites of the file
+#define METRICS_INTERVAL_MSEC 15000
+
+// Most sensors that can be exported by one Metrics
+#define METRICS_MAX_SENSORS 16
+
+struct Metrics;
+typedef struct _Metrics Metrics;
+
+BEGIN_DECLS
+
+/** Create a Metrics that writes to the given file, which should be in
+    the textfile collector's directory, and end in ".prom". A temporary
+    file with ".tmp" appended is written first, and renamed. An interval
+    of zero means METRICS_INTERVAL_MSEC. This method only stores values,
+    and will always succeed. */
+Metrics  *metrics_create (const char *filename, int interval_msec);
+
+/** Clean up. This method implicitly calls _uninit(). */
+void      metrics_destroy (Metrics *self);
+
+/** Add a sensor to export. This must be done before _init(). Returns
+    FALSE if METRICS_MAX_SENSORS have already been added. */
+BOOL      metrics_add_sensor (Metrics *self, HCSR04 *hcsr04);
+
+/** Write the file, and start the thread that rewrites it. If the file
+    can't be written, this method fails and, if error is not NULL,
+    writes an error message to it, that the caller should free. */
+BOOL      metrics_init (Metrics *self, char **error);
+
+/** Stop the thread. The file is left in place, with the last values
+    written. */
+void      metrics_uninit (Metrics *self);
+
+END_DECLS
+
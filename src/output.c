@@ -0,0 +1,208 @@
+/*==========================================================================
+
+    output.c
+
+    This "class" formats samples into a buffer, and writes the buffer a
+    batch at a time. See output.h for the formats.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <time.h>
+#include "defs.h"
+#include "hcsr04.h"
+#include "server.h"
+#include "output.h"
+
+// Size of the output buffer. A batch is written early if the buffer
+//  fills up.
+#define BUFFER_SIZE 65536
+
+// Longest formatted record, in any format
+#define MAX_RECORD 256
+
+static const char *status_names[] =
+  {
+  "ok", "no_rise", "no_fall", "out_of_range"
+  };
+
+struct _Output
+  {
+  int fd;
+  OutputFormat format;
+  int sensors;
+  int batch;
+  int flush_msec;
+  BOOL header_done;  // The CSV header has been written
+  int pending;       // Records in the buffer
+  struct timespec first; // When the oldest record in the buffer was added
+  int len;
+  char buffer[BUFFER_SIZE];
+  };
+
+/*============================================================================
+  output_create
+============================================================================*/
+Output *output_create (int fd, OutputFormat format, int sensors, int batch,
+      int flush_msec)
+  {
+  Output *self = malloc (sizeof (Output));
+  memset (self, 0, sizeof (Output));
+  self->fd = fd;
+  self->format = format;
+  self->sensors = sensors;
+  self->batch = batch > 0 ? batch : OUTPUT_BATCH;
+  self->flush_msec = flush_msec > 0 ? flush_msec : OUTPUT_FLUSH_MSEC;
+  return self;
+  }
+
+/*============================================================================
+  output_destroy
+============================================================================*/
+void output_destroy (Output *self)
+  {
+  if (self)
+    {
+    output_flush (self);
+    free (self);
+    }
+  }
+
+/*============================================================================
+  output_flush
+============================================================================*/
+void output_flush (Output *self)
+  {
+  assert (self != NULL);
+  const char *p = self->buffer;
+  int len = self->len;
+  while (len > 0)
+    {
+    ssize_t n = write (self->fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break; // E.g., the reader has gone away
+    p += n;
+    len -= n;
+    }
+  self->len = 0;
+  self->pending = 0;
+  }
+
+/*============================================================================
+  output_distance
+
+  Format a distance for CSV or JSON, where a missing value is 'none'
+
+============================================================================*/
+static const char *output_distance (char *buff, size_t size, double d,
+      const char *none)
+  {
+  if (d < 0) return none;
+  snprintf (buff, size, "%.4f", d);
+  return buff;
+  }
+
+/*============================================================================
+  output_sample
+============================================================================*/
+void output_sample (Output *self, int sensor, const HCSR04 *hcsr04,
+      const HCSR04Sample *sample)
+  {
+  assert (self != NULL);
+  assert (sample != NULL);
+  if (self->len > BUFFER_SIZE - MAX_RECORD)
+    output_flush (self);
+  if (self->pending == 0)
+    clock_gettime (CLOCK_MONOTONIC, &self->first);
+
+  char *p = self->buffer + self->len;
+  int room = BUFFER_SIZE - self->len;
+  int sound = hcsr04_get_sound_pin (hcsr04);
+  int echo = hcsr04_get_echo_pin (hcsr04);
+  const char *status = sample->status >= 0 && sample->status <= 3
+    ? status_names[sample->status] : "unknown";
+  char raw[32], filtered[32];
+  int n = 0;
+  switch (self->format)
+    {
+    case OUTPUT_CSV:
+      if (!self->header_done)
+        {
+        n = snprintf (p, room, "time_usec,sensor,seq,status,raw,filtered\n");
+        self->header_done = TRUE;
+        }
+      n += snprintf (p + n, room - n, "%lld,%d:%d,%u,%s,%s,%s\n",
+        (long long)sample->time_usec, sound, echo, sample->seq, status,
+        output_distance (raw, sizeof (raw), sample->raw, ""),
+        output_distance (filtered, sizeof (filtered), sample->filtered, ""));
+      break;
+    case OUTPUT_JSONL:
+      n = snprintf (p, room, "{\"time_usec\":%lld,\"sensor\":\"%d:%d\","
+        "\"seq\":%u,\"status\":\"%s\",\"raw\":%s,\"filtered\":%s}\n",
+        (long long)sample->time_usec, sound, echo, sample->seq, status,
+        output_distance (raw, sizeof (raw), sample->raw, "null"),
+        output_distance (filtered, sizeof (filtered), sample->filtered,
+          "null"));
+      break;
+    case OUTPUT_BINARY:
+      {
+      HCSR04StreamRecord r;
+      r.sensor = sensor;
+      r.reserved = 0;
+      r.sample = *sample;
+      memcpy (p, &r, sizeof (r));
+      n = sizeof (r);
+      }
+      break;
+    default:
+      if (self->sensors > 1)
+        n = snprintf (p, room, "%d:%d ", sound, echo);
+      if (sample->filtered >= 0)
+        n += snprintf (p + n, room - n, "%.2f\n", sample->filtered);
+      else
+        n += snprintf (p + n, room - n, "No data\n");
+      break;
+    }
+  self->len += n;
+  if (++self->pending >= self->batch)
+    output_flush (self);
+  }
+
+/*============================================================================
+  output_get_timeout
+============================================================================*/
+int output_get_timeout (const Output *self)
+  {
+  assert (self != NULL);
+  if (self->pending == 0) return -1;
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  long waited = (now.tv_sec - self->first.tv_sec) * 1000
+    + (now.tv_nsec - self->first.tv_nsec) / 1000000;
+  return waited >= self->flush_msec ? 0 : (int)(self->flush_msec - waited);
+  }
+
+/*============================================================================
+  output_parse_format
+============================================================================*/
+BOOL output_parse_format (const char *name, OutputFormat *format)
+  {
+  static const char *names[] = { "text", "csv", "jsonl", "binary" };
+  for (int i = 0; i < 4; i++)
+    {
+    if (strcmp (name, names[i]) == 0)
+      {
+      *format = (OutputFormat)i;
+      return TRUE;
+      }
+    }
+  return FALSE;
+  }
+
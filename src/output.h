@@ -0,0 +1,78 @@
+/*============================================================================
+
+  output.h
+
+  Functions to write samples to a file descriptor, usually stdout, in a
+  choice of formats. Records are collected in a buffer, and written a
+  batch at a time, so that a program reading the output costs one
+  system call per batch rather than one per line.
+
+  Formats:
+
+  OUTPUT_TEXT: the filtered distance, "%.2f", or "No data". With more
+    than one sensor, each line starts with "TRIG:ECHO ".
+  OUTPUT_CSV: a header line, then one line per sample --
+    time_usec,sensor,seq,status,raw,filtered. sensor is "TRIG:ECHO";
+    raw and filtered are metres, or empty if there is no value.
+  OUTPUT_JSONL: one JSON object per line, with the same fields. Missing
+    distances are null.
+  OUTPUT_BINARY: HCSR04StreamRecord structures, as sent by the server,
+    with sensor being the index of the sensor.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include "defs.h"
+#include "hcsr04.h"
+
+// Default number of records in a batch, and the longest time a record
+//  waits to be written
+#define OUTPUT_BATCH 64
+#define OUTPUT_FLUSH_MSEC 1000
+
+typedef enum
+  {
+  OUTPUT_TEXT = 0,
+  OUTPUT_CSV = 1,
+  OUTPUT_JSONL = 2,
+  OUTPUT_BINARY = 3
+  } OutputFormat;
+
+struct Output;
+typedef struct _Output Output;
+
+BEGIN_DECLS
+
+/** Create an Output that writes to fd. sensors is the number of sensors
+    whose samples will be written. A batch is written whenever batch
+    records are waiting, or the oldest has waited flush_msec; zero means
+    the default for either. A batch of 1 writes every record at once.
+    This method only stores values, and will always succeed. */
+Output   *output_create (int fd, OutputFormat format, int sensors,
+            int batch, int flush_msec);
+
+/** Write anything waiting, and free the Output. The descriptor is not
+    closed. */
+void      output_destroy (Output *self);
+
+/** Add a sample, from the sensor with the given index. */
+void      output_sample (Output *self, int sensor, const HCSR04 *hcsr04,
+            const HCSR04Sample *sample);
+
+/** Write anything waiting. */
+void      output_flush (Output *self);
+
+/** Get the number of msec until the waiting records must be written,
+    or -1 if there are none. A caller that waits for samples should wait
+    no longer than this, and then call output_flush(). */
+int       output_get_timeout (const Output *self);
+
+/** Parse a format name -- "text", "csv", "jsonl", or "binary". Returns
+    FALSE if the name is not known. */
+BOOL      output_parse_format (const char *name, OutputFormat *format);
+
+END_DECLS
+
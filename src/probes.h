@@ -0,0 +1,57 @@
+/*============================================================================
+
+  probes.h
+
+  Static tracepoints (USDT probes) on the measurement path. When built
+  with "make USDT=1", these become SystemTap/DTrace-style probes in the
+  "hcsr04" provider, which bpftrace and perf can attach to at run time,
+  for example:
+
+    bpftrace -e 'usdt:./hcsr04:hcsr04:fall { printf ("%d\n", arg2); }'
+
+  A probe that nothing is attached to is a single no-op instruction.
+  Otherwise, the macros only mention their arguments, so that variables
+  kept just for a probe don't cause warnings; no code is generated.
+  Arguments are all integers, so distances are in micrometres. Building
+  with USDT=1 needs sys/sdt.h, which is in the systemtap-sdt-dev package
+  on Debian.
+
+  Probes, and their arguments:
+
+    trigger  (echo_pin, time_usec)            trigger pulse sent
+    rise     (echo_pin, rise_usec)            echo rising edge seen
+    fall     (echo_pin, fall_usec, width_usec) echo falling edge seen
+    timeout  (echo_pin, status)               no valid echo this cycle
+    filter   (echo_pin, raw_um, filtered_um, good_count)
+    publish  (echo_pin, seq, time_usec, status) sample delivered
+    gpio_wake (pin, fired)                    poll() on a pin returned
+    gpio_get (pin, bytes, value)              pin value read
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#ifdef HCSR04_USDT
+
+#include <sys/sdt.h>
+
+#define HCSR04_PROBE2(name, a, b) \
+  DTRACE_PROBE2 (hcsr04, name, a, b)
+#define HCSR04_PROBE3(name, a, b, c) \
+  DTRACE_PROBE3 (hcsr04, name, a, b, c)
+#define HCSR04_PROBE4(name, a, b, c, d) \
+  DTRACE_PROBE4 (hcsr04, name, a, b, c, d)
+
+#else
+
+#define HCSR04_PROBE2(name, a, b) \
+  do { (void)(a); (void)(b); } while (0)
+#define HCSR04_PROBE3(name, a, b, c) \
+  do { (void)(a); (void)(b); (void)(c); } while (0)
+#define HCSR04_PROBE4(name, a, b, c, d) \
+  do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+
+#endif
+
@@ -0,0 +1,186 @@
+/*==========================================================================
+  
+    replay.c
+
+    This "class" acts as a simulator for a HCSR04, taking the echo edge 
+    times from a log that has been memory-mapped by a LogReader.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include "defs.h" 
+#include "hcsr04.h" 
+#include "logreader.h" 
+#include "replay.h" 
+
+struct _Replay
+  {
+  char *filename;
+  BOOL realtime;
+  LogReader *reader;
+  const HCSR04Sample *samples;
+  size_t count;
+  volatile size_t position;   // Index of the next sample to replay
+  int done_fd;                // eventfd signalled at the end of the log
+  // In real time, the monotonic time at which the sample at 'position'
+  //  should be replayed
+  struct timespec due;
+  };
+
+/*============================================================================
+  replay_create
+============================================================================*/
+Replay *replay_create (const char *filename, BOOL realtime)
+  {
+  assert (filename != NULL);
+  Replay *self = malloc (sizeof (Replay));
+  memset (self, 0, sizeof (Replay));
+  self->filename = strdup (filename);
+  self->realtime = realtime;
+  self->done_fd = -1;
+  return self;
+  }
+
+/*============================================================================
+  replay_destroy
+============================================================================*/
+void replay_destroy (Replay *self)
+  {
+  if (self)
+    {
+    replay_uninit (self);
+    free (self->filename);
+    free (self);
+    }
+  }
+
+/*============================================================================
+
+  replay_wait
+
+  In real time, wait until the next sample is due, and work out when the
+  one after that will be due
+
+============================================================================*/
+static void replay_wait (Replay *self)
+  {
+  size_t i = self->position;
+  if (i == 0)
+    {
+    clock_gettime (CLOCK_MONOTONIC, &self->due);
+    return;
+    }
+  int64_t gap = self->samples[i].time_usec - self->samples[i - 1].time_usec;
+  if (gap < 0) gap = 0;
+  if (gap > REPLAY_MAX_GAP_USEC) gap = REPLAY_MAX_GAP_USEC;
+  self->due.tv_nsec += (gap % 1000000) * 1000;
+  self->due.tv_sec += gap / 1000000 + self->due.tv_nsec / 1000000000;
+  self->due.tv_nsec %= 1000000000;
+  while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &self->due, NULL)
+           == EINTR);
+  }
+
+/*============================================================================
+
+  replay_simulator
+
+  The HCSR04Simulator function
+
+============================================================================*/
+static BOOL replay_simulator (void *user_data, HCSR04Sample *sample)
+  {
+  Replay *self = (Replay *)user_data;
+  if (self->position >= self->count) 
+    return FALSE;
+  if (self->realtime)
+    replay_wait (self);
+  const HCSR04Sample *s = &self->samples[self->position];
+  sample->time_usec = s->time_usec;
+  sample->rise_usec = s->rise_usec;
+  sample->fall_usec = s->fall_usec;
+  self->position++;
+  if (self->position == self->count)
+    {
+    uint64_t one = 1;
+    write (self->done_fd, &one, sizeof (one));
+    }
+  return TRUE;
+  }
+
+/*============================================================================
+  replay_init
+============================================================================*/
+BOOL replay_init (Replay *self, HCSR04 *hcsr04, char **error)
+  {
+  assert (self != NULL);
+  assert (self->reader == NULL);
+  self->reader = logreader_create (self->filename);
+  if (!logreader_init (self->reader, error))
+    {
+    logreader_destroy (self->reader);
+    self->reader = NULL;
+    return FALSE;
+    }
+  self->samples = logreader_get_samples (self->reader, &self->count);
+  self->position = 0;
+  self->done_fd = eventfd (self->count == 0 ? 1 : 0, 
+    EFD_NONBLOCK | EFD_CLOEXEC);
+  hcsr04_set_simulator (hcsr04, replay_simulator, self);
+  return TRUE;
+  }
+
+/*============================================================================
+  replay_uninit
+============================================================================*/
+void replay_uninit (Replay *self)
+  {
+  assert (self != NULL);
+  logreader_destroy (self->reader);
+  self->reader = NULL;
+  self->samples = NULL;
+  self->count = 0;
+  if (self->done_fd >= 0) close (self->done_fd);
+  self->done_fd = -1;
+  }
+
+/*============================================================================
+  replay_get_done_fd
+============================================================================*/
+int replay_get_done_fd (const Replay *self)
+  {
+  return self->done_fd;
+  }
+
+/*============================================================================
+  replay_is_finished
+============================================================================*/
+BOOL replay_is_finished (const Replay *self)
+  {
+  return self->position >= self->count;
+  }
+
+/*============================================================================
+  replay_get_position
+============================================================================*/
+size_t replay_get_position (const Replay *self)
+  {
+  return self->position;
+  }
+
+/*============================================================================
+  replay_get_count
+============================================================================*/
+size_t replay_get_count (const Replay *self)
+  {
+  return self->count;
+  }
+
@@ -0,0 +1,63 @@
+/*============================================================================
+  
+  replay.h
+
+  Functions to feed the echo edges recorded in a binary sample log back
+  through a HCSR04, in place of the hardware. Every recorded sample is
+  classified and filtered again, and delivered to zones, reflexes, and
+  sample callbacks, just as it was originally -- with its original
+  timestamp. The replay can run in real time, keeping the recorded 
+  spacing between samples, or as fast as possible.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include "defs.h"
+#include "hcsr04.h"
+
+// In real time, gaps between samples longer than this, such as where
+//  a log was stopped and restarted, are shortened to this
+#define REPLAY_MAX_GAP_USEC 1000000
+
+struct Replay;
+typedef struct _Replay Replay;
+
+BEGIN_DECLS
+
+/** Create a Replay for a log file. If realtime is TRUE, samples are
+    replayed at the rate they were recorded; otherwise as fast as the
+    HCSR04 will take them. This method only stores values, and will 
+    always succeed. */
+Replay   *replay_create (const char *filename, BOOL realtime);
+
+/** Clean up. This method implicitly calls _uninit(). */
+void      replay_destroy (Replay *self);
+
+/** Open the log, and make it the source of the HCSR04's measurements.
+    This must be called before hcsr04_init(), and the HCSR04 should have
+    been created with a cycle time of zero, so that the replay sets the 
+    pace. If this method fails, and error is not NULL, it is written 
+    with an error message that the caller should free. */
+BOOL      replay_init (Replay *self, HCSR04 *hcsr04, char **error);
+
+/** Close the log. The HCSR04 must be uninitialized first. */
+void      replay_uninit (Replay *self);
+
+/** Get a file descriptor that becomes readable when every sample has
+    been replayed. */
+int       replay_get_done_fd (const Replay *self);
+
+/** Returns TRUE if every sample has been replayed. */
+BOOL      replay_is_finished (const Replay *self);
+
+/** Get the number of samples replayed so far, and the total number in
+    the log. */
+size_t    replay_get_position (const Replay *self);
+size_t    replay_get_count (const Replay *self);
+
+END_DECLS
+
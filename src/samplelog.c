@@ -0,0 +1,317 @@
+/*==========================================================================
+  
+    samplelog.c
+
+    This "class" records samples in a binary log file. The HCSR04 thread
+    only has to push each sample into a SampleRing; a separate thread 
+    takes them out, collects them in a buffer, and writes the buffer when
+    it is full, or has been waiting for SAMPLELOG_FLUSH_MSEC.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include "defs.h" 
+#include "hcsr04.h" 
+#include "logformat.h" 
+#include "samplering.h" 
+#include "samplelog.h" 
+
+// Size of the queue between the HCSR04 thread and the writer. This only
+//  needs to cover the time it takes to write one batch.
+#define RING_SIZE 1024
+
+struct _SampleLog
+  {
+  char *filename;
+  int fd;
+  HCSR04 *hcsr04;
+  SampleRing *ring;
+  pthread_t pthread;
+  BOOL running;
+  int stop_fd;         // eventfd to stop the writer thread
+  int count;           // Number of samples in the batch
+  struct timespec first; // When the oldest sample in the batch was added
+  HCSR04Sample batch[SAMPLELOG_BATCH];
+  };
+
+/*============================================================================
+  samplelog_create
+============================================================================*/
+SampleLog *samplelog_create (const char *filename)
+  {
+  assert (filename != NULL);
+  SampleLog *self = malloc (sizeof (SampleLog));
+  memset (self, 0, sizeof (SampleLog));
+  self->filename = strdup (filename);
+  self->fd = -1;
+  self->stop_fd = -1;
+  return self;
+  }
+
+/*============================================================================
+  samplelog_destroy
+============================================================================*/
+void samplelog_destroy (SampleLog *self)
+  {
+  if (self)
+    {
+    samplelog_uninit (self);
+    free (self->filename);
+    free (self);
+    }
+  }
+
+/*============================================================================
+
+  samplelog_flush
+
+  Write the batch. If the write fails there's nothing useful we can do
+  from this thread, so the samples are lost.
+
+============================================================================*/
+static void samplelog_flush (SampleLog *self)
+  {
+  if (self->count == 0) return;
+  size_t len = self->count * sizeof (HCSR04Sample);
+  const char *p = (const char *)self->batch;
+  while (len > 0)
+    {
+    ssize_t n = write (self->fd, p, len);
+    if (n <= 0 && errno != EINTR) break;
+    if (n > 0)
+      {
+      p += n;
+      len -= n;
+      }
+    }
+  self->count = 0;
+  }
+
+/*============================================================================
+
+  samplelog_drain
+
+  Move everything in the ring into the batch, writing the batch whenever
+  it fills up
+
+============================================================================*/
+static void samplelog_drain (SampleLog *self)
+  {
+  while (samplering_pop (self->ring, &self->batch[self->count]))
+    {
+    if (self->count == 0)
+      clock_gettime (CLOCK_MONOTONIC, &self->first);
+    self->count++;
+    if (self->count == SAMPLELOG_BATCH) 
+      samplelog_flush (self);
+    }
+  }
+
+/*============================================================================
+
+  samplelog_get_timeout
+
+  The time, in msec, until the oldest sample in the batch has been 
+  waiting SAMPLELOG_FLUSH_MSEC, for poll(). This is -1 if the batch is
+  empty, and 0 if the batch is already overdue.
+
+============================================================================*/
+static int samplelog_get_timeout (const SampleLog *self)
+  {
+  if (self->count == 0) return -1;
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  long waited = (now.tv_sec - self->first.tv_sec) * 1000
+    + (now.tv_nsec - self->first.tv_nsec) / 1000000;
+  return waited >= SAMPLELOG_FLUSH_MSEC 
+    ? 0 : (int)(SAMPLELOG_FLUSH_MSEC - waited);
+  }
+
+/*============================================================================
+
+  samplelog_loop
+
+  The writer thread
+
+============================================================================*/
+static void *samplelog_loop (void *arg)
+  {
+  SampleLog *self = (SampleLog *)arg;
+  struct pollfd fdset[2];
+  fdset[0].fd = samplering_get_fd (self->ring);
+  fdset[0].events = POLLIN;
+  fdset[1].fd = self->stop_fd;
+  fdset[1].events = POLLIN;
+  while (TRUE)
+    {
+    fdset[0].revents = 0;
+    fdset[1].revents = 0;
+    // Only use a timeout when something is waiting to be written. It 
+    //  runs from when the oldest sample arrived, so a steady stream of
+    //  samples can't keep putting the write off.
+    poll (fdset, 2, samplelog_get_timeout (self));
+    if (fdset[0].revents & POLLIN)
+      {
+      samplering_clear_fd (self->ring);
+      samplelog_drain (self);
+      }
+    if (samplelog_get_timeout (self) == 0)
+      samplelog_flush (self);
+    if (fdset[1].revents & POLLIN)
+      break;
+    }
+  samplelog_drain (self);
+  samplelog_flush (self);
+  return NULL;
+  }
+
+/*============================================================================
+
+  samplelog_open
+
+  Open the file, and write a header if it is empty, or check the header
+  if it is not.
+
+============================================================================*/
+static BOOL samplelog_open (SampleLog *self, const HCSR04 *hcsr04, 
+    char **error)
+  {
+  self->fd = open (self->filename, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 
+    0644);
+  if (self->fd < 0)
+    {
+    if (error)
+      asprintf (error, "Can't open %s: %s", self->filename, strerror (errno));
+    return FALSE;
+    }
+
+  HCSR04LogHeader h;
+  ssize_t n = pread (self->fd, &h, sizeof (h), 0);
+  if (n == 0)
+    {
+    struct timeval tv;
+    gettimeofday (&tv, NULL);
+    memset (&h, 0, sizeof (h));
+    memcpy (h.magic, HCSR04_LOG_MAGIC, sizeof (h.magic));
+    h.version = HCSR04_LOG_VERSION;
+    h.header_size = sizeof (HCSR04LogHeader);
+    h.record_size = sizeof (HCSR04Sample);
+    h.timebase = HCSR04_LOG_TIMEBASE_REALTIME;
+    h.start_time_usec = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    h.sound_pin = hcsr04_get_sound_pin (hcsr04);
+    h.echo_pin = hcsr04_get_echo_pin (hcsr04);
+    h.cycle_usec = hcsr04_get_cycle_usec (hcsr04);
+    h.smoothing = hcsr04_get_smoothing (hcsr04);
+    h.max_range = HCSR04_MAX_RANGE;
+    if (write (self->fd, &h, sizeof (h)) == sizeof (h)) return TRUE;
+    if (error)
+      asprintf (error, "Can't write %s: %s", self->filename, strerror (errno));
+    }
+  else if (n == sizeof (h) && memcmp (h.magic, HCSR04_LOG_MAGIC, 
+              sizeof (h.magic)) == 0 && h.version == HCSR04_LOG_VERSION
+              && h.record_size == sizeof (HCSR04Sample))
+    {
+    // An existing log -- but if the last write was cut short, new 
+    //  records would be out of step. Trim any partial record first.
+    struct stat sb;
+    fstat (self->fd, &sb);
+    off_t partial = (sb.st_size - h.header_size) % h.record_size;
+    if (partial == 0 || ftruncate (self->fd, sb.st_size - partial) == 0)
+      return TRUE;
+    if (error)
+      asprintf (error, "Can't repair %s: %s", self->filename, 
+        strerror (errno));
+    }
+  else
+    {
+    if (error)
+      asprintf (error, "%s is not a compatible sample log", self->filename);
+    }
+  close (self->fd);
+  self->fd = -1;
+  return FALSE;
+  }
+
+/*============================================================================
+  samplelog_init
+============================================================================*/
+BOOL samplelog_init (SampleLog *self, HCSR04 *hcsr04, char **error)
+  {
+  assert (self != NULL);
+  assert (self->fd < 0);
+  if (!samplelog_open (self, hcsr04, error)) return FALSE;
+
+  self->count = 0;
+  self->ring = samplering_create (RING_SIZE);
+  self->stop_fd = eventfd (0, EFD_CLOEXEC);
+  if (self->ring && self->stop_fd >= 0 
+        && pthread_create (&self->pthread, NULL, samplelog_loop, self) == 0)
+    {
+    self->running = TRUE;
+    if (hcsr04_add_sample_callback (hcsr04, samplering_sample_callback, 
+          self->ring))
+      {
+      self->hcsr04 = hcsr04;
+      return TRUE;
+      }
+    if (error)
+      asprintf (error, "Too many sample callbacks on this HCSR04");
+    }
+  else
+    {
+    if (error)
+      asprintf (error, "Can't start log writer: %s", strerror (errno));
+    }
+  samplelog_uninit (self);
+  return FALSE;
+  }
+
+/*============================================================================
+  samplelog_uninit
+============================================================================*/
+void samplelog_uninit (SampleLog *self)
+  {
+  assert (self != NULL);
+  // Stop new samples arriving first, so that the writer's last drain
+  //  really is the last
+  if (self->hcsr04)
+    hcsr04_remove_sample_callback (self->hcsr04, samplering_sample_callback,
+      self->ring);
+  self->hcsr04 = NULL;
+  if (self->running)
+    {
+    uint64_t one = 1;
+    write (self->stop_fd, &one, sizeof (one));
+    pthread_join (self->pthread, NULL);
+    self->running = FALSE;
+    }
+  if (self->stop_fd >= 0) close (self->stop_fd);
+  self->stop_fd = -1;
+  samplering_destroy (self->ring);
+  self->ring = NULL;
+  if (self->fd >= 0) close (self->fd);
+  self->fd = -1;
+  }
+
+/*============================================================================
+  samplelog_get_dropped
+============================================================================*/
+uint64_t samplelog_get_dropped (const SampleLog *self)
+  {
+  return self->ring ? samplering_get_dropped (self->ring) : 0;
+  }
+
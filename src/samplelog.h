@@ -0,0 +1,57 @@
+/*============================================================================
+  
+  samplelog.h
+
+  Functions to record every sample from a HCSR04 in a binary log (see 
+  logformat.h). Samples are passed to a writer thread through a 
+  SampleRing, and written in batches, so the HCSR04 thread never waits 
+  for the disk. If the disk can't keep up, samples are dropped, and
+  counted.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include "defs.h"
+#include "hcsr04.h"
+
+// Number of samples collected before they are written. At 16 samples a
+//  second, the buffer is written about every 16 seconds, unless the 
+//  flush interval is shorter.
+#define SAMPLELOG_BATCH 256
+
+// Longest time a sample waits in the buffer before it is written
+#define SAMPLELOG_FLUSH_MSEC 1000
+
+struct SampleLog;
+typedef struct _SampleLog SampleLog;
+
+BEGIN_DECLS
+
+/** Create a SampleLog that writes to the given file. This method only
+    stores values, and will always succeed. */
+SampleLog *samplelog_create (const char *filename);
+
+/** Clean up. This method implicitly calls _uninit(). */
+void       samplelog_destroy (SampleLog *self);
+
+/** Open the log, and start recording samples from the HCSR04. If the 
+    file already contains a log, new samples are appended to it; 
+    otherwise a new log is started with a header describing the 
+    sensor. If this method fails, and error is not NULL, it is written 
+    with an error message that the caller should free. */
+BOOL       samplelog_init (SampleLog *self, HCSR04 *hcsr04, char **error);
+
+/** Stop recording, write any samples still buffered, and close the 
+    log. */
+void       samplelog_uninit (SampleLog *self);
+
+/** Get the number of samples dropped, because the writer could not 
+    keep up. */
+uint64_t   samplelog_get_dropped (const SampleLog *self);
+
+END_DECLS
+
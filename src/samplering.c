@@ -0,0 +1,181 @@
+/*==========================================================================
+  
+    samplering.c
+
+    A single-producer, single-consumer ring buffer of samples, or of 
+    other records of a fixed size. The head
+    is only written by the producer, and the tail only by the consumer,
+    so no locks are needed -- just acquire/release ordering on the
+    indices. They are kept in separate cache lines, so the two threads
+    don't fight over them.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/eventfd.h>
+#include "defs.h" 
+#include "hcsr04.h" 
+#include "samplering.h" 
+
+struct _SampleRing
+  {
+  char *records;
+  size_t record_size;
+  uint32_t mask;      // Capacity - 1; capacity is a power of two
+  int fd;             // eventfd signalled when the ring becomes non-empty
+  uint32_t head __attribute__((aligned(64))); // Next slot to write
+  uint64_t dropped;
+  uint32_t tail __attribute__((aligned(64))); // Next slot to read
+  };
+
+/*============================================================================
+  samplering_create
+============================================================================*/
+SampleRing *samplering_create (int size)
+  {
+  return samplering_create_sized (size, sizeof (HCSR04Sample));
+  }
+
+/*============================================================================
+  samplering_create_sized
+============================================================================*/
+SampleRing *samplering_create_sized (int size, size_t record_size)
+  {
+  int fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd < 0) return NULL;
+  uint32_t capacity = 2;
+  while (capacity < (uint32_t)size) capacity <<= 1;
+  SampleRing *self = aligned_alloc (64, 
+    (sizeof (SampleRing) + 63) / 64 * 64);
+  memset (self, 0, sizeof (SampleRing));
+  self->records = malloc (capacity * record_size);
+  self->record_size = record_size;
+  self->mask = capacity - 1;
+  self->fd = fd;
+  return self;
+  }
+
+/*============================================================================
+  samplering_destroy
+============================================================================*/
+void samplering_destroy (SampleRing *self)
+  {
+  if (self)
+    {
+    close (self->fd);
+    free (self->records);
+    free (self);
+    }
+  }
+
+/*============================================================================
+  samplering_push
+============================================================================*/
+BOOL samplering_push (SampleRing *self, const HCSR04Sample *sample)
+  {
+  assert (self->record_size == sizeof (HCSR04Sample));
+  return samplering_push_record (self, sample);
+  }
+
+/*============================================================================
+  samplering_push_record
+============================================================================*/
+BOOL samplering_push_record (SampleRing *self, const void *record)
+  {
+  uint32_t head = self->head;
+  uint32_t tail = __atomic_load_n (&self->tail, __ATOMIC_ACQUIRE);
+  if (head - tail > self->mask)
+    {
+    __atomic_add_fetch (&self->dropped, 1, __ATOMIC_RELAXED);
+    return FALSE;
+    }
+  memcpy (self->records + (head & self->mask) * self->record_size, record,
+    self->record_size);
+  __atomic_store_n (&self->head, head + 1, __ATOMIC_RELEASE);
+  // Signal if the consumer had emptied the ring before this record 
+  //  arrived. The tail must be read again after the head is published, 
+  //  or the consumer could empty the ring in between, and sleep without
+  //  seeing this record. The consumer has the matching fence in 
+  //  _pop_record().
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  tail = __atomic_load_n (&self->tail, __ATOMIC_RELAXED);
+  if (head == tail)
+    {
+    uint64_t one = 1;
+    write (self->fd, &one, sizeof (one));
+    }
+  return TRUE;
+  }
+
+/*============================================================================
+  samplering_pop
+============================================================================*/
+BOOL samplering_pop (SampleRing *self, HCSR04Sample *sample)
+  {
+  assert (self->record_size == sizeof (HCSR04Sample));
+  return samplering_pop_record (self, sample);
+  }
+
+/*============================================================================
+  samplering_pop_record
+============================================================================*/
+BOOL samplering_pop_record (SampleRing *self, void *record)
+  {
+  uint32_t tail = self->tail;
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  uint32_t head = __atomic_load_n (&self->head, __ATOMIC_ACQUIRE);
+  if (head == tail) return FALSE;
+  memcpy (record, self->records + (tail & self->mask) * self->record_size,
+    self->record_size);
+  __atomic_store_n (&self->tail, tail + 1, __ATOMIC_RELEASE);
+  return TRUE;
+  }
+
+/*============================================================================
+  samplering_get_fd
+============================================================================*/
+int samplering_get_fd (const SampleRing *self)
+  {
+  return self->fd;
+  }
+
+/*============================================================================
+  samplering_clear_fd
+============================================================================*/
+void samplering_clear_fd (SampleRing *self)
+  {
+  uint64_t n;
+  read (self->fd, &n, sizeof (n));
+  }
+
+/*============================================================================
+  samplering_signal
+============================================================================*/
+void samplering_signal (SampleRing *self)
+  {
+  uint64_t one = 1;
+  write (self->fd, &one, sizeof (one));
+  }
+
+/*============================================================================
+  samplering_get_dropped
+============================================================================*/
+uint64_t samplering_get_dropped (const SampleRing *self)
+  {
+  return __atomic_load_n (&self->dropped, __ATOMIC_RELAXED);
+  }
+
+/*============================================================================
+  samplering_sample_callback
+============================================================================*/
+void samplering_sample_callback (const HCSR04Sample *sample, void *user_data)
+  {
+  samplering_push ((SampleRing *)user_data, sample);
+  }
+
@@ -0,0 +1,83 @@
+/*============================================================================
+  
+  samplering.h
+
+  A lock-free, fixed-size queue of HCSR04Sample records, for passing 
+  samples from exactly one producer thread (usually the HCSR04 thread) to
+  exactly one consumer thread. The producer never blocks -- if the
+  queue is full, the sample is dropped and counted. The consumer can
+  wait for samples by polling the queue's eventfd.
+
+  A ring made by samplering_create_sized() holds records of any fixed
+  size in the same way, with samplering_push_record() and 
+  samplering_pop_record() -- a pipelined HCSR04 passes its raw edges 
+  through one.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include "defs.h"
+#include "hcsr04.h"
+
+struct SampleRing;
+typedef struct _SampleRing SampleRing;
+
+BEGIN_DECLS
+
+/** Create a SampleRing that can hold at least size samples. The size
+    is rounded up to a power of two. This method can only fail if
+    an eventfd cannot be created, in which case it returns NULL. */
+SampleRing *samplering_create (int size);
+
+/** Create a SampleRing of at least size records of record_size bytes,
+    rather than of samples. Like samplering_create(), this method can 
+    only fail if an eventfd cannot be created. */
+SampleRing *samplering_create_sized (int size, size_t record_size);
+
+/** Free the queue. Neither thread may be using it. */
+void      samplering_destroy (SampleRing *self);
+
+/** Add a sample. Called only from the producer thread. Returns FALSE if
+    the queue is full, and the sample was dropped. The eventfd is only
+    signalled when the queue was empty, so a consumer that keeps up
+    costs one system call per wakeup, not one per sample. */
+BOOL      samplering_push (SampleRing *self, const HCSR04Sample *sample);
+
+/** Remove the oldest sample. Called only from the consumer thread. 
+    Returns FALSE if the queue is empty. */
+BOOL      samplering_pop (SampleRing *self, HCSR04Sample *sample);
+
+/** Add a record, of the size the ring was created for, as 
+    samplering_push() adds a sample. */
+BOOL      samplering_push_record (SampleRing *self, const void *record);
+
+/** Remove the oldest record, as samplering_pop() removes a sample. */
+BOOL      samplering_pop_record (SampleRing *self, void *record);
+
+/** Get the file descriptor that becomes readable when samples are
+    added to an empty queue. */
+int       samplering_get_fd (const SampleRing *self);
+
+/** Clear the eventfd. The consumer should call this when woken, before
+    popping everything in the queue. */
+void      samplering_clear_fd (SampleRing *self);
+
+/** Wake the consumer, even if nothing has been added. The producer 
+    calls this when it has finished, having set a flag that the consumer
+    checks when it wakes. */
+void      samplering_signal (SampleRing *self);
+
+/** Get the number of samples dropped because the queue was full. */
+uint64_t  samplering_get_dropped (const SampleRing *self);
+
+/** A HCSR04SampleCallback that pushes samples into the SampleRing passed
+    as user_data. */
+void      samplering_sample_callback (const HCSR04Sample *sample, 
+            void *user_data);
+
+END_DECLS
+
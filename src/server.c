@@ -0,0 +1,524 @@
+/*==========================================================================
+  
+    server.c
+
+    This "class" serves samples to clients on a Unix-domain socket. See
+    server.h for the protocol. 
+
+    Each iteration of the epoll loop first collects whatever has 
+    happened -- new samples, new clients, client commands -- and 
+    formats outgoing data into per-client buffers. Only then are the 
+    buffers written, so each client gets at most one write() per 
+    iteration however many samples arrived. A client whose socket is
+    full is not written again until epoll says it is writable, and in
+    the meantime its buffer fills up and further samples are dropped.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "defs.h" 
+#include "hcsr04.h" 
+#include "samplering.h" 
+#include "server.h" 
+
+// Number of samples each sensor's queue holds, while the server thread
+//  is busy
+#define RING_SIZE 256
+
+// Longest command line a client can send
+#define CLIENT_INPUT 256
+
+// What an epoll event refers to. The type goes in the top byte of 
+//  the event's data, a slot generation in the next 24 bits, and an
+//  index in the bottom half. Only client tags use the generation: a 
+//  client slot can be closed and reused within one batch of events, 
+//  and events still queued for the old client must not reach the new 
+//  one.
+#define TAG_LISTEN 1
+#define TAG_STOP   2
+#define TAG_RING   3
+#define TAG_CLIENT 4
+#define TAG_GEN_MASK 0xFFFFFF
+#define MAKE_TAG(type,gen,index) (((uint64_t)(type) << 56) \
+  | ((uint64_t)((gen) & TAG_GEN_MASK) << 32) | (uint32_t)(index))
+#define TAG_TYPE(tag) ((int)((tag) >> 56))
+#define TAG_GEN(tag) ((uint32_t)((tag) >> 32) & TAG_GEN_MASK)
+#define TAG_INDEX(tag) ((int)((tag) & 0xFFFFFFFF))
+
+typedef enum
+  {
+  FORMAT_TEXT = 0,
+  FORMAT_BINARY = 1
+  } Format;
+
+// Client -- one connected client
+typedef struct _Client
+  {
+  int fd;
+  BOOL subscribed;
+  Format format;
+  int sensor;              // Sensor number, or -1 for all
+  int64_t interval_usec;   // Minimum time between samples, or 0
+  int64_t next_due[SERVER_MAX_SENSORS]; // When the next sample is wanted
+  BOOL blocked;            // Socket was full; wait for EPOLLOUT to write
+  BOOL want_out;           // EPOLLOUT is in the client's epoll events
+  uint64_t dropped;        // Samples dropped because the buffer was full
+  int in_len;
+  char in[CLIENT_INPUT];
+  int out_len;
+  char out[SERVER_CLIENT_BUFFER];
+  } Client;
+
+struct _Server
+  {
+  char *socket_path;
+  HCSR04 *sensors[SERVER_MAX_SENSORS];
+  SampleRing *rings[SERVER_MAX_SENSORS];
+  int sensors_count;
+  Client *clients[SERVER_MAX_CLIENTS]; // NULL for unused slots
+  uint32_t generations[SERVER_MAX_CLIENTS]; // Bumped when a slot closes
+  int listen_fd;
+  int epoll_fd;
+  int stop_fd;
+  };
+
+/*============================================================================
+  server_create
+============================================================================*/
+Server *server_create (const char *socket_path)
+  {
+  assert (socket_path != NULL);
+  Server *self = malloc (sizeof (Server));
+  memset (self, 0, sizeof (Server));
+  self->socket_path = strdup (socket_path);
+  self->listen_fd = -1;
+  self->epoll_fd = -1;
+  self->stop_fd = -1;
+  return self;
+  }
+
+/*============================================================================
+  server_destroy
+============================================================================*/
+void server_destroy (Server *self)
+  {
+  if (self)
+    {
+    server_uninit (self);
+    free (self->socket_path);
+    free (self);
+    }
+  }
+
+/*============================================================================
+  server_add_sensor
+============================================================================*/
+BOOL server_add_sensor (Server *self, HCSR04 *hcsr04)
+  {
+  assert (self != NULL);
+  assert (self->epoll_fd < 0);
+  if (self->sensors_count >= SERVER_MAX_SENSORS) return FALSE;
+  self->sensors[self->sensors_count++] = hcsr04;
+  return TRUE;
+  }
+
+/*============================================================================
+  server_epoll_add
+============================================================================*/
+static BOOL server_epoll_add (Server *self, int fd, uint32_t events, 
+    uint64_t tag)
+  {
+  struct epoll_event ev;
+  memset (&ev, 0, sizeof (ev));
+  ev.events = events;
+  ev.data.u64 = tag;
+  return epoll_ctl (self->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+  }
+
+/*============================================================================
+  server_init
+============================================================================*/
+BOOL server_init (Server *self, char **error)
+  {
+  assert (self != NULL);
+  struct sockaddr_un addr;
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen (self->socket_path) >= sizeof (addr.sun_path))
+    {
+    if (error)
+      asprintf (error, "Socket path %s is too long", self->socket_path);
+    return FALSE;
+    }
+  strcpy (addr.sun_path, self->socket_path);
+
+  self->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+  self->stop_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  self->listen_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK 
+    | SOCK_CLOEXEC, 0);
+  if (self->epoll_fd < 0 || self->stop_fd < 0 || self->listen_fd < 0)
+    {
+    if (error)
+      asprintf (error, "Can't create server: %s", strerror (errno));
+    server_uninit (self);
+    return FALSE;
+    }
+
+  unlink (self->socket_path);
+  if (bind (self->listen_fd, (struct sockaddr *)&addr, sizeof (addr)) != 0
+       || listen (self->listen_fd, SERVER_MAX_CLIENTS) != 0)
+    {
+    if (error)
+      asprintf (error, "Can't listen on %s: %s", self->socket_path, 
+        strerror (errno));
+    server_uninit (self);
+    return FALSE;
+    }
+
+  server_epoll_add (self, self->listen_fd, EPOLLIN, 
+    MAKE_TAG (TAG_LISTEN, 0, 0));
+  server_epoll_add (self, self->stop_fd, EPOLLIN, MAKE_TAG (TAG_STOP, 0, 0));
+  for (int i = 0; i < self->sensors_count; i++)
+    {
+    self->rings[i] = samplering_create (RING_SIZE);
+    if (self->rings[i] == NULL 
+         || !hcsr04_add_sample_callback (self->sensors[i], 
+               samplering_sample_callback, self->rings[i]))
+      {
+      if (error)
+        asprintf (error, "Can't collect samples from sensor %d", i);
+      server_uninit (self);
+      return FALSE;
+      }
+    server_epoll_add (self, samplering_get_fd (self->rings[i]), EPOLLIN, 
+      MAKE_TAG (TAG_RING, 0, i));
+    }
+  return TRUE;
+  }
+
+/*============================================================================
+  server_close_client
+============================================================================*/
+static void server_close_client (Server *self, int index)
+  {
+  Client *c = self->clients[index];
+  if (c)
+    {
+    close (c->fd); // Also removes it from the epoll set
+    free (c);
+    self->clients[index] = NULL;
+    self->generations[index]++;
+    }
+  }
+
+/*============================================================================
+  server_uninit
+============================================================================*/
+void server_uninit (Server *self)
+  {
+  assert (self != NULL);
+  for (int i = 0; i < SERVER_MAX_CLIENTS; i++)
+    server_close_client (self, i);
+  for (int i = 0; i < self->sensors_count; i++)
+    {
+    if (self->rings[i])
+      {
+      hcsr04_remove_sample_callback (self->sensors[i], 
+        samplering_sample_callback, self->rings[i]);
+      samplering_destroy (self->rings[i]);
+      }
+    self->rings[i] = NULL;
+    }
+  if (self->listen_fd >= 0)
+    {
+    close (self->listen_fd);
+    unlink (self->socket_path);
+    }
+  self->listen_fd = -1;
+  if (self->stop_fd >= 0) close (self->stop_fd);
+  self->stop_fd = -1;
+  if (self->epoll_fd >= 0) close (self->epoll_fd);
+  self->epoll_fd = -1;
+  }
+
+/*============================================================================
+  server_stop
+============================================================================*/
+void server_stop (Server *self)
+  {
+  uint64_t one = 1;
+  write (self->stop_fd, &one, sizeof (one));
+  }
+
+/*============================================================================
+  server_accept
+============================================================================*/
+static void server_accept (Server *self)
+  {
+  int fd;
+  while ((fd = accept4 (self->listen_fd, NULL, NULL, 
+           SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    {
+    int index = -1;
+    for (int i = 0; i < SERVER_MAX_CLIENTS && index < 0; i++)
+      if (self->clients[i] == NULL) index = i;
+    if (index < 0)
+      {
+      // Too many clients -- there's no point making this one wait
+      close (fd);
+      continue;
+      }
+    Client *c = malloc (sizeof (Client));
+    memset (c, 0, sizeof (Client));
+    c->fd = fd;
+    c->sensor = -1;
+    self->clients[index] = c;
+    server_epoll_add (self, fd, EPOLLIN, 
+      MAKE_TAG (TAG_CLIENT, self->generations[index], index));
+    }
+  }
+
+/*============================================================================
+  server_append
+
+  Add data to a client's output buffer, if there is room. Returns FALSE
+  if the data was dropped.
+
+============================================================================*/
+static BOOL server_append (Client *c, const void *data, int len)
+  {
+  if (c->out_len + len > SERVER_CLIENT_BUFFER) 
+    {
+    c->dropped++;
+    return FALSE;
+    }
+  memcpy (c->out + c->out_len, data, len);
+  c->out_len += len;
+  return TRUE;
+  }
+
+/*============================================================================
+  server_handle_command
+============================================================================*/
+static void server_handle_command (Server *self, Client *c, char *line)
+  {
+  char *save = NULL;
+  char *verb = strtok_r (line, " \t\r", &save);
+  char *rate = strtok_r (NULL, " \t\r", &save);
+  char *format = strtok_r (NULL, " \t\r", &save);
+  char *sensor = strtok_r (NULL, " \t\r", &save);
+  const char *reply = "OK\n";
+
+  if (!verb || strcmp (verb, "SUBSCRIBE") != 0)
+    reply = "ERROR unknown command\n";
+  else if (!rate || atof (rate) < 0)
+    reply = "ERROR bad rate\n";
+  else if (!format || (strcmp (format, "text") != 0 
+             && strcmp (format, "binary") != 0))
+    reply = "ERROR bad format\n";
+  else if (sensor && strcmp (sensor, "all") != 0 
+             && (atoi (sensor) < 0 || atoi (sensor) >= self->sensors_count))
+    reply = "ERROR bad sensor\n";
+  else
+    {
+    double r = atof (rate);
+    c->interval_usec = r > 0 ? (int64_t)(1000000 / r) : 0;
+    c->format = strcmp (format, "binary") == 0 ? FORMAT_BINARY : FORMAT_TEXT;
+    c->sensor = (sensor && strcmp (sensor, "all") != 0) ? atoi (sensor) : -1;
+    memset (c->next_due, 0, sizeof (c->next_due));
+    c->subscribed = TRUE;
+    }
+  server_append (c, reply, strlen (reply));
+  }
+
+/*============================================================================
+
+  server_read_client
+
+  Read commands from a client. Returns FALSE if the client has gone away,
+  or sent something that can't be a command.
+
+============================================================================*/
+static BOOL server_read_client (Server *self, Client *c)
+  {
+  while (TRUE)
+    {
+    int n = read (c->fd, c->in + c->in_len, CLIENT_INPUT - c->in_len);
+    if (n == 0) return FALSE;
+    if (n < 0) return errno == EAGAIN || errno == EINTR;
+    c->in_len += n;
+    char *nl;
+    while ((nl = memchr (c->in, '\n', c->in_len)) != NULL)
+      {
+      *nl = 0;
+      server_handle_command (self, c, c->in);
+      int used = nl - c->in + 1;
+      memmove (c->in, nl + 1, c->in_len - used);
+      c->in_len -= used;
+      }
+    if (c->in_len == CLIENT_INPUT) return FALSE;
+    }
+  }
+
+/*============================================================================
+
+  server_distribute
+
+  Format a sample for every client that wants it now
+
+============================================================================*/
+static void server_distribute (Server *self, int sensor, 
+    const HCSR04Sample *s)
+  {
+  char text[128];
+  int text_len = -1;
+  for (int i = 0; i < SERVER_MAX_CLIENTS; i++)
+    {
+    Client *c = self->clients[i];
+    if (!c || !c->subscribed) continue;
+    if (c->sensor >= 0 && c->sensor != sensor) continue;
+
+    // Decimate to the client's rate. A quarter of an interval's slack 
+    //  means that asking for the sensor's own rate gets every sample, 
+    //  despite jitter. 
+    if (c->interval_usec)
+      {
+      int64_t *due = &c->next_due[sensor];
+      if (s->time_usec + c->interval_usec / 4 < *due) continue;
+      if (s->time_usec - *due > c->interval_usec)
+        *due = s->time_usec + c->interval_usec;
+      else
+        *due += c->interval_usec;
+      }
+
+    if (c->format == FORMAT_BINARY)
+      {
+      HCSR04StreamRecord r;
+      memset (&r, 0, sizeof (r));
+      r.sensor = sensor;
+      r.sample = *s;
+      server_append (c, &r, sizeof (r));
+      }
+    else
+      {
+      if (text_len < 0)
+        text_len = snprintf (text, sizeof (text), "%d %u %lld %d %.4f %.4f\n",
+          sensor, s->seq, (long long)s->time_usec, s->status, s->raw, 
+          s->filtered);
+      server_append (c, text, text_len);
+      }
+    }
+  }
+
+/*============================================================================
+
+  server_flush_client
+
+  Write as much of a client's buffer as the socket will take. Returns
+  FALSE if the client has gone away.
+
+============================================================================*/
+static BOOL server_flush_client (Server *self, int index)
+  {
+  Client *c = self->clients[index];
+  if (c->out_len > 0)
+    {
+    int n = send (c->fd, c->out, c->out_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0 && errno != EAGAIN && errno != EINTR) return FALSE;
+    if (n > 0)
+      {
+      memmove (c->out, c->out + n, c->out_len - n);
+      c->out_len -= n;
+      }
+    c->blocked = c->out_len > 0;
+    }
+  if (c->blocked != c->want_out)
+    {
+    struct epoll_event ev;
+    memset (&ev, 0, sizeof (ev));
+    ev.events = EPOLLIN | (c->blocked ? EPOLLOUT : 0);
+    ev.data.u64 = MAKE_TAG (TAG_CLIENT, self->generations[index], index);
+    epoll_ctl (self->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->want_out = c->blocked;
+    }
+  return TRUE;
+  }
+
+/*============================================================================
+  server_run
+============================================================================*/
+void server_run (Server *self)
+  {
+  assert (self != NULL);
+  assert (self->epoll_fd >= 0);
+  struct epoll_event events[32];
+  BOOL stop = FALSE;
+  while (!stop)
+    {
+    int n = epoll_wait (self->epoll_fd, events, 32, -1);
+    if (n < 0 && errno != EINTR) break;
+    for (int i = 0; i < n; i++)
+      {
+      int type = TAG_TYPE (events[i].data.u64);
+      int index = TAG_INDEX (events[i].data.u64);
+      switch (type)
+        {
+        case TAG_STOP:
+          stop = TRUE;
+          break;
+        case TAG_LISTEN:
+          server_accept (self);
+          break;
+        case TAG_RING:
+          {
+          HCSR04Sample s;
+          samplering_clear_fd (self->rings[index]);
+          while (samplering_pop (self->rings[index], &s))
+            server_distribute (self, index, &s);
+          }
+          break;
+        case TAG_CLIENT:
+          {
+          // Skip events for a client that was closed earlier in this 
+          //  batch, even if a new client has taken over its slot since
+          Client *c = self->clients[index];
+          if (!c || TAG_GEN (events[i].data.u64) 
+                != (self->generations[index] & TAG_GEN_MASK)) break;
+          if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+            server_close_client (self, index);
+            break;
+            }
+          // Writability and input can be reported together, and
+          //  neither may be dropped
+          if (events[i].events & EPOLLOUT)
+            c->blocked = FALSE;
+          if ((events[i].events & EPOLLIN) 
+                && !server_read_client (self, c))
+            server_close_client (self, index);
+          }
+          break;
+        }
+      }
+
+    // Now write everything that has been collected in this iteration
+    for (int i = 0; i < SERVER_MAX_CLIENTS; i++)
+      {
+      Client *c = self->clients[i];
+      if (c && !c->blocked && !server_flush_client (self, i))
+        server_close_client (self, i);
+      }
+    }
+  }
+
@@ -0,0 +1,91 @@
+/*============================================================================
+  
+  server.h
+
+  Functions to serve samples from one or more HCSR04 objects to clients
+  connected on a Unix-domain socket. Everything runs in one thread, 
+  around a single epoll loop. Samples reach that thread through a
+  SampleRing per sensor, so a slow client can never hold up a sensor:
+  if a client can't keep up, its samples are dropped.
+
+  Protocol: a client connects, and sends a line
+
+    SUBSCRIBE <rate> <format> [<sensor>]
+
+  rate is the maximum number of samples per second the client wants 
+  from each sensor; 0 means every sample. format is "text" or "binary".
+  sensor is a sensor number, from zero in the order the sensors were
+  added to the server, or "all" (the default). The server replies with
+  "OK" or "ERROR <reason>" on a line of its own, and then pushes samples
+  as they arrive. In text format each sample is a line
+
+    <sensor> <seq> <time_usec> <status> <raw> <filtered>
+
+  In binary format each sample is a HCSR04StreamRecord, in the server's
+  byte order. A client can send another SUBSCRIBE line at any time to 
+  change its subscription.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include "defs.h"
+#include "hcsr04.h"
+
+// The maximum number of sensors one server can handle
+#define SERVER_MAX_SENSORS 16
+
+// The maximum number of clients connected at the same time
+#define SERVER_MAX_CLIENTS 64
+
+// Size of each client's output buffer. When this is full, samples for
+//  that client are dropped.
+#define SERVER_CLIENT_BUFFER 16384
+
+// HCSR04StreamRecord -- one sample in binary format
+typedef struct _HCSR04StreamRecord
+  {
+  uint32_t sensor;
+  uint32_t reserved;
+  HCSR04Sample sample;
+  } HCSR04StreamRecord;
+
+struct Server;
+typedef struct _Server Server;
+
+BEGIN_DECLS
+
+/** Create a server that will listen on the given socket path. This 
+    method only stores values, and will always succeed. */
+Server   *server_create (const char *socket_path);
+
+/** Clean up. This method implicitly calls _uninit(). */
+void      server_destroy (Server *self);
+
+/** Add a sensor, whose samples will be served. All sensors must be added
+    before calling _init(). Returns FALSE if there are already 
+    SERVER_MAX_SENSORS sensors. */
+BOOL      server_add_sensor (Server *self, HCSR04 *hcsr04);
+
+/** Create the socket, and start collecting samples from the sensors. 
+    Any existing file at the socket path is replaced. If this method 
+    fails, and error is not NULL, it is written with an error message
+    that the caller should free. */
+BOOL      server_init (Server *self, char **error);
+
+/** Stop collecting samples, disconnect all clients, and remove the
+    socket. */
+void      server_uninit (Server *self);
+
+/** Serve clients until server_stop() is called. */
+void      server_run (Server *self);
+
+/** Make server_run() return. This method only writes to an eventfd, so
+    it can safely be called from a signal handler. */
+void      server_stop (Server *self);
+
+END_DECLS
+
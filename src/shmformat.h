@@ -0,0 +1,79 @@
+/*============================================================================
+  
+  shmformat.h
+
+  The layout of the shared memory segment written by ShmPublisher and read
+  by ShmReader. The segment holds a snapshot of the latest sample, and a
+  ring of recent samples. Every sample is held in its own cache-line-sized
+  slot, protected by a sequence lock: the writer makes the slot's sequence
+  number odd while it is writing, and even when it has finished. A reader
+  copies the slot, and then checks that the sequence number is even and 
+  has not changed; if it has, the copy is repeated. So readers never block
+  the writer, and need no system calls at all.
+
+  This file depends on nothing else in the program, so that a consumer 
+  can build against it without the rest of the headers.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+
+// "HS04", and a version that is incremented on any change to the layout
+#define HCSR04_SHM_MAGIC 0x34305348
+#define HCSR04_SHM_VERSION 1
+
+// Default number of samples in the ring -- at 16 samples a second, about
+//  a minute's worth
+#define HCSR04_SHM_RING_SIZE 1024
+
+#define HCSR04_SHM_CACHE_LINE 64
+
+// HCSR04ShmSample -- one sample as it is stored in the segment. This has
+//  the same fields as HCSR04Sample in hcsr04.h, which a publisher copies
+//  into it.
+typedef struct _HCSR04ShmSample
+  {
+  int64_t time_usec;  // Time the trigger pulse was sent, usec since epoch
+  uint32_t seq;       // Cycle number, from zero when the sensor started
+  int32_t status;     // 0 for a good reading; else a HCSR04SampleStatus
+  int32_t rise_usec;  // Start of the echo, usec after time_usec, or -1
+  int32_t fall_usec;  // End of the echo, usec after time_usec, or -1
+  float raw;          // Unfiltered distance in metres, or -1.0
+  float filtered;     // Filtered distance in metres, or -1.0 if not valid
+  } HCSR04ShmSample;
+
+// HCSR04ShmSlot -- one sample, and the sequence lock that protects it
+typedef struct _HCSR04ShmSlot
+  {
+  uint32_t lock;      // Sequence lock -- odd while the slot is being written
+  uint32_t reserved;
+  uint64_t index;     // Position of the sample in the stream, from zero
+  HCSR04ShmSample sample;
+  } __attribute__((aligned(HCSR04_SHM_CACHE_LINE))) HCSR04ShmSlot;
+
+// HCSR04ShmHeader -- the start of the segment. The ring of ring_size 
+//  slots follows immediately.
+typedef struct _HCSR04ShmHeader
+  {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t ring_size;  
+  uint32_t slot_size;  // sizeof (HCSR04ShmSlot), as a layout check
+  int32_t sound_pin;
+  int32_t echo_pin;
+  int32_t cycle_usec;
+  float smoothing;
+  int32_t publisher_pid;
+  // The latest sample -- the same as the newest entry in the ring, but
+  //  a reader that only wants the current value need only look here
+  HCSR04ShmSlot latest;
+  // Number of samples ever published. The newest is at ring index
+  //  (head - 1) % ring_size. 
+  uint64_t head __attribute__((aligned(HCSR04_SHM_CACHE_LINE)));
+  HCSR04ShmSlot ring[];
+  } HCSR04ShmHeader;
+
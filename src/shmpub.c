@@ -0,0 +1,193 @@
+/*==========================================================================
+  
+    shmpub.c
+
+    This "class" publishes samples into a shared memory segment, using the
+    layout described in shmformat.h. It is the only writer to the segment;
+    the HCSR04 object it is attached to remains the only user of the
+    GPIO pins.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "defs.h" 
+#include "hcsr04.h" 
+#include "shmformat.h" 
+#include "shmpub.h" 
+
+struct _ShmPublisher
+  {
+  char *name;
+  int ring_size;
+  HCSR04ShmHeader *header; // The mapped segment, or NULL
+  size_t size;             // Size of the mapped segment
+  HCSR04 *hcsr04;          // The sensor we are attached to, if any
+  };
+
+/*============================================================================
+  shmpub_create
+============================================================================*/
+ShmPublisher *shmpub_create (const char *name, int ring_size)
+  {
+  assert (name != NULL);
+  ShmPublisher *self = malloc (sizeof (ShmPublisher));
+  memset (self, 0, sizeof (ShmPublisher));
+  self->name = strdup (name);
+  self->ring_size = ring_size > 0 ? ring_size : HCSR04_SHM_RING_SIZE;
+  return self;
+  }
+
+/*============================================================================
+  shmpub_destroy
+============================================================================*/
+void shmpub_destroy (ShmPublisher *self)
+  {
+  if (self)
+    {
+    shmpub_uninit (self);
+    free (self->name);
+    free (self);
+    }
+  }
+
+/*============================================================================
+  shmpub_sample_callback
+============================================================================*/
+static void shmpub_sample_callback (const HCSR04Sample *sample, 
+    void *user_data)
+  {
+  shmpub_publish ((ShmPublisher *)user_data, sample);
+  }
+
+/*============================================================================
+  shmpub_init
+============================================================================*/
+BOOL shmpub_init (ShmPublisher *self, HCSR04 *hcsr04, char **error)
+  {
+  assert (self != NULL);
+  assert (self->header == NULL);
+  self->size = sizeof (HCSR04ShmHeader) 
+    + (size_t)self->ring_size * sizeof (HCSR04ShmSlot);
+
+  // Remove any old segment, rather than reusing it -- a reader that
+  //  still has it mapped should not see it change layout underneath it
+  shm_unlink (self->name);
+  int fd = shm_open (self->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0)
+    {
+    if (error)
+      asprintf (error, "Can't create shared memory %s: %s", self->name, 
+        strerror (errno));
+    return FALSE;
+    }
+
+  BOOL ret = FALSE;
+  if (ftruncate (fd, self->size) == 0)
+    {
+    void *p = mmap (NULL, self->size, PROT_READ | PROT_WRITE, MAP_SHARED, 
+      fd, 0);
+    if (p != MAP_FAILED)
+      {
+      // The new segment is full of zeros, so all the slots are unlocked
+      //  and empty, and we only need to fill in the description
+      HCSR04ShmHeader *h = p;
+      h->version = HCSR04_SHM_VERSION;
+      h->ring_size = self->ring_size;
+      h->slot_size = sizeof (HCSR04ShmSlot);
+      h->sound_pin = hcsr04_get_sound_pin (hcsr04);
+      h->echo_pin = hcsr04_get_echo_pin (hcsr04);
+      h->cycle_usec = hcsr04_get_cycle_usec (hcsr04);
+      h->smoothing = hcsr04_get_smoothing (hcsr04);
+      h->publisher_pid = getpid();
+      // Readers check the magic number last
+      __atomic_store_n (&h->magic, HCSR04_SHM_MAGIC, __ATOMIC_RELEASE);
+      self->header = h;
+      ret = TRUE;
+      }
+    }
+  if (!ret)
+    {
+    if (error)
+      asprintf (error, "Can't map shared memory %s: %s", self->name, 
+        strerror (errno));
+    shm_unlink (self->name);
+    }
+  close (fd);
+
+  if (ret)
+    {
+    if (hcsr04_add_sample_callback (hcsr04, shmpub_sample_callback, self))
+      self->hcsr04 = hcsr04;
+    else
+      {
+      if (error)
+        asprintf (error, "Too many sample callbacks on this HCSR04");
+      shmpub_uninit (self);
+      ret = FALSE;
+      }
+    }
+  return ret;
+  }
+
+/*============================================================================
+  shmpub_uninit
+============================================================================*/
+void shmpub_uninit (ShmPublisher *self)
+  {
+  assert (self != NULL);
+  if (self->hcsr04)
+    hcsr04_remove_sample_callback (self->hcsr04, shmpub_sample_callback, 
+      self);
+  self->hcsr04 = NULL;
+  if (self->header)
+    {
+    munmap (self->header, self->size);
+    shm_unlink (self->name);
+    }
+  self->header = NULL;
+  }
+
+/*============================================================================
+  shmpub_write_slot
+============================================================================*/
+static void shmpub_write_slot (HCSR04ShmSlot *slot, uint64_t index,
+    const HCSR04Sample *sample)
+  {
+  uint32_t lock = slot->lock;
+  __atomic_store_n (&slot->lock, lock + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  slot->index = index;
+  slot->sample.time_usec = sample->time_usec;
+  slot->sample.seq = sample->seq;
+  slot->sample.status = sample->status;
+  slot->sample.rise_usec = sample->rise_usec;
+  slot->sample.fall_usec = sample->fall_usec;
+  slot->sample.raw = sample->raw;
+  slot->sample.filtered = sample->filtered;
+  __atomic_store_n (&slot->lock, lock + 2, __ATOMIC_RELEASE);
+  }
+
+/*============================================================================
+  shmpub_publish
+============================================================================*/
+void shmpub_publish (ShmPublisher *self, const HCSR04Sample *sample)
+  {
+  assert (self != NULL);
+  HCSR04ShmHeader *h = self->header;
+  if (!h) return;
+  uint64_t index = h->head;
+  shmpub_write_slot (&h->ring[index % h->ring_size], index, sample);
+  shmpub_write_slot (&h->latest, index, sample);
+  __atomic_store_n (&h->head, index + 1, __ATOMIC_RELEASE);
+  }
+
@@ -0,0 +1,48 @@
+/*============================================================================
+  
+  shmpub.h
+
+  Functions to publish the samples from a HCSR04 into a shared memory
+  segment (in /dev/shm), so that any number of other processes can read
+  them with ShmReader, without touching the GPIO pins.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include "defs.h"
+#include "hcsr04.h"
+
+struct ShmPublisher;
+typedef struct _ShmPublisher ShmPublisher;
+
+BEGIN_DECLS
+
+/** Create a ShmPublisher. name is the name of the shared memory segment,
+    which should start with a '/', e.g., "/hcsr04-17-27". ring_size is the
+    number of recent samples to keep; HCSR04_SHM_RING_SIZE is a reasonable
+    choice. This method only stores values, and will always succeed. */
+ShmPublisher *shmpub_create (const char *name, int ring_size);
+
+/** Clean up the object. This method implicitly calls _uninit(). */
+void          shmpub_destroy (ShmPublisher *self);
+
+/** Create the shared memory segment, and start publishing the samples
+    from the HCSR04. Any existing segment of the same name is replaced.
+    If this method fails, and error is not NULL, it is written with an
+    error message that the caller should free. */
+BOOL          shmpub_init (ShmPublisher *self, HCSR04 *hcsr04, char **error);
+
+/** Stop publishing, and remove the segment. Readers that already have
+    it open can continue to read the last samples published. */
+void          shmpub_uninit (ShmPublisher *self);
+
+/** Publish a sample. This is done automatically for the HCSR04 passed
+    to _init(), but can be called directly when samples come from 
+    somewhere else. Only one thread may publish at a time. */
+void          shmpub_publish (ShmPublisher *self, const HCSR04Sample *sample);
+
+END_DECLS
+
@@ -0,0 +1,204 @@
+/*==========================================================================
+  
+    shmreader.c
+
+    This "class" reads samples from a shared memory segment written by
+    a ShmPublisher, possibly in a different process. See shmformat.h 
+    for the locking protocol.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "defs.h" 
+#include "shmformat.h" 
+#include "shmreader.h" 
+
+// If a slot is still being written after this many attempts to read it,
+//  give up. The writer holds the lock for a few tens of nanoseconds, so
+//  this only happens if it dies in the middle of a write.
+#define MAX_READ_ATTEMPTS 1000
+
+struct _ShmReader
+  {
+  char *name;
+  const HCSR04ShmHeader *header; // The mapped segment, or NULL
+  size_t size;
+  };
+
+/*============================================================================
+  shmreader_create
+============================================================================*/
+ShmReader *shmreader_create (const char *name)
+  {
+  assert (name != NULL);
+  ShmReader *self = malloc (sizeof (ShmReader));
+  memset (self, 0, sizeof (ShmReader));
+  self->name = strdup (name);
+  return self;
+  }
+
+/*============================================================================
+  shmreader_destroy
+============================================================================*/
+void shmreader_destroy (ShmReader *self)
+  {
+  if (self)
+    {
+    shmreader_uninit (self);
+    free (self->name);
+    free (self);
+    }
+  }
+
+/*============================================================================
+  shmreader_init
+============================================================================*/
+BOOL shmreader_init (ShmReader *self, char **error)
+  {
+  assert (self != NULL);
+  assert (self->header == NULL);
+  int fd = shm_open (self->name, O_RDONLY, 0);
+  if (fd < 0)
+    {
+    if (error)
+      asprintf (error, "Can't open shared memory %s: %s", self->name, 
+        strerror (errno));
+    return FALSE;
+    }
+
+  BOOL ret = FALSE;
+  struct stat sb;
+  if (fstat (fd, &sb) == 0 && (size_t)sb.st_size >= sizeof (HCSR04ShmHeader))
+    {
+    void *p = mmap (NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p != MAP_FAILED)
+      {
+      const HCSR04ShmHeader *h = p;
+      if (__atomic_load_n (&h->magic, __ATOMIC_ACQUIRE) == HCSR04_SHM_MAGIC
+           && h->version == HCSR04_SHM_VERSION 
+           && h->slot_size == sizeof (HCSR04ShmSlot)
+           && sizeof (HCSR04ShmHeader) + (size_t)h->ring_size 
+               * sizeof (HCSR04ShmSlot) <= (size_t)sb.st_size)
+        {
+        self->header = h;
+        self->size = sb.st_size;
+        ret = TRUE;
+        }
+      else
+        {
+        if (error)
+          asprintf (error, "%s is not a compatible HCSR04 segment", 
+            self->name);
+        munmap (p, sb.st_size);
+        }
+      }
+    else
+      {
+      if (error)
+        asprintf (error, "Can't map shared memory %s: %s", self->name, 
+          strerror (errno));
+      }
+    }
+  else
+    {
+    if (error)
+      asprintf (error, "%s is not a compatible HCSR04 segment", self->name);
+    }
+  close (fd);
+  return ret;
+  }
+
+/*============================================================================
+  shmreader_uninit
+============================================================================*/
+void shmreader_uninit (ShmReader *self)
+  {
+  assert (self != NULL);
+  if (self->header)
+    munmap ((void *)self->header, self->size);
+  self->header = NULL;
+  }
+
+/*============================================================================
+  shmreader_get_header
+============================================================================*/
+const HCSR04ShmHeader *shmreader_get_header (const ShmReader *self)
+  {
+  assert (self != NULL);
+  return self->header;
+  }
+
+/*============================================================================
+
+  shmreader_read_slot
+
+  Copy a slot, retrying if the publisher was writing it at the time.
+  Returns FALSE if a consistent copy could not be made.
+
+============================================================================*/
+static BOOL shmreader_read_slot (const HCSR04ShmSlot *slot, uint64_t *index,
+    HCSR04ShmSample *sample)
+  {
+  for (int i = 0; i < MAX_READ_ATTEMPTS; i++)
+    {
+    uint32_t before = __atomic_load_n (&slot->lock, __ATOMIC_ACQUIRE);
+    if (before & 1) continue;
+    *index = slot->index;
+    *sample = slot->sample;
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    uint32_t after = __atomic_load_n (&slot->lock, __ATOMIC_RELAXED);
+    if (before == after) return TRUE;
+    }
+  return FALSE;
+  }
+
+/*============================================================================
+  shmreader_read_latest
+============================================================================*/
+BOOL shmreader_read_latest (const ShmReader *self, HCSR04ShmSample *sample)
+  {
+  assert (self != NULL);
+  assert (self->header != NULL);
+  const HCSR04ShmHeader *h = self->header;
+  if (__atomic_load_n (&h->head, __ATOMIC_ACQUIRE) == 0) return FALSE;
+  uint64_t index;
+  return shmreader_read_slot (&h->latest, &index, sample);
+  }
+
+/*============================================================================
+  shmreader_read_since
+============================================================================*/
+int shmreader_read_since (const ShmReader *self, uint64_t *cursor,
+      HCSR04ShmSample *samples, int max)
+  {
+  assert (self != NULL);
+  assert (self->header != NULL);
+  const HCSR04ShmHeader *h = self->header;
+  uint64_t head = __atomic_load_n (&h->head, __ATOMIC_ACQUIRE);
+  if (*cursor + h->ring_size < head)
+    *cursor = head - h->ring_size;
+
+  int n = 0;
+  while (*cursor < head && n < max)
+    {
+    uint64_t index;
+    const HCSR04ShmSlot *slot = &h->ring[*cursor % h->ring_size];
+    if (!shmreader_read_slot (slot, &index, &samples[n])) break;
+    // If the index does not match, the publisher has lapped us since we
+    //  read the head, and this sample is lost
+    if (index == *cursor) n++;
+    (*cursor)++;
+    }
+  return n;
+  }
+
@@ -0,0 +1,59 @@
+/*============================================================================
+  
+  shmreader.h
+
+  Functions to read the samples published by a ShmPublisher in another
+  process. Reads do not involve any system calls, and never block the
+  publisher. This file, shmformat.h, and shmreader.c are all that a 
+  consumer needs.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include "defs.h"
+#include "shmformat.h"
+
+struct ShmReader;
+typedef struct _ShmReader ShmReader;
+
+BEGIN_DECLS
+
+/** Create a ShmReader for the named segment. This method only stores
+    values, and will always succeed. */
+ShmReader *shmreader_create (const char *name);
+
+/** Clean up the object. This method implicitly calls _uninit(). */
+void       shmreader_destroy (ShmReader *self);
+
+/** Open and map the segment. This fails if the segment does not exist,
+    or was written by an incompatible version of the publisher. If it 
+    does, and error is not NULL, it is written with an error message
+    that the caller should free. */
+BOOL       shmreader_init (ShmReader *self, char **error);
+
+/** Unmap the segment. */
+void       shmreader_uninit (ShmReader *self);
+
+/** Get the header of the segment, which describes the sensor. */
+const HCSR04ShmHeader *shmreader_get_header (const ShmReader *self);
+
+/** Get the latest sample. Returns FALSE if nothing has been published 
+    yet. */
+BOOL       shmreader_read_latest (const ShmReader *self, 
+             HCSR04ShmSample *sample);
+
+/** Get samples published since the last call. *cursor should be zero on
+    the first call, and is updated to the index of the next sample 
+    expected. Up to max samples are written to samples, oldest first, and
+    the number written is returned. If the reader has fallen so far 
+    behind that samples have been overwritten, they are skipped, and 
+    the cursor moves to the oldest sample still available. */
+int        shmreader_read_since (const ShmReader *self, uint64_t *cursor,
+             HCSR04ShmSample *samples, int max);
+
+END_DECLS
+
@@ -0,0 +1,371 @@
+/*==========================================================================
+
+    zoneset.c
+
+    This "class" keeps track of whether a measured distance lies in each
+    of a set of zones, and delivers events when it enters or leaves one.
+    To avoid examining every zone on every sample, the zone edges are
+    kept in a sorted array. A zone can only change state when the distance
+    crosses one of its edges, so we only need to look at the edges that
+    lie between the previous and current distance, plus any zones that
+    are waiting out a dwell time or debounce count.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <assert.h>
+#include "defs.h"
+#include "hcsr04.h"
+#include "zoneset.h"
+
+// Each zone contributes this many edges to the sorted edge array:
+//  near - hysteresis, near, far, and far + hysteresis
+#define EDGES_PER_ZONE 4
+
+// Zone -- the configuration and state of one zone
+typedef struct _Zone
+  {
+  int id;
+  HCSR04Zone config;
+  BOOL inside;       // The state last reported to the subscriber
+  BOOL pending;      // A transition to !inside is waiting for dwell/debounce
+  int pending_count; // Number of consecutive samples supporting the transition
+  int64_t pending_since; // Time the pending transition started, usec
+  BOOL fresh;        // Added since the last sample; must be examined
+  unsigned stamp;    // Evaluation pass in which this zone was last examined
+  } Zone;
+
+// Edge -- one entry in the sorted array of zone edges
+typedef struct _Edge
+  {
+  double distance;
+  int zone;          // Index into the zones array
+  } Edge;
+
+struct _ZoneSet
+  {
+  Zone *zones;
+  int zones_count;
+  Edge *edges;       // Sorted by distance; EDGES_PER_ZONE * zones_count
+  int *pending;      // Indices of zones that have a transition pending
+  int pending_count;
+  int next_id;       // ID to give to the next zone added
+  int occupied;      // Number of zones that are inside
+  double last;       // The distance at the last evaluation
+  BOOL have_last;    // FALSE until the first evaluation
+  unsigned stamp;    // Incremented on every evaluation pass
+  };
+
+/*============================================================================
+  zoneset_create
+============================================================================*/
+ZoneSet *zoneset_create (void)
+  {
+  ZoneSet *self = malloc (sizeof (ZoneSet));
+  memset (self, 0, sizeof (ZoneSet));
+  self->next_id = 1;
+  return self;
+  }
+
+/*============================================================================
+  zoneset_destroy
+============================================================================*/
+void zoneset_destroy (ZoneSet *self)
+  {
+  if (self)
+    {
+    free (self->zones);
+    free (self->edges);
+    free (self->pending);
+    free (self);
+    }
+  }
+
+/*============================================================================
+  zoneset_compare_edges
+============================================================================*/
+static int zoneset_compare_edges (const void *a, const void *b)
+  {
+  double da = ((const Edge *)a)->distance;
+  double db = ((const Edge *)b)->distance;
+  if (da < db) return -1;
+  if (da > db) return 1;
+  return 0;
+  }
+
+/*============================================================================
+
+  zoneset_rebuild
+
+  Regenerate the sorted edge array and the pending list, after a zone
+  has been added or removed. This is the only place where zones are
+  sorted, so adding and removing zones is O(zones log zones), but these
+  are rare operations.
+
+============================================================================*/
+static void zoneset_rebuild (ZoneSet *self)
+  {
+  int n = self->zones_count;
+  self->edges = realloc (self->edges,
+    (n * EDGES_PER_ZONE + 1) * sizeof (Edge));
+  self->pending = realloc (self->pending, (n + 1) * sizeof (int));
+  self->pending_count = 0;
+  self->occupied = 0;
+  for (int i = 0; i < n; i++)
+    {
+    self->occupied += self->zones[i].inside;
+    const HCSR04Zone *c = &self->zones[i].config;
+    Edge *e = &self->edges[i * EDGES_PER_ZONE];
+    e[0].distance = c->near - c->hysteresis;
+    e[1].distance = c->near;
+    e[2].distance = c->far;
+    e[3].distance = c->far + c->hysteresis;
+    for (int j = 0; j < EDGES_PER_ZONE; j++)
+      e[j].zone = i;
+    if (self->zones[i].pending || self->zones[i].fresh)
+      self->pending[self->pending_count++] = i;
+    }
+  qsort (self->edges, n * EDGES_PER_ZONE, sizeof (Edge),
+    zoneset_compare_edges);
+  }
+
+/*============================================================================
+  zoneset_add
+============================================================================*/
+int zoneset_add (ZoneSet *self, const HCSR04Zone *zone)
+  {
+  assert (self != NULL);
+  assert (zone != NULL);
+  if (zone->far <= zone->near || zone->hysteresis < 0
+       || zone->dwell_msec < 0 || zone->debounce < 0)
+    return -1;
+
+  self->zones = realloc (self->zones,
+    (self->zones_count + 1) * sizeof (Zone));
+  Zone *z = &self->zones[self->zones_count];
+  memset (z, 0, sizeof (Zone));
+  z->id = self->next_id++;
+  z->config = *zone;
+  // If we already have a distance, the new zone might start out
+  //  occupied, even though no edge will be crossed. Putting it on the
+  //  pending list gets it examined on the next sample.
+  z->fresh = self->have_last;
+  self->zones_count++;
+  zoneset_rebuild (self);
+  return z->id;
+  }
+
+/*============================================================================
+  zoneset_find
+============================================================================*/
+static int zoneset_find (const ZoneSet *self, int zone_id)
+  {
+  for (int i = 0; i < self->zones_count; i++)
+    if (self->zones[i].id == zone_id) return i;
+  return -1;
+  }
+
+/*============================================================================
+  zoneset_remove
+============================================================================*/
+BOOL zoneset_remove (ZoneSet *self, int zone_id)
+  {
+  assert (self != NULL);
+  int i = zoneset_find (self, zone_id);
+  if (i < 0) return FALSE;
+  memmove (&self->zones[i], &self->zones[i + 1],
+    (self->zones_count - i - 1) * sizeof (Zone));
+  self->zones_count--;
+  zoneset_rebuild (self);
+  return TRUE;
+  }
+
+/*============================================================================
+  zoneset_is_occupied
+============================================================================*/
+BOOL zoneset_is_occupied (const ZoneSet *self, int zone_id)
+  {
+  assert (self != NULL);
+  int i = zoneset_find (self, zone_id);
+  if (i < 0) return FALSE;
+  return self->zones[i].inside;
+  }
+
+/*============================================================================
+
+  zoneset_deliver
+
+  Tell the subscriber that a zone has been entered or left. The callback,
+  if any, is called first, then the eventfd, if any, is signalled.
+
+============================================================================*/
+static void zoneset_deliver (const Zone *z, double distance)
+  {
+  HCSR04ZoneEvent event = z->inside ? HCSR04_ZONE_ENTERED : HCSR04_ZONE_LEFT;
+  if (z->config.callback)
+    z->config.callback (z->id, event, distance, z->config.user_data);
+  if (z->config.event_fd >= 0)
+    {
+    uint64_t one = 1;
+    write (z->config.event_fd, &one, sizeof (one));
+    }
+  }
+
+/*============================================================================
+
+  zoneset_evaluate_zone
+
+  Work out whether this distance supports a change of state for the zone
+  and, if it does and the dwell time and debounce count are satisfied,
+  make the change. A negative distance means there is no valid distance,
+  which is outside every zone. Returns TRUE if the zone still has a 
+  transition pending after this sample.
+
+  With hysteresis h, a zone is entered when the distance is between near
+  and far, and left when the distance is outside near-h to far+h.
+
+============================================================================*/
+static BOOL zoneset_evaluate_zone (ZoneSet *self, Zone *z, double d, 
+    int64_t time_usec)
+  {
+  const HCSR04Zone *c = &z->config;
+  BOOL want;
+  if (d < 0)
+    want = FALSE;
+  else if (z->inside)
+    want = (d >= c->near - c->hysteresis && d <= c->far + c->hysteresis);
+  else
+    want = (d >= c->near && d <= c->far);
+
+  if (want == z->inside)
+    {
+    // The distance has come back before the transition completed
+    z->pending = FALSE;
+    return FALSE;
+    }
+
+  if (!z->pending)
+    {
+    z->pending = TRUE;
+    z->pending_count = 0;
+    z->pending_since = time_usec;
+    }
+  z->pending_count++;
+
+  if (z->pending_count >= c->debounce &&
+       time_usec - z->pending_since >= (int64_t)c->dwell_msec * 1000)
+    {
+    z->inside = want;
+    z->pending = FALSE;
+    self->occupied += want ? 1 : -1;
+    zoneset_deliver (z, d);
+    return FALSE;
+    }
+  return TRUE;
+  }
+
+/*============================================================================
+
+  zoneset_lower_bound
+
+  Find the index of the first edge whose distance is not less than d
+
+============================================================================*/
+static int zoneset_lower_bound (const ZoneSet *self, double d)
+  {
+  int lo = 0, hi = self->zones_count * EDGES_PER_ZONE;
+  while (lo < hi)
+    {
+    int mid = (lo + hi) / 2;
+    if (self->edges[mid].distance < d)
+      lo = mid + 1;
+    else
+      hi = mid;
+    }
+  return lo;
+  }
+
+/*============================================================================
+  zoneset_evaluate
+============================================================================*/
+void zoneset_evaluate (ZoneSet *self, double distance, int64_t time_usec)
+  {
+  assert (self != NULL);
+  self->stamp++;
+  int still_pending = 0;
+
+  // First, zones that were already waiting to change state. Any that
+  //  are still waiting are compacted to the front of the pending list.
+  for (int i = 0; i < self->pending_count; i++)
+    {
+    Zone *z = &self->zones[self->pending[i]];
+    z->stamp = self->stamp;
+    z->fresh = FALSE;
+    if (zoneset_evaluate_zone (self, z, distance, time_usec))
+      self->pending[still_pending++] = self->pending[i];
+    }
+
+  if (!self->have_last)
+    {
+    // First sample -- there is no previous distance to compare with,
+    //  so every zone has to be examined once.
+    for (int i = 0; i < self->zones_count; i++)
+      {
+      Zone *z = &self->zones[i];
+      if (z->stamp == self->stamp) continue;
+      z->stamp = self->stamp;
+      if (zoneset_evaluate_zone (self, z, distance, time_usec))
+        self->pending[still_pending++] = i;
+      }
+    self->have_last = TRUE;
+    }
+  else
+    {
+    double lo = distance < self->last ? distance : self->last;
+    double hi = distance < self->last ? self->last : distance;
+    int n = self->zones_count * EDGES_PER_ZONE;
+    for (int i = zoneset_lower_bound (self, lo);
+          i < n && self->edges[i].distance <= hi; i++)
+      {
+      int zi = self->edges[i].zone;
+      Zone *z = &self->zones[zi];
+      if (z->stamp == self->stamp) continue;
+      z->stamp = self->stamp;
+      if (zoneset_evaluate_zone (self, z, distance, time_usec))
+        self->pending[still_pending++] = zi;
+      }
+    }
+
+  self->pending_count = still_pending;
+  self->last = distance;
+  }
+
+/*============================================================================
+  zoneset_invalidate
+============================================================================*/
+void zoneset_invalidate (ZoneSet *self, int64_t time_usec)
+  {
+  assert (self != NULL);
+  // Whatever happens, the next distance can't be compared with the last
+  self->have_last = FALSE;
+  if (self->occupied == 0 && self->pending_count == 0) return;
+  self->stamp++;
+  int still_pending = 0;
+  for (int i = 0; i < self->zones_count; i++)
+    {
+    Zone *z = &self->zones[i];
+    if (!z->inside && !z->pending) continue;
+    z->stamp = self->stamp;
+    z->fresh = FALSE;
+    if (zoneset_evaluate_zone (self, z, -1.0, time_usec))
+      self->pending[still_pending++] = i;
+    }
+  self->pending_count = still_pending;
+  }
+
@@ -0,0 +1,57 @@
+/*============================================================================
+
+  zoneset.h
+
+  Functions to track which of a set of distance zones an object is in,
+  with hysteresis, dwell time, and debounce. This is used internally by
+  the HCSR04 class, which evaluates the zones after each filtered sample.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include "defs.h"
+#include "hcsr04.h"
+
+struct ZoneSet;
+typedef struct _ZoneSet ZoneSet;
+
+BEGIN_DECLS
+
+/** Create an empty ZoneSet. Always succeeds. */
+ZoneSet  *zoneset_create (void);
+
+/** Free the ZoneSet and all its zones. */
+void      zoneset_destroy (ZoneSet *self);
+
+/** Add a zone. The configuration is copied. Returns a positive
+    zone ID, or -1 if the configuration is not sensible. */
+int       zoneset_add (ZoneSet *self, const HCSR04Zone *zone);
+
+/** Remove a zone by ID. Returns FALSE if there is no such zone. */
+BOOL      zoneset_remove (ZoneSet *self, int zone_id);
+
+/** Returns TRUE if the object is currently considered to be inside
+    the zone, that is, the last event delivered for it was
+    HCSR04_ZONE_ENTERED. */
+BOOL      zoneset_is_occupied (const ZoneSet *self, int zone_id);
+
+/** Evaluate the zones against a new distance, and deliver any events
+    that result. time_usec is the time of the sample, and is used to
+    measure dwell times. Only zones with a boundary between the previous
+    and current distance, or with a transition pending, are examined, so
+    the cost is O(log zones) plus the number of zones that change. */
+void      zoneset_evaluate (ZoneSet *self, double distance, int64_t time_usec);
+
+/** Tell the zones that there is no valid distance. Every occupied zone
+    is left, once its dwell time and debounce count allow, and events 
+    are delivered with a distance of -1.0; transitions into zones are 
+    cancelled. The next zoneset_evaluate() examines every zone, as the
+    first one does. When no zone is occupied, or waiting to change, 
+    this costs nothing. */
+void      zoneset_invalidate (ZoneSet *self, int64_t time_usec);
+
+END_DECLS
+
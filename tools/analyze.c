@@ -0,0 +1,599 @@
+/*==========================================================================
+
+    analyze.c
+
+    hcsr04-analyze -- summarize any number of binary sample logs, as
+    written by SampleLog. Logs are grouped by sensor (the pin numbers in
+    the log header), and for each sensor we report the sample rate, the
+    proportion of samples lost or invalid and why, the distribution of
+    distances, the spectrum of the measurement noise, and the jitter in
+    the cycle period.
+
+    Each log is memory-mapped and analyzed by one of a pool of worker
+    threads, so many logs are processed in parallel. Within a log, samples
+    are copied in batches into separate arrays of times, sequence numbers,
+    statuses, and distances, so that the statistics are simple loops over
+    contiguous data that the compiler can vectorize. The results for each
+    log are merged afterwards, so no locking is needed during analysis.
+
+    Usage: hcsr04-analyze [-j threads] log...
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+#include "defs.h"
+#include "hcsr04.h"
+#include "logformat.h"
+#include "logreader.h"
+
+// Number of samples copied into the arrays at a time
+#define ANALYZE_BATCH 4096
+
+// Width of a distance histogram bin, metres
+#define ANALYZE_BIN_WIDTH 0.1
+#define ANALYZE_BINS 40     // Covers HCSR04_MAX_RANGE
+
+// Number of consecutive samples in each block of the noise spectrum.
+//  Must be a power of two.
+#define ANALYZE_FFT 128
+
+// Longest run of invalid or missing samples that is bridged, by repeating
+//  the last valid distance, rather than starting a new spectrum block
+#define ANALYZE_MAX_FILL 2
+
+// A silence between samples longer than this, in usec, is taken to be a
+//  restart of the sensor, like a sequence number that goes backwards
+#define ANALYZE_RESTART_USEC 60000000LL
+#define ANALYZE_FFT_BINS (ANALYZE_FFT / 2 + 1)
+
+// Number of frequency bands the spectrum is reported in
+#define ANALYZE_BANDS 16
+
+// Stats -- the statistics for one log, or one sensor after merging
+typedef struct _Stats
+  {
+  int32_t sound_pin;
+  int32_t echo_pin;
+  int files;
+  long long samples;
+  long long missed;          // Samples missing from the sequence
+  long long status[4];       // Count of each HCSR04SampleStatus
+  // Total of the time spans of the logs, not counting the time the 
+  //  sensor was stopped, when a log was appended to after a restart
+  int64_t duration_usec;
+  long long restarts;        // Restarts found within the logs
+  // Cycle period -- count, mean, and sum of squared deviations, usec
+  long long periods;
+  double period_mean;
+  double period_m2;
+  double period_min;
+  double period_max;
+  long long histogram[ANALYZE_BINS];
+  // Sum of the periodograms of all the complete blocks
+  double spectrum[ANALYZE_FFT_BINS];
+  long long blocks;
+  } Stats;
+
+// Job -- one log, and the result of analyzing it
+typedef struct _Job
+  {
+  const char *filename;
+  BOOL ok;
+  char *error;
+  Stats stats;
+  } Job;
+
+// Analysis -- the state shared by the worker threads
+typedef struct _Analysis
+  {
+  Job *jobs;
+  int jobs_count;
+  int next;                  // Next job to take; updated atomically
+  } Analysis;
+
+// Hann window and FFT twiddle factors, filled in before the workers start
+static double window[ANALYZE_FFT];
+static double twiddle_re[ANALYZE_FFT / 2];
+static double twiddle_im[ANALYZE_FFT / 2];
+static double window_power;
+
+/*============================================================================
+  analyze_setup_fft
+============================================================================*/
+static void analyze_setup_fft (void)
+  {
+  window_power = 0;
+  for (int i = 0; i < ANALYZE_FFT; i++)
+    {
+    window[i] = 0.5 - 0.5 * cos (2 * M_PI * i / ANALYZE_FFT);
+    window_power += window[i] * window[i];
+    }
+  for (int i = 0; i < ANALYZE_FFT / 2; i++)
+    {
+    twiddle_re[i] = cos (2 * M_PI * i / ANALYZE_FFT);
+    twiddle_im[i] = -sin (2 * M_PI * i / ANALYZE_FFT);
+    }
+  }
+
+/*============================================================================
+
+  analyze_fft
+
+  In-place iterative radix-2 FFT of ANALYZE_FFT points
+
+============================================================================*/
+static void analyze_fft (double *re, double *im)
+  {
+  int n = ANALYZE_FFT;
+  for (int i = 1, j = 0; i < n; i++)
+    {
+    int bit = n >> 1;
+    for (; j & bit; bit >>= 1)
+      j ^= bit;
+    j ^= bit;
+    if (i < j)
+      {
+      double t = re[i]; re[i] = re[j]; re[j] = t;
+      t = im[i]; im[i] = im[j]; im[j] = t;
+      }
+    }
+  for (int len = 2; len <= n; len <<= 1)
+    {
+    int step = n / len;
+    for (int i = 0; i < n; i += len)
+      {
+      for (int k = 0; k < len / 2; k++)
+        {
+        double wr = twiddle_re[k * step];
+        double wi = twiddle_im[k * step];
+        int a = i + k, b = i + k + len / 2;
+        double xr = re[b] * wr - im[b] * wi;
+        double xi = re[b] * wi + im[b] * wr;
+        re[b] = re[a] - xr;
+        im[b] = im[a] - xi;
+        re[a] += xr;
+        im[a] += xi;
+        }
+      }
+    }
+  }
+
+/*============================================================================
+
+  analyze_block
+
+  Add the periodogram of one block of consecutive valid distances to the
+  spectrum. The mean is removed first, so that what remains is the noise
+  (and any genuine movement) around the average distance.
+
+============================================================================*/
+static void analyze_block (Stats *stats, const float *block)
+  {
+  double re[ANALYZE_FFT], im[ANALYZE_FFT];
+  double mean = 0;
+  for (int i = 0; i < ANALYZE_FFT; i++)
+    mean += block[i];
+  mean /= ANALYZE_FFT;
+  for (int i = 0; i < ANALYZE_FFT; i++)
+    {
+    re[i] = (block[i] - mean) * window[i];
+    im[i] = 0;
+    }
+  analyze_fft (re, im);
+  for (int i = 0; i < ANALYZE_FFT_BINS; i++)
+    stats->spectrum[i] += (re[i] * re[i] + im[i] * im[i]) / window_power;
+  stats->blocks++;
+  }
+
+/*============================================================================
+
+  analyze_merge_periods
+
+  Combine a count, mean, and sum of squared deviations with another,
+  using Chan's method, so that neither needs to be recomputed.
+
+============================================================================*/
+static void analyze_merge_periods (Stats *stats, long long n, double mean,
+      double m2)
+  {
+  if (n == 0) return;
+  long long total = stats->periods + n;
+  double delta = mean - stats->period_mean;
+  stats->period_mean += delta * n / total;
+  stats->period_m2 += m2 + delta * delta
+    * ((double)stats->periods * n / total);
+  stats->periods = total;
+  }
+
+/*============================================================================
+
+  analyze_log
+
+  Analyze one log. The samples are processed in batches: each batch is
+  copied from the mapped records into one array per field, and then
+  each statistic is a separate pass over the arrays.
+
+============================================================================*/
+static BOOL analyze_log (const char *filename, Stats *stats, char **error)
+  {
+  LogReader *reader = logreader_create (filename);
+  if (!logreader_init (reader, error))
+    {
+    logreader_destroy (reader);
+    return FALSE;
+    }
+
+  const HCSR04LogHeader *header = logreader_get_header (reader);
+  size_t count;
+  const HCSR04Sample *samples = logreader_get_samples (reader, &count);
+
+  memset (stats, 0, sizeof (Stats));
+  stats->sound_pin = header->sound_pin;
+  stats->echo_pin = header->echo_pin;
+  stats->files = 1;
+  stats->samples = count;
+  stats->period_min = INFINITY;
+  stats->period_max = -INFINITY;
+  if (count > 0)
+    stats->duration_usec = samples[count - 1].time_usec - samples[0].time_usec;
+
+  static __thread int64_t t[ANALYZE_BATCH + 1];
+  static __thread uint32_t seq[ANALYZE_BATCH + 1];
+  static __thread int32_t status[ANALYZE_BATCH];
+  static __thread uint8_t restart[ANALYZE_BATCH];
+  static __thread float raw[ANALYZE_BATCH];
+  static __thread int32_t bin[ANALYZE_BATCH];
+  static __thread double period[ANALYZE_BATCH];
+  static __thread float block[ANALYZE_FFT];
+  int block_count = 0;
+  int fill_count = 0;         // Invalid or missing samples since a valid one
+
+  for (size_t start = 0; start < count; start += ANALYZE_BATCH)
+    {
+    int n = count - start < ANALYZE_BATCH ? count - start : ANALYZE_BATCH;
+    const HCSR04Sample *s = samples + start;
+
+    // Element 0 of t and seq is the last sample of the previous batch,
+    //  so that differences can be taken across the batch boundary
+    t[0] = start > 0 ? s[-1].time_usec : s[0].time_usec;
+    seq[0] = start > 0 ? s[-1].seq : s[0].seq - 1;
+    for (int i = 0; i < n; i++)
+      {
+      t[i + 1] = s[i].time_usec;
+      seq[i + 1] = s[i].seq;
+      status[i] = s[i].status;
+      raw[i] = s[i].raw;
+      }
+
+    // Status breakdown
+    long long ok = 0, no_rise = 0, no_fall = 0, out_of_range = 0;
+    for (int i = 0; i < n; i++)
+      {
+      ok += status[i] == HCSR04_SAMPLE_OK;
+      no_rise += status[i] == HCSR04_SAMPLE_NO_RISE;
+      no_fall += status[i] == HCSR04_SAMPLE_NO_FALL;
+      out_of_range += status[i] == HCSR04_SAMPLE_OUT_OF_RANGE;
+      }
+    stats->status[HCSR04_SAMPLE_OK] += ok;
+    stats->status[HCSR04_SAMPLE_NO_RISE] += no_rise;
+    stats->status[HCSR04_SAMPLE_NO_FALL] += no_fall;
+    stats->status[HCSR04_SAMPLE_OUT_OF_RANGE] += out_of_range;
+
+    // Restarts. SampleLog appends to an existing log, and the sequence
+    //  numbers start again from zero when the sensor is restarted, so
+    //  a sequence number that goes backwards, or a long silence, 
+    //  starts a new run. Nothing is missing between runs, and the time
+    //  between them is not counted.
+    long long restarts = 0;
+    int64_t stopped = 0;
+    for (int i = 0; i < n; i++)
+      {
+      int64_t dt = t[i + 1] - t[i];
+      restart[i] = (int32_t)(seq[i + 1] - seq[i]) <= 0 || dt < 0 
+        || dt > ANALYZE_RESTART_USEC;
+      restarts += restart[i];
+      stopped += restart[i] ? dt : 0;
+      }
+    stats->restarts += restarts;
+    stats->duration_usec -= stopped;
+
+    // Missing samples, and the periods between consecutive samples. A
+    //  period that spans missing samples, or a restart, is not a cycle 
+    //  period.
+    long long missed = 0;
+    int periods = 0;
+    for (int i = 0; i < n; i++)
+      {
+      if (restart[i]) continue;
+      uint32_t gap = seq[i + 1] - seq[i] - 1;
+      missed += gap;
+      if (gap == 0 && (start > 0 || i > 0))
+        period[periods++] = t[i + 1] - t[i];
+      }
+    stats->missed += missed;
+
+    if (periods > 0)
+      {
+      double sum = 0, min = period[0], max = period[0];
+      for (int i = 0; i < periods; i++)
+        {
+        sum += period[i];
+        min = period[i] < min ? period[i] : min;
+        max = period[i] > max ? period[i] : max;
+        }
+      double mean = sum / periods, m2 = 0;
+      for (int i = 0; i < periods; i++)
+        m2 += (period[i] - mean) * (period[i] - mean);
+      analyze_merge_periods (stats, periods, mean, m2);
+      if (min < stats->period_min) stats->period_min = min;
+      if (max > stats->period_max) stats->period_max = max;
+      }
+
+    // Distance histogram, of valid samples only
+    for (int i = 0; i < n; i++)
+      {
+      int b = (int)(raw[i] / ANALYZE_BIN_WIDTH);
+      b = b < 0 ? 0 : b;
+      b = b >= ANALYZE_BINS ? ANALYZE_BINS - 1 : b;
+      bin[i] = status[i] == HCSR04_SAMPLE_OK ? b : -1;
+      }
+    for (int i = 0; i < n; i++)
+      if (bin[i] >= 0) stats->histogram[bin[i]]++;
+
+    // Noise spectrum, over runs of consecutive samples. Short runs of
+    //  invalid or missing samples are filled with the last valid 
+    //  distance; a longer run, or a restart, starts a new block.
+    for (int i = 0; i < n; i++)
+      {
+      if (restart[i])
+        {
+        block_count = 0;
+        fill_count = 0;
+        }
+      int fill = restart[i] ? 0 : (int)(seq[i + 1] - seq[i] - 1);
+      if (status[i] != HCSR04_SAMPLE_OK) fill++;
+      if (fill > 0)
+        {
+        fill_count += fill;
+        if (fill_count > ANALYZE_MAX_FILL)
+          block_count = 0;
+        else
+          {
+          for (int f = 0; f < fill && block_count > 0; f++)
+            {
+            block[block_count] = block[block_count - 1];
+            if (++block_count == ANALYZE_FFT)
+              {
+              analyze_block (stats, block);
+              block_count = 0;
+              }
+            }
+          }
+        if (status[i] != HCSR04_SAMPLE_OK) continue;
+        }
+      fill_count = 0;
+      block[block_count++] = raw[i];
+      if (block_count == ANALYZE_FFT)
+        {
+        analyze_block (stats, block);
+        block_count = 0;
+        }
+      }
+    }
+
+  logreader_destroy (reader);
+  return TRUE;
+  }
+
+/*============================================================================
+  analyze_worker
+============================================================================*/
+static void *analyze_worker (void *data)
+  {
+  Analysis *analysis = data;
+  int i;
+  while ((i = __atomic_fetch_add (&analysis->next, 1, __ATOMIC_RELAXED))
+       < analysis->jobs_count)
+    {
+    Job *job = &analysis->jobs[i];
+    job->ok = analyze_log (job->filename, &job->stats, &job->error);
+    }
+  return NULL;
+  }
+
+/*============================================================================
+  analyze_merge
+============================================================================*/
+static void analyze_merge (Stats *into, const Stats *from)
+  {
+  if (into->files == 0)
+    {
+    *into = *from;
+    return;
+    }
+  into->files += from->files;
+  into->duration_usec += from->duration_usec;
+  into->samples += from->samples;
+  into->missed += from->missed;
+  into->restarts += from->restarts;
+  for (int i = 0; i < 4; i++)
+    into->status[i] += from->status[i];
+  analyze_merge_periods (into, from->periods, from->period_mean,
+    from->period_m2);
+  if (from->period_min < into->period_min)
+    into->period_min = from->period_min;
+  if (from->period_max > into->period_max)
+    into->period_max = from->period_max;
+  for (int i = 0; i < ANALYZE_BINS; i++)
+    into->histogram[i] += from->histogram[i];
+  for (int i = 0; i < ANALYZE_FFT_BINS; i++)
+    into->spectrum[i] += from->spectrum[i];
+  into->blocks += from->blocks;
+  }
+
+/*============================================================================
+  analyze_percent
+============================================================================*/
+static double analyze_percent (long long n, long long total)
+  {
+  return total > 0 ? 100.0 * n / total : 0;
+  }
+
+/*============================================================================
+  analyze_report
+============================================================================*/
+static void analyze_report (const Stats *s)
+  {
+  printf ("Sensor %d/%d: %d log(s)\n", s->sound_pin, s->echo_pin, s->files);
+
+  double span = s->duration_usec / 1e6;
+  printf ("  samples      %lld over %.1f s", s->samples, span);
+  if (span > 0) printf (" (%.1f/s)", s->samples / span);
+  if (s->restarts > 0) printf (", %lld restart(s)", s->restarts);
+  printf ("\n");
+
+  long long expected = s->samples + s->missed;
+  long long invalid = s->samples - s->status[HCSR04_SAMPLE_OK];
+  printf ("  dropout      %.2f%% (missed %.2f%%, no rise %.2f%%, "
+          "no fall %.2f%%, out of range %.2f%%)\n",
+    analyze_percent (invalid + s->missed, expected),
+    analyze_percent (s->missed, expected),
+    analyze_percent (s->status[HCSR04_SAMPLE_NO_RISE], expected),
+    analyze_percent (s->status[HCSR04_SAMPLE_NO_FALL], expected),
+    analyze_percent (s->status[HCSR04_SAMPLE_OUT_OF_RANGE], expected));
+
+  if (s->periods > 0)
+    {
+    double sd = s->periods > 1 ? sqrt (s->period_m2 / (s->periods - 1)) : 0;
+    printf ("  cycle        mean %.3f ms, jitter (sd) %.3f ms, "
+            "min %.3f ms, max %.3f ms\n", s->period_mean / 1000, sd / 1000,
+       s->period_min / 1000, s->period_max / 1000);
+    }
+
+  long long ok = s->status[HCSR04_SAMPLE_OK];
+  if (ok > 0)
+    {
+    long long biggest = 0;
+    for (int i = 0; i < ANALYZE_BINS; i++)
+      if (s->histogram[i] > biggest) biggest = s->histogram[i];
+    printf ("  distance\n");
+    for (int i = 0; i < ANALYZE_BINS; i++)
+      {
+      if (s->histogram[i] == 0) continue;
+      int bar = (int)(50 * s->histogram[i] / biggest);
+      printf ("    %4.1f-%4.1f m %6.2f%% %.*s\n", i * ANALYZE_BIN_WIDTH,
+        (i + 1) * ANALYZE_BIN_WIDTH, analyze_percent (s->histogram[i], ok),
+        bar > 0 ? bar : 1,
+        "##################################################");
+      }
+    }
+
+  if (s->blocks > 0 && s->periods > 0)
+    {
+    // The spectrum is reported in bands, as the one-sided power spectral
+    //  density averaged over the band, in dB relative to 1 mm^2/Hz
+    double rate = 1e6 / s->period_mean;
+    double bin_hz = rate / ANALYZE_FFT;
+    int per_band = (ANALYZE_FFT_BINS - 1) / ANALYZE_BANDS;
+    printf ("  noise spectrum (%lld blocks of %d samples)\n", s->blocks,
+      ANALYZE_FFT);
+    for (int band = 0; band < ANALYZE_BANDS; band++)
+      {
+      double power = 0;
+      int first = 1 + band * per_band;
+      for (int i = first; i < first + per_band; i++)
+        power += s->spectrum[i];
+      double psd = 2 * power / per_band / s->blocks / rate * 1e6;
+      printf ("    %7.2f-%7.2f Hz %7.1f dB\n", (first - 0.5) * bin_hz,
+        (first + per_band - 0.5) * bin_hz,
+        psd > 0 ? 10 * log10 (psd) : -INFINITY);
+      }
+    }
+  }
+
+/*============================================================================
+  main
+============================================================================*/
+int main (int argc, char **argv)
+  {
+  int threads = sysconf (_SC_NPROCESSORS_ONLN);
+  int opt;
+  while ((opt = getopt (argc, argv, "j:")) != -1)
+    {
+    switch (opt)
+      {
+      case 'j':
+        threads = atoi (optarg);
+        break;
+      default:
+        fprintf (stderr, "Usage: %s [-j threads] log...\n", argv[0]);
+        return 1;
+      }
+    }
+  if (optind >= argc)
+    {
+    fprintf (stderr, "Usage: %s [-j threads] log...\n", argv[0]);
+    return 1;
+    }
+
+  Analysis analysis;
+  analysis.jobs_count = argc - optind;
+  analysis.jobs = calloc (analysis.jobs_count, sizeof (Job));
+  analysis.next = 0;
+  for (int i = 0; i < analysis.jobs_count; i++)
+    analysis.jobs[i].filename = argv[optind + i];
+
+  if (threads < 1) threads = 1;
+  if (threads > analysis.jobs_count) threads = analysis.jobs_count;
+
+  analyze_setup_fft ();
+  pthread_t *workers = malloc (threads * sizeof (pthread_t));
+  for (int i = 0; i < threads; i++)
+    pthread_create (&workers[i], NULL, analyze_worker, &analysis);
+  for (int i = 0; i < threads; i++)
+    pthread_join (workers[i], NULL);
+  free (workers);
+
+  // Merge the logs for each sensor. There are seldom more than a few
+  //  sensors, so a linear search is fine.
+  int ret = 0;
+  Stats *sensors = NULL;
+  int sensors_count = 0;
+  for (int i = 0; i < analysis.jobs_count; i++)
+    {
+    Job *job = &analysis.jobs[i];
+    if (!job->ok)
+      {
+      fprintf (stderr, "%s: %s\n", job->filename, job->error);
+      free (job->error);
+      ret = 1;
+      continue;
+      }
+    int j;
+    for (j = 0; j < sensors_count; j++)
+      if (sensors[j].sound_pin == job->stats.sound_pin
+           && sensors[j].echo_pin == job->stats.echo_pin) break;
+    if (j == sensors_count)
+      {
+      sensors = realloc (sensors, (sensors_count + 1) * sizeof (Stats));
+      memset (&sensors[sensors_count++], 0, sizeof (Stats));
+      }
+    analyze_merge (&sensors[j], &job->stats);
+    }
+
+  for (int i = 0; i < sensors_count; i++)
+    analyze_report (&sensors[i]);
+
+  free (sensors);
+  free (analysis.jobs);
+  return ret;
+  }
+
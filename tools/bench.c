@@ -0,0 +1,200 @@
+/*==========================================================================
+
+    bench.c
+
+    hcsr04-bench -- measure the cost of processing a sample -- filtering,
+    validity tracking, zones, and publication -- as the number of sensors
+    grows. For each size, the same synthetic echoes are processed three
+    times: by separate HCSR04 objects, one hcsr04_process_sample() call 
+    per sensor, each keeping its own filter; by the same, but with their
+    filters in one shared FilterBank, as a HCSR04Executor keeps them; and
+    by a HCSR04Group, whose sensors share a FilterBank that is updated 
+    for all of them at once. Each sensor watches one zone, and has one 
+    sample callback. No GPIO is used.
+
+    The result is the mean time per sample, in nsec, which should stay
+    about the same as the number of sensors grows.
+
+    Usage: hcsr04-bench [-c cycles]
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include "defs.h"
+#include "hcsr04.h"
+#include "hcsr04group.h"
+#include "filterbank.h"
+
+#define DEFAULT_CYCLES 20000
+
+// Echo width, and how much it wanders from cycle to cycle, in usec
+#define BENCH_ECHO 5000
+#define BENCH_WANDER 500
+
+// Start of the echo, usec after the trigger
+#define BENCH_RISE 450
+
+/*============================================================================
+  bench_now
+============================================================================*/
+static int64_t bench_now (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  }
+
+/*============================================================================
+  bench_callback
+============================================================================*/
+static void bench_callback (const HCSR04Sample *sample, void *user_data)
+  {
+  uint64_t *seen = user_data;
+  *seen += sample->seq;
+  }
+
+/*============================================================================
+
+  bench_fill
+
+  Make up one cycle's samples. Every seventh is missing its echo, so
+  that the filters see some invalid samples too.
+
+============================================================================*/
+static void bench_fill (HCSR04Sample *samples, int n, int cycle)
+  {
+  for (int i = 0; i < n; i++)
+    {
+    HCSR04Sample *s = &samples[i];
+    memset (s, 0, sizeof (HCSR04Sample));
+    s->time_usec = cycle;
+    if ((cycle + i) % 7 == 0)
+      {
+      s->rise_usec = -1;
+      s->fall_usec = -1;
+      }
+    else
+      {
+      s->rise_usec = BENCH_RISE;
+      s->fall_usec = BENCH_RISE + BENCH_ECHO
+        + (cycle * 37 + i * 11) % BENCH_WANDER;
+      }
+    }
+  }
+
+/*============================================================================
+
+  bench_setup
+
+  Give a sensor a zone and a callback
+
+============================================================================*/
+static void bench_setup (HCSR04 *hcsr04, uint64_t *seen)
+  {
+  HCSR04Zone zone;
+  hcsr04_zone_init (&zone, 0.5, 0.9);
+  hcsr04_add_zone (hcsr04, &zone);
+  hcsr04_add_sample_callback (hcsr04, bench_callback, seen);
+  }
+
+/*============================================================================
+
+  bench_single
+
+  Separate sensors, with their filters in bank, if it is not NULL
+
+============================================================================*/
+static double bench_single (int n, int cycles, uint64_t *seen, 
+    FilterBank *bank)
+  {
+  HCSR04 *sensors[HCSR04GROUP_MAX_SENSORS];
+  for (int i = 0; i < n; i++)
+    {
+    sensors[i] = hcsr04_create (0, i, 0, 0.5);
+    if (bank) hcsr04_set_filter_bank (sensors[i], bank, i);
+    bench_setup (sensors[i], seen);
+    }
+  HCSR04Sample samples[HCSR04GROUP_MAX_SENSORS];
+  int64_t total = 0;
+  for (int c = 0; c < cycles; c++)
+    {
+    bench_fill (samples, n, c);
+    int64_t start = bench_now();
+    for (int i = 0; i < n; i++)
+      hcsr04_process_sample (sensors[i], &samples[i], -1);
+    total += bench_now() - start;
+    }
+  for (int i = 0; i < n; i++)
+    hcsr04_destroy (sensors[i]);
+  return (double)total / ((double)cycles * n);
+  }
+
+/*============================================================================
+  bench_group
+============================================================================*/
+static double bench_group (int n, int cycles, uint64_t *seen)
+  {
+  int echoes[HCSR04GROUP_MAX_SENSORS] = { 0 };
+  for (int i = 0; i < n; i++)
+    echoes[i] = i;
+  HCSR04Group *group = hcsr04group_create (0, echoes, n, 0, 0.5);
+  for (int i = 0; i < n; i++)
+    bench_setup (hcsr04group_get_sensor (group, i), seen);
+  HCSR04Sample samples[HCSR04GROUP_MAX_SENSORS];
+  int64_t total = 0;
+  for (int c = 0; c < cycles; c++)
+    {
+    bench_fill (samples, n, c);
+    int64_t start = bench_now();
+    hcsr04group_process_samples (group, samples, -1);
+    total += bench_now() - start;
+    }
+  hcsr04group_destroy (group);
+  return (double)total / ((double)cycles * n);
+  }
+
+/*============================================================================
+  main
+============================================================================*/
+int main (int argc, char **argv)
+  {
+  int cycles = DEFAULT_CYCLES;
+  int opt;
+  while ((opt = getopt (argc, argv, "c:")) != -1)
+    {
+    switch (opt)
+      {
+      case 'c':
+        cycles = atoi (optarg);
+        break;
+      default:
+        fprintf (stderr, "Usage: %s [-c cycles]\n", argv[0]);
+        return 1;
+      }
+    }
+  if (cycles < 1) cycles = 1;
+
+  uint64_t seen = 0;
+  printf ("%8s %18s %18s %18s\n", "sensors", "single ns/sample", 
+    "bank ns/sample", "group ns/sample");
+  for (int n = 1; n <= HCSR04GROUP_MAX_SENSORS; n *= 2)
+    {
+    double single = bench_single (n, cycles, &seen, NULL);
+    FilterBank *bank = filterbank_create (n);
+    double banked = bench_single (n, cycles, &seen, bank);
+    filterbank_destroy (bank);
+    double group = bench_group (n, cycles, &seen);
+    printf ("%8d %18.1f %18.1f %18.1f\n", n, single, banked, group);
+    }
+  // Keep the callbacks from being optimized away
+  if (seen == 0) printf ("No samples were published\n");
+  return 0;
+  }
+
@@ -0,0 +1,555 @@
+/*==========================================================================
+
+    fakegpio.c
+
+    A fake GPIO sysfs tree, with a thread that emulates the kernel and
+    HC-SR04 sensors. See fakegpio.h.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include "defs.h"
+#include "hcsr04.h"
+#include "fakegpio.h"
+
+typedef struct _FakePin
+  {
+  BOOL exported;
+  int fd;        // The helper's end of the value FIFO
+  BOOL level;
+  } FakePin;
+
+typedef struct _FakeSensor
+  {
+  int trigger_pin;
+  int echo_pin;
+  double distance;
+  int pulses;
+  int64_t rise_at; // When the echo pin goes high, or 0 if not pending
+  int64_t fall_at; // When it goes low again, or 0
+  } FakeSensor;
+
+struct _FakeGPIO
+  {
+  char root[64];     // A short temporary directory name
+  pthread_t pthread;
+  BOOL running;
+  int wake_fd;     // Signalled to stop the helper thread
+  int inotify_fd;  // Watches root, for writes to export and unexport
+  pthread_mutex_t lock; // Protects everything below
+  FakePin pins[FAKEGPIO_MAX_PINS];
+  FakeSensor sensors[FAKEGPIO_MAX_SENSORS];
+  int sensors_count;
+  };
+
+/*============================================================================
+  fakegpio_now
+============================================================================*/
+static int64_t fakegpio_now (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+/*============================================================================
+  fakegpio_write_file
+============================================================================*/
+static void fakegpio_write_file (const char *path, const char *text)
+  {
+  int fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+  if (fd >= 0)
+    {
+    write (fd, text, strlen (text));
+    close (fd);
+    }
+  }
+
+/*============================================================================
+  fakegpio_create
+============================================================================*/
+FakeGPIO *fakegpio_create (void)
+  {
+  FakeGPIO *self = malloc (sizeof (FakeGPIO));
+  memset (self, 0, sizeof (FakeGPIO));
+  self->wake_fd = -1;
+  self->inotify_fd = -1;
+  for (int i = 0; i < FAKEGPIO_MAX_PINS; i++)
+    self->pins[i].fd = -1;
+  pthread_mutex_init (&self->lock, NULL);
+  return self;
+  }
+
+/*============================================================================
+  fakegpio_destroy
+============================================================================*/
+void fakegpio_destroy (FakeGPIO *self)
+  {
+  if (self)
+    {
+    fakegpio_uninit (self);
+    pthread_mutex_destroy (&self->lock);
+    free (self);
+    }
+  }
+
+/*============================================================================
+
+  fakegpio_do_export
+
+  Make a pin's directory. The files are made in a directory with another
+  name, which is then renamed, so nothing sees a directory that is only
+  partly set up. Must be called with the lock held.
+
+============================================================================*/
+static void fakegpio_do_export (FakeGPIO *self, int pin)
+  {
+  if (pin < 0 || pin >= FAKEGPIO_MAX_PINS) return;
+  FakePin *p = &self->pins[pin];
+  if (p->exported) return;
+  char tmp[96], dir[96], path[128];
+  snprintf (tmp, sizeof (tmp), "%s/.gpio%d", self->root, pin);
+  snprintf (dir, sizeof (dir), "%s/gpio%d", self->root, pin);
+  mkdir (tmp, 0775);
+  snprintf (path, sizeof (path), "%s/direction", tmp);
+  fakegpio_write_file (path, "in\n");
+  snprintf (path, sizeof (path), "%s/edge", tmp);
+  fakegpio_write_file (path, "none\n");
+  snprintf (path, sizeof (path), "%s/value", tmp);
+  mkfifo (path, 0664);
+  rename (tmp, dir);
+  snprintf (path, sizeof (path), "%s/value", dir);
+  // Opening read-write means the FIFO never blocks, or reports end of
+  //  file, whatever the program under test does with its end
+  p->fd = open (path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  p->level = LOW;
+  p->exported = TRUE;
+  }
+
+/*============================================================================
+
+  fakegpio_do_unexport
+
+  Must be called with the lock held
+
+============================================================================*/
+static void fakegpio_do_unexport (FakeGPIO *self, int pin)
+  {
+  if (pin < 0 || pin >= FAKEGPIO_MAX_PINS) return;
+  FakePin *p = &self->pins[pin];
+  if (!p->exported) return;
+  if (p->fd >= 0) close (p->fd);
+  p->fd = -1;
+  p->exported = FALSE;
+  char path[128];
+  const char *files[] = { "direction", "edge", "value" };
+  for (int i = 0; i < 3; i++)
+    {
+    snprintf (path, sizeof (path), "%s/gpio%d/%s", self->root, pin,
+      files[i]);
+    unlink (path);
+    }
+  snprintf (path, sizeof (path), "%s/gpio%d", self->root, pin);
+  rmdir (path);
+  }
+
+/*============================================================================
+
+  fakegpio_do_set_level
+
+  Change the level of an input pin, and report an edge to whatever is
+  reading the pin, if it matches the edge setting. Must be called with
+  the lock held.
+
+============================================================================*/
+static void fakegpio_do_set_level (FakeGPIO *self, int pin, BOOL level)
+  {
+  if (pin < 0 || pin >= FAKEGPIO_MAX_PINS) return;
+  FakePin *p = &self->pins[pin];
+  if (p->level == level) return;
+  p->level = level;
+  if (!p->exported) return;
+  char path[128], edge[16];
+  snprintf (path, sizeof (path), "%s/gpio%d/edge", self->root, pin);
+  memset (edge, 0, sizeof (edge));
+  int fd = open (path, O_RDONLY);
+  if (fd >= 0)
+    {
+    read (fd, edge, sizeof (edge) - 1);
+    close (fd);
+    }
+  if (strncmp (edge, "both", 4) == 0
+      || (level && strncmp (edge, "rising", 6) == 0)
+      || (!level && strncmp (edge, "falling", 7) == 0))
+    {
+    char c = level ? '1' : '0';
+    write (p->fd, &c, 1);
+    }
+  }
+
+/*============================================================================
+
+  fakegpio_handle_file
+
+  Act on a write to export or unexport. Must be called with the lock held.
+
+============================================================================*/
+static void fakegpio_handle_file (FakeGPIO *self, const char *name)
+  {
+  BOOL export = strcmp (name, "export") == 0;
+  if (!export && strcmp (name, "unexport") != 0) return;
+  char path[128], text[32];
+  snprintf (path, sizeof (path), "%s/%s", self->root, name);
+  memset (text, 0, sizeof (text));
+  int fd = open (path, O_RDONLY);
+  if (fd < 0) return;
+  int n = read (fd, text, sizeof (text) - 1);
+  close (fd);
+  if (n <= 0) return;
+  // Empty the file, without closing a writable descriptor, which would
+  //  cause another event
+  truncate (path, 0);
+  if (export)
+    fakegpio_do_export (self, atoi (text));
+  else
+    fakegpio_do_unexport (self, atoi (text));
+  }
+
+/*============================================================================
+
+  fakegpio_handle_trigger
+
+  Read the values written to a sensor's trigger pin. The end of a pulse
+  sets off an echo. Must be called with the lock held.
+
+============================================================================*/
+static void fakegpio_handle_trigger (FakeGPIO *self, int pin)
+  {
+  FakePin *p = &self->pins[pin];
+  char buff[64];
+  int n;
+  while ((n = read (p->fd, buff, sizeof (buff))) > 0)
+    {
+    for (int i = 0; i < n; i++)
+      {
+      BOOL level = (buff[i] == '1');
+      if (buff[i] != '0' && buff[i] != '1') continue;
+      if (p->level && !level)
+        {
+        for (int j = 0; j < self->sensors_count; j++)
+          {
+          FakeSensor *s = &self->sensors[j];
+          if (s->trigger_pin != pin) continue;
+          s->pulses++;
+          if (s->distance < 0) continue;
+          s->rise_at = fakegpio_now() + FAKEGPIO_ECHO_DELAY;
+          s->fall_at = s->rise_at
+            + (int64_t)(s->distance / HCSR04_USEC_TO_METRES);
+          }
+        }
+      p->level = level;
+      }
+    }
+  }
+
+/*============================================================================
+
+  fakegpio_loop
+
+  The helper thread
+
+============================================================================*/
+static void *fakegpio_loop (void *arg)
+  {
+  FakeGPIO *self = arg;
+  BOOL stop = FALSE;
+  while (!stop)
+    {
+    struct pollfd fdset[2 + FAKEGPIO_MAX_SENSORS];
+    int pins[2 + FAKEGPIO_MAX_SENSORS];
+    int nfds = 0;
+    fdset[nfds++].fd = self->wake_fd;
+    fdset[nfds++].fd = self->inotify_fd;
+    int64_t next = 0;
+
+    pthread_mutex_lock (&self->lock);
+    for (int i = 0; i < self->sensors_count; i++)
+      {
+      FakeSensor *s = &self->sensors[i];
+      FakePin *p = &self->pins[s->trigger_pin];
+      if (p->exported)
+        {
+        pins[nfds] = s->trigger_pin;
+        fdset[nfds++].fd = p->fd;
+        }
+      if (s->rise_at && (!next || s->rise_at < next)) next = s->rise_at;
+      if (s->fall_at && (!next || s->fall_at < next)) next = s->fall_at;
+      }
+    pthread_mutex_unlock (&self->lock);
+
+    for (int i = 0; i < nfds; i++)
+      {
+      fdset[i].events = POLLIN;
+      fdset[i].revents = 0;
+      }
+    // Echo edges have to be timed to the microsecond, so use ppoll()
+    struct timespec ts, *timeout = NULL;
+    if (next)
+      {
+      int64_t wait = next - fakegpio_now();
+      if (wait < 0) wait = 0;
+      ts.tv_sec = wait / 1000000;
+      ts.tv_nsec = (wait % 1000000) * 1000;
+      timeout = &ts;
+      }
+    ppoll (fdset, nfds, timeout, NULL);
+    if (fdset[0].revents & POLLIN)
+      {
+      stop = TRUE;
+      continue;
+      }
+
+    pthread_mutex_lock (&self->lock);
+    if (fdset[1].revents & POLLIN)
+      {
+      char buff[4096] __attribute__ ((aligned (8)));
+      int n;
+      while ((n = read (self->inotify_fd, buff, sizeof (buff))) > 0)
+        {
+        for (char *e = buff; e < buff + n; )
+          {
+          struct inotify_event *event = (struct inotify_event *)e;
+          if (event->len > 0)
+            fakegpio_handle_file (self, event->name);
+          e += sizeof (struct inotify_event) + event->len;
+          }
+        }
+      }
+    for (int i = 2; i < nfds; i++)
+      {
+      if (fdset[i].revents & POLLIN)
+        fakegpio_handle_trigger (self, pins[i]);
+      }
+    int64_t now = fakegpio_now();
+    for (int i = 0; i < self->sensors_count; i++)
+      {
+      FakeSensor *s = &self->sensors[i];
+      if (s->rise_at && s->rise_at <= now)
+        {
+        fakegpio_do_set_level (self, s->echo_pin, HIGH);
+        s->rise_at = 0;
+        }
+      if (s->fall_at && s->fall_at <= now && !s->rise_at)
+        {
+        fakegpio_do_set_level (self, s->echo_pin, LOW);
+        s->fall_at = 0;
+        }
+      }
+    pthread_mutex_unlock (&self->lock);
+    }
+  return NULL;
+  }
+
+/*============================================================================
+  fakegpio_init
+============================================================================*/
+BOOL fakegpio_init (FakeGPIO *self, char **error)
+  {
+  assert (self != NULL);
+  // tmpfs, if there is one
+  const char *base = access ("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp";
+  snprintf (self->root, sizeof (self->root), "%s/hcsr04-gpio-XXXXXX", base);
+  if (!mkdtemp (self->root))
+    {
+    if (error)
+      asprintf (error, "Can't create %s: %s", self->root, strerror (errno));
+    self->root[0] = 0;
+    return FALSE;
+    }
+  char path[128];
+  snprintf (path, sizeof (path), "%s/export", self->root);
+  fakegpio_write_file (path, "");
+  snprintf (path, sizeof (path), "%s/unexport", self->root);
+  fakegpio_write_file (path, "");
+
+  self->wake_fd = eventfd (0, EFD_CLOEXEC);
+  self->inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (self->wake_fd < 0 || self->inotify_fd < 0
+       || inotify_add_watch (self->inotify_fd, self->root,
+            IN_CLOSE_WRITE) < 0)
+    {
+    if (error)
+      asprintf (error, "Can't watch %s: %s", self->root, strerror (errno));
+    fakegpio_uninit (self);
+    return FALSE;
+    }
+  int err = pthread_create (&self->pthread, NULL, fakegpio_loop, self);
+  if (err != 0)
+    {
+    if (error)
+      asprintf (error, "Can't start helper thread: %s", strerror (err));
+    fakegpio_uninit (self);
+    return FALSE;
+    }
+  self->running = TRUE;
+  return TRUE;
+  }
+
+/*============================================================================
+  fakegpio_uninit
+============================================================================*/
+void fakegpio_uninit (FakeGPIO *self)
+  {
+  assert (self != NULL);
+  if (self->running)
+    {
+    uint64_t one = 1;
+    write (self->wake_fd, &one, sizeof (one));
+    pthread_join (self->pthread, NULL);
+    self->running = FALSE;
+    }
+  if (self->wake_fd >= 0) close (self->wake_fd);
+  self->wake_fd = -1;
+  if (self->inotify_fd >= 0) close (self->inotify_fd);
+  self->inotify_fd = -1;
+  if (self->root[0])
+    {
+    for (int i = 0; i < FAKEGPIO_MAX_PINS; i++)
+      fakegpio_do_unexport (self, i);
+    char path[128];
+    snprintf (path, sizeof (path), "%s/export", self->root);
+    unlink (path);
+    snprintf (path, sizeof (path), "%s/unexport", self->root);
+    unlink (path);
+    rmdir (self->root);
+    self->root[0] = 0;
+    }
+  }
+
+/*============================================================================
+  fakegpio_get_root
+============================================================================*/
+const char *fakegpio_get_root (const FakeGPIO *self)
+  {
+  assert (self != NULL);
+  return self->root;
+  }
+
+/*============================================================================
+  fakegpio_export
+============================================================================*/
+void fakegpio_export (FakeGPIO *self, int pin)
+  {
+  assert (self != NULL);
+  pthread_mutex_lock (&self->lock);
+  fakegpio_do_export (self, pin);
+  pthread_mutex_unlock (&self->lock);
+  }
+
+/*============================================================================
+  fakegpio_is_exported
+============================================================================*/
+BOOL fakegpio_is_exported (FakeGPIO *self, int pin)
+  {
+  assert (self != NULL);
+  assert (pin >= 0 && pin < FAKEGPIO_MAX_PINS);
+  pthread_mutex_lock (&self->lock);
+  BOOL ret = self->pins[pin].exported;
+  pthread_mutex_unlock (&self->lock);
+  return ret;
+  }
+
+/*============================================================================
+  fakegpio_set_level
+============================================================================*/
+void fakegpio_set_level (FakeGPIO *self, int pin, BOOL level)
+  {
+  assert (self != NULL);
+  pthread_mutex_lock (&self->lock);
+  fakegpio_do_set_level (self, pin, level);
+  pthread_mutex_unlock (&self->lock);
+  }
+
+/*============================================================================
+  fakegpio_get_level
+============================================================================*/
+BOOL fakegpio_get_level (FakeGPIO *self, int pin)
+  {
+  assert (self != NULL);
+  assert (pin >= 0 && pin < FAKEGPIO_MAX_PINS);
+  pthread_mutex_lock (&self->lock);
+  FakePin *p = &self->pins[pin];
+  // An output pin that isn't a sensor's trigger isn't read by the
+  //  helper thread, so catch up with it here
+  char buff[64];
+  int n;
+  while (p->exported && (n = read (p->fd, buff, sizeof (buff))) > 0)
+    p->level = (buff[n - 1] == '1');
+  BOOL ret = p->level;
+  pthread_mutex_unlock (&self->lock);
+  return ret;
+  }
+
+/*============================================================================
+  fakegpio_add_sensor
+============================================================================*/
+void fakegpio_add_sensor (FakeGPIO *self, int trigger_pin, int echo_pin,
+      double distance)
+  {
+  assert (self != NULL);
+  assert (trigger_pin >= 0 && trigger_pin < FAKEGPIO_MAX_PINS);
+  assert (echo_pin >= 0 && echo_pin < FAKEGPIO_MAX_PINS);
+  pthread_mutex_lock (&self->lock);
+  if (self->sensors_count < FAKEGPIO_MAX_SENSORS)
+    {
+    FakeSensor *s = &self->sensors[self->sensors_count++];
+    memset (s, 0, sizeof (FakeSensor));
+    s->trigger_pin = trigger_pin;
+    s->echo_pin = echo_pin;
+    s->distance = distance;
+    }
+  pthread_mutex_unlock (&self->lock);
+  }
+
+/*============================================================================
+  fakegpio_set_distance
+============================================================================*/
+void fakegpio_set_distance (FakeGPIO *self, int echo_pin, double distance)
+  {
+  assert (self != NULL);
+  pthread_mutex_lock (&self->lock);
+  for (int i = 0; i < self->sensors_count; i++)
+    if (self->sensors[i].echo_pin == echo_pin)
+      self->sensors[i].distance = distance;
+  pthread_mutex_unlock (&self->lock);
+  }
+
+/*============================================================================
+  fakegpio_get_pulses
+============================================================================*/
+int fakegpio_get_pulses (FakeGPIO *self, int echo_pin)
+  {
+  assert (self != NULL);
+  int ret = 0;
+  pthread_mutex_lock (&self->lock);
+  for (int i = 0; i < self->sensors_count; i++)
+    if (self->sensors[i].echo_pin == echo_pin)
+      ret = self->sensors[i].pulses;
+  pthread_mutex_unlock (&self->lock);
+  return ret;
+  }
+
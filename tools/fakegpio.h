@@ -0,0 +1,91 @@
+/*============================================================================
+
+  fakegpio.h
+
+  A fake GPIO sysfs tree, for testing the sysfs backend on a machine that
+  has no GPIO. The tree is made in a temporary directory on tmpfs, and
+  a helper thread emulates the kernel: writing a pin number to "export"
+  creates the pin's directory, with "direction", "edge", and "value"
+  files, and writing it to "unexport" removes it again.
+
+  sysfs signals an edge on a value file with POLLPRI, which nothing but
+  the kernel can produce. So here each value file is a FIFO, and an edge
+  is a byte written to it -- the new value, '0' or '1' -- if it matches
+  the pin's "edge" setting. gpiopin recognizes a FIFO, and waits for it to
+  become readable instead. Values written by the program under test,
+  to output pins, arrive at the helper thread the same way.
+
+  The helper thread can also play the part of HC-SR04 sensors: when the
+  trigger pin of a sensor is pulsed, its echo pin goes high shortly
+  afterwards, and low again after the time that sound would take to
+  travel to the target and back.
+
+  Point gpiopin at the tree with gpiopin_set_root(fakegpio_get_root()),
+  or by setting HCSR04_GPIO_ROOT.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include "defs.h"
+
+// Most pins, and sensors, that can be emulated
+#define FAKEGPIO_MAX_PINS 32
+#define FAKEGPIO_MAX_SENSORS 8
+
+// Time from the end of the trigger pulse to the start of the echo, usec.
+//  A real HC-SR04 takes about this long to send its burst of sound.
+#define FAKEGPIO_ECHO_DELAY 450
+
+struct FakeGPIO;
+typedef struct _FakeGPIO FakeGPIO;
+
+BEGIN_DECLS
+
+/** Create a fake GPIO tree. This method only stores values, and will
+    always succeed. */
+FakeGPIO   *fakegpio_create (void);
+
+/** Stop the helper thread, remove the tree, and free the object. */
+void        fakegpio_destroy (FakeGPIO *self);
+
+/** Make the tree, and start the helper thread. Returns FALSE, and fills
+    in *error, if this can't be done. */
+BOOL        fakegpio_init (FakeGPIO *self, char **error);
+
+/** Stop the helper thread, and remove the tree. */
+void        fakegpio_uninit (FakeGPIO *self);
+
+/** Get the directory that stands in for /sys/class/gpio. */
+const char *fakegpio_get_root (const FakeGPIO *self);
+
+/** Export a pin, as something other than the program under test might
+    have done. */
+void        fakegpio_export (FakeGPIO *self, int pin);
+
+/** Find whether a pin is exported. */
+BOOL        fakegpio_is_exported (FakeGPIO *self, int pin);
+
+/** Drive an input pin high or low, as the hardware would. */
+void        fakegpio_set_level (FakeGPIO *self, int pin, BOOL level);
+
+/** Get the last value written to an output pin. */
+BOOL        fakegpio_get_level (FakeGPIO *self, int pin);
+
+/** Add an emulated sensor, with its target at the given distance, in
+    metres. A negative distance means there is no echo at all. Sensors
+    must be added before fakegpio_init(). */
+void        fakegpio_add_sensor (FakeGPIO *self, int trigger_pin,
+              int echo_pin, double distance);
+
+/** Change the distance of the target of a sensor added earlier. */
+void        fakegpio_set_distance (FakeGPIO *self, int echo_pin,
+              double distance);
+
+/** Get the number of trigger pulses seen on a sensor's trigger pin. */
+int         fakegpio_get_pulses (FakeGPIO *self, int echo_pin);
+
+END_DECLS
+
@@ -0,0 +1,1355 @@
+/*==========================================================================
+
+    gpiotest.c
+
+    Tests of the GPIO sysfs backend, run against a fake GPIO tree (see
+    fakegpio.h), so they need no hardware. Each test prints "ok" or
+    "FAIL" and a description; the program exits with status 1 if
+    anything failed. The same way, parts of the library that sit behind
+    the sensor -- storage, zones, reflexes, and publishing -- are tested
+    with the simulated backend. Then a sensor is measured repeatedly, 
+    and the phase times are printed, as a rough benchmark of the 
+    backend.
+
+    Usage: hcsr04-gpiotest [cycles]
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include "defs.h"
+#include "gpiopin.h"
+#include "hcsr04.h"
+#include "hcsr04group.h"
+#include "hcsr04executor.h"
+#include "histo.h"
+#include "compstore.h"
+#include "compreader.h"
+#include "shmpub.h"
+#include "shmreader.h"
+#include "fakegpio.h"
+
+// Pins used by the tests
+#define PIN_OUT 5
+#define PIN_IN 6
+#define PIN_TRIGGER 17
+#define PIN_ECHO 27
+#define PIN_GROUP_TRIGGER 22
+#define PIN_GROUP_ECHO_A 23
+#define PIN_GROUP_ECHO_B 24
+
+// Distance of the emulated sensor's target, and how close a measurement
+//  has to be. The echo edges are timed by two threads sharing the CPU, so
+//  this can't be very tight, and any one reading can be thrown right out
+//  by a thread not being scheduled in time. So the test uses the median
+//  of several readings.
+#define TEST_DISTANCE 1.0
+#define TEST_TOLERANCE 0.05
+#define TEST_READINGS 9
+
+// Distances of the targets of the two sensors that share a trigger pin,
+//  and how long to run them for
+#define TEST_GROUP_DISTANCE_A 0.5
+#define TEST_GROUP_DISTANCE_B 1.5
+#define TEST_GROUP_CYCLE 20
+#define TEST_GROUP_MSEC 1000
+
+// Cycle of the executor, which runs the single sensor and the group in
+//  two slots, one after the other
+#define TEST_EXECUTOR_CYCLE 40
+
+// Background cycle of the sensor that is asked for measurements on 
+//  demand, msec. It is long enough that an answer that comes in less
+//  than half of it can only have come from a ping made for the request.
+#define TEST_REQUEST_CYCLE 2000
+
+// The answers to one on-demand measurement request
+typedef struct _RequestAnswer
+  {
+  int count;
+  HCSR04Sample sample;
+  // If set, the callback checks that the sensor's last sample is the 
+  //  answer
+  HCSR04 *hcsr04;
+  BOOL last_matches;
+  } RequestAnswer;
+
+// Samples run through a CompStore at the sampling rate, while waiting 
+//  for the first timed flush, and then TEST_STORE_FAST more, quickly, to
+//  fill its buffer -- but not so quickly that its queue overflows. The
+//  timed flush must come within TEST_STORE_SLACK msec of 
+//  COMPSTORE_FLUSH_MSEC.
+#define TEST_STORE_CYCLE 20
+#define TEST_STORE_FAST 1500
+#define TEST_STORE_FAST_USEC 500
+#define TEST_STORE_SLACK 1000
+#define TEST_STORE_MAX (TEST_STORE_FAST \
+  + 2 * COMPSTORE_FLUSH_MSEC / TEST_STORE_CYCLE)
+
+// StoreTest -- the state of the simulator that feeds the CompStore, and
+//  the samples it published
+typedef struct _StoreTest
+  {
+  char dir[64];
+  int64_t start_usec;  // Monotonic time of the first sample
+  long flush_msec;     // When the first flush was seen, or -1
+  int fast;            // Samples made since then
+  BOOL done;           // Set when the simulator has finished
+  int count;
+  HCSR04Sample *expected;
+  } StoreTest;
+
+// A script of distances for the simulated sensor -- a phase of steps 
+//  samples at one distance, -1 being no echo -- and the zone events it
+//  should cause. The samples are TEST_SCRIPT_CYCLE msec apart.
+#define TEST_SCRIPT_CYCLE 60
+#define TEST_SCRIPT_MAX 64
+
+typedef struct _ScriptPhase
+  {
+  int steps;
+  double distance;
+  } ScriptPhase;
+
+// ZoneEvent -- an event seen, or expected, by the zone test. sample is 
+//  the number of the sample that caused it.
+typedef struct _ZoneEvent
+  {
+  int zone;              // Index of the zone in the test
+  HCSR04ZoneEvent event;
+  int sample;
+  BOOL invalid;          // Delivered with no distance
+  const char *what;
+  } ZoneEvent;
+
+// ScriptTest -- the state of the scripted simulator
+typedef struct _ScriptTest
+  {
+  const ScriptPhase *phases;
+  int n;                 // Samples made so far
+  BOOL done;
+  int zone_ids[2];
+  int count;
+  ZoneEvent events[TEST_SCRIPT_MAX];
+  } ScriptTest;
+
+// ReflexTest -- a scripted sensor driving a reflex output, and the 
+//  output's level after each sample
+typedef struct _ReflexTest
+  {
+  ScriptTest script;
+  GPIOPin *pin;
+  int count;
+  BOOL levels[TEST_SCRIPT_MAX];
+  } ReflexTest;
+
+// Shared memory test: the ring size, which is small so that it wraps 
+//  quickly, and the number of samples published while a reader reads
+#define TEST_SHM_RING 8
+#define TEST_SHM_RACE 200000
+
+// ShmTest -- a publisher thread racing the reader
+typedef struct _ShmTest
+  {
+  ShmPublisher *pub;
+  uint32_t first;        // seq of the first sample the thread publishes
+  int done;
+  } ShmTest;
+
+// Readings collected from one sensor in a group
+typedef struct _GroupReadings
+  {
+  int count;
+  double values[TEST_GROUP_MSEC / TEST_GROUP_CYCLE];
+  uint32_t stall_seq;  // If not 0, the sample whose callback overruns
+  } GroupReadings;
+
+// Longest wait for the helper thread to catch up, in msec
+#define TEST_WAIT 1000
+
+// Trigger pulse width for the test of the sleep trigger mode, usec
+#define TEST_SLEEP_PULSE 100
+
+#define DEFAULT_CYCLES 1000
+
+static int failures = 0;
+
+/*============================================================================
+  gpiotest_check
+============================================================================*/
+static void gpiotest_check (BOOL ok, const char *what)
+  {
+  printf ("%s - %s\n", ok ? "ok" : "FAIL", what);
+  if (!ok) failures++;
+  }
+
+/*============================================================================
+
+  gpiotest_wait_level
+
+  Wait a little while for the helper thread to see a value written to
+  an output pin
+
+============================================================================*/
+static BOOL gpiotest_wait_level (FakeGPIO *fake, int pin, BOOL level)
+  {
+  for (int i = 0; i < TEST_WAIT; i++)
+    {
+    if (fakegpio_get_level (fake, pin) == level) return TRUE;
+    usleep (1000);
+    }
+  return FALSE;
+  }
+
+/*============================================================================
+
+  gpiotest_wait_exported
+
+  Wait a little while for the helper thread to act on a write to export
+  or unexport. Unlike the kernel, it does this some time after the write.
+
+============================================================================*/
+static BOOL gpiotest_wait_exported (FakeGPIO *fake, int pin, BOOL exported)
+  {
+  for (int i = 0; i < TEST_WAIT; i++)
+    {
+    if (fakegpio_is_exported (fake, pin) == exported) return TRUE;
+    usleep (1000);
+    }
+  return FALSE;
+  }
+
+/*============================================================================
+  gpiotest_compare_double
+============================================================================*/
+static int gpiotest_compare_double (const void *a, const void *b)
+  {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+  }
+
+/*============================================================================
+  gpiotest_pins
+============================================================================*/
+static void gpiotest_pins (FakeGPIO *fake)
+  {
+  char *error = NULL;
+  GPIOPin *out = gpiopin_create (PIN_OUT);
+  BOOL ok = gpiopin_init (out, GPIOPIN_OUT, &error);
+  gpiotest_check (ok, "export and open an output pin");
+  if (!ok)
+    {
+    printf ("  %s\n", error);
+    free (error);
+    gpiopin_destroy (out);
+    return;
+    }
+  gpiotest_check (fakegpio_is_exported (fake, PIN_OUT),
+    "output pin is exported");
+  gpiopin_set (out, HIGH);
+  gpiotest_check (gpiotest_wait_level (fake, PIN_OUT, HIGH),
+    "set output pin high");
+  gpiopin_set (out, LOW);
+  gpiotest_check (gpiotest_wait_level (fake, PIN_OUT, LOW),
+    "set output pin low");
+  gpiopin_uninit (out);
+  gpiotest_check (gpiotest_wait_exported (fake, PIN_OUT, FALSE),
+    "output pin is unexported");
+
+  gpiopin_set_unexport (out, FALSE);
+  gpiopin_init (out, GPIOPIN_OUT, NULL);
+  gpiopin_uninit (out);
+  gpiotest_check (fakegpio_is_exported (fake, PIN_OUT),
+    "output pin is left exported when asked");
+  gpiopin_set_unexport (out, TRUE);
+  gpiopin_init (out, GPIOPIN_OUT, NULL);
+  gpiopin_uninit (out);
+  gpiotest_check (fakegpio_is_exported (fake, PIN_OUT),
+    "a pin that was already exported is not unexported");
+  gpiopin_destroy (out);
+
+  GPIOPin *in = gpiopin_create (PIN_IN);
+  ok = gpiopin_init (in, GPIOPIN_IN, NULL);
+  gpiotest_check (ok, "export and open an input pin");
+  if (ok)
+    {
+    gpiopin_set_trigger (in, GPIOPIN_RISING);
+    fakegpio_set_level (fake, PIN_IN, HIGH);
+    gpiotest_check (gpiopin_wait_for_trigger (in, 100000),
+      "rising edge is seen");
+    gpiotest_check (gpiopin_get (in) == HIGH, "input pin reads high");
+    fakegpio_set_level (fake, PIN_IN, LOW);
+    gpiotest_check (!gpiopin_wait_for_trigger (in, 20000),
+      "falling edge is ignored when waiting for rising");
+    gpiopin_set_trigger (in, GPIOPIN_FALLING);
+    fakegpio_set_level (fake, PIN_IN, HIGH);
+    fakegpio_set_level (fake, PIN_IN, LOW);
+    gpiotest_check (gpiopin_wait_for_trigger (in, 100000),
+      "falling edge is seen");
+    gpiotest_check (gpiopin_get (in) == LOW, "input pin reads low");
+    }
+  gpiopin_destroy (in);
+  }
+
+/*============================================================================
+  gpiotest_now
+============================================================================*/
+static int64_t gpiotest_now (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+/*============================================================================
+  gpiotest_sensor
+============================================================================*/
+static void gpiotest_sensor (FakeGPIO *fake, int cycles)
+  {
+  char *error = NULL;
+  HCSR04 *hcsr04 = hcsr04_create (PIN_TRIGGER, PIN_ECHO, 0, 0.5);
+  int pulses_before = fakegpio_get_pulses (fake, PIN_ECHO);
+  BOOL ok = hcsr04_open (hcsr04, &error);
+  gpiotest_check (ok, "open a sensor");
+  if (!ok)
+    {
+    printf ("  %s\n", error);
+    free (error);
+    hcsr04_destroy (hcsr04);
+    return;
+    }
+  double readings[TEST_READINGS];
+  for (int i = 0; i < TEST_READINGS; i++)
+    readings[i] = hcsr04_read_one (hcsr04);
+  qsort (readings, TEST_READINGS, sizeof (double), gpiotest_compare_double);
+  double d = readings[TEST_READINGS / 2];
+  char what[100];
+  snprintf (what, sizeof (what), "measure %.2f m (got %.3f)",
+    TEST_DISTANCE, d);
+  gpiotest_check (fabs (d - TEST_DISTANCE) < TEST_TOLERANCE, what);
+  gpiotest_check (fakegpio_get_pulses (fake, PIN_ECHO) - pulses_before 
+    == TEST_READINGS,
+    "one trigger pulse per measurement");
+  HCSR04Counters counters;
+  hcsr04_get_counters (hcsr04, &counters);
+  gpiotest_check (counters.pulses == TEST_READINGS,
+    "every trigger pulse is counted");
+  gpiotest_check (counters.pulse_usec_total 
+    >= (uint64_t)TEST_READINGS * HCSR04_PULSE_USEC, 
+    "trigger pulses are measured at least as wide as asked for");
+
+  hcsr04_set_trigger_mode (hcsr04, HCSR04_TRIGGER_SLEEP, TEST_SLEEP_PULSE);
+  d = hcsr04_read_one (hcsr04);
+  hcsr04_get_counters (hcsr04, &counters);
+  gpiotest_check (counters.pulse_usec_max >= TEST_SLEEP_PULSE,
+    "a slept trigger pulse is measured");
+  hcsr04_set_trigger_mode (hcsr04, HCSR04_TRIGGER_SPIN, 0);
+
+  fakegpio_set_distance (fake, PIN_ECHO, -1);
+  gpiotest_check (hcsr04_read_one (hcsr04) < 0, "no echo gives no reading");
+  // As in one-shot mode, a silent sensor costs no more than the longest
+  //  echo, for each edge
+  hcsr04_set_echo_timeout (hcsr04, HCSR04_MAX_ECHO + HCSR04_MAX_ECHO_SLACK);
+  int64_t silent_start = gpiotest_now();
+  d = hcsr04_read_one (hcsr04);
+  long silent_msec = (long)((gpiotest_now() - silent_start) / 1000);
+  snprintf (what, sizeof (what), "a short echo timeout gives up on a "
+    "silent sensor quickly (%ld msec)", silent_msec);
+  gpiotest_check (d < 0 && silent_msec < 2 * (HCSR04_MAX_ECHO 
+    + HCSR04_MAX_ECHO_SLACK) / 1000, what);
+  hcsr04_set_echo_timeout (hcsr04, 0);
+  fakegpio_set_distance (fake, PIN_ECHO, TEST_DISTANCE);
+
+  // Benchmark
+  hcsr04_set_instrumented (hcsr04, TRUE);
+  hcsr04_reset_phase_histograms (hcsr04);
+  HCSR04Histogram errors;
+  histo_reset (&errors);
+  struct timespec start, end;
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  int good = 0;
+  for (int i = 0; i < cycles; i++)
+    {
+    d = hcsr04_read_one (hcsr04);
+    if (d < 0) continue;
+    good++;
+    histo_record (&errors, (int64_t)(fabs (d - TEST_DISTANCE) * 1e6));
+    }
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  double secs = (end.tv_sec - start.tv_sec)
+    + (end.tv_nsec - start.tv_nsec) / 1e9;
+  snprintf (what, sizeof (what), "%d of %d benchmark readings good", good,
+    cycles);
+  gpiotest_check (good * 10 >= cycles * 9, what);
+
+  printf ("\n%d cycles in %.3f s, %.1f usec/cycle\n", cycles, secs,
+    secs * 1e6 / cycles);
+  for (int i = 0; i < HCSR04_PHASE_COUNT; i++)
+    {
+    HCSR04Histogram h;
+    hcsr04_get_phase_histogram (hcsr04, (HCSR04Phase)i, &h);
+    histo_print (&h, hcsr04_get_phase_name ((HCSR04Phase)i), stdout);
+    }
+  histo_print (&errors, "error_um", stdout);
+  hcsr04_destroy (hcsr04);
+  }
+
+/*============================================================================
+
+  gpiotest_dir_size
+
+  The total size of the files in a directory
+
+============================================================================*/
+static long gpiotest_dir_size (const char *dir)
+  {
+  long total = 0;
+  DIR *d = opendir (dir);
+  if (!d) return 0;
+  struct dirent *de;
+  char path[PATH_MAX];
+  while ((de = readdir (d)) != NULL)
+    {
+    struct stat sb;
+    snprintf (path, sizeof (path), "%s/%s", dir, de->d_name);
+    if (de->d_name[0] != '.' && stat (path, &sb) == 0) 
+      total += sb.st_size;
+    }
+  closedir (d);
+  return total;
+  }
+
+/*============================================================================
+
+  gpiotest_store_simulator
+
+  Make up samples of every status, with irregular times and widths. 
+  Until the CompStore has written something, samples come at the 
+  sampling rate; then TEST_STORE_FAST more come quickly.
+
+============================================================================*/
+static BOOL gpiotest_store_simulator (void *user_data, HCSR04Sample *sample)
+  {
+  StoreTest *t = user_data;
+  int n = t->count + t->fast;
+  if (t->flush_msec < 0)
+    {
+    if (t->start_usec == 0) t->start_usec = gpiotest_now();
+    long msec = (long)((gpiotest_now() - t->start_usec) / 1000);
+    if (gpiotest_dir_size (t->dir) > (long)sizeof (HCSR04CompHeader))
+      t->flush_msec = msec;
+    else if (msec > 2 * COMPSTORE_FLUSH_MSEC)
+      t->flush_msec = msec; // Too late, but carry on, to test the rest
+    else
+      usleep (TEST_STORE_CYCLE * 1000);
+    }
+  if (t->flush_msec >= 0)
+    {
+    if (t->fast++ == TEST_STORE_FAST)
+      {
+      t->done = TRUE;
+      return FALSE;
+      }
+    usleep (TEST_STORE_FAST_USEC);
+    }
+  sample->time_usec = 1600000000000000LL + (int64_t)n * 60000 
+    + (n * 7919) % 3000;
+  if (n % 11 == 3)
+    return TRUE; // No echo
+  sample->rise_usec = 400 + (n * 31) % 200;
+  if (n % 13 == 5)
+    return TRUE; // No end to the echo
+  if (n % 17 == 7)
+    sample->fall_usec = sample->rise_usec + 30000; // Out of range
+  else
+    sample->fall_usec = sample->rise_usec + 2000 + (n * 2654435761u) % 9000;
+  return TRUE;
+  }
+
+/*============================================================================
+  gpiotest_store_callback
+============================================================================*/
+static void gpiotest_store_callback (const HCSR04Sample *sample,
+      void *user_data)
+  {
+  StoreTest *t = user_data;
+  if (t->count < TEST_STORE_MAX)
+    t->expected[t->count++] = *sample;
+  }
+
+/*============================================================================
+
+  gpiotest_store
+
+  Run simulated samples through a CompStore, and check that a CompReader
+  gets back what was published: exactly, but for the filtered distance,
+  which is stored to the nearest 1/HCSR04_COMP_FILTERED_SCALE metre
+
+============================================================================*/
+static void gpiotest_store (void)
+  {
+  char *error = NULL;
+  StoreTest t;
+  memset (&t, 0, sizeof (t));
+  t.flush_msec = -1;
+  t.expected = malloc (TEST_STORE_MAX * sizeof (HCSR04Sample));
+  snprintf (t.dir, sizeof (t.dir), "/tmp/hcsr04-store-XXXXXX");
+  if (!mkdtemp (t.dir))
+    {
+    gpiotest_check (FALSE, "make a directory for the CompStore");
+    free (t.expected);
+    return;
+    }
+  HCSR04 *hcsr04 = hcsr04_create (PIN_TRIGGER, PIN_ECHO, 0, 0.5);
+  hcsr04_set_simulator (hcsr04, gpiotest_store_simulator, &t);
+  hcsr04_add_sample_callback (hcsr04, gpiotest_store_callback, &t);
+  CompStore *store = compstore_create (t.dir, "test", 0, 0);
+  BOOL ok = compstore_init (store, hcsr04, &error)
+    && hcsr04_init (hcsr04, &error);
+  gpiotest_check (ok, "start a CompStore");
+  if (!ok)
+    {
+    printf ("  %s\n", error);
+    free (error);
+    }
+  else
+    {
+    for (int i = 0; i < 4 * COMPSTORE_FLUSH_MSEC && !t.done; i++)
+      usleep (1000);
+    }
+  hcsr04_uninit (hcsr04);
+  uint64_t dropped = compstore_get_dropped (store);
+  compstore_destroy (store);
+  hcsr04_destroy (hcsr04);
+
+  char what[100];
+  snprintf (what, sizeof (what), "CompStore flushes within %d msec, "
+    "while samples keep coming (%ld)", COMPSTORE_FLUSH_MSEC, t.flush_msec);
+  gpiotest_check (ok && t.flush_msec >= 0 
+    && t.flush_msec <= COMPSTORE_FLUSH_MSEC + TEST_STORE_SLACK, what);
+
+  // There is only one segment
+  char path[PATH_MAX];
+  path[0] = 0;
+  DIR *d = opendir (t.dir);
+  struct dirent *de;
+  while (d && (de = readdir (d)) != NULL)
+    {
+    if (de->d_name[0] != '.')
+      snprintf (path, sizeof (path), "%s/%s", t.dir, de->d_name);
+    }
+  if (d) closedir (d);
+  CompReader *reader = compreader_create (path);
+  int read = 0, matched = 0;
+  if (ok && compreader_init (reader, NULL))
+    {
+    HCSR04Sample s;
+    while (compreader_next (reader, &s))
+      {
+      const HCSR04Sample *e = &t.expected[read];
+      if (read < t.count && s.time_usec == e->time_usec && s.seq == e->seq
+           && s.status == e->status && s.rise_usec == e->rise_usec
+           && s.fall_usec == e->fall_usec && fabsf (s.raw - e->raw) < 1e-6
+           && fabs (s.filtered - e->filtered) 
+                < 1.0 / HCSR04_COMP_FILTERED_SCALE)
+        matched++;
+      read++;
+      }
+    }
+  compreader_destroy (reader);
+  snprintf (what, sizeof (what), "CompReader returns the samples stored "
+    "(%d of %d match, %d read, %d dropped)", matched, t.count, read, 
+    (int)dropped);
+  gpiotest_check (t.count > TEST_STORE_FAST && dropped == 0 
+    && matched == t.count && read == t.count, what);
+
+  if (path[0]) unlink (path);
+  rmdir (t.dir);
+  free (t.expected);
+  }
+
+/*============================================================================
+
+  gpiotest_script_simulator
+
+  Make the samples of a script, at the script's distances and times
+
+============================================================================*/
+static BOOL gpiotest_script_simulator (void *user_data, HCSR04Sample *sample)
+  {
+  ScriptTest *t = user_data;
+  int n = t->n;
+  const ScriptPhase *p = t->phases;
+  while (p->steps > 0 && n >= p->steps)
+    {
+    n -= p->steps;
+    p++;
+    }
+  if (p->steps == 0)
+    {
+    t->done = TRUE;
+    return FALSE;
+    }
+  sample->time_usec = 1600000000000000LL 
+    + (int64_t)t->n * TEST_SCRIPT_CYCLE * 1000;
+  t->n++;
+  if (p->distance > 0)
+    {
+    sample->rise_usec = 400;
+    sample->fall_usec = 400 + (int)(p->distance / HCSR04_USEC_TO_METRES);
+    }
+  return TRUE;
+  }
+
+/*============================================================================
+  gpiotest_zone_callback
+============================================================================*/
+static void gpiotest_zone_callback (int zone_id, HCSR04ZoneEvent event,
+        double distance, void *user_data)
+  {
+  ScriptTest *t = user_data;
+  if (t->count == TEST_SCRIPT_MAX) return;
+  ZoneEvent *e = &t->events[t->count++];
+  e->zone = zone_id == t->zone_ids[0] ? 0 : 1;
+  e->event = event;
+  e->sample = t->n - 1;
+  e->invalid = distance < 0;
+  }
+
+/*============================================================================
+
+  gpiotest_zones
+
+  Run a script of distances past two "nearer than 1 m" zones, one with
+  hysteresis and one with a dwell time, and check that the events come
+  from the right samples
+
+============================================================================*/
+static void gpiotest_zones (void)
+  {
+  static const ScriptPhase phases[] =
+    {
+    { 6, 2.0 },    // 0-5: out of the zones; valid from sample 3
+    { 6, 0.5 },    // 6-11: in them
+    { 4, 1.05 },   // 12-15: out, but within the hysteresis, and not
+                   //  for as long as the dwell time
+    { 3, 0.5 },    // 16-18: back in
+    { 10, -1 },    // 19-28: no echoes, so no valid distance
+    { 10, 0.5 },   // 29-38: valid again from sample 32
+    { 0, 0 }
+    };
+  static const ZoneEvent expected[] =
+    {
+    { 0, HCSR04_ZONE_ENTERED, 6, FALSE, "zone entered" },
+    { 1, HCSR04_ZONE_ENTERED, 11, FALSE, "zone entered after the dwell time" },
+    { 0, HCSR04_ZONE_LEFT, 19, TRUE, "zone left when the distance is invalid" },
+    { 1, HCSR04_ZONE_LEFT, 24, TRUE, 
+      "dwell time applies when the distance is invalid" },
+    { 0, HCSR04_ZONE_ENTERED, 32, FALSE, 
+      "zone entered when the distance is valid again" },
+    { 1, HCSR04_ZONE_ENTERED, 37, FALSE, 
+      "zone with dwell entered again, after the dwell time" },
+    };
+  int expected_count = sizeof (expected) / sizeof (ZoneEvent);
+
+  char *error = NULL;
+  ScriptTest t;
+  memset (&t, 0, sizeof (t));
+  t.phases = phases;
+  HCSR04 *hcsr04 = hcsr04_create (PIN_TRIGGER, PIN_ECHO, 0, 0.5);
+  hcsr04_set_simulator (hcsr04, gpiotest_script_simulator, &t);
+  hcsr04_set_filter (hcsr04, HCSR04_FILTER_NONE, 1);
+  HCSR04Zone zone;
+  hcsr04_zone_init (&zone, 0.0, 1.0);
+  zone.callback = gpiotest_zone_callback;
+  zone.user_data = &t;
+  zone.hysteresis = 0.1;
+  t.zone_ids[0] = hcsr04_add_zone (hcsr04, &zone);
+  zone.hysteresis = 0.0;
+  zone.dwell_msec = 5 * TEST_SCRIPT_CYCLE;
+  t.zone_ids[1] = hcsr04_add_zone (hcsr04, &zone);
+  BOOL ok = hcsr04_init (hcsr04, &error);
+  gpiotest_check (ok, "start a simulated sensor with zones");
+  if (!ok)
+    {
+    printf ("  %s\n", error);
+    free (error);
+    }
+  for (int i = 0; ok && i < TEST_WAIT && !t.done; i++)
+    usleep (1000);
+  hcsr04_uninit (hcsr04);
+
+  for (int i = 0; ok && i < expected_count; i++)
+    {
+    const ZoneEvent *x = &expected[i];
+    const ZoneEvent *e = i < t.count ? &t.events[i] : NULL;
+    char what[100];
+    snprintf (what, sizeof (what), "%s (sample %d, expected %d)", x->what,
+      e ? e->sample : -1, x->sample);
+    gpiotest_check (e && e->zone == x->zone && e->event == x->event 
+      && e->sample == x->sample && e->invalid == x->invalid, what);
+    }
+  gpiotest_check (t.count == expected_count, "no other zone events");
+  gpiotest_check (hcsr04_is_zone_occupied (hcsr04, t.zone_ids[0])
+    && hcsr04_is_zone_occupied (hcsr04, t.zone_ids[1]), 
+    "zones occupied at the end");
+  hcsr04_destroy (hcsr04);
+  }
+
+/*============================================================================
+  gpiotest_reflex_callback
+============================================================================*/
+static void gpiotest_reflex_callback (const HCSR04Sample *sample,
+      void *user_data)
+  {
+  ReflexTest *t = user_data;
+  if (sample->seq < TEST_SCRIPT_MAX)
+    {
+    t->levels[sample->seq] = gpiopin_get (t->pin);
+    t->count = sample->seq + 1;
+    }
+  }
+
+/*============================================================================
+
+  gpiotest_reflex
+
+  Run a script of distances past a "nearer than 1 m" reflex, with 
+  hysteresis, that is also asserted when there is no valid distance, 
+  and check the level of its simulated output pin after each sample, 
+  and its stats
+
+============================================================================*/
+static void gpiotest_reflex (void)
+  {
+  static const ScriptPhase phases[] =
+    {
+    { 6, 2.0 },    // 0-5: invalid until sample 3, then clear
+    { 4, 0.5 },    // 6-9: too near
+    { 4, 1.05 },   // 10-13: within the hysteresis
+    { 4, 1.5 },    // 14-17: clear
+    { 3, -1 },     // 18-20: no valid distance
+    { 6, 2.0 },    // 21-26: valid again, and clear, from sample 23, as 
+                   //  three missed echoes leave a good count of one
+    { 0, 0 }
+    };
+  // The changes of level, from asserted at the start
+  static const int changes[] = { 3, 6, 14, 18, 23 };
+  int changes_count = sizeof (changes) / sizeof (int);
+
+  char *error = NULL;
+  ReflexTest t;
+  memset (&t, 0, sizeof (t));
+  t.script.phases = phases;
+  t.pin = gpiopin_create_simulated (PIN_OUT);
+  BOOL ok = gpiopin_init (t.pin, GPIOPIN_OUT, &error);
+  HCSR04 *hcsr04 = hcsr04_create (PIN_TRIGGER, PIN_ECHO, 0, 0.5);
+  hcsr04_set_simulator (hcsr04, gpiotest_script_simulator, &t.script);
+  hcsr04_set_filter (hcsr04, HCSR04_FILTER_NONE, 1);
+  hcsr04_add_sample_callback (hcsr04, gpiotest_reflex_callback, &t);
+  HCSR04Reflex reflex;
+  memset (&reflex, 0, sizeof (reflex));
+  reflex.pin = t.pin;
+  reflex.threshold = 1.0;
+  reflex.hysteresis = 0.1;
+  reflex.direction = HCSR04_REFLEX_BELOW;
+  reflex.active_level = HIGH;
+  reflex.assert_on_invalid = TRUE;
+  int id = ok ? hcsr04_add_reflex (hcsr04, &reflex) : -1;
+  gpiotest_check (id >= 0 && gpiopin_get (t.pin) == HIGH, 
+    "reflex asserted when added, with no distance yet");
+  ok = ok && hcsr04_init (hcsr04, &error);
+  gpiotest_check (ok, "start a simulated sensor with a reflex");
+  if (!ok)
+    {
+    printf ("  %s\n", error);
+    free (error);
+    }
+  for (int i = 0; ok && i < TEST_WAIT && !t.script.done; i++)
+    usleep (1000);
+  hcsr04_uninit (hcsr04);
+
+  if (ok)
+    {
+    BOOL level = HIGH;
+    int wrong = -1;
+    for (int i = 0, c = 0; i < t.count; i++)
+      {
+      if (c < changes_count && changes[c] == i)
+        {
+        level = !level;
+        c++;
+        }
+      if (t.levels[i] != level && wrong < 0) wrong = i;
+      }
+    char what[100];
+    snprintf (what, sizeof (what), "reflex output follows the distance "
+      "(%d samples, first wrong %d)", t.count, wrong);
+    gpiotest_check (t.count == t.script.n && wrong < 0, what);
+
+    HCSR04ReflexStats stats;
+    memset (&stats, 0, sizeof (stats));
+    hcsr04_get_reflex_stats (hcsr04, id, &stats);
+    snprintf (what, sizeof (what), "reflex stats count %d actuations "
+      "(got %ld, latency %ld usec max)", changes_count, stats.actuations,
+      stats.max_latency_usec);
+    gpiotest_check (stats.actuations == changes_count 
+      && stats.last_latency_usec >= 0 
+      && stats.max_latency_usec >= stats.last_latency_usec
+      && stats.total_latency_usec >= stats.max_latency_usec
+      && stats.max_latency_usec < TEST_WAIT * 1000, what);
+    }
+  hcsr04_destroy (hcsr04);
+  gpiopin_destroy (t.pin);
+  }
+
+/*============================================================================
+
+  gpiotest_shm_sample
+
+  Make up a sample whose fields can all be worked out from its seq, so
+  that a reader can tell if it got parts of two different samples
+
+============================================================================*/
+static void gpiotest_shm_sample (HCSR04Sample *sample, uint32_t seq)
+  {
+  memset (sample, 0, sizeof (HCSR04Sample));
+  sample->seq = seq;
+  sample->time_usec = 1600000000000000LL + (int64_t)seq * 1000;
+  sample->rise_usec = seq % 1000;
+  sample->fall_usec = seq % 1000 + 2000;
+  sample->raw = (float)(seq % 4000) / 1000.0f;
+  sample->filtered = sample->raw;
+  }
+
+/*============================================================================
+  gpiotest_shm_is_whole
+============================================================================*/
+static BOOL gpiotest_shm_is_whole (const HCSR04ShmSample *sample)
+  {
+  HCSR04Sample e;
+  gpiotest_shm_sample (&e, sample->seq);
+  return sample->time_usec == e.time_usec && sample->status == e.status
+    && sample->rise_usec == e.rise_usec && sample->fall_usec == e.fall_usec
+    && sample->raw == e.raw && sample->filtered == e.filtered;
+  }
+
+/*============================================================================
+  gpiotest_shm_publisher
+============================================================================*/
+static void *gpiotest_shm_publisher (void *arg)
+  {
+  ShmTest *t = arg;
+  HCSR04Sample sample;
+  for (uint32_t i = 0; i < TEST_SHM_RACE; i++)
+    {
+    gpiotest_shm_sample (&sample, t->first + i);
+    shmpub_publish (t->pub, &sample);
+    }
+  __atomic_store_n (&t->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+  }
+
+/*============================================================================
+
+  gpiotest_shm
+
+  Publish samples through a ShmPublisher and read them back with a 
+  ShmReader: the latest sample, the ring before and after it has 
+  wrapped, and then both while another thread publishes as fast as it
+  can, which must never give a torn or out-of-order sample
+
+============================================================================*/
+static void gpiotest_shm (void)
+  {
+  char *error = NULL;
+  char name[64];
+  snprintf (name, sizeof (name), "/hcsr04-gpiotest-%d", (int)getpid());
+  HCSR04 *hcsr04 = hcsr04_create (PIN_TRIGGER, PIN_ECHO, 60, 0.5);
+  ShmPublisher *pub = shmpub_create (name, TEST_SHM_RING);
+  ShmReader *reader = shmreader_create (name);
+  BOOL ok = shmpub_init (pub, hcsr04, &error)
+    && shmreader_init (reader, &error);
+  gpiotest_check (ok, "open a shared memory segment to publish and read");
+  if (!ok)
+    {
+    printf ("  %s\n", error);
+    free (error);
+    shmreader_destroy (reader);
+    shmpub_destroy (pub);
+    hcsr04_destroy (hcsr04);
+    return;
+    }
+  const HCSR04ShmHeader *h = shmreader_get_header (reader);
+  gpiotest_check (h->echo_pin == PIN_ECHO && h->sound_pin == PIN_TRIGGER
+    && h->ring_size == TEST_SHM_RING, "shared memory header describes "
+    "the sensor");
+
+  HCSR04Sample published;
+  HCSR04ShmSample sample, samples[2 * TEST_SHM_RING];
+  gpiotest_check (!shmreader_read_latest (reader, &sample), 
+    "nothing to read before anything is published");
+  uint32_t seq = 0;
+  for (; seq < 5; seq++)
+    {
+    gpiotest_shm_sample (&published, seq);
+    shmpub_publish (pub, &published);
+    }
+  gpiotest_check (shmreader_read_latest (reader, &sample) 
+    && sample.seq == 4 && gpiotest_shm_is_whole (&sample),
+    "read the latest sample");
+
+  uint64_t cursor = 0;
+  int n = shmreader_read_since (reader, &cursor, samples, 
+    2 * TEST_SHM_RING);
+  BOOL in_order = TRUE;
+  for (int i = 0; i < n; i++)
+    in_order = in_order && samples[i].seq == (uint32_t)i 
+      && gpiotest_shm_is_whole (&samples[i]);
+  gpiotest_check (n == 5 && in_order && cursor == 5, 
+    "read the ring before it wraps");
+
+  // Three times round the ring: the reader has missed some, and gets 
+  //  the newest TEST_SHM_RING
+  for (; seq < 5 + 3 * TEST_SHM_RING; seq++)
+    {
+    gpiotest_shm_sample (&published, seq);
+    shmpub_publish (pub, &published);
+    }
+  n = shmreader_read_since (reader, &cursor, samples, 2 * TEST_SHM_RING);
+  in_order = TRUE;
+  for (int i = 0; i < n; i++)
+    in_order = in_order && samples[i].seq == seq - TEST_SHM_RING + i
+      && gpiotest_shm_is_whole (&samples[i]);
+  char what[200];
+  snprintf (what, sizeof (what), "read the ring after it wraps "
+    "(%d samples, cursor %llu)", n, (unsigned long long)cursor);
+  gpiotest_check (n == TEST_SHM_RING && in_order && cursor == seq, what);
+
+  // Race a publisher
+  ShmTest t;
+  t.pub = pub;
+  t.first = seq;
+  t.done = 0;
+  pthread_t thread;
+  pthread_create (&thread, NULL, gpiotest_shm_publisher, &t);
+  long reads = 0, torn = 0, backwards = 0;
+  uint32_t last_latest = 0;
+  uint32_t last_since = seq - 1;
+  while (!__atomic_load_n (&t.done, __ATOMIC_ACQUIRE))
+    {
+    if (shmreader_read_latest (reader, &sample))
+      {
+      reads++;
+      if (!gpiotest_shm_is_whole (&sample)) torn++;
+      if ((int32_t)(sample.seq - last_latest) < 0) backwards++;
+      last_latest = sample.seq;
+      }
+    n = shmreader_read_since (reader, &cursor, samples, TEST_SHM_RING);
+    for (int i = 0; i < n; i++)
+      {
+      reads++;
+      if (!gpiotest_shm_is_whole (&samples[i])) torn++;
+      if ((int32_t)(samples[i].seq - last_since) <= 0) backwards++;
+      last_since = samples[i].seq;
+      }
+    }
+  pthread_join (thread, NULL);
+  snprintf (what, sizeof (what), "no torn or out-of-order reads while "
+    "publishing (%ld reads, %ld torn, %ld backwards)", reads, torn, 
+    backwards);
+  gpiotest_check (reads > 0 && torn == 0 && backwards == 0, what);
+  gpiotest_check (shmreader_read_latest (reader, &sample) 
+    && sample.seq == seq + TEST_SHM_RACE - 1, 
+    "read the last sample published");
+
+  shmreader_destroy (reader);
+  shmpub_destroy (pub);
+  hcsr04_destroy (hcsr04);
+  }
+
+/*============================================================================
+  gpiotest_request_callback
+============================================================================*/
+static void gpiotest_request_callback (const HCSR04Sample *sample,
+      void *user_data)
+  {
+  RequestAnswer *answer = user_data;
+  answer->count++;
+  answer->sample = *sample;
+  HCSR04Sample last;
+  if (answer->hcsr04)
+    answer->last_matches = hcsr04_get_last_sample (answer->hcsr04, &last) 
+      && last.seq == sample->seq;
+  }
+
+/*============================================================================
+  gpiotest_group_callback
+============================================================================*/
+static void gpiotest_group_callback (const HCSR04Sample *sample,
+      void *user_data)
+  {
+  GroupReadings *readings = user_data;
+  if (readings->stall_seq && sample->seq == readings->stall_seq)
+    usleep (2 * TEST_GROUP_CYCLE * 1000);
+  int max = sizeof (readings->values) / sizeof (double);
+  if (sample->status == HCSR04_SAMPLE_OK && readings->count < max)
+    readings->values[readings->count++] = sample->raw;
+  }
+
+/*============================================================================
+  gpiotest_group
+============================================================================*/
+static void gpiotest_group (FakeGPIO *fake)
+  {
+  char *error = NULL;
+  int echoes[2] = { PIN_GROUP_ECHO_A, PIN_GROUP_ECHO_B };
+  double distances[2] = { TEST_GROUP_DISTANCE_A, TEST_GROUP_DISTANCE_B };
+  GroupReadings readings[2];
+  memset (readings, 0, sizeof (readings));
+  HCSR04Group *group = hcsr04group_create (PIN_GROUP_TRIGGER, echoes, 2,
+    TEST_GROUP_CYCLE, 0.5);
+  hcsr04group_set_adaptive (group, TRUE);
+  for (int i = 0; i < 2; i++)
+    hcsr04_add_sample_callback (hcsr04group_get_sensor (group, i),
+      gpiotest_group_callback, &readings[i]);
+  // The group's thread keeps the sensors' accounts: only the first is
+  //  instrumented, and the second stalls one cycle into an overrun
+  hcsr04_set_instrumented (hcsr04group_get_sensor (group, 0), TRUE);
+  readings[1].stall_seq = 5;
+  BOOL ok = hcsr04group_init (group, &error);
+  gpiotest_check (ok, "start a group of sensors sharing a trigger pin");
+  if (!ok)
+    {
+    printf ("  %s\n", error);
+    free (error);
+    hcsr04group_destroy (group);
+    return;
+    }
+  usleep (TEST_GROUP_MSEC * 1000);
+  hcsr04group_uninit (group);
+
+  HCSR04Counters counters[2];
+  for (int i = 0; i < 2; i++)
+    {
+    hcsr04_get_counters (hcsr04group_get_sensor (group, i), &counters[i]);
+    GroupReadings *r = &readings[i];
+    char what[100];
+    if (r->count == 0)
+      {
+      snprintf (what, sizeof (what), "group sensor %d gives readings", i);
+      gpiotest_check (FALSE, what);
+      continue;
+      }
+    qsort (r->values, r->count, sizeof (double), gpiotest_compare_double);
+    double d = r->values[r->count / 2];
+    snprintf (what, sizeof (what), "group sensor %d measures %.2f m "
+      "(got %.3f from %d readings)", i, distances[i], d, r->count);
+    gpiotest_check (fabs (d - distances[i]) < TEST_TOLERANCE, what);
+    }
+  int pulses = fakegpio_get_pulses (fake, PIN_GROUP_ECHO_A);
+  gpiotest_check (counters[0].cycles == counters[1].cycles
+    && counters[0].cycles > 0 && pulses - (int)counters[0].cycles <= 1,
+    "one trigger pulse per cycle, for the whole group");
+
+  char what[120];
+  snprintf (what, sizeof (what), "group sensors count their overruns "
+    "(%llu and %llu)", (unsigned long long)counters[0].overruns,
+    (unsigned long long)counters[1].overruns);
+  gpiotest_check (counters[1].overruns >= 1 
+    && counters[1].overruns <= counters[1].cycles / 2, what);
+  snprintf (what, sizeof (what), "group sensors share the thread's CPU "
+    "time (%lld and %lld usec)", (long long)counters[0].cpu_usec, 
+    (long long)counters[1].cpu_usec);
+  gpiotest_check (counters[0].cpu_usec > 0 && counters[1].cpu_usec > 0,
+    what);
+  // The pulse and filter are timed every cycle, but the echo only when
+  //  there was one
+  BOOL timed = TRUE, untimed = TRUE;
+  HCSR04Phase phases[4] = { HCSR04_PHASE_PULSE, HCSR04_PHASE_FILTER,
+    HCSR04_PHASE_RISE_WAIT, HCSR04_PHASE_ECHO_WIDTH };
+  for (int p = 0; p < 4; p++)
+    {
+    HCSR04Histogram h;
+    hcsr04_get_phase_histogram (hcsr04group_get_sensor (group, 0), 
+      phases[p], &h);
+    timed = timed && (p < 2 ? h.count == counters[0].cycles 
+      : h.count > 0 && h.count <= counters[0].cycles);
+    hcsr04_get_phase_histogram (hcsr04group_get_sensor (group, 1), 
+      phases[p], &h);
+    untimed = untimed && h.count == 0;
+    }
+  gpiotest_check (timed && untimed, 
+    "group times the phases of an instrumented sensor only");
+  hcsr04group_destroy (group);
+  }
+
+/*============================================================================
+
+  gpiotest_pipelined
+
+  Run the single sensor with its measurement and processing split 
+  between two threads
+
+============================================================================*/
+static void gpiotest_pipelined (FakeGPIO *fake)
+  {
+  char *error = NULL;
+  GroupReadings readings;
+  memset (&readings, 0, sizeof (readings));
+  HCSR04 *hcsr04 = hcsr04_create (PIN_TRIGGER, PIN_ECHO, TEST_GROUP_CYCLE,
+    0.5);
+  hcsr04_set_adaptive (hcsr04, TRUE);
+  hcsr04_set_pipelined (hcsr04, TRUE);
+  hcsr04_add_sample_callback (hcsr04, gpiotest_group_callback, &readings);
+  int pulses_before = fakegpio_get_pulses (fake, PIN_ECHO);
+  BOOL ok = hcsr04_init (hcsr04, &error);
+  gpiotest_check (ok, "start a pipelined sensor");
+  if (!ok)
+    {
+    printf ("  %s\n", error);
+    free (error);
+    hcsr04_destroy (hcsr04);
+    return;
+    }
+  usleep (TEST_GROUP_MSEC * 1000);
+  hcsr04_uninit (hcsr04);
+  // The executor test opens the same pins
+  gpiotest_wait_exported (fake, PIN_TRIGGER, FALSE);
+  gpiotest_wait_exported (fake, PIN_ECHO, FALSE);
+
+  char what[100];
+  double d = -1.0;
+  if (readings.count > 0)
+    {
+    qsort (readings.values, readings.count, sizeof (double),
+      gpiotest_compare_double);
+    d = readings.values[readings.count / 2];
+    }
+  snprintf (what, sizeof (what), "pipelined sensor measures %.2f m "
+    "(got %.3f from %d readings)", TEST_DISTANCE, d, readings.count);
+  gpiotest_check (fabs (d - TEST_DISTANCE) < TEST_TOLERANCE, what);
+
+  // Every measurement made is processed, even those still queued when
+  //  the sensor was stopped
+  HCSR04Counters counters;
+  hcsr04_get_counters (hcsr04, &counters);
+  int pulses = fakegpio_get_pulses (fake, PIN_ECHO) - pulses_before;
+  gpiotest_check (counters.cycles > 0 && (int)counters.cycles == pulses
+    && counters.pipeline_dropped == 0,
+    "every pipelined measurement processed");
+  hcsr04_destroy (hcsr04);
+  }
+
+/*============================================================================
+
+  gpiotest_request
+
+  Run the single sensor with a long cycle, and ask it for measurements
+  between its cycles: two by callback, and one by eventfd, all at once,
+  which should be answered by one ping
+
+============================================================================*/
+static void gpiotest_request (FakeGPIO *fake)
+  {
+  char *error = NULL;
+  HCSR04 *hcsr04 = hcsr04_create (PIN_TRIGGER, PIN_ECHO, TEST_REQUEST_CYCLE,
+    0.5);
+  RequestAnswer answers[2];
+  memset (answers, 0, sizeof (answers));
+  answers[1].hcsr04 = hcsr04;
+  gpiotest_check (!hcsr04_request_measurement (hcsr04, 
+    gpiotest_request_callback, &answers[0], -1),
+    "no measurement requests before the thread starts");
+  BOOL ok = hcsr04_init (hcsr04, &error);
+  gpiotest_check (ok, "start a sensor with a long cycle");
+  if (!ok)
+    {
+    printf ("  %s\n", error);
+    free (error);
+    hcsr04_destroy (hcsr04);
+    return;
+    }
+  // Let the first cycle's measurement finish
+  usleep (2 * HCSR04_MIN_CYCLE * 1000);
+  int pulses_before = fakegpio_get_pulses (fake, PIN_ECHO);
+  int fd = eventfd (0, EFD_CLOEXEC);
+  struct timespec start, end;
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  ok = hcsr04_request_measurement (hcsr04, gpiotest_request_callback, 
+      &answers[0], -1)
+    && hcsr04_request_measurement (hcsr04, gpiotest_request_callback, 
+      &answers[1], -1)
+    && hcsr04_request_measurement (hcsr04, NULL, NULL, fd);
+  gpiotest_check (ok, "request measurements while the sensor sleeps");
+  struct pollfd fdset[1];
+  fdset[0].fd = fd;
+  fdset[0].events = POLLIN;
+  fdset[0].revents = 0;
+  BOOL signalled = poll (fdset, 1, TEST_REQUEST_CYCLE / 2) == 1;
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  long msec = (end.tv_sec - start.tv_sec) * 1000 
+    + (end.tv_nsec - start.tv_nsec) / 1000000;
+  char what[100];
+  snprintf (what, sizeof (what), 
+    "requested measurement answered before the cycle ends (%ld msec)", 
+    signalled ? msec : -1);
+  gpiotest_check (signalled, what);
+  hcsr04_uninit (hcsr04);
+  close (fd);
+
+  // One reading can be some way out on a busy machine -- the other tests
+  //  check the distance against the median of many -- so this only 
+  //  checks that the answer is a good measurement
+  HCSR04Sample *a = &answers[0].sample;
+  snprintf (what, sizeof (what), "requested measurement is a good "
+    "sample (got %.3f m, status %d)", a->raw, (int)a->status);
+  gpiotest_check (answers[0].count == 1 && a->status == HCSR04_SAMPLE_OK
+    && a->raw > 0.0, what);
+  HCSR04Counters counters;
+  hcsr04_get_counters (hcsr04, &counters);
+  int pulses = fakegpio_get_pulses (fake, PIN_ECHO) - pulses_before;
+  gpiotest_check (answers[1].count == 1 
+    && answers[1].sample.seq == a->seq && pulses == 1 
+    && counters.requests == 3 && counters.request_pings == 1,
+    "requests made together share one trigger pulse");
+  gpiotest_check (answers[1].last_matches, 
+    "the answer is the last sample, read from the callback");
+  hcsr04_destroy (hcsr04);
+  // The executor test opens the same pins
+  gpiotest_wait_exported (fake, PIN_TRIGGER, FALSE);
+  gpiotest_wait_exported (fake, PIN_ECHO, FALSE);
+  }
+
+/*============================================================================
+
+  gpiotest_executor
+
+  Run the single sensor and the group together, in an executor's two
+  slots
+
+============================================================================*/
+static void gpiotest_executor (FakeGPIO *fake)
+  {
+  char *error = NULL;
+  int echoes[2] = { PIN_GROUP_ECHO_A, PIN_GROUP_ECHO_B };
+  double distances[3] = { TEST_DISTANCE, TEST_GROUP_DISTANCE_A, 
+    TEST_GROUP_DISTANCE_B };
+  GroupReadings readings[3];
+  memset (readings, 0, sizeof (readings));
+  HCSR04 *sensors[3];
+  HCSR04 *single = hcsr04_create (PIN_TRIGGER, PIN_ECHO, 
+    TEST_EXECUTOR_CYCLE, 0.5);
+  HCSR04Group *group = hcsr04group_create (PIN_GROUP_TRIGGER, echoes, 2,
+    TEST_EXECUTOR_CYCLE, 0.5);
+  sensors[0] = single;
+  sensors[1] = hcsr04group_get_sensor (group, 0);
+  sensors[2] = hcsr04group_get_sensor (group, 1);
+  for (int i = 0; i < 3; i++)
+    hcsr04_add_sample_callback (sensors[i], gpiotest_group_callback, 
+      &readings[i]);
+  HCSR04Executor *executor = hcsr04executor_create (TEST_EXECUTOR_CYCLE, 0);
+  hcsr04executor_add_sensor (executor, single);
+  hcsr04executor_add_group (executor, group);
+  int pulses_before = fakegpio_get_pulses (fake, PIN_GROUP_ECHO_A);
+  BOOL ok = hcsr04executor_init (executor, &error);
+  gpiotest_check (ok, "start an executor with a sensor and a group");
+  if (!ok)
+    {
+    printf ("  %s\n", error);
+    free (error);
+    }
+  else
+    {
+    usleep (TEST_GROUP_MSEC * 1000);
+    hcsr04executor_uninit (executor);
+
+    for (int i = 0; i < 3; i++)
+      {
+      GroupReadings *r = &readings[i];
+      char what[100];
+      if (r->count == 0)
+        {
+        snprintf (what, sizeof (what), "executor sensor %d gives readings",
+          i);
+        gpiotest_check (FALSE, what);
+        continue;
+        }
+      qsort (r->values, r->count, sizeof (double), gpiotest_compare_double);
+      double d = r->values[r->count / 2];
+      snprintf (what, sizeof (what), "executor sensor %d measures %.2f m "
+        "(got %.3f from %d readings)", i, distances[i], d, r->count);
+      gpiotest_check (fabs (d - distances[i]) < TEST_TOLERANCE, what);
+      }
+
+    // Each slot is measured once a cycle, and its samples are all
+    //  processed, unless the cycle was cut short by the uninit
+    HCSR04ExecutorStats stats;
+    hcsr04executor_get_stats (executor, &stats);
+    BOOL once = stats.cycles > 0 && stats.dropped == 0;
+    for (int i = 0; i < 3; i++)
+      {
+      HCSR04Counters counters;
+      hcsr04_get_counters (sensors[i], &counters);
+      once = once && counters.cycles + 1 >= stats.cycles 
+        && counters.cycles <= stats.cycles + 1;
+      }
+    int pulses = fakegpio_get_pulses (fake, PIN_GROUP_ECHO_A) 
+      - pulses_before;
+    once = once && pulses <= (int)stats.cycles + 1;
+    gpiotest_check (once, "each slot measured once per executor cycle");
+    }
+  hcsr04executor_destroy (executor);
+  hcsr04group_destroy (group);
+  hcsr04_destroy (single);
+  }
+
+/*============================================================================
+  main
+============================================================================*/
+int main (int argc, char **argv)
+  {
+  int cycles = argc > 1 ? atoi (argv[1]) : DEFAULT_CYCLES;
+  char *error = NULL;
+  FakeGPIO *fake = fakegpio_create ();
+  fakegpio_add_sensor (fake, PIN_TRIGGER, PIN_ECHO, TEST_DISTANCE);
+  fakegpio_add_sensor (fake, PIN_GROUP_TRIGGER, PIN_GROUP_ECHO_A,
+    TEST_GROUP_DISTANCE_A);
+  fakegpio_add_sensor (fake, PIN_GROUP_TRIGGER, PIN_GROUP_ECHO_B,
+    TEST_GROUP_DISTANCE_B);
+  if (!fakegpio_init (fake, &error))
+    {
+    fprintf (stderr, "%s: %s\n", argv[0], error);
+    free (error);
+    fakegpio_destroy (fake);
+    return 1;
+    }
+  gpiopin_set_root (fakegpio_get_root (fake));
+
+  gpiotest_pins (fake);
+  gpiotest_store ();
+  gpiotest_zones ();
+  gpiotest_reflex ();
+  gpiotest_shm ();
+  gpiotest_group (fake);
+  gpiotest_pipelined (fake);
+  gpiotest_request (fake);
+  gpiotest_executor (fake);
+  gpiotest_sensor (fake, cycles);
+
+  fakegpio_destroy (fake);
+  printf ("\n%s\n", failures ? "FAILED" : "PASSED");
+  return failures ? 1 : 0;
+  }
+
@@ -0,0 +1,564 @@
+/*==========================================================================
+
+    stress.c
+
+    hcsr04-stress -- run many simulated sensors at once, and see how the
+    ways of running them scale. Each sensor has a simulator, a zone, and
+    a sample callback, and is measured every cycle. For 8, 16, ... up to
+    the largest number of sensors, each of these models is run in turn:
+
+    thread  One HCSR04 thread per sensor, started by hcsr04_init(), as
+            a program using the library does now.
+    pipe    The same, but pipelined by hcsr04_set_pipelined(): each
+            sensor has a measurement thread and a processing thread.
+    loop    One thread that wakes at each sensor's turn, and processes
+            its sample with hcsr04_process_sample(). The sensors' turns
+            are spread evenly over the cycle.
+    pool    A HCSR04Executor: one thread makes the measurements, in 
+            slots spread over the cycle, and hands the samples to a 
+            pool of worker threads, which steal work from each other.
+
+    For each, it reports the samples per second actually processed,
+    against the number that were due; the CPU time per sample, of the
+    whole process; the latency from each measurement to the publication
+    of its sample; the jitter -- how late measurements started, against
+    one cycle after the last one (for the loop model, against its turn);
+    and the memory used, resident and virtual, per sensor. Times are in 
+    usec. Each run is made in a new child process, so that memory freed
+    by one run can't be reused by the next, and make it look free.
+
+    -l makes every sample callback spin for the given time, in usec, as
+    a heavy filter or a slow logger would; with -e N, only every Nth 
+    sample's callback does, as a periodic flush would.
+
+    Usage: hcsr04-stress [-c cycle_msec] [-d seconds] [-e every] 
+                         [-l load_usec] [-m model] [-n sensors] 
+                         [-w workers]
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "defs.h"
+#include "hcsr04.h"
+#include "hcsr04executor.h"
+#include "histo.h"
+
+#define DEFAULT_CYCLE_MSEC 50
+#define DEFAULT_SECONDS 2
+#define DEFAULT_SENSORS 512
+
+// Time given to a model to settle, before anything is counted, in usec
+#define STRESS_WARMUP 250000
+
+// Echo width, and how much it wanders from cycle to cycle, in usec
+#define STRESS_ECHO 5000
+#define STRESS_WANDER 500
+#define STRESS_RISE 450
+
+typedef enum
+  {
+  STRESS_THREAD = 0,
+  STRESS_PIPE = 1,
+  STRESS_LOOP = 2,
+  STRESS_POOL = 3,
+  STRESS_MODELS = 4
+  } StressModel;
+
+static const char *stress_model_names[STRESS_MODELS] =
+  { "thread", "pipe", "loop", "pool" };
+
+// Only what happens in this range, of monotonic usec, is counted. Set
+//  before a run starts, and not changed while it runs.
+static int64_t record_start;
+static int64_t record_end;
+
+// Time that a sample callback spins for, and how often, set by -l and -e
+static int load_usec = 0;
+static int load_every = 1;
+
+// StressSensor -- one simulated sensor, and what has been measured of it.
+//  The measurement fields are only touched by the thread that measures
+//  the sensor, and the others by the thread that processes its samples,
+//  which may be a different one.
+typedef struct _StressSensor
+  {
+  HCSR04 *hcsr04;
+  int64_t cycle;     // usec
+  int64_t next_due;  // Monotonic usec
+  uint32_t seq;
+  HCSR04Histogram jitter;
+  uint64_t samples;
+  HCSR04Histogram latency;
+  } StressSensor;
+
+// StressRun -- one model, with one number of sensors
+typedef struct _StressRun
+  {
+  StressModel model;
+  int count;
+  StressSensor *sensors;
+  int stop;
+  pthread_t scheduler;
+  int workers_count;
+  HCSR04Executor *executor;
+  HCSR04ExecutorStats stats;
+  } StressRun;
+
+/*============================================================================
+  stress_now
+============================================================================*/
+static int64_t stress_now (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+/*============================================================================
+  stress_sleep_until
+============================================================================*/
+static void stress_sleep_until (int64_t usec)
+  {
+  struct timespec ts;
+  ts.tv_sec = usec / 1000000;
+  ts.tv_nsec = (usec % 1000000) * 1000;
+  while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+      == EINTR);
+  }
+
+/*============================================================================
+  stress_realtime
+============================================================================*/
+static int64_t stress_realtime (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+/*============================================================================
+
+  stress_recording
+
+  Whether something that happened at a monotonic time is counted
+
+============================================================================*/
+static BOOL stress_recording (int64_t now)
+  {
+  return now >= record_start && now < record_end;
+  }
+
+/*============================================================================
+  stress_cpu_usec
+============================================================================*/
+static int64_t stress_cpu_usec (void)
+  {
+  struct rusage ru;
+  getrusage (RUSAGE_SELF, &ru);
+  return (int64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000
+    + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+  }
+
+/*============================================================================
+
+  stress_memory
+
+  Get the virtual size and the resident size of the process, in kB
+
+============================================================================*/
+static void stress_memory (long *virt, long *rss)
+  {
+  *virt = 0;
+  *rss = 0;
+  FILE *f = fopen ("/proc/self/statm", "r");
+  if (f)
+    {
+    long pages = sysconf (_SC_PAGESIZE) / 1024;
+    if (fscanf (f, "%ld %ld", virt, rss) == 2)
+      {
+      *virt *= pages;
+      *rss *= pages;
+      }
+    fclose (f);
+    }
+  }
+
+/*============================================================================
+
+  stress_fill
+
+  Make up the echo edges of a sensor's next sample
+
+============================================================================*/
+static void stress_fill (StressSensor *s, HCSR04Sample *sample)
+  {
+  s->seq++;
+  sample->rise_usec = STRESS_RISE;
+  sample->fall_usec = STRESS_RISE + STRESS_ECHO
+    + (int32_t)((s->seq * 37) % STRESS_WANDER);
+  }
+
+/*============================================================================
+
+  stress_simulate
+
+  The simulator for the thread, pipe and pool models, which call it as
+  soon as they start a measurement. The measurement should have started
+  one cycle after the last.
+
+============================================================================*/
+static BOOL stress_simulate (void *user_data, HCSR04Sample *sample)
+  {
+  StressSensor *s = user_data;
+  int64_t now = stress_now();
+  if (s->next_due && stress_recording (now))
+    histo_record (&s->jitter, now - s->next_due);
+  s->next_due = now + s->cycle;
+  stress_fill (s, sample);
+  return TRUE;
+  }
+
+/*============================================================================
+
+  stress_published
+
+  The sample callback. It counts the sample, and then spins, if it 
+  has been asked to.
+
+============================================================================*/
+static void stress_published (const HCSR04Sample *sample, void *user_data)
+  {
+  StressSensor *s = user_data;
+  int64_t now = stress_now();
+  if (stress_recording (now))
+    {
+    histo_record (&s->latency, stress_realtime() - sample->time_usec);
+    s->samples++;
+    }
+  if (load_usec > 0 && sample->seq % load_every == 0)
+    {
+    int64_t until = now + load_usec;
+    while (stress_now() < until);
+    }
+  }
+
+/*============================================================================
+
+  stress_schedule
+
+  The loop model's thread. The sensors take their turns in order, 
+  spread evenly over the cycle. A sensor whose turn is more than a cycle
+  late skips the cycles it missed.
+
+============================================================================*/
+static void *stress_schedule (void *arg)
+  {
+  StressRun *run = arg;
+  int i = 0;
+  while (!run->stop)
+    {
+    StressSensor *s = &run->sensors[i];
+    i = (i + 1) % run->count;
+    stress_sleep_until (s->next_due);
+    int64_t now = stress_now();
+    if (stress_recording (now))
+      histo_record (&s->jitter, now - s->next_due);
+    if (now - s->next_due > s->cycle)
+      s->next_due += (now - s->next_due) / s->cycle * s->cycle;
+    s->next_due += s->cycle;
+    HCSR04Sample sample;
+    memset (&sample, 0, sizeof (sample));
+    sample.time_usec = stress_realtime();
+    stress_fill (s, &sample);
+    hcsr04_process_sample (s->hcsr04, &sample, -1);
+    }
+  return NULL;
+  }
+
+/*============================================================================
+
+  stress_start
+
+  Create the sensors, and start the threads of the model
+
+============================================================================*/
+static BOOL stress_start (StressRun *run, int cycle_msec)
+  {
+  int64_t now = stress_now();
+  for (int i = 0; i < run->count; i++)
+    {
+    StressSensor *s = &run->sensors[i];
+    s->hcsr04 = hcsr04_create (0, i, cycle_msec, 0.5);
+    HCSR04Zone zone;
+    hcsr04_zone_init (&zone, 0.5, 0.9);
+    hcsr04_add_zone (s->hcsr04, &zone);
+    hcsr04_add_sample_callback (s->hcsr04, stress_published, s);
+    }
+
+  if (run->model == STRESS_THREAD || run->model == STRESS_PIPE)
+    {
+    for (int i = 0; i < run->count; i++)
+      {
+      StressSensor *s = &run->sensors[i];
+      hcsr04_set_simulator (s->hcsr04, stress_simulate, s);
+      hcsr04_set_adaptive (s->hcsr04, TRUE);
+      hcsr04_set_pipelined (s->hcsr04, run->model == STRESS_PIPE);
+      char *error = NULL;
+      if (!hcsr04_init (s->hcsr04, &error))
+        {
+        fprintf (stderr, "Can't start sensor %d: %s\n", i, error);
+        free (error);
+        run->count = i; // So that only these are stopped
+        return FALSE;
+        }
+      }
+    return TRUE;
+    }
+
+  if (run->model == STRESS_POOL)
+    {
+    run->executor = hcsr04executor_create (cycle_msec, run->workers_count);
+    for (int i = 0; i < run->count; i++)
+      {
+      StressSensor *s = &run->sensors[i];
+      hcsr04_set_simulator (s->hcsr04, stress_simulate, s);
+      hcsr04executor_add_sensor (run->executor, s->hcsr04);
+      }
+    char *error = NULL;
+    if (!hcsr04executor_init (run->executor, &error))
+      {
+      fprintf (stderr, "Can't start executor: %s\n", error);
+      free (error);
+      return FALSE;
+      }
+    return TRUE;
+    }
+
+  for (int i = 0; i < run->count; i++)
+    {
+    StressSensor *s = &run->sensors[i];
+    s->next_due = now + s->cycle * i / run->count;
+    }
+  pthread_create (&run->scheduler, NULL, stress_schedule, run);
+  return TRUE;
+  }
+
+/*============================================================================
+
+  stress_stop
+
+  Stop the model's threads, and free the sensors
+
+============================================================================*/
+static void stress_stop (StressRun *run)
+  {
+  __atomic_store_n (&run->stop, 1, __ATOMIC_RELEASE);
+  if (run->model == STRESS_THREAD || run->model == STRESS_PIPE)
+    {
+    for (int i = 0; i < run->count; i++)
+      hcsr04_uninit (run->sensors[i].hcsr04);
+    }
+  else if (run->model == STRESS_POOL)
+    {
+    hcsr04executor_get_stats (run->executor, &run->stats);
+    hcsr04executor_destroy (run->executor);
+    }
+  else
+    pthread_join (run->scheduler, NULL);
+  for (int i = 0; i < run->count; i++)
+    hcsr04_destroy (run->sensors[i].hcsr04);
+  }
+
+/*============================================================================
+
+  stress_run
+
+  Run one model with count sensors, and print a line of results
+
+============================================================================*/
+static void stress_run (StressModel model, int count, int cycle_msec,
+    int seconds, int workers)
+  {
+  StressRun run;
+  memset (&run, 0, sizeof (run));
+  run.model = model;
+  run.count = count;
+  run.workers_count = workers;
+  // Everything the benchmark itself needs is allocated, and touched,
+  //  before the memory is measured
+  run.sensors = calloc (count, sizeof (StressSensor));
+  for (int i = 0; i < count; i++)
+    {
+    run.sensors[i].cycle = cycle_msec * 1000;
+    histo_reset (&run.sensors[i].jitter);
+    histo_reset (&run.sensors[i].latency);
+    }
+
+  long virt_before, rss_before;
+  stress_memory (&virt_before, &rss_before);
+  record_start = stress_now() + STRESS_WARMUP;
+  record_end = record_start + (int64_t)seconds * 1000000;
+  BOOL ok = stress_start (&run, cycle_msec);
+
+  stress_sleep_until (record_start);
+  int64_t cpu_start = stress_cpu_usec();
+  stress_sleep_until (record_end);
+  int64_t cpu = stress_cpu_usec() - cpu_start;
+  long virt, rss;
+  stress_memory (&virt, &rss);
+  stress_stop (&run);
+
+  HCSR04Histogram jitter, latency;
+  histo_reset (&jitter);
+  histo_reset (&latency);
+  uint64_t samples = 0;
+  for (int i = 0; i < run.count; i++)
+    {
+    histo_add (&jitter, &run.sensors[i].jitter);
+    histo_add (&latency, &run.sensors[i].latency);
+    samples += run.sensors[i].samples;
+    }
+
+  if (!ok)
+    printf ("%-6s %6d  failed after %d sensors\n",
+      stress_model_names[model], count, run.count);
+  else
+    {
+    double secs = seconds;
+    printf ("%-6s %6d %9.0f %9.0f %8.1f %7lld %7lld %7lld %8lld %7lld %8lld"
+      " %7.1f %9.1f",
+      stress_model_names[model], count, count * 1000.0 / cycle_msec,
+      samples / secs, samples ? (double)cpu / samples : 0.0,
+      (long long)histo_percentile (&latency, 50),
+      (long long)histo_percentile (&latency, 99),
+      (long long)histo_percentile (&latency, 99.9),
+      (long long)latency.max,
+      (long long)histo_percentile (&jitter, 99),
+      (long long)jitter.max,
+      (double)(rss - rss_before) / count,
+      (double)(virt - virt_before) / count);
+    if (model == STRESS_POOL)
+      printf ("  steals=%llu dropped=%llu late=%llu", 
+        (unsigned long long)run.stats.steals,
+        (unsigned long long)run.stats.dropped,
+        (unsigned long long)run.stats.late_slots);
+    printf ("\n");
+    }
+  fflush (stdout);
+  free (run.sensors);
+  }
+
+/*============================================================================
+
+  stress_run_child
+
+  Make a run in a child process, and wait for it. The child starts with
+  only the parent's small heap, so its growth is the memory the model
+  actually needs
+
+============================================================================*/
+static void stress_run_child (StressModel model, int count, int cycle_msec,
+    int seconds, int workers)
+  {
+  fflush (stdout);
+  pid_t pid = fork();
+  if (pid < 0)
+    {
+    // Can't fork: run here, and the memory figures may be low
+    stress_run (model, count, cycle_msec, seconds, workers);
+    return;
+    }
+  if (pid == 0)
+    {
+    stress_run (model, count, cycle_msec, seconds, workers);
+    _exit (0);
+    }
+  int status;
+  while (waitpid (pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    printf ("%-6s %6d  failed (child status %d)\n",
+      stress_model_names[model], count, status);
+  }
+
+/*============================================================================
+  main
+============================================================================*/
+int main (int argc, char **argv)
+  {
+  int cycle_msec = DEFAULT_CYCLE_MSEC;
+  int seconds = DEFAULT_SECONDS;
+  int max_sensors = DEFAULT_SENSORS;
+  int workers = (int)sysconf (_SC_NPROCESSORS_ONLN);
+  int only = -1;
+  int opt;
+  while ((opt = getopt (argc, argv, "c:d:e:l:m:n:w:")) != -1)
+    {
+    switch (opt)
+      {
+      case 'c':
+        cycle_msec = atoi (optarg);
+        break;
+      case 'd':
+        seconds = atoi (optarg);
+        break;
+      case 'e':
+        load_every = atoi (optarg);
+        break;
+      case 'l':
+        load_usec = atoi (optarg);
+        break;
+      case 'm':
+        for (int m = 0; m < STRESS_MODELS; m++)
+          if (strcmp (optarg, stress_model_names[m]) == 0) only = m;
+        if (only < 0)
+          {
+          fprintf (stderr, "%s: unknown model '%s'\n", argv[0], optarg);
+          return 1;
+          }
+        break;
+      case 'n':
+        max_sensors = atoi (optarg);
+        break;
+      case 'w':
+        workers = atoi (optarg);
+        break;
+      default:
+        fprintf (stderr, "Usage: %s [-c cycle_msec] [-d seconds] "
+          "[-e every] [-l load_usec] [-m thread|pipe|loop|pool] "
+          "[-n sensors] [-w workers]\n", argv[0]);
+        return 1;
+      }
+    }
+  if (cycle_msec < 1) cycle_msec = 1;
+  if (seconds < 1) seconds = 1;
+  if (workers < 1) workers = 1;
+  if (load_every < 1) load_every = 1;
+  if (max_sensors < 1) max_sensors = 1;
+
+  printf ("Cycle %d msec, %d sec per run, %d pool workers, "
+    "load %d usec every %d samples\n", cycle_msec, seconds, workers,
+    load_usec, load_every);
+  printf ("%-6s %6s %9s %9s %8s %7s %7s %7s %8s %7s %8s %7s %9s\n",
+    "model", "sensors", "due/s", "done/s", "cpu_us", "p50_us", "p99_us",
+    "p999_us", "max_us", "jit99", "jit_max", "rss_kB", "virt_kB");
+  for (int n = max_sensors < 8 ? max_sensors : 8; n <= max_sensors; n *= 2)
+    {
+    for (int m = 0; m < STRESS_MODELS; m++)
+      if (only < 0 || only == m)
+        stress_run_child (m, n, cycle_msec, seconds, workers);
+    }
+  return 0;
+  }
+